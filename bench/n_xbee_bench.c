@@ -0,0 +1,452 @@
+/*
+ * Microbenchmarks for what every packet goes through.
+ *
+ * Links the bridge against n_xbee_serial_stub instead of a serial port,
+ * builds one bridge the way n_xbee_serial_open would minus the radio
+ * handshake, and times each function on its own. The tap is /dev/null.
+ *
+ *   n_xbee_bench [--commit=ID] [--out=PATH] [--filter=NAME] [--min-ms=MS]
+ *
+ * Every result is one JSON object per line, appended to --out (stdout
+ * without it, mixed with the bridge's log):
+ *
+ *   {"commit":"abc123","bench":"node_find_eth","param":"nodes=512",
+ *    "iters":4194304,"ns_per_op":9.81,"min_ns_per_op":9.64}
+ *
+ * ns_per_op is the median of N_XBEE_BENCH_REPS runs of iters calls each,
+ * min_ns_per_op the fastest of them.
+ */
+#include "../src/n_xbee.h"
+#include "../src/n_xbee_proto.h"
+#include "../src/n_xbee_lz.h"
+#include "n_xbee_serial_stub.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <net/if_arp.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include <xbee/wpan.h>
+
+#define N_XBEE_BENCH_REPS 5
+#define N_XBEE_BENCH_MIN_MS 200
+// frames fed to the library per xbee_dev_tick
+#define N_XBEE_BENCH_RX_BATCH 64
+
+#define N_XBEE_BENCH_LOCAL_IP "10.115.9.1"
+#define N_XBEE_BENCH_PEER_IP "10.115.9.2"
+
+typedef void (*n_xbee_bench_fn)(void* ctx, uint64_t iters);
+
+typedef struct n_xbee_bench_ctx {
+  xbee_serial_bridge* bridge;
+  xbee_remote_node* peer;
+  // a node table of its own for the lookups, so the bridge's stays small
+  n_xbee_node_table* table;
+  int nnodes;
+  unsigned char frame[N_XBEE_FRAME_MAX];
+  int len;
+  wpan_envelope_t envelope;
+  // API frames to feed, N_XBEE_BENCH_RX_BATCH of them back to back
+  unsigned char* api;
+  int apilen;
+} n_xbee_bench_ctx;
+
+static const char* n_xbee_bench_commit = "unknown";
+static const char* n_xbee_bench_filter;
+static FILE* n_xbee_bench_out;
+static uint32_t n_xbee_bench_min_ms = N_XBEE_BENCH_MIN_MS;
+// keeps lookups from being optimized away
+static volatile uintptr_t n_xbee_bench_sink;
+
+static uint64_t n_xbee_bench_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int n_xbee_bench_cmp(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void n_xbee_bench_run(const char* name, const char* param, n_xbee_bench_fn fn, void* ctx) {
+  double ns[N_XBEE_BENCH_REPS];
+  uint64_t iters = 64, start, elapsed;
+  int i;
+
+  if (n_xbee_bench_filter && !strstr(name, n_xbee_bench_filter))
+    return;
+  // grow until one run takes a fifth of the target, which warms up too
+  for (;;) {
+    start = n_xbee_bench_ns();
+    fn(ctx, iters);
+    elapsed = n_xbee_bench_ns() - start;
+    if (elapsed * 5 >= n_xbee_bench_min_ms * 1000000ull)
+      break;
+    iters *= 2;
+  }
+  iters = iters * n_xbee_bench_min_ms * 1000000ull / (elapsed ? elapsed : 1) + 1;
+  for (i = 0; i < N_XBEE_BENCH_REPS; i++) {
+    start = n_xbee_bench_ns();
+    fn(ctx, iters);
+    ns[i] = (double)(n_xbee_bench_ns() - start) / iters;
+  }
+  qsort(ns, N_XBEE_BENCH_REPS, sizeof(double), n_xbee_bench_cmp);
+  fprintf(n_xbee_bench_out, "{\"commit\":\"%s\",\"bench\":\"%s\",\"param\":\"%s\",\"iters\":%llu,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f}\n",
+      n_xbee_bench_commit, name, param, (unsigned long long)iters, ns[N_XBEE_BENCH_REPS / 2], ns[0]);
+  fflush(n_xbee_bench_out);
+  // the bridge logs to stdout, this is for whoever is watching
+  if (n_xbee_bench_out != stdout)
+    fprintf(stderr, "%-22s %-20s %10.2f ns/op\n", name, param, ns[N_XBEE_BENCH_REPS / 2]);
+}
+
+/* = Fixtures = */
+static void n_xbee_bench_addr(addr64* addr, uint32_t i) {
+  // 0013A200 5200xxxx, nothing like the bridge's own
+  addr->b[0] = 0x00;
+  addr->b[1] = 0x13;
+  addr->b[2] = 0xA2;
+  addr->b[3] = 0x00;
+  addr->b[4] = 0x52;
+  addr->b[5] = i >> 16;
+  addr->b[6] = i >> 8;
+  addr->b[7] = i;
+}
+
+static uint16_t n_xbee_bench_csum(const void* data, int len) {
+  const unsigned char* p = data;
+  uint32_t sum = 0;
+  for (; len > 1; p += 2, len -= 2)
+    sum += (p[0] << 8) | p[1];
+  if (len)
+    sum += p[0] << 8;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return htons(~sum);
+}
+
+// An ethernet IPv4 UDP frame of len bytes from src to dst, the payload
+// text-like so compression has something to work with.
+static int n_xbee_bench_udp(unsigned char* out, int len, const unsigned char* dst, const unsigned char* src, const char* ipsrc, const char* ipdst) {
+  struct ether_header* eh = (struct ether_header*)out;
+  struct ip* iph = (struct ip*)(out + N_XBEE_ETHHDR_LEN);
+  struct udphdr* udph = (struct udphdr*)(out + N_XBEE_ETHHDR_LEN + sizeof(struct ip));
+  int i, hlen = N_XBEE_ETHHDR_LEN + sizeof(struct ip) + sizeof(struct udphdr);
+
+  memset(out, 0, hlen);
+  memcpy(eh->ether_dhost, dst, ETH_ALEN);
+  memcpy(eh->ether_shost, src, ETH_ALEN);
+  eh->ether_type = htons(ETHERTYPE_IP);
+  iph->ip_v = 4;
+  iph->ip_hl = 5;
+  iph->ip_len = htons(len - N_XBEE_ETHHDR_LEN);
+  iph->ip_ttl = 64;
+  iph->ip_p = IPPROTO_UDP;
+  inet_pton(AF_INET, ipsrc, &iph->ip_src);
+  inet_pton(AF_INET, ipdst, &iph->ip_dst);
+  iph->ip_sum = n_xbee_bench_csum(iph, sizeof(struct ip));
+  udph->uh_sport = htons(40000);
+  udph->uh_dport = htons(9000);
+  udph->uh_ulen = htons(len - N_XBEE_ETHHDR_LEN - sizeof(struct ip));
+  for (i = hlen; i < len; i++)
+    out[i] = "temperature=21.5 humidity=40 "[(i - hlen) % 29];
+  return len;
+}
+
+// A broadcast ARP request from the peer for ip.
+static int n_xbee_bench_arp(unsigned char* out, const unsigned char* src, const char* ipsrc, const char* ip) {
+  struct ether_header* eh = (struct ether_header*)out;
+  struct arphdr* arph = (struct arphdr*)(out + N_XBEE_ETHHDR_LEN);
+  unsigned char* p = (unsigned char*)(arph + 1);
+
+  memset(eh->ether_dhost, 0xFF, ETH_ALEN);
+  memcpy(eh->ether_shost, src, ETH_ALEN);
+  eh->ether_type = htons(ETHERTYPE_ARP);
+  arph->ar_hrd = htons(ARPHRD_ETHER);
+  arph->ar_pro = htons(ETHERTYPE_IP);
+  arph->ar_hln = ETH_ALEN;
+  arph->ar_pln = 4;
+  arph->ar_op = htons(ARPOP_REQUEST);
+  memcpy(p, src, ETH_ALEN);
+  inet_pton(AF_INET, ipsrc, p + ETH_ALEN);
+  memset(p + ETH_ALEN + 4, 0, ETH_ALEN);
+  inet_pton(AF_INET, ip, p + 2 * ETH_ALEN + 4);
+  return N_XBEE_ARP_FRAME_LEN;
+}
+
+// Appends an API frame made of hdr and data to out.
+static int n_xbee_bench_api_frame(unsigned char* out, const void* hdr, int hlen, const void* data, int dlen) {
+  int i, len = hlen + dlen;
+  unsigned char sum = 0;
+  out[0] = 0x7E;
+  out[1] = len >> 8;
+  out[2] = len & 0xFF;
+  memcpy(out + 3, hdr, hlen);
+  memcpy(out + 3 + hlen, data, dlen);
+  for (i = 0; i < len; i++)
+    sum += out[3 + i];
+  out[3 + len] = 0xFF - sum;
+  return len + 4;
+}
+
+// N_XBEE_BENCH_RX_BATCH explicit RX frames from the peer carrying frame.
+static void n_xbee_bench_rx_frames(n_xbee_bench_ctx* c, const unsigned char* frame, int len) {
+  unsigned char hdr[18];
+  int i;
+
+  hdr[0] = XBEE_FRAME_RECEIVE_EXPLICIT;
+  memcpy(hdr + 1, c->peer->node_addr, 8);
+  hdr[9] = 0xFF;
+  hdr[10] = 0xFE;
+  hdr[11] = N_XBEE_ENDPOINT;
+  hdr[12] = N_XBEE_ENDPOINT;
+  hdr[13] = N_XBEE_CLUSTER_ID >> 8;
+  hdr[14] = N_XBEE_CLUSTER_ID & 0xFF;
+  hdr[15] = WPAN_PROFILE_DIGI >> 8;
+  hdr[16] = WPAN_PROFILE_DIGI & 0xFF;
+  hdr[17] = 0x01;
+  c->apilen = 0;
+  for (i = 0; i < N_XBEE_BENCH_RX_BATCH; i++)
+    c->apilen += n_xbee_bench_api_frame(c->api + c->apilen, hdr, sizeof(hdr), frame, len);
+}
+
+// The radio never answers here, so nothing ever leaves the window.
+static inline void n_xbee_bench_settle(xbee_serial_bridge* bridge) {
+  if (bridge->tx.inflight >= bridge->tx.window)
+    n_xbee_tx_init(&bridge->tx, bridge->tx.window);
+}
+
+/* = Benchmarks = */
+static void n_xbee_bench_find_eth(void* ctx, uint64_t iters) {
+  n_xbee_bench_ctx* c = ctx;
+  addr64 addr;
+  uint64_t i;
+  uintptr_t acc = 0;
+  for (i = 0; i < iters; i++) {
+    n_xbee_bench_addr(&addr, i % c->nnodes);
+    acc += (uintptr_t)n_xbee_node_find_eth(c->table, addr.b + 2, ETH_ALEN);
+  }
+  n_xbee_bench_sink = acc;
+}
+
+static void n_xbee_bench_find_eth_miss(void* ctx, uint64_t iters) {
+  n_xbee_bench_ctx* c = ctx;
+  addr64 addr;
+  uint64_t i;
+  uintptr_t acc = 0;
+  for (i = 0; i < iters; i++) {
+    n_xbee_bench_addr(&addr, 0x100000 + (i % c->nnodes));
+    acc += (uintptr_t)n_xbee_node_find_eth(c->table, addr.b + 2, ETH_ALEN);
+  }
+  n_xbee_bench_sink = acc;
+}
+
+static void n_xbee_bench_find_or_insert(void* ctx, uint64_t iters) {
+  n_xbee_bench_ctx* c = ctx;
+  addr64 addr;
+  uint64_t i;
+  uintptr_t acc = 0;
+  for (i = 0; i < iters; i++) {
+    n_xbee_bench_addr(&addr, i % c->nnodes);
+    acc += (uintptr_t)n_xbee_node_find_or_insert(c->table, &addr);
+  }
+  n_xbee_bench_sink = acc;
+}
+
+// Nodes come and go, a full table evicts one per new node.
+static void n_xbee_bench_insert_evict(void* ctx, uint64_t iters) {
+  n_xbee_bench_ctx* c = ctx;
+  static uint32_t next = 0x200000;
+  addr64 addr;
+  uint64_t i;
+  uintptr_t acc = 0;
+  for (i = 0; i < iters; i++) {
+    n_xbee_bench_addr(&addr, next++ & 0xFFFFFF);
+    acc += (uintptr_t)n_xbee_node_find_or_insert(c->table, &addr);
+  }
+  n_xbee_bench_sink = acc;
+}
+
+static void n_xbee_bench_xmit(void* ctx, uint64_t iters) {
+  n_xbee_bench_ctx* c = ctx;
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    n_xbee_xmit_ether_packet(c->bridge, c->frame, c->len);
+    n_xbee_bench_settle(c->bridge);
+  }
+}
+
+static void n_xbee_bench_netdev_rx(void* ctx, uint64_t iters) {
+  n_xbee_bench_ctx* c = ctx;
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    n_xbee_netdev_rx(&c->envelope, NULL);
+    n_xbee_bench_settle(c->bridge);
+  }
+}
+
+static void n_xbee_bench_frame_write(void* ctx, uint64_t iters) {
+  n_xbee_bench_ctx* c = ctx;
+  xbee_header_transmit_explicit_t header;
+  uint64_t i;
+
+  memset(&header, 0, sizeof(header));
+  header.frame_type = XBEE_FRAME_TRANSMIT_EXPLICIT;
+  memcpy(&header.ieee_address, c->peer->node_addr, 8);
+  header.network_address_be = htobe16(WPAN_NET_ADDR_UNDEFINED);
+  header.source_endpoint = header.dest_endpoint = N_XBEE_ENDPOINT;
+  header.cluster_id_be = htobe16(N_XBEE_CLUSTER_ID);
+  header.profile_id_be = htobe16(WPAN_PROFILE_DIGI);
+  for (i = 0; i < iters; i++)
+    xbee_frame_write(c->bridge->xbee_dev, &header, sizeof(header), c->frame, c->len, 0);
+}
+
+// Per frame, N_XBEE_BENCH_RX_BATCH at a time.
+static void n_xbee_bench_dev_tick(void* ctx, uint64_t iters) {
+  n_xbee_bench_ctx* c = ctx;
+  uint64_t i;
+  for (i = 0; i < iters; i += N_XBEE_BENCH_RX_BATCH) {
+    n_xbee_stub_feed(c->api, c->apilen);
+    while (n_xbee_stub_pending() && xbee_dev_tick(c->bridge->xbee_dev) > 0)
+      ;
+    n_xbee_bench_settle(c->bridge);
+  }
+}
+
+/* = Setup = */
+static xbee_serial_bridge* n_xbee_bench_bridge(void) {
+  const char* argv[] = { "n_xbee_bench", "--workers=1", "--agg-hold=0", "--tx-window=64", "/dev/ttyBENCH0" };
+  xbee_serial_bridge* bridge;
+  xbee_dev_t* xbee;
+
+  if (n_xbee_init() != 0 || parse_serial_arguments(sizeof(argv) / sizeof(argv[0]), argv, &n_xbee_opts) != 0)
+    return NULL;
+  n_xbee_lz_dict_default(&n_xbee_lz_local_dict);
+  if (n_xbee_bridge_new(&n_xbee_opts.serial[0], &bridge) != 0)
+    return NULL;
+  n_xbee_bridges[n_xbee_bridge_count++] = bridge;
+
+  // what the device query would have found
+  xbee = bridge->xbee_dev;
+  n_xbee_bench_addr(&xbee->wpan_dev.address.ieee, 0);
+  xbee->wpan_dev.address.ieee.b[4] = 0x51;
+  xbee_wpan_init(xbee, xbee_endpoints);
+  memcpy(bridge->mac, xbee->wpan_dev.address.ieee.b + 2, ETH_ALEN);
+
+  // what n_xbee_init_netdev would have set up
+  if (n_xbee_pool_init(&bridge->pool, N_XBEE_POOL_SIZE) != 0 || (bridge->netdev = open("/dev/null", O_WRONLY)) < 0)
+    return NULL;
+  bridge->netdevInitialized = 1;
+  inet_pton(AF_INET, N_XBEE_BENCH_LOCAL_IP, &bridge->addrs.v4[0]);
+  bridge->addrs.plen4[0] = 24;
+  bridge->addrs.count4 = 1;
+  return bridge;
+}
+
+int main(int argc, const char** argv) {
+  static const int sizes[] = { 16, 128, 512 };
+  static const int frames[] = { 64, 512, 1400 };
+  n_xbee_bench_ctx c;
+  char param[64];
+  const char* out = NULL;
+  addr64 addr;
+  int i, j;
+
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--commit=", 9) == 0)
+      n_xbee_bench_commit = argv[i] + 9;
+    else if (strncmp(argv[i], "--out=", 6) == 0)
+      out = argv[i] + 6;
+    else if (strncmp(argv[i], "--filter=", 9) == 0)
+      n_xbee_bench_filter = argv[i] + 9;
+    else if (strncmp(argv[i], "--min-ms=", 9) == 0)
+      n_xbee_bench_min_ms = atoi(argv[i] + 9);
+    else {
+      printf("usage: %s [--commit=ID] [--out=PATH] [--filter=NAME] [--min-ms=MS]\n", argv[0]);
+      return 1;
+    }
+  }
+  n_xbee_bench_out = out ? fopen(out, "a") : stdout;
+  if (!n_xbee_bench_out) {
+    printk(KERN_ALERT "%s: unable to open %s.\n", __FUNCTION__, out);
+    return 1;
+  }
+
+  memset(&c, 0, sizeof(c));
+  if (!(c.bridge = n_xbee_bench_bridge())) {
+    printk(KERN_ALERT "%s: unable to set up a bridge.\n", __FUNCTION__);
+    return 1;
+  }
+  c.table = malloc(sizeof(n_xbee_node_table));
+  c.api = malloc(N_XBEE_BENCH_RX_BATCH * (N_XBEE_FRAME_MAX + 32));
+  if (!c.table || !c.api)
+    return 1;
+
+  // node table
+  for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+    n_xbee_node_table_init(c.table);
+    c.nnodes = sizes[i];
+    for (j = 0; j < c.nnodes; j++) {
+      n_xbee_bench_addr(&addr, j);
+      n_xbee_node_find_or_insert(c.table, &addr);
+    }
+    snprintf(param, sizeof(param), "nodes=%d", c.nnodes);
+    n_xbee_bench_run("node_find_eth", param, n_xbee_bench_find_eth, &c);
+    n_xbee_bench_run("node_find_eth_miss", param, n_xbee_bench_find_eth_miss, &c);
+    n_xbee_bench_run("node_find_or_insert", param, n_xbee_bench_find_or_insert, &c);
+  }
+  snprintf(param, sizeof(param), "nodes=%d", N_XBEE_NODE_MAX);
+  n_xbee_bench_run("node_insert_evict", param, n_xbee_bench_insert_evict, &c);
+
+  // one peer that knows us, asked for its caps already
+  n_xbee_bench_addr(&addr, 1);
+  c.peer = n_xbee_node_find_or_insert(&c.bridge->nodes, &addr);
+  c.peer->caps_requested = 1;
+
+  // tap to serial, plain ethernet and then everything the peer takes
+  for (i = 0; i < (int)(sizeof(frames) / sizeof(frames[0])); i++) {
+    c.len = n_xbee_bench_udp(c.frame, frames[i], c.peer->eth, c.bridge->mac, N_XBEE_BENCH_LOCAL_IP, N_XBEE_BENCH_PEER_IP);
+    c.peer->caps = 0;
+    snprintf(param, sizeof(param), "len=%d caps=none", c.len);
+    n_xbee_bench_run("xmit_ether_packet", param, n_xbee_bench_xmit, &c);
+    c.peer->caps = N_XBEE_CAP_FRAG | N_XBEE_CAP_HC | N_XBEE_CAP_AGG | N_XBEE_CAP_LZ;
+    c.peer->lz_dict = n_xbee_lz_local_dict.id;
+    snprintf(param, sizeof(param), "len=%d caps=hc,lz", c.len);
+    n_xbee_bench_run("xmit_ether_packet", param, n_xbee_bench_xmit, &c);
+  }
+  c.peer->caps = 0;
+
+  // radio to tap, from the envelope and from the serial bytes
+  n_xbee_init_envelope(c.bridge, &c.envelope);
+  memcpy(&c.envelope.ieee_address, c.peer->node_addr, 8);
+  c.envelope.payload = c.frame;
+  for (i = 0; i < (int)(sizeof(frames) / sizeof(frames[0])); i++) {
+    if (frames[i] > N_XBEE_DATA_MTU)
+      break;
+    c.len = n_xbee_bench_udp(c.frame, frames[i], c.bridge->mac, c.peer->eth, N_XBEE_BENCH_PEER_IP, N_XBEE_BENCH_LOCAL_IP);
+    c.envelope.length = c.len;
+    snprintf(param, sizeof(param), "len=%d", c.len);
+    n_xbee_bench_run("netdev_rx", param, n_xbee_bench_netdev_rx, &c);
+
+    n_xbee_bench_run("xbee_frame_write", param, n_xbee_bench_frame_write, &c);
+    n_xbee_bench_rx_frames(&c, c.frame, c.len);
+    n_xbee_bench_run("xbee_dev_tick_rx", param, n_xbee_bench_dev_tick, &c);
+  }
+  c.len = n_xbee_bench_arp(c.frame, c.peer->eth, N_XBEE_BENCH_PEER_IP, N_XBEE_BENCH_LOCAL_IP);
+  c.envelope.length = c.len;
+  snprintf(param, sizeof(param), "len=%d", c.len);
+  n_xbee_bench_run("netdev_rx_arp_reply", param, n_xbee_bench_netdev_rx, &c);
+
+  if (out)
+    fclose(n_xbee_bench_out);
+  return 0;
+}
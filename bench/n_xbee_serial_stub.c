@@ -0,0 +1,138 @@
+#include "n_xbee_serial_stub.h"
+#include "../src/n_xbee_serial.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <xbee/platform.h>
+#include <xbee/serial.h>
+
+uint64_t n_xbee_stub_written;
+
+static unsigned char n_xbee_stub_rx[N_XBEE_STUB_RX_SIZE];
+static int n_xbee_stub_head;
+static int n_xbee_stub_tail;
+
+int n_xbee_stub_feed(const void* data, int len) {
+  if (n_xbee_stub_head == n_xbee_stub_tail)
+    n_xbee_stub_head = n_xbee_stub_tail = 0;
+  if (len > N_XBEE_STUB_RX_SIZE - n_xbee_stub_tail)
+    len = N_XBEE_STUB_RX_SIZE - n_xbee_stub_tail;
+  memcpy(n_xbee_stub_rx + n_xbee_stub_tail, data, len);
+  n_xbee_stub_tail += len;
+  return len;
+}
+
+int n_xbee_stub_pending(void) {
+  return n_xbee_stub_tail - n_xbee_stub_head;
+}
+
+void n_xbee_serial_batch(xbee_serial_t* serial, int on) {
+}
+
+int n_xbee_serial_flush(xbee_serial_t* serial) {
+  return 0;
+}
+
+int n_xbee_serial_rx_buffered(xbee_serial_t* serial) {
+  return n_xbee_stub_pending();
+}
+
+void n_xbee_serial_syscalls(xbee_serial_t* serial, uint64_t* reads, uint64_t* writes) {
+  *reads = *writes = 0;
+}
+
+int xbee_ser_invalid(xbee_serial_t* serial) {
+  return serial == NULL || serial->fd < 0;
+}
+
+const char* xbee_ser_portname(xbee_serial_t* serial) {
+  return serial->device;
+}
+
+int xbee_ser_write(xbee_serial_t* serial, const void FAR* buffer, int length) {
+  n_xbee_stub_written += length;
+  return length;
+}
+
+int xbee_ser_read(xbee_serial_t* serial, void FAR* buffer, int bufsize) {
+  int n = n_xbee_stub_pending();
+  if (n > bufsize)
+    n = bufsize;
+  memcpy(buffer, n_xbee_stub_rx + n_xbee_stub_head, n);
+  n_xbee_stub_head += n;
+  return n;
+}
+
+int xbee_ser_putchar(xbee_serial_t* serial, uint8_t ch) {
+  n_xbee_stub_written++;
+  return 0;
+}
+
+int xbee_ser_getchar(xbee_serial_t* serial) {
+  if (!n_xbee_stub_pending())
+    return -ENODATA;
+  return n_xbee_stub_rx[n_xbee_stub_head++];
+}
+
+int xbee_ser_tx_free(xbee_serial_t* serial) {
+  return N_XBEE_STUB_RX_SIZE;
+}
+
+int xbee_ser_tx_used(xbee_serial_t* serial) {
+  return 0;
+}
+
+int xbee_ser_tx_flush(xbee_serial_t* serial) {
+  return 0;
+}
+
+int xbee_ser_rx_free(xbee_serial_t* serial) {
+  return N_XBEE_STUB_RX_SIZE - n_xbee_stub_pending();
+}
+
+int xbee_ser_rx_used(xbee_serial_t* serial) {
+  return n_xbee_stub_pending();
+}
+
+int xbee_ser_rx_flush(xbee_serial_t* serial) {
+  n_xbee_stub_head = n_xbee_stub_tail = 0;
+  return 0;
+}
+
+int xbee_ser_baudrate(xbee_serial_t* serial, uint32_t baudrate) {
+  serial->baudrate = baudrate;
+  return 0;
+}
+
+int xbee_ser_open(xbee_serial_t* serial, uint32_t baudrate) {
+  if ((serial->fd = open("/dev/null", O_RDWR)) < 0)
+    return -errno;
+  serial->baudrate = baudrate;
+  return 0;
+}
+
+int xbee_ser_close(xbee_serial_t* serial) {
+  if (serial->fd >= 0)
+    close(serial->fd);
+  serial->fd = -1;
+  return 0;
+}
+
+int xbee_ser_break(xbee_serial_t* serial, bool_t enabled) {
+  return 0;
+}
+
+int xbee_ser_flowcontrol(xbee_serial_t* serial, bool_t enabled) {
+  return 0;
+}
+
+int xbee_ser_set_rts(xbee_serial_t* serial, bool_t asserted) {
+  return 0;
+}
+
+int xbee_ser_get_cts(xbee_serial_t* serial) {
+  return 1;
+}
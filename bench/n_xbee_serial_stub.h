@@ -0,0 +1,25 @@
+#pragma once
+#ifndef _N_XBEE_SERIAL_STUB_H
+#define _N_XBEE_SERIAL_STUB_H
+
+#include <stdint.h>
+
+/*
+ * Stand in for n_xbee_serial.o in the bench harness.
+ *
+ * Nothing is opened but /dev/null, so TIOCOUTQ never reports a backlog.
+ * Writes are counted and thrown away, reads come out of a buffer the
+ * harness fills with n_xbee_stub_feed. Nothing is batched, there is no
+ * syscall to save.
+ */
+#define N_XBEE_STUB_RX_SIZE (1 << 16)
+
+// bytes the library wrote
+extern uint64_t n_xbee_stub_written;
+
+// Queues len bytes for xbee_ser_read, returns how many fit.
+int n_xbee_stub_feed(const void* data, int len);
+// Bytes queued and not read yet.
+int n_xbee_stub_pending(void);
+
+#endif
@@ -0,0 +1,82 @@
+#!/bin/bash
+# End to end benchmark over simulated radios. Needs root, for the taps,
+# the /dev links and the network namespaces.
+#
+# Each xbee_netdev runs in its own namespace on its own simulated radio,
+# so the traffic can't take a shortcut through the host's loopback. The
+# first node runs the client against the second. Results go to stdout and
+# bench_e2e_output.txt, bench_output.txt is make bench's.
+#
+# Knobs, as environment variables:
+#   RADIOS=2 SIZES="64 512 1400" RATE=50 DURATION=10
+#   AIR_BPS=250000 LOSS=0 LATENCY=2 FLOOD=1 (a rate 0 run per size too)
+set -e
+cd "$(dirname "$0")/.."
+
+RADIOS=${RADIOS:-2}
+SIZES=${SIZES:-64 512 1400}
+RATE=${RATE:-50}
+DURATION=${DURATION:-10}
+AIR_BPS=${AIR_BPS:-250000}
+LOSS=${LOSS:-0}
+LATENCY=${LATENCY:-2}
+FLOOD=${FLOOD:-1}
+PORT=9000
+LINK=/dev/ttySIM
+OUT=bench_e2e_output.txt
+
+if [ "$(id -u)" != 0 ]; then
+  echo "bench-e2e needs root." >&2
+  exit 1
+fi
+if [ "$RADIOS" -lt 2 ]; then
+  echo "bench-e2e needs two radios or more." >&2
+  exit 1
+fi
+
+PIDS=""
+cleanup() {
+  for pid in $PIDS; do
+    kill "$pid" 2>/dev/null || true
+  done
+  wait 2>/dev/null || true
+  for i in $(seq 0 $((RADIOS - 1))); do
+    ip netns del "xbsim$i" 2>/dev/null || true
+  done
+}
+trap cleanup EXIT
+
+./sim/xbee_sim --radios="$RADIOS" --link="$LINK" --air-bps="$AIR_BPS" \
+  --loss="$LOSS" --latency="$LATENCY" > sim_output.txt &
+PIDS="$PIDS $!"
+for i in $(seq 0 $((RADIOS - 1))); do
+  while [ ! -e "$LINK$i" ]; do sleep 0.1; done
+done
+
+for i in $(seq 0 $((RADIOS - 1))); do
+  ip netns add "xbsim$i"
+  ip netns exec "xbsim$i" ./xbee_netdev --workers=1 "$LINK$i" > "xbee_netdev$i.txt" 2>&1 &
+  PIDS="$PIDS $!"
+done
+for i in $(seq 0 $((RADIOS - 1))); do
+  while ! ip netns exec "xbsim$i" ip link show "xbeeSIM$i" > /dev/null 2>&1; do sleep 0.1; done
+  ip netns exec "xbsim$i" ip addr add "10.115.9.$((i + 1))/24" dev "xbeeSIM$i"
+  ip netns exec "xbsim$i" ip link set "xbeeSIM$i" up
+done
+
+ip netns exec xbsim1 ./sim/xbee_bench server "$PORT" &
+PIDS="$PIDS $!"
+# let discovery go around and ARP settle
+ip netns exec xbsim0 ping -c 3 -W 10 10.115.9.2 > /dev/null
+
+{
+  echo "radios $RADIOS air $AIR_BPS bit/s loss $LOSS% latency $LATENCY ms"
+  for size in $SIZES; do
+    ip netns exec xbsim0 ./sim/xbee_bench client 10.115.9.2 "$PORT" \
+      --rate="$RATE" --size="$size" --duration="$DURATION"
+    if [ "$FLOOD" = 1 ]; then
+      ip netns exec xbsim0 ./sim/xbee_bench client 10.115.9.2 "$PORT" \
+        --rate=0 --size="$size" --duration="$DURATION"
+    fi
+  done
+} | tee "$OUT"
@@ -0,0 +1,184 @@
+/*
+ * UDP traffic for benchmarking a link end to end.
+ *
+ *   xbee_bench server [PORT]
+ *   xbee_bench client HOST [PORT] [--rate=PPS] [--size=BYTES]
+ *                     [--duration=S] [--drain=S]
+ *
+ * The server echoes every datagram back. The client sends --size byte
+ * datagrams at --rate for --duration seconds, waits --drain seconds for
+ * the stragglers and prints one line: what was sent and echoed, echoed
+ * packets and payload bits per second, loss and round trip percentiles.
+ * A rate of 0 sends as fast as the socket takes them, which measures
+ * what the link holds rather than its latency.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define N_XBEE_BENCH_PORT 9000
+#define N_XBEE_BENCH_MAX_SIZE 65507
+
+typedef struct bench_hdr {
+  uint32_t seq;
+  uint64_t sent_us;
+} __attribute__((packed)) bench_hdr;
+
+static uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bench_cmp(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static double bench_pct(const uint64_t* rtt, uint32_t n, double pct) {
+  if (!n)
+    return 0;
+  return rtt[(uint32_t)((n - 1) * pct / 100.0 + 0.5)] / 1000.0;
+}
+
+static int bench_server(int port) {
+  struct sockaddr_in addr;
+  socklen_t alen;
+  unsigned char buf[N_XBEE_BENCH_MAX_SIZE];
+  int fd, n;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    printf("%s: unable to listen on %d, %d (%s)\n", __FUNCTION__, port, errno, strerror(errno));
+    return 1;
+  }
+  while (1) {
+    alen = sizeof(addr);
+    if ((n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*)&addr, &alen)) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    sendto(fd, buf, n, 0, (struct sockaddr*)&addr, alen);
+  }
+  return 1;
+}
+
+static int bench_client(const char* host, int port, uint32_t rate, int size, double duration, double drain) {
+  struct sockaddr_in addr;
+  struct pollfd pfd;
+  unsigned char buf[N_XBEE_BENCH_MAX_SIZE];
+  bench_hdr* hdr = (bench_hdr*)buf;
+  uint64_t* rtt;
+  uint64_t start, now, next, stop_send, stop_recv, interval;
+  uint32_t sent = 0, got = 0, cap;
+  double secs;
+  int fd, n, timeout;
+
+  if (size < (int)sizeof(bench_hdr) || size > N_XBEE_BENCH_MAX_SIZE) {
+    printf("%s: size is %d to %d.\n", __FUNCTION__, (int)sizeof(bench_hdr), N_XBEE_BENCH_MAX_SIZE);
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    printf("%s: %s isn't an IPv4 address.\n", __FUNCTION__, host);
+    return 1;
+  }
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    printf("%s: unable to reach %s:%d, %d (%s)\n", __FUNCTION__, host, port, errno, strerror(errno));
+    return 1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  cap = rate ? (uint32_t)(rate * duration) + 1 : 1 << 20;
+  if (!(rtt = malloc(cap * sizeof(uint64_t))))
+    return 1;
+  memset(buf, 0xA5, size);
+  interval = rate ? 1000000 / rate : 0;
+  start = next = bench_now();
+  stop_send = start + (uint64_t)(duration * 1000000);
+  stop_recv = stop_send + (uint64_t)(drain * 1000000);
+  pfd.fd = fd;
+
+  while ((now = bench_now()) < stop_recv) {
+    if (now < stop_send && now >= next && sent < cap) {
+      hdr->seq = sent;
+      hdr->sent_us = now;
+      if (send(fd, buf, size, 0) == size) {
+        sent++;
+        next += interval;
+      } else if (errno != EAGAIN && errno != ENOBUFS && errno != ECONNREFUSED)
+        break;
+    }
+    if (now >= stop_send)
+      timeout = (stop_recv - now) / 1000 + 1;
+    else if (!rate)
+      timeout = 1;
+    else
+      timeout = next > now ? (next - now) / 1000 : 0;
+    pfd.events = POLLIN | (now < stop_send && !rate ? POLLOUT : 0);
+    if (poll(&pfd, 1, timeout) <= 0 || !(pfd.revents & POLLIN))
+      continue;
+    while ((n = recv(fd, buf, size, 0)) >= (int)sizeof(bench_hdr)) {
+      if (got < cap)
+        rtt[got] = bench_now() - hdr->sent_us;
+      got++;
+    }
+  }
+
+  secs = duration;
+  if (got > cap)
+    got = cap;
+  qsort(rtt, got, sizeof(uint64_t), bench_cmp);
+  printf("size %d sent %u echoed %u pps %.1f goodput %.1f kbit/s loss %.1f%% rtt ms p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+      size, sent, got, got / secs, got * (double)size * 8 / secs / 1000, sent ? 100.0 * (sent - got) / sent : 0,
+      bench_pct(rtt, got, 50), bench_pct(rtt, got, 90), bench_pct(rtt, got, 99), bench_pct(rtt, got, 100));
+  free(rtt);
+  close(fd);
+  return 0;
+}
+
+int main(int argc, const char** argv) {
+  uint32_t rate = 50;
+  int size = 64, port = N_XBEE_BENCH_PORT, i;
+  double duration = 10, drain = 2;
+  const char* host = NULL;
+
+  if (argc >= 2 && strcmp(argv[1], "server") == 0)
+    return bench_server(argc >= 3 ? atoi(argv[2]) : port);
+  if (argc < 3 || strcmp(argv[1], "client") != 0) {
+    printf("usage: %s server [PORT]\n       %s client HOST [PORT] [--rate=PPS] [--size=BYTES] [--duration=S] [--drain=S]\n", argv[0], argv[0]);
+    return 1;
+  }
+  host = argv[2];
+  for (i = 3; i < argc; i++) {
+    if (strncmp(argv[i], "--rate=", 7) == 0)
+      rate = strtoul(argv[i] + 7, NULL, 0);
+    else if (strncmp(argv[i], "--size=", 7) == 0)
+      size = atoi(argv[i] + 7);
+    else if (strncmp(argv[i], "--duration=", 11) == 0)
+      duration = atof(argv[i] + 11);
+    else if (strncmp(argv[i], "--drain=", 8) == 0)
+      drain = atof(argv[i] + 8);
+    else
+      port = atoi(argv[i]);
+  }
+  return bench_client(host, port, rate, size, duration, drain);
+}
@@ -0,0 +1,632 @@
+/*
+ * Simulated XBee radios on pseudo-terminals, so xbee_netdev can be run,
+ * tested and benchmarked without hardware.
+ *
+ * Every radio is a pty speaking API mode 1 (no escaping) the way a
+ * ZigBee / DigiMesh firmware does: local AT commands (0x08 / 0x88),
+ * explicit and plain transmit requests (0x11, 0x10), receive indicators
+ * (0x91, or 0x90 with AO 0), transmit statuses (0x8B) and node discovery
+ * (ATND). "+++" drops a radio into a minimal AT command mode until ATCN.
+ *
+ * The radios share one virtual channel. A frame holds the channel for
+ * its air time at --air-bps, plus N_XBEE_SIM_AIR_OVERHEAD bytes per
+ * attempt, then arrives --latency ms later. Every attempt is lost with
+ * probability --loss percent; unicast is retried up to --retries times
+ * like the MAC would, and the transmit status reports the retries or a
+ * MAC ACK failure. Broadcasts are sent once and each radio loses its copy
+ * independently.
+ *
+ * The serial side is not rate limited: the pty moves bytes as fast as
+ * both ends take them, the channel is the bottleneck.
+ *
+ *   xbee_sim [--radios=N] [--link=/dev/ttySIM] [--air-bps=250000]
+ *            [--loss=PCT] [--latency=MS] [--retries=N] [--seed=N]
+ *
+ * --link makes PREFIX0, PREFIX1, ... symlinks to the ptys, /dev/ttySIM0
+ * for example, which xbee_netdev takes as a serial port and names its tap
+ * xbeeSIM0 after. Counters are printed on exit.
+ */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+
+#define N_XBEE_SIM_MAX_RADIOS 32
+// biggest API frame we take or make, data and checksum included
+#define N_XBEE_SIM_FRAME_MAX 512
+// PHY, MAC and APS headers and the ACK, bytes per attempt
+#define N_XBEE_SIM_AIR_OVERHEAD 40
+// what ATNP reports, the most one frame carries
+#define N_XBEE_SIM_NP 84
+
+#define N_XBEE_SIM_API_START 0x7E
+
+#define N_XBEE_SIM_FRAME_AT 0x08
+#define N_XBEE_SIM_FRAME_TX 0x10
+#define N_XBEE_SIM_FRAME_TX_EXPLICIT 0x11
+#define N_XBEE_SIM_FRAME_AT_RESPONSE 0x88
+#define N_XBEE_SIM_FRAME_TX_STATUS 0x8B
+#define N_XBEE_SIM_FRAME_RX 0x90
+#define N_XBEE_SIM_FRAME_RX_EXPLICIT 0x91
+
+#define N_XBEE_SIM_DELIVERY_OK 0x00
+#define N_XBEE_SIM_DELIVERY_NO_ACK 0x01
+#define N_XBEE_SIM_DELIVERY_NOT_FOUND 0x24
+
+#define N_XBEE_SIM_AT_OK 0
+#define N_XBEE_SIM_AT_ERROR 1
+
+typedef struct sim_radio {
+  int master;
+  // held open so the master never sees a hangup between clients
+  int slave;
+  char link[64];
+  unsigned char addr[8];
+  uint16_t my;
+  char ni[21];
+  uint8_t ap;
+  uint8_t ao;
+  uint8_t bd;
+  // an API frame coming in
+  unsigned char rx[N_XBEE_SIM_FRAME_MAX + 4];
+  int rxlen;
+  // AT command mode
+  int atmode;
+  int plus;
+  char line[64];
+  int linelen;
+  // frames from and to the host, air attempts, frames the host didn't
+  // take in time
+  uint64_t frames_in;
+  uint64_t frames_out;
+  uint64_t attempts;
+  uint64_t lost;
+  uint64_t overruns;
+} sim_radio;
+
+// an API frame due at a radio at some point
+typedef struct sim_event {
+  uint64_t at;
+  // keeps events due at the same time in order
+  uint64_t seq;
+  int radio;
+  int len;
+  unsigned char frame[N_XBEE_SIM_FRAME_MAX + 4];
+} sim_event;
+
+typedef struct sim_options {
+  int radios;
+  const char* link;
+  uint32_t air_bps;
+  double loss;
+  uint32_t latency_us;
+  int retries;
+  unsigned int seed;
+} sim_options;
+
+static sim_options opts = { 2, NULL, 250000, 0, 2000, 3, 1 };
+static sim_radio radios[N_XBEE_SIM_MAX_RADIOS];
+// min heap on at
+static sim_event** events;
+static int nevents;
+static int events_size;
+static uint64_t events_seq;
+// when the channel is free again
+static uint64_t air_busy;
+static volatile sig_atomic_t stop;
+
+static uint64_t sim_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* = Events = */
+static int sim_event_before(const sim_event* a, const sim_event* b) {
+  return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void sim_event_push(sim_event* ev) {
+  int i, parent;
+  if (nevents == events_size) {
+    events_size = events_size ? events_size * 2 : 64;
+    events = realloc(events, events_size * sizeof(sim_event*));
+  }
+  for (i = nevents++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (!sim_event_before(ev, events[parent]))
+      break;
+    events[i] = events[parent];
+  }
+  events[i] = ev;
+}
+
+static sim_event* sim_event_pop(void) {
+  sim_event* top = events[0];
+  sim_event* last = events[--nevents];
+  int i = 0, child;
+  while ((child = 2 * i + 1) < nevents) {
+    if (child + 1 < nevents && sim_event_before(events[child + 1], events[child]))
+      child++;
+    if (!sim_event_before(events[child], last))
+      break;
+    events[i] = events[child];
+    i = child;
+  }
+  events[i] = last;
+  return top;
+}
+
+// Queues the frame data (type onwards) for radio to hand to its host at.
+static void sim_schedule(int radio, uint64_t at, const unsigned char* data, int len) {
+  sim_event* ev;
+  unsigned char sum = 0;
+  int i;
+
+  if (len > N_XBEE_SIM_FRAME_MAX || !(ev = malloc(sizeof(sim_event))))
+    return;
+  ev->at = at;
+  ev->seq = events_seq++;
+  ev->radio = radio;
+  ev->frame[0] = N_XBEE_SIM_API_START;
+  ev->frame[1] = len >> 8;
+  ev->frame[2] = len & 0xFF;
+  memcpy(ev->frame + 3, data, len);
+  for (i = 0; i < len; i++)
+    sum += data[i];
+  ev->frame[3 + len] = 0xFF - sum;
+  ev->len = len + 4;
+  sim_event_push(ev);
+}
+
+static void sim_write(sim_radio* r, const void* buf, int len) {
+  // a host that doesn't read loses frames, like a UART overrun would
+  if (write(r->master, buf, len) != len)
+    r->overruns++;
+}
+
+/* = Air = */
+static int sim_find(const unsigned char* addr) {
+  int i;
+  for (i = 0; i < opts.radios; i++) {
+    if (memcmp(radios[i].addr, addr, 8) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static int sim_is_bcast(const unsigned char* addr) {
+  static const unsigned char bcast[8] = { 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+  return memcmp(addr, bcast, 8) == 0;
+}
+
+static int sim_lost(void) {
+  return opts.loss > 0 && rand() < opts.loss / 100.0 * ((double)RAND_MAX + 1);
+}
+
+// Puts a payload on the air from radio src. Returns when it is done and
+// fills in the retries and the delivery status.
+static uint64_t sim_air(int src, const unsigned char* dest, const unsigned char* hdr, const unsigned char* data, int len, uint8_t* retries, uint8_t* delivery) {
+  unsigned char rx[N_XBEE_SIM_FRAME_MAX];
+  uint64_t airtime = (uint64_t)(len + N_XBEE_SIM_AIR_OVERHEAD) * 8 * 1000000 / opts.air_bps;
+  uint64_t start = sim_now();
+  int i, dst = -1, attempts, hlen;
+  int bcast = sim_is_bcast(dest);
+
+  *retries = 0;
+  *delivery = N_XBEE_SIM_DELIVERY_OK;
+  if (!bcast && (dst = sim_find(dest)) < 0) {
+    *delivery = N_XBEE_SIM_DELIVERY_NOT_FOUND;
+    return start;
+  }
+  if (start < air_busy)
+    start = air_busy;
+
+  if (bcast) {
+    attempts = 1;
+  } else {
+    // the first try and up to opts.retries more
+    for (attempts = 1; attempts <= opts.retries + 1 && sim_lost(); attempts++)
+      ;
+    if (attempts > opts.retries + 1) {
+      *retries = opts.retries;
+      *delivery = N_XBEE_SIM_DELIVERY_NO_ACK;
+      attempts = opts.retries + 1;
+    } else
+      *retries = attempts - 1;
+  }
+  radios[src].attempts += attempts;
+  air_busy = start + airtime * attempts;
+
+  for (i = 0; i < opts.radios; i++) {
+    if (i == src || (!bcast && i != dst))
+      continue;
+    if ((bcast && sim_lost()) || *delivery != N_XBEE_SIM_DELIVERY_OK) {
+      radios[i].lost++;
+      continue;
+    }
+    // 0x91 with AO 1, 0x90 otherwise
+    hlen = 0;
+    rx[hlen++] = radios[i].ao ? N_XBEE_SIM_FRAME_RX_EXPLICIT : N_XBEE_SIM_FRAME_RX;
+    memcpy(rx + hlen, radios[src].addr, 8);
+    hlen += 8;
+    rx[hlen++] = radios[src].my >> 8;
+    rx[hlen++] = radios[src].my & 0xFF;
+    if (radios[i].ao) {
+      // endpoints, cluster and profile
+      memcpy(rx + hlen, hdr, 6);
+      hlen += 6;
+    }
+    rx[hlen++] = bcast ? 0x02 : 0x01;
+    if (hlen + len > (int)sizeof(rx))
+      continue;
+    memcpy(rx + hlen, data, len);
+    sim_schedule(i, air_busy + opts.latency_us, rx, hlen + len);
+  }
+  return air_busy + opts.latency_us;
+}
+
+/* = API frames = */
+static void sim_at_response(int radio, uint8_t id, const unsigned char* cmd, uint8_t status, const void* value, int vlen) {
+  unsigned char resp[5 + N_XBEE_SIM_FRAME_MAX];
+  resp[0] = N_XBEE_SIM_FRAME_AT_RESPONSE;
+  resp[1] = id;
+  resp[2] = cmd[0];
+  resp[3] = cmd[1];
+  resp[4] = status;
+  memcpy(resp + 5, value, vlen);
+  sim_schedule(radio, 0, resp, 5 + vlen);
+}
+
+// One ATND answer about radio i.
+static int sim_nd_entry(int i, unsigned char* out) {
+  int n = 0, nlen = strlen(radios[i].ni);
+  out[n++] = radios[i].my >> 8;
+  out[n++] = radios[i].my & 0xFF;
+  memcpy(out + n, radios[i].addr, 8);
+  n += 8;
+  memcpy(out + n, radios[i].ni, nlen + 1);
+  n += nlen + 1;
+  // parent, router, status, profile and manufacturer
+  out[n++] = 0xFF;
+  out[n++] = 0xFE;
+  out[n++] = 1;
+  out[n++] = 0;
+  out[n++] = 0xC1;
+  out[n++] = 0x05;
+  out[n++] = 0x10;
+  out[n++] = 0x1E;
+  return n;
+}
+
+static uint32_t sim_be(const unsigned char* p, int len) {
+  uint32_t v = 0;
+  while (len-- > 0)
+    v = (v << 8) | *p++;
+  return v;
+}
+
+static void sim_at(int radio, const unsigned char* f, int len) {
+  sim_radio* r = &radios[radio];
+  unsigned char value[64];
+  const unsigned char* cmd = f + 2;
+  const unsigned char* param = f + 4;
+  int plen = len - 4, i, n;
+  uint8_t id = f[1];
+
+  if (len < 4)
+    return;
+#define SIM_CMD(a, b) (cmd[0] == (a) && cmd[1] == (b))
+#define SIM_U8(field) \
+  do { \
+    if (plen > 0) \
+      r->field = sim_be(param, plen); \
+    value[0] = r->field; \
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, value, plen > 0 ? 0 : 1); \
+  } while (0)
+  if (SIM_CMD('A', 'P'))
+    SIM_U8(ap);
+  else if (SIM_CMD('A', 'O'))
+    SIM_U8(ao);
+  else if (SIM_CMD('B', 'D'))
+    SIM_U8(bd);
+  else if (SIM_CMD('S', 'H') || SIM_CMD('S', 'L'))
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, r->addr + (cmd[1] == 'L' ? 4 : 0), 4);
+  else if (SIM_CMD('M', 'Y')) {
+    value[0] = r->my >> 8;
+    value[1] = r->my & 0xFF;
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, value, 2);
+  } else if (SIM_CMD('V', 'R') || SIM_CMD('H', 'V')) {
+    // ZigBee API firmware on an S2C
+    value[0] = cmd[0] == 'V' ? 0x40 : 0x2D;
+    value[1] = cmd[0] == 'V' ? 0x5F : 0x00;
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, value, 2);
+  } else if (SIM_CMD('N', 'P')) {
+    value[0] = 0;
+    value[1] = N_XBEE_SIM_NP;
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, value, 2);
+  } else if (SIM_CMD('N', 'I')) {
+    if (plen > 0) {
+      n = plen < (int)sizeof(r->ni) - 1 ? plen : (int)sizeof(r->ni) - 1;
+      memcpy(r->ni, param, n);
+      r->ni[n] = '\0';
+    }
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, r->ni, plen > 0 ? 0 : strlen(r->ni));
+  } else if (SIM_CMD('N', 'T')) {
+    // shortest ZigBee allows, 3.2 s
+    value[0] = 0x20;
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, value, 1);
+  } else if (SIM_CMD('N', 'D')) {
+    // everyone answers right away, the empty response ends it
+    for (i = 0; i < opts.radios; i++) {
+      if (i == radio || (plen > 0 && (strlen(radios[i].ni) != (size_t)plen || memcmp(radios[i].ni, param, plen) != 0)))
+        continue;
+      n = sim_nd_entry(i, value);
+      sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, value, n);
+    }
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, NULL, 0);
+  } else if (SIM_CMD('A', 'I') || plen > 0 || SIM_CMD('W', 'R') || SIM_CMD('A', 'C') || SIM_CMD('F', 'R') || SIM_CMD('C', 'N')) {
+    // associated, and everything else that is set sticks
+    value[0] = 0;
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, value, SIM_CMD('A', 'I') ? 1 : 0);
+  } else {
+    value[0] = 0;
+    sim_at_response(radio, id, cmd, N_XBEE_SIM_AT_OK, value, 1);
+  }
+#undef SIM_U8
+#undef SIM_CMD
+}
+
+static void sim_tx(int radio, const unsigned char* f, int len) {
+  // endpoints E8, cluster 0x0011 and the Digi profile for 0x10
+  static const unsigned char plain_hdr[6] = { 0xE8, 0xE8, 0x00, 0x11, 0xC1, 0x05 };
+  unsigned char status[7];
+  const unsigned char* hdr = plain_hdr;
+  int off = 14;
+  uint8_t retries, delivery;
+  uint64_t done;
+
+  if (f[0] == N_XBEE_SIM_FRAME_TX_EXPLICIT) {
+    hdr = f + 12;
+    off = 20;
+  }
+  if (len < off)
+    return;
+  radios[radio].frames_in++;
+  done = sim_air(radio, f + 2, hdr, f + off, len - off, &retries, &delivery);
+  if (!f[1])
+    return;
+  status[0] = N_XBEE_SIM_FRAME_TX_STATUS;
+  status[1] = f[1];
+  status[2] = 0xFF;
+  status[3] = 0xFE;
+  status[4] = retries;
+  status[5] = delivery;
+  status[6] = 0;
+  sim_schedule(radio, done, status, sizeof(status));
+}
+
+static void sim_frame(int radio, const unsigned char* f, int len) {
+  switch (f[0]) {
+    case N_XBEE_SIM_FRAME_AT:
+      sim_at(radio, f, len);
+      break;
+    case N_XBEE_SIM_FRAME_TX:
+    case N_XBEE_SIM_FRAME_TX_EXPLICIT:
+      sim_tx(radio, f, len);
+      break;
+  }
+}
+
+/* = AT mode = */
+static void sim_atmode_line(sim_radio* r) {
+  char out[32];
+  char* arg;
+  uint8_t* field = NULL;
+
+  r->line[r->linelen] = '\0';
+  r->linelen = 0;
+  if (strncasecmp(r->line, "AT", 2) != 0) {
+    sim_write(r, "ERROR\r", 6);
+    return;
+  }
+  arg = r->line + 4;
+  while (*arg == ' ')
+    arg++;
+  if (strncasecmp(r->line + 2, "AP", 2) == 0)
+    field = &r->ap;
+  else if (strncasecmp(r->line + 2, "AO", 2) == 0)
+    field = &r->ao;
+  else if (strncasecmp(r->line + 2, "BD", 2) == 0)
+    field = &r->bd;
+  else if (strncasecmp(r->line + 2, "CN", 2) == 0)
+    r->atmode = 0;
+  if (field && !*arg) {
+    snprintf(out, sizeof(out), "%X\r", *field);
+    sim_write(r, out, strlen(out));
+    return;
+  }
+  if (field)
+    *field = strtoul(arg, NULL, 16);
+  sim_write(r, "OK\r", 3);
+}
+
+/* = Serial = */
+static void sim_serial_byte(int radio, unsigned char c) {
+  sim_radio* r = &radios[radio];
+  int len, i;
+  unsigned char sum = 0;
+
+  if (r->atmode) {
+    if (c == '\r')
+      sim_atmode_line(r);
+    else if (r->linelen < (int)sizeof(r->line) - 1)
+      r->line[r->linelen++] = c;
+    return;
+  }
+  if (!r->rxlen) {
+    if (c == N_XBEE_SIM_API_START) {
+      r->rx[r->rxlen++] = c;
+      r->plus = 0;
+    } else if (c == '+' && ++r->plus == 3) {
+      // the guard times aren't checked
+      r->plus = 0;
+      r->atmode = 1;
+      r->linelen = 0;
+      sim_write(r, "OK\r", 3);
+    } else if (c != '+')
+      r->plus = 0;
+    return;
+  }
+  r->rx[r->rxlen++] = c;
+  if (r->rxlen < 3)
+    return;
+  len = (r->rx[1] << 8) | r->rx[2];
+  if (len == 0 || len > N_XBEE_SIM_FRAME_MAX) {
+    r->rxlen = 0;
+    return;
+  }
+  if (r->rxlen < len + 4)
+    return;
+  for (i = 0; i < len + 1; i++)
+    sum += r->rx[3 + i];
+  if (sum == 0xFF)
+    sim_frame(radio, r->rx + 3, len);
+  r->rxlen = 0;
+}
+
+static void sim_serial_read(int radio) {
+  unsigned char buf[4096];
+  int n, i;
+  while ((n = read(radios[radio].master, buf, sizeof(buf))) > 0) {
+    for (i = 0; i < n; i++)
+      sim_serial_byte(radio, buf[i]);
+  }
+}
+
+/* = Setup = */
+static int sim_open(int i) {
+  sim_radio* r = &radios[i];
+  struct termios tio;
+  const char* name;
+
+  memset(r, 0, sizeof(sim_radio));
+  if ((r->master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(r->master) != 0 || unlockpt(r->master) != 0 || !(name = ptsname(r->master)))
+    return -errno;
+  if ((r->slave = open(name, O_RDWR | O_NOCTTY)) < 0)
+    return -errno;
+  tcgetattr(r->slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(r->slave, TCSANOW, &tio);
+  fcntl(r->master, F_SETFL, fcntl(r->master, F_GETFL) | O_NONBLOCK);
+
+  // 0013A200 5100000i, the way a Digi address looks
+  r->addr[0] = 0x00;
+  r->addr[1] = 0x13;
+  r->addr[2] = 0xA2;
+  r->addr[3] = 0x00;
+  r->addr[4] = 0x51;
+  r->addr[7] = i;
+  r->my = 0x1000 + i;
+  r->ap = 1;
+  r->ao = 1;
+  // 115200
+  r->bd = 7;
+  snprintf(r->ni, sizeof(r->ni), "SIM%d", i);
+
+  if (opts.link) {
+    snprintf(r->link, sizeof(r->link), "%s%d", opts.link, i);
+    unlink(r->link);
+    if (symlink(name, r->link) != 0)
+      return -errno;
+  }
+  printf("%s: radio %d is %s%s%s\n", __FUNCTION__, i, name, opts.link ? " linked as " : "", opts.link ? r->link : "");
+  return 0;
+}
+
+static void sim_on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+int main(int argc, const char** argv) {
+  struct pollfd fds[N_XBEE_SIM_MAX_RADIOS];
+  sim_event* ev;
+  uint64_t now;
+  int i, err, timeout;
+
+  for (i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--radios=", 9) == 0)
+      opts.radios = atoi(argv[i] + 9);
+    else if (strncmp(argv[i], "--link=", 7) == 0)
+      opts.link = argv[i] + 7;
+    else if (strncmp(argv[i], "--air-bps=", 10) == 0)
+      opts.air_bps = strtoul(argv[i] + 10, NULL, 0);
+    else if (strncmp(argv[i], "--loss=", 7) == 0)
+      opts.loss = atof(argv[i] + 7);
+    else if (strncmp(argv[i], "--latency=", 10) == 0)
+      opts.latency_us = atof(argv[i] + 10) * 1000;
+    else if (strncmp(argv[i], "--retries=", 10) == 0)
+      opts.retries = atoi(argv[i] + 10);
+    else if (strncmp(argv[i], "--seed=", 7) == 0)
+      opts.seed = strtoul(argv[i] + 7, NULL, 0);
+    else {
+      printf("usage: %s [--radios=N] [--link=PREFIX] [--air-bps=BPS] [--loss=PCT] [--latency=MS] [--retries=N] [--seed=N]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (opts.radios < 1 || opts.radios > N_XBEE_SIM_MAX_RADIOS || !opts.air_bps) {
+    printf("%s: 1 to %d radios, and some bandwidth.\n", __FUNCTION__, N_XBEE_SIM_MAX_RADIOS);
+    return 1;
+  }
+  srand(opts.seed);
+  signal(SIGINT, sim_on_signal);
+  signal(SIGTERM, sim_on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < opts.radios; i++) {
+    if ((err = sim_open(i)) != 0) {
+      printf("%s: unable to set up radio %d, %d (%s)\n", __FUNCTION__, i, -err, strerror(-err));
+      return 1;
+    }
+    fds[i].fd = radios[i].master;
+    fds[i].events = POLLIN;
+  }
+  fflush(stdout);
+
+  while (!stop) {
+    now = sim_now();
+    while (nevents && events[0]->at <= now) {
+      ev = sim_event_pop();
+      radios[ev->radio].frames_out++;
+      sim_write(&radios[ev->radio], ev->frame, ev->len);
+      free(ev);
+    }
+    timeout = nevents ? (int)((events[0]->at - now + 999) / 1000) : -1;
+    if (poll(fds, opts.radios, timeout) < 0 && errno != EINTR)
+      break;
+    for (i = 0; i < opts.radios; i++) {
+      if (fds[i].revents & POLLIN)
+        sim_serial_read(i);
+    }
+  }
+
+  for (i = 0; i < opts.radios; i++) {
+    printf("%s: radio %d took %llu frames, gave %llu, %llu air attempts, lost %llu, %llu overruns\n", __FUNCTION__, i,
+        (unsigned long long)radios[i].frames_in, (unsigned long long)radios[i].frames_out,
+        (unsigned long long)radios[i].attempts, (unsigned long long)radios[i].lost, (unsigned long long)radios[i].overruns);
+    if (opts.link)
+      unlink(radios[i].link);
+  }
+  return 0;
+}
@@ -1 +0,0 @@
-void hexdump(void *mem, unsigned int len);
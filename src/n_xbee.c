@@ -1,11 +1,21 @@
 #include "n_xbee.h"
-#include "hexdump.h"
+#include "n_xbee_proto.h"
+#include "n_xbee_hc.h"
+#include "n_xbee_bond.h"
+#include "n_xbee_lz.h"
+#include "n_xbee_nd.h"
+#include "n_xbee_mtu.h"
+#include "n_xbee_serial.h"
 
 #include <unistd.h>
 #include <libgen.h>
 #include <assert.h>
+#include <signal.h>
 
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -29,11 +39,18 @@
 #include <netinet/ip_icmp.h>
 
 
-// compat with old printk defs
-#define KERN_INFO
-#define KERN_ALERT
-#define printk printf
-#define msleep(TIME) usleep(TIME * 1000)
+// what we tell other nodes we understand
+#ifndef N_XBEE_NO_HEADER_COMPRESSION
+#define N_XBEE_LOCAL_CAPS_HC N_XBEE_CAP_HC
+#else
+#define N_XBEE_LOCAL_CAPS_HC 0
+#endif
+#ifndef N_XBEE_NO_PAYLOAD_COMPRESSION
+#define N_XBEE_LOCAL_CAPS_LZ N_XBEE_CAP_LZ
+#else
+#define N_XBEE_LOCAL_CAPS_LZ 0
+#endif
+#define N_XBEE_LOCAL_CAPS (N_XBEE_CAP_FRAG | N_XBEE_CAP_BOND | N_XBEE_CAP_AGG | N_XBEE_LOCAL_CAPS_HC | N_XBEE_LOCAL_CAPS_LZ)
 
 #ifndef N_XBEE_ENABLE_UNIMPLEMENTED
 #undef N_XBEE_PING_RESPONDER
@@ -52,18 +69,27 @@ struct ether_arp {
 /* == Xbee stuff == */
 const xbee_dispatch_table_entry_t xbee_frame_handlers[] =
 {
+  // frame type 0 matches everything, records what the radio says
+  { 0, 0, n_xbee_cap_frame_handler, NULL },
   // handle AT frames
   XBEE_FRAME_HANDLE_LOCAL_AT,
   XBEE_FRAME_HANDLE_ATND_RESPONSE,
   // handle receiving a frame
   XBEE_FRAME_HANDLE_RX_EXPLICIT,
   XBEE_FRAME_HANDLE_AO0_NODEID,
+  // track link health
+  { XBEE_FRAME_TRANSMIT_STATUS, 0, n_xbee_tx_status_handler, NULL },
   // print modem statuses
   XBEE_FRAME_MODEM_STATUS_DEBUG,
   // marker for the end
   XBEE_FRAME_TABLE_END
 };
 
+struct xbee_serial_bridge* n_xbee_bridges[N_XBEE_MAX_BRIDGES];
+int n_xbee_bridge_count;
+pthread_mutex_t n_xbee_lib_lock;
+n_xbee_options n_xbee_opts;
+
 wpan_ep_state_t zdo_ep_state = { 0 };
 wpan_ep_state_t zcl_ep_state = { 0 };
 
@@ -72,6 +98,7 @@ void n_xbee_xmit_ether_packet(struct xbee_serial_bridge* bridge, const void* buf
 
 const wpan_cluster_table_entry_t xbee_data_clusters[] = {
   { N_XBEE_CLUSTER_ID, NULL, NULL, WPAN_CLUST_FLAG_INOUT | WPAN_CLUST_FLAG_NOT_ZCL },
+  { N_XBEE_CLUSTER_ID_ENCAP, NULL, NULL, WPAN_CLUST_FLAG_INOUT | WPAN_CLUST_FLAG_NOT_ZCL },
   // if we don't set ATAO to 0...
   XBEE_DISC_DIGI_DATA_CLUSTER_ENTRY,
   WPAN_CLUST_ENTRY_LIST_END
@@ -93,6 +120,40 @@ const wpan_endpoint_table_entry_t xbee_endpoints[] = {
 };
 
 /* = Serial Bridge Stuff = */
+xbee_serial_bridge* n_xbee_find_bridge_byxbee(xbee_dev_t* xbee) {
+  int i;
+  for (i = 0; i < n_xbee_bridge_count; i++) {
+    if (n_xbee_bridges[i]->xbee_dev == xbee)
+      return n_xbee_bridges[i];
+  }
+  return NULL;
+}
+
+xbee_serial_bridge* n_xbee_find_bridge_bywpan(const wpan_dev_t* dev) {
+  int i;
+  for (i = 0; i < n_xbee_bridge_count; i++) {
+    if (&n_xbee_bridges[i]->xbee_dev->wpan_dev == dev)
+      return n_xbee_bridges[i];
+  }
+  return NULL;
+}
+
+// Every frame we send goes through the transmit engine, which tracks it
+// by frame ID until the radio says how it went.
+int n_xbee_envelope_send(const wpan_envelope_t* envelope) {
+  return n_xbee_envelope_send_prefixed(envelope, NULL, 0);
+}
+
+int n_xbee_envelope_send_prefixed(const wpan_envelope_t* envelope, const void* prefix, int prefixlen) {
+  struct xbee_serial_bridge* bridge = n_xbee_find_bridge_bywpan(envelope->dev);
+  if (!bridge)
+    return -ENODEV;
+  // the capture already holds what we said back then
+  if (n_xbee_cap_replaying)
+    return -ENETDOWN;
+  return n_xbee_tx_send(bridge, envelope, prefix, prefixlen);
+}
+
 void n_xbee_free_xbee_dev(xbee_dev_t* dev) {
   if (dev)
     free(dev);
@@ -103,6 +164,9 @@ void n_xbee_free_xbee_dev(xbee_dev_t* dev) {
 void n_xbee_free_netdev(xbee_serial_bridge* n);
 void n_xbee_free_bridge(xbee_serial_bridge* n) {
   if (!n) return;
+  // queued frames go back to the pool before it goes away
+  n_xbee_sched_clear(&n->sched);
+  n_xbee_cap_destroy(&n->cap);
   if (n->netdevInitialized)
     n_xbee_free_netdev(n);
   if (n->name)
@@ -114,72 +178,13 @@ void n_xbee_free_bridge(xbee_serial_bridge* n) {
   free(n);
 }
 
-void n_xbee_free_remote_nodetable(void) {
-  struct xbee_remote_node* nodn;
-  struct xbee_remote_node* nod = n_xbee_node_table;
-  n_xbee_node_table = NULL;
-  while (nod) {
-    nodn = nod->next;
-    // do something to free
-    free(nod);
-    nod = nodn;
-  }
-}
-
-/* = Node Table Stuff = */
-xbee_remote_node* n_xbee_node_find_or_insert(const addr64* id) {
-  char addr64_buf[ADDR64_STRING_LENGTH];
-  struct xbee_remote_node* nnod;
-  struct xbee_remote_node* pnod = NULL;
-  struct xbee_remote_node* nod = n_xbee_node_table;
-  while (nod) {
-    if (memcmp(&nod->node_addr, id, sizeof(addr64)) == 0) {
-      return nod;
-    }
-    pnod = nod;
-    nod = nod->next;
-  }
-  printk(KERN_INFO "%s: registering new remote node %s\n", __FUNCTION__, addr64_format(addr64_buf, id));
-  nnod = malloc(sizeof(xbee_remote_node));
-  memcpy(&nnod->node_addr, id, sizeof(addr64));
-  nnod->next = NULL;
-  if (pnod)
-    pnod->next = nnod;
-  else
-    n_xbee_node_table = nnod;
-  return 0;
-}
-
-// should be ETH_ALEN
-xbee_remote_node* n_xbee_node_find_eth(const void* addr, int len) {
-  void* tocmp;
-  struct xbee_remote_node* nod = n_xbee_node_table;
-  if (len > 8)
-    len = 8;
-  while (nod) {
-    tocmp = (nod->node_addr) + (8 - len);
-    if (memcmp(tocmp, addr, len) == 0)
-      return nod;
-    nod = nod->next;
-  }
-  return 0;
-}
-
 /* = XBEE Controls */
-#define N_XBEE_CHECK_ITERATIONS(iter, itern) \
-  if (iterations >= itern) { \
+#define N_XBEE_CHECK_DEADLINE(start, ms) \
+  if (xbee_millisecond_timer() - (start) >= (ms)) { \
     printk(KERN_ALERT "%s: Timeout waiting for AT mode\n", __FUNCTION__); \
     return -ETIMEDOUT; \
   }
 
-// Checks the tty to see if there is really an xbee
-// on the other end, and if so, it's communicating right.
-// Also retreives some params about the remote dev
-// THIS IS REALLY MESSY CODE
-// FUTURE IMPROVEMENT: Only enter AT mode if API mode fails.
-// REWRITE:
-//   - Attempt to send API frame with AT command to get API mode.
-//   - If it does not return OR returns a mode other than 1, revert to ATMODE
 #define CHECK_MISC_ATMODE_ERRS \
   else if (mode == -EPERM) { \
     printk(KERN_ALERT "%s: [bug] After sending, xbee code isn't waiting for a response.\n", __FUNCTION__); \
@@ -197,20 +202,71 @@ else if (mode == -ETIMEDOUT) { \
   return -EIO; \
 }
 #define CHECK_RESP_BUF_SIZE 255
-void n_xbee_node_discovered(xbee_dev_t* xbee, const xbee_node_id_t *rec);
-int n_xbee_check_tty(xbee_serial_bridge* bridge) {
-  int err, mode, iterations, bytesread;
+
+// Waits up to timeout ms for the radio to send something.
+static void n_xbee_serial_wait(xbee_dev_t* xbee, int timeout) {
+  struct pollfd pfd;
+  // already read, the tty has nothing more to say about it
+  if (timeout <= 0 || n_xbee_serial_rx_buffered(&xbee->serial))
+    return;
+  // whatever we're waiting on an answer to may still be queued
+  n_xbee_serial_flush(&xbee->serial);
+  pfd.fd = xbee->serial.fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  poll(&pfd, 1, timeout);
+}
+
+// Sends an AT command in AT mode and waits for the reply, which must be
+// ok, or contain expect if that is set.
+static int n_xbee_atmode_command(xbee_dev_t* xbee, const char* cmd, char expect) {
+  int err, mode, bytesread = 0;
+  uint32_t start;
   char respbuf[CHECK_RESP_BUF_SIZE];
+
+  if ((err = xbee_atmode_send_request(xbee, cmd)) != 0) {
+    printk(KERN_ALERT "%s: Unable to send %s, error: %d\n", __FUNCTION__, cmd, err);
+    return err;
+  }
+  start = xbee_millisecond_timer();
+  while (1) {
+    N_XBEE_CHECK_DEADLINE(start, N_XBEE_ATMODE_TIMEOUT);
+    mode = xbee_atmode_read_response(xbee, respbuf, CHECK_RESP_BUF_SIZE, &bytesread);
+    if (mode == -EAGAIN) {
+      n_xbee_serial_wait(xbee, 5);
+      continue;
+    }
+    else if (mode == 0) {
+      if (expect && respbuf[0] != expect && respbuf[1] != expect && respbuf[2] != expect) {
+        if (respbuf[0] > 0 && respbuf[0] < 200)
+          printk(KERN_ALERT "%s: Response to %s is %c, should be %c, failing.\n", __FUNCTION__, cmd, respbuf[0], expect);
+        else
+          printk(KERN_ALERT "%s: Response to %s is NOT ASCII - (%d), should be %c (%d), failing.\n", __FUNCTION__, cmd, (int)respbuf[0], expect, (int)expect);
+        return -EIO;
+      }
+      printk(KERN_INFO "%s: %s ok...\n", __FUNCTION__, cmd);
+      return 0;
+    }
+    CHECK_MISC_ATMODE_ERRS;
+  }
+}
+
+// Puts the radio in API mode 1 with AO 1 through AT mode, which costs
+// the guard time twice over. The settings are written to flash so the
+// next start can take the fast path.
+static int n_xbee_atmode_setup(xbee_serial_bridge* bridge) {
+  int err, mode;
+  uint32_t start;
   xbee_dev_t* xbee = bridge->xbee_dev;
-  // xbee_ser_rx_flush(bridge->xbee_dev->);
+
   printk(KERN_INFO "Putting board into AT mode to check values...\n");
   if ((err = xbee_atmode_enter(xbee)) != 0) {
     printk(KERN_ALERT "Unable to put board into AT mode, error: %d\n", err);
     return err;
   }
-  iterations = 0;
+  start = xbee_millisecond_timer();
   while (1) {
-    N_XBEE_CHECK_ITERATIONS(iterations, 4000);
+    N_XBEE_CHECK_DEADLINE(start, N_XBEE_ATMODE_SWITCH_TIMEOUT);
 
     mode = xbee_atmode_tick(xbee);
 
@@ -222,168 +278,271 @@ int n_xbee_check_tty(xbee_serial_bridge* bridge) {
       printk(KERN_ALERT "%s: Never entered AT mode (in idle mode), assuming failure.\n", __FUNCTION__);
       return -ETIMEDOUT;
     }
-
-    // msleep 5 milliseconds
-    msleep(5);
-    iterations ++;
+    // wakes up early for the OK, otherwise the guard time has to pass
+    n_xbee_serial_wait(xbee, 5);
   }
 
-  // n_xbee_flush_buffer(bridge->tty);
+  if ((err = n_xbee_atmode_command(xbee, "AP 1", 0)) != 0 ||
+      (err = n_xbee_atmode_command(xbee, "AP", '1')) != 0 ||
+      (err = n_xbee_atmode_command(xbee, "AO 1", 0)) != 0 ||
+      (err = n_xbee_atmode_command(xbee, "AO", '1')) != 0 ||
+      (err = n_xbee_atmode_command(xbee, "WR", 0)) != 0)
+    return err;
 
-  printk(KERN_INFO "%s: Setting API mode 1...\n", __FUNCTION__);
-  if ((err = xbee_atmode_send_request(xbee, "AP 1")) != 0) {
-    printk(KERN_ALERT "%s: Unable to set API mode, error: %d\n", __FUNCTION__, err);
+  // exit AT mode
+  printk(KERN_INFO "%s: Exiting AT mode...\n", __FUNCTION__);
+  if ((err = xbee_atmode_exit(xbee)) != 0) {
+    printk(KERN_ALERT "%s: Unable to exit AT mode, error: %d\n", __FUNCTION__, err);
     return err;
   }
 
-  bytesread = 0;
-  iterations = 0;
+  start = xbee_millisecond_timer();
   while (1) {
-    N_XBEE_CHECK_ITERATIONS(iterations, 200);
-    mode = xbee_atmode_read_response(xbee, respbuf, CHECK_RESP_BUF_SIZE, &bytesread);
-    if (mode == -EAGAIN) {
-      msleep(5);
-      iterations ++;
-      continue;
-    }
-    else if (mode == 0) {
-      printk(KERN_INFO "%s: Successfully set API mode 1 from %c...\n", __FUNCTION__, respbuf[0]);
+    N_XBEE_CHECK_DEADLINE(start, N_XBEE_ATMODE_SWITCH_TIMEOUT);
+    mode = xbee_atmode_tick(xbee);
+    if (mode == XBEE_MODE_IDLE) {
+      printk(KERN_INFO "%s: Successfully exited AT mode.\n", __FUNCTION__);
       break;
     }
-    CHECK_MISC_ATMODE_ERRS;
+    n_xbee_serial_wait(xbee, 5);
   }
+  return 0;
+}
 
-  msleep(100);
-  // n_xbee_flush_buffer(bridge->tty);
+// An AT command sent in an API frame.
+typedef struct n_xbee_api_cmd {
+  int16_t handle;
+  // -1 until answered, then whether it went through
+  int ok;
+  uint32_t value;
+} n_xbee_api_cmd;
+
+static int n_xbee_api_cmd_response(const xbee_cmd_response_t FAR* response) {
+  n_xbee_api_cmd* cmd = (n_xbee_api_cmd*)response->context;
+  cmd->handle = -1;
+  cmd->ok = !(response->flags & XBEE_CMD_RESP_FLAG_TIMEOUT) &&
+    (response->flags & XBEE_CMD_RESP_MASK_STATUS) == XBEE_AT_RESP_SUCCESS;
+  cmd->value = response->value;
+  return XBEE_ATCMD_DONE;
+}
+
+// Sends an AT command in an API frame, setting it to value unless that
+// is <0, and waits up to timeout ms for the answer. Returns 0 with the
+// value in *result (if not NULL), or <0.
+static int n_xbee_api_command(xbee_dev_t* xbee, const char* command, long value, uint32_t* result, uint32_t timeout) {
+  n_xbee_api_cmd cmd;
+  uint32_t start, elapsed;
+  int err;
 
-  printk(KERN_INFO "%s: Verifying API mode...\n", __FUNCTION__);
-  if ((err = xbee_atmode_send_request(xbee, "AP")) != 0) {
-    printk(KERN_ALERT "%s: Unable to request API mode, error: %d\n", __FUNCTION__, err);
+  cmd.ok = -1;
+  if ((cmd.handle = xbee_cmd_create(xbee, command)) < 0)
+    return cmd.handle;
+  xbee_cmd_set_callback(cmd.handle, n_xbee_api_cmd_response, &cmd);
+  if (value >= 0)
+    xbee_cmd_set_param(cmd.handle, value);
+  if ((err = xbee_cmd_send(cmd.handle)) != 0) {
+    xbee_cmd_release_handle(cmd.handle);
     return err;
   }
 
-  bytesread = 0;
-  iterations = 0;
-  while (1) {
-    N_XBEE_CHECK_ITERATIONS(iterations, 200);
-    mode = xbee_atmode_read_response(xbee, respbuf, CHECK_RESP_BUF_SIZE, &bytesread);
-    if (mode == -EAGAIN) {
-      msleep(5);
-      iterations ++;
-      continue;
-    }
-    else if (mode == 0) {
-      if (respbuf[0] != '1' && respbuf[1] != '1' && respbuf[2] != '1') {
-        if (respbuf[0] > 0 && respbuf[0] < 200)
-          printk(KERN_ALERT "%s: Response from AT is %c, should be 1, failing.\n", __FUNCTION__, respbuf[0]);
-        else
-          printk(KERN_ALERT "%s: Response from AT is NOT ASCII - (%d), should be 1 (%d), failing.\n", __FUNCTION__, (int)respbuf[0], (int)'1');
-        return -EIO;
-      }
-      printk(KERN_INFO "%s: Successfully verified API mode 1...\n", __FUNCTION__);
-      break;
-    }
-    CHECK_MISC_ATMODE_ERRS;
+  start = xbee_millisecond_timer();
+  while (cmd.ok < 0 && (elapsed = xbee_millisecond_timer() - start) < timeout) {
+    n_xbee_serial_wait(xbee, timeout - elapsed);
+    xbee_dev_tick(xbee);
   }
+  // cmd lives on our stack, nothing may call back into it later
+  if (cmd.handle >= 0)
+    xbee_cmd_release_handle(cmd.handle);
+  if (cmd.ok != 1)
+    return cmd.ok < 0 ? -ETIMEDOUT : -EIO;
+  if (result)
+    *result = cmd.value;
+  return 0;
+}
 
-  printk(KERN_INFO "%s: Setting AO mode 1...\n", __FUNCTION__);
-  if ((err = xbee_atmode_send_request(xbee, "AO 1")) != 0) {
-    printk(KERN_ALERT "%s: Unable to set API mode, error: %d\n", __FUNCTION__, err);
-    return err;
+// Asks for AP and AO in API frames. Returns 0 if the radio answered in
+// API mode 1, fixing AO on the way if needed, or <0 if AT mode is needed.
+static int n_xbee_probe_api(xbee_serial_bridge* bridge) {
+  xbee_dev_t* xbee = bridge->xbee_dev;
+  uint32_t ap, ao;
+
+  if (n_xbee_api_command(xbee, "AP", -1, &ap, N_XBEE_PROBE_TIMEOUT) != 0 || ap != 1)
+    return -ENODEV;
+  if (n_xbee_api_command(xbee, "AO", -1, &ao, N_XBEE_PROBE_TIMEOUT) != 0 || ao != 1) {
+    printk(KERN_INFO "%s: setting AO mode 1...\n", __FUNCTION__);
+    if (n_xbee_api_command(xbee, "AO", 1, NULL, N_XBEE_PROBE_TIMEOUT) != 0)
+      return -EIO;
+    xbee_cmd_simple(xbee, "WR", 0);
   }
+  return 0;
+}
 
-  bytesread = 0;
-  iterations = 0;
-  while (1) {
-    // N_XBEE_CHECK_ITERATIONS(iterations, 200);
-    mode = xbee_atmode_read_response(xbee, respbuf, CHECK_RESP_BUF_SIZE, &bytesread);
-    if (mode == -EAGAIN) {
-      // msleep(5);
-      iterations ++;
+/* == Baud rate == */
+// indexed by the radio's BD setting, the last few only on some radios
+static const uint32_t n_xbee_bauds[] = {
+  1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600
+};
+#define N_XBEE_NBAUDS (sizeof(n_xbee_bauds) / sizeof(n_xbee_bauds[0]))
+
+static void n_xbee_host_baud(xbee_dev_t* xbee, uint32_t baud) {
+  xbee_ser_baudrate(&xbee->serial, baud);
+  // anything half read was at the old rate
+  xbee_ser_rx_flush(&xbee->serial);
+}
+
+// Tries the API probe at every rate we know of, fastest first, and leaves
+// the port at the one the radio answered on.
+static int n_xbee_detect_baud(xbee_serial_bridge* bridge) {
+  int i;
+  xbee_dev_t* xbee = bridge->xbee_dev;
+  uint32_t configured = xbee->serial.baudrate;
+
+  for (i = N_XBEE_NBAUDS - 1; i >= 0; i--) {
+    if (n_xbee_bauds[i] == configured)
       continue;
+    n_xbee_host_baud(xbee, n_xbee_bauds[i]);
+    if (n_xbee_probe_api(bridge) == 0) {
+      printk(KERN_INFO "%s: %s answers at %u baud, not %u.\n", __FUNCTION__, bridge->tty_name, n_xbee_bauds[i], configured);
+      return 0;
     }
-    else if (mode == 0) {
-      printk(KERN_INFO "%s: Successfully set AO mode 1 from %c...\n", __FUNCTION__, respbuf[0]);
-      break;
-    }
-    CHECK_MISC_ATMODE_ERRS;
   }
+  n_xbee_host_baud(xbee, configured);
+  return -ENODEV;
+}
 
-  msleep(100);
-  // n_xbee_flush_buffer(bridge->tty);
+// Moves the radio and the port to n_xbee_bauds[idx] and checks the radio
+// still answers. If it doesn't, both go back to the old rate.
+static int n_xbee_set_baud(xbee_serial_bridge* bridge, int idx) {
+  int i, old_idx = -1;
+  xbee_dev_t* xbee = bridge->xbee_dev;
+  uint32_t old = xbee->serial.baudrate;
 
-  printk(KERN_INFO "%s: Verifying AO mode...\n", __FUNCTION__);
-  if ((err = xbee_atmode_send_request(xbee, "AO")) != 0) {
-    printk(KERN_ALERT "%s: Unable to request AO mode, error: %d\n", __FUNCTION__, err);
-    return err;
+  for (i = 0; i < N_XBEE_NBAUDS; i++) {
+    if (n_xbee_bauds[i] == old)
+      old_idx = i;
   }
+  // radios that can't do the rate say so
+  if (n_xbee_api_command(xbee, "BD", idx, NULL, N_XBEE_PROBE_TIMEOUT) != 0)
+    return -EINVAL;
+  n_xbee_host_baud(xbee, n_xbee_bauds[idx]);
+  if (n_xbee_probe_api(bridge) == 0)
+    return 0;
 
-  bytesread = 0;
-  iterations = 0;
-  while (1) {
-    N_XBEE_CHECK_ITERATIONS(iterations, 200);
-    mode = xbee_atmode_read_response(xbee, respbuf, CHECK_RESP_BUF_SIZE, &bytesread);
-    if (mode == -EAGAIN) {
-      msleep(5);
-      iterations ++;
+  printk(KERN_ALERT "%s: %s doesn't verify at %u baud, going back to %u.\n", __FUNCTION__, bridge->tty_name, n_xbee_bauds[idx], old);
+  if (old_idx >= 0)
+    n_xbee_api_command(xbee, "BD", old_idx, NULL, N_XBEE_PROBE_TIMEOUT);
+  n_xbee_host_baud(xbee, old);
+  if (n_xbee_probe_api(bridge) != 0)
+    n_xbee_detect_baud(bridge);
+  return -EIO;
+}
+
+// Raises the radio and the port to the fastest rate up to max that the
+// radio takes and that verifies. The radio's flash keeps the old rate,
+// so a reset radio is found again by n_xbee_detect_baud.
+static void n_xbee_raise_baud(xbee_serial_bridge* bridge, uint32_t max) {
+  int i;
+  uint32_t base = bridge->xbee_dev->serial.baudrate;
+
+  for (i = N_XBEE_NBAUDS - 1; i >= 0 && n_xbee_bauds[i] > base; i--) {
+    if (n_xbee_bauds[i] > max)
       continue;
+    if (n_xbee_set_baud(bridge, i) == 0) {
+      printk(KERN_INFO "%s: %s raised from %u to %u baud.\n", __FUNCTION__, bridge->tty_name, base, n_xbee_bauds[i]);
+      bridge->baud_base = base;
+      return;
     }
-    else if (mode == 0) {
-      if (respbuf[0] != '1' && respbuf[1] != '1' && respbuf[2] != '1') {
-        if (respbuf[0] > 0 && respbuf[0] < 200)
-          printk(KERN_ALERT "%s: Response from AT is %c, should be 1, failing.\n", __FUNCTION__, respbuf[0]);
-        else
-          printk(KERN_ALERT "%s: Response from AT is NOT ASCII - (%d), should be 1 (%d), failing.\n", __FUNCTION__, (int)respbuf[0], (int)'1');
-        return -EIO;
-      }
-      printk(KERN_INFO "%s: Successfully verified AO mode 1...\n", __FUNCTION__);
-      break;
-    }
-    CHECK_MISC_ATMODE_ERRS;
   }
+}
 
-  // exit AT mode
-  printk(KERN_INFO "%s: Exiting AT mode...\n", __FUNCTION__);
-  if ((err = xbee_atmode_exit(xbee)) != 0) {
-    printk(KERN_ALERT "%s: Unable to exit AT mode, error: %d\n", __FUNCTION__, err);
-    return err;
+// Goes back to the rate we started at when the radio stops answering
+// at the raised one. Caller holds n_xbee_lib_lock, so one attempt is a
+// handful of probes at most: the radio may have reset to the rate in its
+// flash, or still be at the raised rate with a garbled link, or somewhere
+// else entirely, of which one other rate is tried per attempt. If none
+// answers the port is left at the raised rate and housekeeping tries
+// again after N_XBEE_BAUD_RETRY.
+static void n_xbee_baud_fallback(xbee_serial_bridge* bridge) {
+  int i, base_idx = -1;
+  xbee_dev_t* xbee = bridge->xbee_dev;
+  uint32_t raised = xbee->serial.baudrate;
+  uint32_t other;
+
+  printk(KERN_ALERT "%s: %s lost %d transmit statuses in a row at %u baud, dropping back to %u.\n", __FUNCTION__,
+      bridge->tty_name, bridge->tx.lost_streak, raised, bridge->baud_base);
+  for (i = 0; i < N_XBEE_NBAUDS; i++) {
+    if (n_xbee_bauds[i] == bridge->baud_base)
+      base_idx = i;
   }
 
-  iterations = 0;
-  // we have to wait around 2 seconds here for the xbee driver to exit AT mode
-  while (1) {
-    N_XBEE_CHECK_ITERATIONS(iterations, 410);
-    mode = xbee_atmode_tick(xbee);
-    if (mode == XBEE_MODE_IDLE) {
-      printk(KERN_INFO "%s: Successfully exited AT mode.\n", __FUNCTION__);
-      break;
-    }
-    msleep(5);
-    iterations++;
+  // reset, it's back at the rate in its flash
+  n_xbee_host_baud(xbee, bridge->baud_base);
+  if (n_xbee_probe_api(bridge) == 0)
+    goto found;
+  // still at the raised rate, tell it to come down whether or not the
+  // answer makes it back
+  n_xbee_host_baud(xbee, raised);
+  if (base_idx >= 0) {
+    n_xbee_api_command(xbee, "BD", base_idx, NULL, N_XBEE_PROBE_TIMEOUT);
+    n_xbee_host_baud(xbee, bridge->baud_base);
+    if (n_xbee_probe_api(bridge) == 0)
+      goto found;
+  }
+  // anywhere else, a different rate each time round
+  other = n_xbee_bauds[bridge->baud_scan++ % N_XBEE_NBAUDS];
+  if (other != raised && other != bridge->baud_base) {
+    n_xbee_host_baud(xbee, other);
+    if (n_xbee_probe_api(bridge) == 0)
+      goto found;
   }
 
-  // TODO: might be decreasable
-  msleep(2000);
-  // n_xbee_flush_buffer(bridge->tty);
+  printk(KERN_ALERT "%s: %s isn't answering yet, trying again in %d ms.\n", __FUNCTION__, bridge->tty_name, N_XBEE_BAUD_RETRY);
+  n_xbee_host_baud(xbee, raised);
+  bridge->baud_retry = xbee_millisecond_timer() + N_XBEE_BAUD_RETRY;
+  return;
+
+found:
+  printk(KERN_INFO "%s: %s answers at %u baud.\n", __FUNCTION__, bridge->tty_name, xbee->serial.baudrate);
+  bridge->baud_base = 0;
+  bridge->tx.lost_streak = 0;
+}
+
+// Checks the tty to see if there is really an xbee on the other end, and
+// if so, that it's communicating right. Asks in API mode first, and only
+// goes through AT mode if the radio doesn't answer that way.
+// Also retreives some params about the remote dev.
+void n_xbee_node_discovered(xbee_dev_t* xbee, const xbee_node_id_t *rec);
+int n_xbee_check_tty(xbee_serial_bridge* bridge) {
+  int err;
+  uint32_t start;
+  xbee_dev_t* xbee = bridge->xbee_dev;
+
+  if (n_xbee_probe_api(bridge) == 0)
+    printk(KERN_INFO "%s: radio is already in API mode, skipping AT mode.\n", __FUNCTION__);
+  else if (n_xbee_detect_baud(bridge) != 0) {
+    printk(KERN_INFO "%s: no answer in API mode 1, falling back to AT mode.\n", __FUNCTION__);
+    if ((err = n_xbee_atmode_setup(bridge)) != 0)
+      return err;
+  }
+  if (n_xbee_opts.baud_max)
+    n_xbee_raise_baud(bridge, n_xbee_opts.baud_max);
 
   if ((err = xbee_cmd_init_device(xbee)) != 0) {
     printk(KERN_ALERT "%s: Error initing device: %d\n", __FUNCTION__, err);
     return err;
   }
 
-  // Wait for the cmd_query_device to finish.
-  iterations = 0;
+  // Wait for the cmd_query_device to finish, the library times it out.
+  start = xbee_millisecond_timer();
   do {
-    // N_XBEE_CHECK_ITERATIONS(iterations, 4000);
-    // msleep(1);
-    iterations++;
+    n_xbee_serial_wait(xbee, 10);
     xbee_dev_tick(xbee);
-    pthread_yield();
   } while ((err = xbee_cmd_query_status(xbee)) == -EBUSY);
   if (err != 0) {
     printk(KERN_ALERT "%s: Error waiting for device query: %d\n", __FUNCTION__, err);
     return err;
   }
+  printk(KERN_INFO "%s: device queried in %u ms.\n", __FUNCTION__, xbee_millisecond_timer() - start);
 
   // init the wpan layer
   xbee_wpan_init(xbee, xbee_endpoints);
@@ -396,10 +555,37 @@ int n_xbee_check_tty(xbee_serial_bridge* bridge) {
   return 0;
 }
 
+// Opens a queue of the tap called name, creating the tap if it isn't
+// there yet. Returns the fd or <0.
+static int n_xbee_tap_open(const char* name, int flags, struct ifreq* ifr) {
+  int fd;
+
+  if ((fd = open(TUN_PATH, O_RDWR)) < 0) {
+    printk(KERN_ALERT "%s: Unable to open %s, error %d (%s)...\n", __FUNCTION__, TUN_PATH, errno, strerror(errno));
+    return -errno;
+  }
+
+  memset(ifr, 0, sizeof(*ifr));
+  ifr->ifr_flags = flags;
+  // doesn't work - maybe set later
+  // ifr->ifr_mtu = N_XBEE_DATA_MTU;
+
+  if (name)
+    strncpy(ifr->ifr_name, name, IFNAMSIZ);
+
+  if (ioctl(fd, TUNSETIFF, (void *)ifr) < 0) {
+    close(fd);
+    return -errno;
+  }
+  // read by the event loop until EAGAIN
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
 int n_xbee_init_netdev(xbee_serial_bridge* bridge) {
   struct xbee_netdev_priv* priv;
   int err, fd, sock_fd;
-  int flags = IFF_TAP | IFF_NO_PI;
+  int flags = (n_xbee_opts.tun ? IFF_TUN : IFF_TAP) | IFF_NO_PI;
   struct sockaddr_ll sall;
   struct ifreq ifr;
 
@@ -410,22 +596,8 @@ int n_xbee_init_netdev(xbee_serial_bridge* bridge) {
   }
 
   printk(KERN_INFO "%s: Initializing net bridge %s as %s...\n", __FUNCTION__, bridge->name, bridge->netdevName);
-  if ((fd = open(TUN_PATH, O_RDWR)) < 0) {
-    printk(KERN_ALERT "%s: Unable to open %s, error %d (%s)...\n", __FUNCTION__, TUN_PATH, fd, strerror(fd));
-    return fd;
-  }
-
-  memset(&ifr, 0, sizeof(ifr));
-  ifr.ifr_flags = flags;
-  // doesn't work - maybe set later
-  // ifr.ifr_mtu = N_XBEE_DATA_MTU;
-
-  if (bridge->netdevName)
-    strncpy(ifr.ifr_name, bridge->netdevName, IFNAMSIZ);
-
-  if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
-    printk(KERN_ALERT "%s: Failed to alloc tap, %d (%s)...\n", __FUNCTION__, errno, strerror(errno));
-    close(fd);
+  if ((err = fd = n_xbee_tap_open(bridge->netdevName, flags, &ifr)) < 0) {
+    printk(KERN_ALERT "%s: Failed to alloc tap, %d (%s)...\n", __FUNCTION__, -err, strerror(-err));
     return err;
   }
 
@@ -439,13 +611,26 @@ int n_xbee_init_netdev(xbee_serial_bridge* bridge) {
   }
 
   strcpy(bridge->netdevName, ifr.ifr_name);
+  if ((err = n_xbee_pool_init(&bridge->pool, N_XBEE_POOL_SIZE)) != 0) {
+    close(fd);
+    return err;
+  }
   bridge->netdev = fd;
   bridge->netdev_idx = ifr.ifr_ifindex;
   bridge->netdev_sock = socket(AF_INET, SOCK_DGRAM, 0);
   bridge->netdevInitialized = 1;
-
-  // set hwaddr
-  memcpy(ifr.ifr_hwaddr.sa_data, bridge->xbee_dev->wpan_dev.address.ieee.b + 2, ETH_ALEN);
+  // TCP sizes its segments from this
+  ifr.ifr_mtu = n_xbee_opts.mtu;
+  if (ioctl(bridge->netdev_sock, SIOCSIFMTU, (void *)&ifr) < 0)
+    printk(KERN_ALERT "%s: unable to set MTU to %d, %d (%s)...\n", __FUNCTION__, n_xbee_opts.mtu, errno, strerror(errno));
+  // the responders work without it, they just never answer
+  n_xbee_addr_open(&bridge->addrs, bridge->netdev_idx);
+  n_xbee_nd_setup(bridge);
+
+  // set hwaddr, a tun has none
+  if (n_xbee_opts.tun)
+    return 0;
+  memcpy(ifr.ifr_hwaddr.sa_data, bridge->mac, ETH_ALEN);
   ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
   if (ioctl(fd, SIOCSIFHWADDR, (void *)&ifr) < 0) {
     printk(KERN_ALERT "%s: unable to set MAC addr, %d (%s)...\n", __FUNCTION__, errno, strerror(errno));
@@ -454,23 +639,53 @@ int n_xbee_init_netdev(xbee_serial_bridge* bridge) {
   return 0;
 }
 
+// Attaches another bond member to the tap of owner, which reads it for
+// the whole bond.
+int n_xbee_init_netdev_queue(xbee_serial_bridge* bridge, xbee_serial_bridge* owner) {
+  bridge->netdev = owner->netdev;
+  bridge->netdev_sock = owner->netdev_sock;
+  bridge->netdev_idx = owner->netdev_idx;
+  strcpy(bridge->netdevName, owner->netdevName);
+  bridge->netdevInitialized = 1;
+  return 0;
+}
+
 void n_xbee_free_netdev(xbee_serial_bridge* n) {
   if (!n) return;
   n->netdevInitialized = 0;
   if (!n->netdev) return;
+  // the tap belongs to the first member of the bond
+  if (n->bond && n != n->bond->members[0]) {
+    n->netdev = n->netdev_sock = 0;
+    n->addrs.fd = -1;
+    return;
+  }
   if (n->netdevName)
     printk(KERN_INFO "%s: Shutting down net bridge %s...\n", __FUNCTION__, n->netdevName);
   if (n->netdev_sock)
     close(n->netdev_sock);
   close(n->netdev);
   n->netdev = n->netdev_sock = 0;
+  n_xbee_addr_close(&n->addrs);
+  n_xbee_pool_destroy(&n->pool);
+  if (n->tick_fd > 0)
+    close(n->tick_fd);
+  if (n->discover_fd > 0)
+    close(n->discover_fd);
+  if (n->pace_fd > 0)
+    close(n->pace_fd);
+  n->tick_fd = n->discover_fd = n->pace_fd = 0;
 }
 
 // ticks the xbee
 // since we register all the callbacks in the xbee code
 // we can just call tick.
 inline int n_xbee_handle_runtime_frames(xbee_serial_bridge* bridge) {
-  return xbee_dev_tick(bridge->xbee_dev);
+  int ret;
+  pthread_mutex_lock(&n_xbee_lib_lock);
+  ret = xbee_dev_tick(bridge->xbee_dev);
+  pthread_mutex_unlock(&n_xbee_lib_lock);
+  return ret;
 }
 
 /* = XBEE Detection and Setup  =
@@ -485,25 +700,69 @@ int n_xbee_resolve_pending_dev(xbee_serial_bridge* bridge) {
   return 0;
 }
 
+// Fills in the parts of the envelope that are the same for every frame.
+void n_xbee_init_envelope(struct xbee_serial_bridge* bridge, wpan_envelope_t* envelope) {
+  memset(envelope, 0, sizeof(wpan_envelope_t));
+  envelope->dev = &bridge->xbee_dev->wpan_dev;
+  envelope->profile_id = WPAN_PROFILE_DIGI;
+  envelope->cluster_id = N_XBEE_CLUSTER_ID;
+  envelope->dest_endpoint = envelope->source_endpoint = N_XBEE_ENDPOINT;
+  envelope->network_address = WPAN_NET_ADDR_UNDEFINED;
+}
+
+// Tells a node which encapsulations we understand.
+int n_xbee_send_caps(struct xbee_serial_bridge* bridge, const unsigned char* addr, unsigned char flags) {
+  int err;
+  wpan_envelope_t envelope;
+  unsigned char msg[N_XBEE_CTRL_CAPS_LZ_LEN];
+
+  if (!n_xbee_tx_ctrl_ready(&bridge->tx))
+    return -EBUSY;
+  msg[0] = N_XBEE_DISPATCH_CTRL;
+  msg[1] = N_XBEE_CTRL_CAPS;
+  msg[2] = N_XBEE_LOCAL_CAPS >> 8;
+  msg[3] = N_XBEE_LOCAL_CAPS & 0xFF;
+  msg[4] = flags;
+  memcpy(msg + N_XBEE_CTRL_CAPS_LEN, bridge->mac, ETH_ALEN);
+  msg[N_XBEE_CTRL_CAPS_BOND_LEN] = n_xbee_lz_local_dict.id >> 8;
+  msg[N_XBEE_CTRL_CAPS_BOND_LEN + 1] = n_xbee_lz_local_dict.id & 0xFF;
+
+  pthread_mutex_lock(&bridge->write_lock);
+  n_xbee_init_envelope(bridge, &envelope);
+  envelope.cluster_id = N_XBEE_CLUSTER_ID_ENCAP;
+  memcpy(&envelope.ieee_address, addr, 8);
+  envelope.payload = msg;
+  envelope.length = sizeof(msg);
+  err = n_xbee_envelope_send(&envelope);
+  pthread_mutex_unlock(&bridge->write_lock);
+  return err;
+}
+
+// Asks a node for its caps the first time we see it, or the next time
+// if there was no room to ask.
+void n_xbee_node_check_caps(struct xbee_serial_bridge* bridge, struct xbee_remote_node* node) {
+  if (!node || node->caps_requested)
+    return;
+  if (n_xbee_send_caps(bridge, node->node_addr, N_XBEE_CTRL_FLAG_REPLY) == 0)
+    node->caps_requested = 1;
+}
+
 void n_xbee_node_discovered(xbee_dev_t* xbee, const xbee_node_id_t *rec) {
   xbee_serial_bridge* bridge;
   char addr64_buf[ADDR64_STRING_LENGTH];
-  // bridge = n_xbee_find_bridge_byxbee(xbee);
-  bridge = n_xbee_serial_bridge;
+  bridge = n_xbee_find_bridge_byxbee(xbee);
   if (!bridge)
     return;
   printk(KERN_INFO "%s: %s discovered remote node %s.\n", __FUNCTION__, bridge->name, addr64_format(addr64_buf, &rec->ieee_addr_be));
-  n_xbee_node_find_or_insert(&rec->ieee_addr_be);
+  n_xbee_node_check_caps(bridge, n_xbee_node_find_or_insert(&bridge->nodes, &rec->ieee_addr_be));
+  n_xbee_route_discovered(bridge, rec->node_info, rec->ieee_addr_be.b, xbee_millisecond_timer());
 }
 
-
-/*
- * We actually need to check if there is a valid xbee on the
- * other end, and if not, bail out with an error.
- */
-static int n_xbee_serial_open(xbee_serial_t* serial) {
+// Allocates a bridge for serial and opens the port, without talking to
+// the radio yet.
+int n_xbee_bridge_new(xbee_serial_t* serial, xbee_serial_bridge** out) {
   xbee_serial_bridge* bridge;
-  int i, nlen, ndevnlen, err, resolvatt;
+  int nlen, ndevnlen, err;
   const char* rttyname;
   const char* tty_name = basename(serial->device);
 
@@ -515,7 +774,7 @@ static int n_xbee_serial_open(xbee_serial_t* serial) {
   rttyname = strncmp("tty", tty_name, 3) == 0 ? (tty_name + 3) : tty_name;
   nlen = strlen(rttyname);
 
-  bridge = (xbee_serial_bridge*)malloc(sizeof(xbee_serial_bridge));
+  bridge = (xbee_serial_bridge*)calloc(1, sizeof(xbee_serial_bridge));
   pthread_mutex_init(&bridge->write_lock, NULL);
   bridge->tty_name = tty_name;
   bridge->name = (char*)malloc(sizeof(char) * (nlen + 1));
@@ -524,6 +783,16 @@ static int n_xbee_serial_open(xbee_serial_t* serial) {
 
   bridge->netdevInitialized = 0;
   bridge->netdev = 0;
+  bridge->tick_fd = bridge->discover_fd = bridge->pace_fd = 0;
+  bridge->addrs.fd = -1;
+  bridge->link_up = 1;
+  n_xbee_frag_init(&bridge->frag);
+  n_xbee_sched_init(&bridge->sched, &bridge->pool);
+  n_xbee_tx_init(&bridge->tx, n_xbee_opts.tx_window);
+  n_xbee_node_table_init(&bridge->nodes);
+  n_xbee_disc_init(&bridge->disc);
+  n_xbee_arp_init(&bridge->arp);
+  n_xbee_route_init(&bridge->routes);
 
   bridge->xbee_dev = (xbee_dev_t*) malloc(sizeof(xbee_dev_t));
   memset(bridge->xbee_dev, 0, sizeof(xbee_dev_t));
@@ -545,7 +814,26 @@ static int n_xbee_serial_open(xbee_serial_t* serial) {
   bridge->netdevName[ndevnlen] = '\0';
   strncpy(bridge->netdevName, XBEE_NETDEV_PREFIX, strlen(XBEE_NETDEV_PREFIX));
   strncpy(bridge->netdevName + strlen(XBEE_NETDEV_PREFIX), rttyname, nlen);
-  n_xbee_serial_bridge = bridge;
+  *out = bridge;
+  return 0;
+}
+
+/*
+ * We actually need to check if there is a valid xbee on the
+ * other end, and if not, bail out with an error.
+ */
+static int n_xbee_serial_open(xbee_serial_t* serial) {
+  xbee_serial_bridge* bridge;
+  int err, resolvatt;
+
+  if (n_xbee_bridge_count >= N_XBEE_MAX_BRIDGES) {
+    printk(KERN_ALERT "%s: too many bridges, max is %d.\n", __FUNCTION__, N_XBEE_MAX_BRIDGES);
+    return -ENOSPC;
+  }
+  if ((err = n_xbee_bridge_new(serial, &bridge)) != 0)
+    return err;
+  // visible to the xbee callbacks from here on
+  n_xbee_bridges[n_xbee_bridge_count++] = bridge;
 
 #define MAX_RESOLVE_ATTEMPTS 4
   resolvatt = 0;
@@ -553,20 +841,20 @@ static int n_xbee_serial_open(xbee_serial_t* serial) {
     resolvatt++;
     if (resolvatt > 4) {
       printk(KERN_INFO "%s: Too many attempts, failing.\n", __FUNCTION__);
+      n_xbee_bridges[--n_xbee_bridge_count] = NULL;
       n_xbee_free_bridge(bridge);
       return -1;
     } else if (resolvatt > 1) {
+      // 250 ms, 500 ms, 1 s, and whatever was half sent is stale by then
       printk(KERN_INFO "%s: init failed, will try again...\n", __FUNCTION__);
-      msleep(5000);
+      msleep(N_XBEE_RETRY_DELAY << (resolvatt - 2));
+      xbee_ser_rx_flush(&bridge->xbee_dev->serial);
     }
     printk(KERN_INFO "%s: Attempting to init xbee, attempt %d/%d...\n", __FUNCTION__, resolvatt, MAX_RESOLVE_ATTEMPTS);
   } while (n_xbee_resolve_pending_dev(bridge) != 0);
 
-  if (n_xbee_init_netdev(bridge) != 0) {
-    printk(KERN_ALERT "%s: %s n_xbee_init_netdev indicated failure, aborting.\n", __FUNCTION__, bridge->tty_name);
-    return -ENODEV;
-  }
-
+  // known now that the device has been queried
+  memcpy(bridge->mac, bridge->xbee_dev->wpan_dev.address.ieee.b + 2, ETH_ALEN);
   return 0;
 }
 
@@ -577,7 +865,7 @@ inline int n_xbee_netdev_handle_icmp(xbee_serial_bridge* bridge, const wpan_enve
   struct ether_header* eh;
 
   eh = (struct ether_header*)envelope->payload;
-  if (memcmp(bridge->xbee_dev->wpan_dev.address.ieee.b + 2, eh->ether_dhost, ETH_ALEN) != 0) {
+  if (memcmp(bridge->mac, eh->ether_dhost, ETH_ALEN) != 0) {
 #ifdef N_XBEE_VERBOSE
     printk(KERN_INFO "%s: ignoring icmp to someone else.\n", __FUNCTION__);
 #endif
@@ -603,15 +891,16 @@ inline int n_xbee_netdev_handle_icmp(xbee_serial_bridge* bridge, const wpan_enve
 #endif
 
 #ifdef N_XBEE_ARP_RESPONDER
-inline int n_xbee_netdev_handle_arp(xbee_serial_bridge* bridge, const wpan_envelope_t* envelope) {
+static inline int n_xbee_netdev_handle_arp(xbee_serial_bridge* bridge, const wpan_envelope_t* envelope) {
   struct arphdr* arph;
   struct ether_arp* arpeh;
   struct ether_arp* txarpeh;
   struct ether_header* eh;
   struct ether_header* txeh;
-  struct ifreq ifr;
-  unsigned char* txbuf;
-  const int txlen = sizeof(struct ether_header) + sizeof(struct ether_arp);
+  // the tap owner keeps the addresses, same worker as us
+  struct xbee_serial_bridge* owner = bridge->bond ? bridge->bond->members[0] : bridge;
+  unsigned char* txbuf = bridge->arp_reply;
+  const int txlen = sizeof(bridge->arp_reply);
 
   eh = (struct ether_header*)envelope->payload;
   arph = (struct arphdr*)(envelope->payload + N_XBEE_ETHHDR_LEN);
@@ -642,61 +931,96 @@ inline int n_xbee_netdev_handle_arp(xbee_serial_bridge* bridge, const wpan_envel
     return 4;
   }
 
+  if (envelope->length < txlen)
+    return 5;
+
   arpeh = (struct ether_arp*)arph;
-  // compare target ip to our ip
-  memset(&ifr, 0, sizeof(struct ifreq));
-  ifr.ifr_addr.sa_family = AF_INET;
-  ifr.ifr_ifindex = bridge->netdev_idx;
-  strncpy(ifr.ifr_name, bridge->netdevName, IFNAMSIZ-1);
-  if (ioctl(bridge->netdev_sock, SIOCGIFADDR, &ifr) < 0) {
-    printk(KERN_ALERT "%s: unable to check IP of netdev, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
-    return 6;
-  }
-
-  // compare
-  if (memcmp(&((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr, &arpeh->arp_tpa, sizeof(arpeh->arp_tpa)) != 0) {
+  // compare target ip to our ips
+  if (!n_xbee_addr_has4(&owner->addrs, arpeh->arp_tpa))
     return 7;
-  }
 
-  printk(KERN_ALERT "%s: sending arp response.", __FUNCTION__);
+#ifdef N_XBEE_VERBOSE
+  printk(KERN_INFO "%s: sending arp response.\n", __FUNCTION__);
+#endif
   // build arp packet
-  // do we need the 4 byte header here?
-  txbuf = malloc(txlen);
   txeh = (struct ether_header*)(txbuf + N_XBEE_PREAMBLE_LEN);
   txeh->ether_type = htons(ETHERTYPE_ARP);
   memcpy(txeh->ether_dhost, eh->ether_shost, 6);
-  memcpy(txeh->ether_shost, (bridge->xbee_dev->wpan_dev.address.ieee.b) + 2, 6);
+  memcpy(txeh->ether_shost, bridge->mac, 6);
 
   txarpeh = (struct ether_arp*)(txbuf + N_XBEE_PREAMBLE_LEN + sizeof(struct ether_header));
   memcpy(txarpeh, arpeh, sizeof(struct arphdr));
   txarpeh->ea_hdr.ar_op = htons(ARPOP_REPLY);
-  memcpy(txarpeh->arp_sha, (bridge->xbee_dev->wpan_dev.address.ieee.b) + 2, 6);
+  memcpy(txarpeh->arp_sha, bridge->mac, 6);
   memcpy(txarpeh->arp_spa, arpeh->arp_tpa, 4);
   memcpy(txarpeh->arp_tha, arpeh->arp_sha, 6);
   memcpy(txarpeh->arp_tpa, arpeh->arp_spa, 4);
   n_xbee_xmit_ether_packet(bridge, txbuf, txlen);
-  free(txbuf);
   return 0;
 }
 #endif
 
-int n_xbee_netdev_rx(const wpan_envelope_t* envelope, void* context) {
+// Handles a full ethernet frame, envelope->payload points at the frame.
+// Lowers the MSS of a TCP SYN from the air to fit our MTU, in
+// bridge->rx_frame since the frame might be the library's. Returns the
+// envelope to carry on with.
+static const wpan_envelope_t* n_xbee_netdev_rx_clamp(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope, wpan_envelope_t* clamped) {
+  if (!n_xbee_mtu_clamp_needed(envelope->payload, envelope->length) || envelope->length > sizeof(bridge->rx_frame))
+    return envelope;
+  *clamped = *envelope;
+  if (envelope->payload != bridge->rx_frame)
+    memcpy(bridge->rx_frame, envelope->payload, envelope->length);
+  clamped->payload = bridge->rx_frame;
+  bridge->mss_clamped += n_xbee_mtu_clamp(bridge->rx_frame, envelope->length);
+  return clamped;
+}
+
+// Writes a frame that came in over the air to the device.
+static void n_xbee_netdev_write(struct xbee_serial_bridge* bridge, const void* buf, int len) {
+  n_xbee_cap(&bridge->cap, N_XBEE_CAP_TAP, 0, buf, len);
+  if (write(bridge->netdev, buf, len) < 0) {
+    bridge->stats.drops[N_XBEE_DROP_TAP_WRITE]++;
+    return;
+  }
+  bridge->stats.tap_tx_frames++;
+  bridge->stats.tap_tx_bytes += len;
+  // held back for reordering, this counts from the serial event that
+  // released it
+  n_xbee_hist_add(&bridge->stats.serial_to_tap, n_xbee_stats_us() - bridge->stats.rx_start);
+}
+
+// Passes the IP packet in a frame that came in over the air on to the
+// tun, and learns the route back to its sender.
+static int n_xbee_netdev_rx_tun(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope) {
+  const struct ether_header* mh = (const struct ether_header*)envelope->payload;
+  uint16_t ether_type = ntohs(mh->ether_type);
+  wpan_envelope_t clamped;
+
+  // ARP from tap peers and anything else that isn't IP has nowhere to go
+  if (ether_type != ETHERTYPE_IP && ether_type != ETHERTYPE_IPV6)
+    return 0;
+  envelope = n_xbee_netdev_rx_clamp(bridge, envelope, &clamped);
+  n_xbee_route_learn(bridge, envelope->payload, envelope->length, envelope->ieee_address.b, xbee_millisecond_timer());
+  n_xbee_netdev_write(bridge, (const unsigned char*)envelope->payload + N_XBEE_ETHHDR_LEN, envelope->length - N_XBEE_ETHHDR_LEN);
+#ifdef N_XBEE_VERBOSE
+  printk(KERN_INFO "%s: wrote packet of type %u len %d to tun.\n", __FUNCTION__, ether_type, (int)(envelope->length - N_XBEE_ETHHDR_LEN));
+#endif
+  return 0;
+}
+
+int n_xbee_netdev_rx_ether(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope) {
 #ifdef N_XBEE_ARP_RESPONDER
   int res;
 #endif
-  struct xbee_remote_node* remnode;
   struct ether_header* mh;
   unsigned char proto;
-  struct xbee_serial_bridge* bridge = n_xbee_serial_bridge;
-  if (!bridge)
-    return 0;
-#ifdef N_XBEE_VERBOSE
-  printk(KERN_INFO "%s: handling xbee packet of len %d\n", __FUNCTION__, envelope->length);
-  hexdump((void*)envelope->payload, envelope->length);
-#endif
-  remnode = n_xbee_node_find_or_insert(&envelope->ieee_address);
-  if (!bridge->netdevInitialized)
+  wpan_envelope_t clamped;
+
+  if (envelope->length < N_XBEE_ETHHDR_LEN)
     return 0;
+  if (n_xbee_opts.tun)
+    return n_xbee_netdev_rx_tun(bridge, envelope);
+  envelope = n_xbee_netdev_rx_clamp(bridge, envelope, &clamped);
 
   // skip preamble
   mh = (struct ether_header*) (envelope->payload);
@@ -705,6 +1029,7 @@ int n_xbee_netdev_rx(const wpan_envelope_t* envelope, void* context) {
 #endif
 
   uint16_t ether_type = ntohs(mh->ether_type);
+  n_xbee_arp_learn(bridge, envelope->payload, envelope->length, xbee_millisecond_timer());
 #ifdef N_XBEE_ARP_RESPONDER
   if (ether_type == ETHERTYPE_ARP) {
     res = n_xbee_netdev_handle_arp(bridge, envelope);
@@ -729,21 +1054,278 @@ int n_xbee_netdev_rx(const wpan_envelope_t* envelope, void* context) {
 #endif
 #endif
 
-  write(bridge->netdev, (void*)envelope->payload, envelope->length);
+  n_xbee_netdev_write(bridge, envelope->payload, envelope->length);
 #ifdef N_XBEE_VERBOSE
   printk(KERN_INFO "%s: wrote packet of type %u len %d to tap.\n", __FUNCTION__, ether_type, envelope->length);
 #endif
   return 0;
 }
 
-void n_xbee_xmit_ether_packet(struct xbee_serial_bridge* bridge, const void* buffer, int len) {
-  struct ether_header* mh;
-  int i, err, nbcast = 0;
-  wpan_envelope_t envelope;
-  struct xbee_remote_node* rnod;
+int n_xbee_netdev_rx_ctrl(struct xbee_serial_bridge* bridge, struct xbee_remote_node* remnode, const unsigned char* buf, int len) {
+  char addr64_buf[ADDR64_STRING_LENGTH];
 
-#ifdef N_XBEE_VERBOSE
-  if (len < 28) {
+  if (len < 2 || !remnode)
+    return 0;
+  switch (buf[1]) {
+    case N_XBEE_CTRL_CAPS:
+      if (len < N_XBEE_CTRL_CAPS_LEN)
+        return 0;
+      if (remnode->caps != ((buf[2] << 8) | buf[3]))
+        printk(KERN_INFO "%s: node %s has caps 0x%04x.\n", __FUNCTION__, addr64_format(addr64_buf, (const addr64*)remnode->node_addr), (buf[2] << 8) | buf[3]);
+      remnode->caps = (buf[2] << 8) | buf[3];
+      // bonded nodes send every frame from the same MAC
+      if ((remnode->caps & N_XBEE_CAP_BOND) && len >= N_XBEE_CTRL_CAPS_BOND_LEN)
+        n_xbee_node_set_eth(&bridge->nodes, remnode, buf + N_XBEE_CTRL_CAPS_LEN);
+      if ((remnode->caps & N_XBEE_CAP_LZ) && len >= N_XBEE_CTRL_CAPS_LZ_LEN)
+        remnode->lz_dict = (buf[N_XBEE_CTRL_CAPS_BOND_LEN] << 8) | buf[N_XBEE_CTRL_CAPS_BOND_LEN + 1];
+      if (buf[4] & N_XBEE_CTRL_FLAG_REPLY)
+        n_xbee_send_caps(bridge, remnode->node_addr, 0);
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+// Unpacks an aggregate, every datagram in it is handled on its own.
+static void n_xbee_netdev_rx_agg(struct xbee_serial_bridge* bridge, struct xbee_remote_node* remnode, const wpan_envelope_t* envelope, const unsigned char* buf, int len, int layers) {
+  int pos = 1, sublen;
+  while (pos < len) {
+    sublen = buf[pos++];
+    if (sublen == 0 || pos + sublen > len)
+      return;
+    // aggregates never nest
+    if (buf[pos] != N_XBEE_DISPATCH_AGG)
+      n_xbee_netdev_rx_encap(bridge, remnode, envelope, buf + pos, sublen, layers | N_XBEE_RX_FRAG);
+    pos += sublen;
+  }
+}
+
+// Expands a compressed datagram and handles what was inside.
+static int n_xbee_netdev_rx_lz(struct xbee_serial_bridge* bridge, struct xbee_remote_node* remnode, const wpan_envelope_t* envelope, const unsigned char* buf, int len, int layers) {
+  const n_xbee_lz_dict* dict = NULL;
+  int dlen;
+
+  if (len < N_XBEE_LZ_HDR_LEN)
+    return 0;
+  // a sender compresses once, and buf may already be rx_lz
+  if (layers & N_XBEE_RX_LZ) {
+    bridge->stats.drops[N_XBEE_DROP_DECODE]++;
+    return 0;
+  }
+  // the sender only uses it if our IDs matched
+  if (buf[1] & N_XBEE_LZ_FLAG_DICT) {
+    if (!n_xbee_lz_local_dict.id)
+      return 0;
+    dict = &n_xbee_lz_local_dict;
+  }
+  dlen = (buf[2] << 8) | buf[3];
+  if (n_xbee_lz_decompress(dict, buf + N_XBEE_LZ_HDR_LEN, len - N_XBEE_LZ_HDR_LEN, bridge->rx_lz, dlen) != dlen) {
+#ifdef N_XBEE_VERBOSE
+    printk(KERN_INFO "%s: unable to decompress, dropping.\n", __FUNCTION__);
+#endif
+    return 0;
+  }
+  return n_xbee_netdev_rx_encap(bridge, remnode, envelope, bridge->rx_lz, dlen, layers | N_XBEE_RX_FRAG | N_XBEE_RX_LZ);
+}
+
+// Handles a datagram from N_XBEE_CLUSTER_ID_ENCAP, by its dispatch byte.
+int n_xbee_netdev_rx_encap(struct xbee_serial_bridge* bridge, struct xbee_remote_node* remnode, const wpan_envelope_t* envelope, const unsigned char* buf, int len, int layers) {
+  const unsigned char* dgram;
+  int dlen;
+  wpan_envelope_t inner;
+
+  if (len < 1)
+    return 0;
+
+  inner = *envelope;
+  if ((buf[0] & N_XBEE_DISPATCH_FRAG_MASK) == N_XBEE_DISPATCH_FRAG1 ||
+      (buf[0] & N_XBEE_DISPATCH_FRAG_MASK) == N_XBEE_DISPATCH_FRAGN) {
+    // fragments never nest
+    if (layers & N_XBEE_RX_FRAG)
+      return 0;
+    if (n_xbee_frag_rx(bridge, envelope, &dgram, &dlen) != 1)
+      return 0;
+    return n_xbee_netdev_rx_encap(bridge, remnode, envelope, dgram, dlen, N_XBEE_RX_FRAG);
+  }
+
+  if ((buf[0] & N_XBEE_DISPATCH_HC_MASK) == N_XBEE_DISPATCH_HC) {
+    dlen = n_xbee_hc_decompress(remnode ? remnode->eth : envelope->ieee_address.b + 2, bridge->mac, buf, len, bridge->rx_frame, sizeof(bridge->rx_frame));
+    if (dlen < 0) {
+      bridge->stats.drops[N_XBEE_DROP_DECODE]++;
+#ifdef N_XBEE_VERBOSE
+      printk(KERN_INFO "%s: unable to decompress, error %d.\n", __FUNCTION__, dlen);
+#endif
+      return 0;
+    }
+    inner.payload = bridge->rx_frame;
+    inner.length = dlen;
+    return n_xbee_netdev_rx_ether(bridge, &inner);
+  }
+
+  switch (buf[0]) {
+    case N_XBEE_DISPATCH_CTRL:
+      return n_xbee_netdev_rx_ctrl(bridge, remnode, buf, len);
+    case N_XBEE_DISPATCH_LZ:
+      return n_xbee_netdev_rx_lz(bridge, remnode, envelope, buf, len, layers);
+    case N_XBEE_DISPATCH_AGG:
+      n_xbee_netdev_rx_agg(bridge, remnode, envelope, buf, len, layers);
+      return 0;
+    case N_XBEE_DISPATCH_BOND:
+      if (len < N_XBEE_BOND_HDR_LEN || !remnode)
+        return 0;
+      // a sender only ever puts one on, a second would have n_xbee_bond_rx
+      // run again for the same peer while it is still delivering
+      if (layers & N_XBEE_RX_BOND) {
+        bridge->stats.drops[N_XBEE_DROP_DECODE]++;
+        return 0;
+      }
+      layers |= N_XBEE_RX_FRAG | N_XBEE_RX_BOND;
+      // not bonded ourselves, order doesn't matter over a single radio
+      if (!bridge->bond)
+        return n_xbee_netdev_rx_encap(bridge, remnode, envelope, buf + N_XBEE_BOND_HDR_LEN, len - N_XBEE_BOND_HDR_LEN, layers);
+      return n_xbee_bond_rx(bridge->bond, bridge, remnode->eth, envelope, (buf[1] << 8) | buf[2], buf + N_XBEE_BOND_HDR_LEN, len - N_XBEE_BOND_HDR_LEN, layers);
+    case N_XBEE_DISPATCH_ETH:
+      inner.payload = buf + 1;
+      inner.length = len - 1;
+      return n_xbee_netdev_rx_ether(bridge, &inner);
+    default:
+      bridge->stats.drops[N_XBEE_DROP_DECODE]++;
+#ifdef N_XBEE_VERBOSE
+      printk(KERN_INFO "%s: unknown dispatch 0x%02x, dropping.\n", __FUNCTION__, buf[0]);
+#endif
+      return 0;
+  }
+}
+
+int n_xbee_netdev_rx(const wpan_envelope_t* envelope, void* context) {
+  struct xbee_remote_node* remnode;
+  struct xbee_serial_bridge* bridge = n_xbee_find_bridge_bywpan(envelope->dev);
+  if (!bridge)
+    return 0;
+#ifdef N_XBEE_VERBOSE
+  printk(KERN_INFO "%s: handling xbee packet of len %d\n", __FUNCTION__, envelope->length);
+#endif
+  bridge->stats.air_rx_frames++;
+  bridge->stats.air_rx_bytes += envelope->length;
+  if (n_xbee_cap_on)
+    n_xbee_cap_envelope(bridge, envelope, NULL, 0, 1);
+  remnode = n_xbee_node_find_or_insert(&bridge->nodes, &envelope->ieee_address);
+  if (remnode) {
+    remnode->rx_frames++;
+    remnode->rx_bytes += envelope->length;
+  }
+  n_xbee_node_check_caps(bridge, remnode);
+  if (!bridge->netdevInitialized)
+    return 0;
+
+  if (envelope->cluster_id == N_XBEE_CLUSTER_ID_ENCAP)
+    return n_xbee_netdev_rx_encap(bridge, remnode, envelope, envelope->payload, envelope->length, 0);
+  return n_xbee_netdev_rx_ether(bridge, envelope);
+}
+
+// Sends hdr followed by buf on the encap cluster, compressed if node
+// takes it and it helps, fragmented if it doesn't fit. Caller holds
+// write_lock.
+static int n_xbee_xmit_encap(struct xbee_serial_bridge* bridge, wpan_envelope_t* envelope, struct xbee_remote_node* node, const unsigned char* hdr, int hlen, const unsigned char* buf, int len) {
+#ifndef N_XBEE_NO_PAYLOAD_COMPRESSION
+  unsigned char plain[N_XBEE_LZ_MAX_INPUT];
+  unsigned char lz[N_XBEE_LZ_HDR_LEN + N_XBEE_LZ_MAX_INPUT];
+  const n_xbee_lz_dict* dict;
+  int clen;
+
+  if (node && (node->caps & N_XBEE_CAP_LZ) && hlen + len >= N_XBEE_LZ_MIN_INPUT && hlen + len <= N_XBEE_LZ_MAX_INPUT) {
+    memcpy(plain, hdr, hlen);
+    memcpy(plain + hlen, buf, len);
+    dict = n_xbee_lz_local_dict.id && node->lz_dict == n_xbee_lz_local_dict.id ? &n_xbee_lz_local_dict : NULL;
+    node->tx_lz_in += hlen + len;
+    // anything already compressed comes out bigger and goes as is
+    clen = n_xbee_lz_compress(dict, plain, hlen + len, lz + N_XBEE_LZ_HDR_LEN, hlen + len - N_XBEE_LZ_HDR_LEN - 1);
+    if (clen > 0) {
+      lz[0] = N_XBEE_DISPATCH_LZ;
+      lz[1] = dict ? N_XBEE_LZ_FLAG_DICT : 0;
+      lz[2] = (hlen + len) >> 8;
+      lz[3] = (hlen + len) & 0xFF;
+      hdr = lz;
+      hlen = N_XBEE_LZ_HDR_LEN + clen;
+      buf = lz + hlen;
+      len = 0;
+    }
+    node->tx_lz_out += hlen + len;
+  }
+#endif
+
+  if (hlen + len > N_XBEE_DATA_MTU)
+    return n_xbee_frag_send(bridge, envelope, hdr, hlen, buf, len);
+
+  envelope->cluster_id = N_XBEE_CLUSTER_ID_ENCAP;
+  envelope->payload = buf;
+  envelope->length = len;
+  return n_xbee_envelope_send_prefixed(envelope, hdr, hlen);
+}
+
+// Sends a frame with its headers compressed, caller holds write_lock.
+int n_xbee_xmit_compressed(struct xbee_serial_bridge* bridge, wpan_envelope_t* envelope, struct xbee_remote_node* node, const unsigned char* buffer, int len, const unsigned char* prefix, int prefixlen) {
+  unsigned char hdr[N_XBEE_BOND_HDR_LEN + N_XBEE_HC_MAX_HDR];
+  int hlen, consumed;
+
+  if (prefixlen)
+    memcpy(hdr, prefix, prefixlen);
+  hlen = n_xbee_hc_compress(bridge->mac, envelope->options & WPAN_ENVELOPE_BROADCAST_ADDR, buffer, len, hdr + prefixlen, &consumed);
+  if (hlen < 0) {
+    // can't elide the MACs, send it whole
+    hdr[prefixlen] = N_XBEE_DISPATCH_ETH;
+    hlen = 1;
+    consumed = 0;
+  }
+  return n_xbee_xmit_encap(bridge, envelope, node, hdr, prefixlen + hlen, buffer + consumed, len - consumed);
+}
+
+int n_xbee_xmit_frame(struct xbee_serial_bridge* bridge, struct xbee_remote_node* node, const unsigned char* buffer, int len, const unsigned char* prefix, int prefixlen) {
+  int err;
+  wpan_envelope_t envelope;
+  unsigned char hdr[N_XBEE_BOND_HDR_LEN + 1];
+
+  pthread_mutex_lock(&bridge->write_lock);
+  n_xbee_init_envelope(bridge, &envelope);
+  if (!node) {
+    envelope.ieee_address = *WPAN_IEEE_ADDR_BROADCAST;
+    envelope.options |= WPAN_ENVELOPE_BROADCAST_ADDR;
+  } else {
+    memcpy(&envelope.ieee_address, node->node_addr, 8);
+    node->tx_frames++;
+    node->tx_bytes += len;
+  }
+
+  if (node && (node->caps & N_XBEE_CAP_HC))
+    err = n_xbee_xmit_compressed(bridge, &envelope, node, buffer, len, prefix, prefixlen);
+  else if (prefixlen || len > N_XBEE_DATA_MTU || (node && (node->caps & N_XBEE_CAP_LZ))) {
+    // too big for one radio frame, needs a header or might compress, so
+    // encapsulate
+    if (prefixlen)
+      memcpy(hdr, prefix, prefixlen);
+    hdr[prefixlen] = N_XBEE_DISPATCH_ETH;
+    err = n_xbee_xmit_encap(bridge, &envelope, node, hdr, prefixlen + 1, buffer, len);
+  } else {
+    envelope.payload = buffer;
+    envelope.length = len;
+    err = n_xbee_envelope_send(&envelope);
+  }
+#ifdef N_XBEE_VERBOSE
+  if (err != 0)
+    printk(KERN_ALERT "%s: unable to transmit, error %d (%s).\n", __FUNCTION__,  err, strerror(err));
+#endif
+  pthread_mutex_unlock(&bridge->write_lock);
+  return err;
+}
+
+// Sends a frame from the tap right away.
+static void n_xbee_xmit_ether_now(struct xbee_serial_bridge* bridge, const void* buffer, int len) {
+  struct ether_header* mh;
+  int i, nbcast = 0;
+  struct xbee_remote_node* rnod = NULL;
+
+#ifdef N_XBEE_VERBOSE
+  if (len < 28) {
     printk(KERN_ALERT "%s: packet length is %d, less than min of 64, dropping.\n", __FUNCTION__, len);
     return;
   }
@@ -754,17 +1336,14 @@ void n_xbee_xmit_ether_packet(struct xbee_serial_bridge* bridge, const void* buf
 
 #ifdef N_XBEE_VERBOSE
   printk(KERN_INFO "%s: sending from mac %.2x:%.2x:%.2x:%.2x:%.2x:%.2x to mac %.2x:%.2x:%.2x:%.2x:%.2x:%.2x\n", __FUNCTION__, mh->ether_shost[0], mh->ether_shost[1], mh->ether_shost[2], mh->ether_shost[3], mh->ether_shost[4], mh->ether_shost[5], mh->ether_dhost[0], mh->ether_dhost[1], mh->ether_dhost[2], mh->ether_dhost[3], mh->ether_dhost[4], mh->ether_dhost[5]);
-  hexdump((void*) buffer, len);
 #endif
 
-  // set initial values
-  pthread_mutex_lock(&bridge->write_lock);
-  memset(&envelope, 0, sizeof(envelope));
-  envelope.dev = &bridge->xbee_dev->wpan_dev;
-  envelope.profile_id = WPAN_PROFILE_DIGI;
-  envelope.cluster_id = N_XBEE_CLUSTER_ID;
-  envelope.dest_endpoint = envelope.source_endpoint = N_XBEE_ENDPOINT;
-  envelope.network_address = WPAN_NET_ADDR_UNDEFINED;
+  // the bond picks the radio
+  if (bridge->bond) {
+    n_xbee_bond_xmit(bridge->bond, buffer, len);
+    return;
+  }
+
   // check if broadcast addr
 #ifdef N_XBEE_NO_MULTICAST
   for (i = 0; i < ETH_ALEN; i++) {
@@ -778,182 +1357,839 @@ void n_xbee_xmit_ether_packet(struct xbee_serial_bridge* bridge, const void* buf
   nbcast = !(mh->ether_dhost[0] & 1);
 #endif
 
-  // destination is broadcast
-  if (!nbcast) {
-    envelope.ieee_address = *WPAN_IEEE_ADDR_BROADCAST;
-    envelope.options |= WPAN_ENVELOPE_BROADCAST_ADDR;
-  }
-  else {
-    rnod = n_xbee_node_find_eth(&mh->ether_dhost, ETH_ALEN);
+  // destination is not broadcast
+  if (nbcast) {
+    rnod = n_xbee_node_find_eth(&bridge->nodes, &mh->ether_dhost, ETH_ALEN);
     if (!rnod) {
+      bridge->stats.drops[N_XBEE_DROP_NO_NODE]++;
+      n_xbee_disc_miss(bridge, mh->ether_dhost);
 #ifdef N_XBEE_VERBOSE
       printk(KERN_INFO "%s: unable to transmit, can't find in lookup table.\n", __FUNCTION__);
 #endif
       return;
     }
-    memcpy(&envelope.ieee_address, &rnod->node_addr, 8);
   }
-  envelope.payload = buffer;
-  envelope.length = len;
-  err = wpan_envelope_send(&envelope);
-#ifdef N_XBEE_VERBOSE
-  if (err != 0)
-    printk(KERN_ALERT "%s: unable to transmit, error %d (%s).\n", __FUNCTION__,  err, strerror(err));
+  n_xbee_xmit_frame(bridge, rnod, buffer, len, NULL, 0);
+}
+
+/* = Aggregation = */
+// Encodes one tap frame as a datagram for node into out, the way
+// n_xbee_xmit_frame would. Returns its length or -1 if it needs more
+// than room bytes.
+static int n_xbee_agg_encode(struct xbee_serial_bridge* bridge, struct xbee_remote_node* node, const unsigned char* buffer, int len, unsigned char* out, int room) {
+  int hlen = -1, consumed = 0;
+
+#ifndef N_XBEE_NO_HEADER_COMPRESSION
+  if ((node->caps & N_XBEE_CAP_HC) && room >= N_XBEE_HC_MAX_HDR)
+    hlen = n_xbee_hc_compress(bridge->mac, 0, buffer, len, out, &consumed);
 #endif
+  if (hlen < 0) {
+    out[0] = N_XBEE_DISPATCH_ETH;
+    hlen = 1;
+    consumed = 0;
+  }
+  if (hlen + len - consumed > room || hlen + len - consumed > 255)
+    return -1;
+  memcpy(out + hlen, buffer + consumed, len - consumed);
+  return hlen + len - consumed;
+}
+
+// Packs pkt and whatever else is at the front of the queues for the same
+// node into one radio frame. Returns 0 if there was nothing to pack it
+// with and it still needs sending.
+static int n_xbee_xmit_aggregate(struct xbee_serial_bridge* bridge, struct xbee_remote_node* node, n_xbee_pkt* pkt) {
+  int n = 0, alen = 1, sublen, flow;
+  unsigned char agg[N_XBEE_DATA_MTU];
+  wpan_envelope_t envelope;
+  n_xbee_pkt* next;
+  const unsigned char* mac = ((const struct ether_header*)pkt->data)->ether_dhost;
+
+  agg[0] = N_XBEE_DISPATCH_AGG;
+  if ((sublen = n_xbee_agg_encode(bridge, node, pkt->data, pkt->len, agg + alen + 1, sizeof(agg) - alen - 1)) < 0)
+    return 0;
+  agg[alen] = sublen;
+  alen += 1 + sublen;
+  n++;
+  while (alen + 2 < sizeof(agg) && (next = n_xbee_sched_peek_dest(&bridge->sched, mac, &flow))) {
+    if ((sublen = n_xbee_agg_encode(bridge, node, next->data, next->len, agg + alen + 1, sizeof(agg) - alen - 1)) < 0)
+      break;
+    agg[alen] = sublen;
+    alen += 1 + sublen;
+    n++;
+    n_xbee_sched_free(&bridge->sched, n_xbee_sched_take(&bridge->sched, flow));
+  }
+  if (n == 1)
+    return 0;
+
+  pthread_mutex_lock(&bridge->write_lock);
+  n_xbee_init_envelope(bridge, &envelope);
+  memcpy(&envelope.ieee_address, node->node_addr, 8);
+  if (n_xbee_xmit_encap(bridge, &envelope, node, agg, alen, agg + alen, 0) == 0) {
+    bridge->agg_frames++;
+    bridge->agg_packets += n;
+  }
   pthread_mutex_unlock(&bridge->write_lock);
+  return 1;
 }
 
-void* n_xbee_read_loop(void* ctx) {
-  struct xbee_serial_bridge* bridge = n_xbee_serial_bridge;
-  if (!bridge)
-    return;
+/* = Transmit scheduling = */
+// The bridge whose tap, and so whose scheduler, a frame goes through.
+static inline struct xbee_serial_bridge* n_xbee_sched_owner(struct xbee_serial_bridge* bridge) {
+  return bridge->bond ? bridge->bond->members[0] : bridge;
+}
 
-  int err;
-  uint32_t mstime;
-  uint32_t discover = xbee_millisecond_timer();
+// Bytes still waiting in the serial driver, or queued for it.
+static int n_xbee_serial_outq(struct xbee_serial_bridge* bridge) {
+  return xbee_ser_tx_used(&bridge->xbee_dev->serial);
+}
 
-  while (1) {
-    mstime = xbee_millisecond_timer();
-    // tick the xbee
-    err = n_xbee_handle_runtime_frames(bridge);
+// The same over every radio the scheduler feeds.
+static int n_xbee_sched_outq(struct xbee_serial_bridge* bridge) {
+  int i, outq = 0;
+  if (!bridge->bond)
+    return n_xbee_serial_outq(bridge);
+  for (i = 0; i < bridge->bond->nmembers; i++)
+    outq += n_xbee_serial_outq(bridge->bond->members[i]);
+  return outq;
+}
 
-    if (mstime - discover > N_XBEE_DISCOVER_INTERVAL) {
-      xbee_disc_discover_nodes(bridge->xbee_dev, NULL);
-      discover = mstime;
+// Sends queued frames for as long as the radio keeps up, that is while
+// there is room in the transmit window and the serial driver isn't
+// backed up. Holding them here rather than in the serial driver is what
+// lets a late ARP reply overtake a bulk transfer.
+// Wakes the scheduler up in about delay ms.
+static void n_xbee_pace(struct xbee_serial_bridge* bridge, uint32_t delay) {
+  struct itimerspec its;
+  if (bridge->pace_fd <= 0)
+    return;
+  // a ms late rather than early, and never zero, which would disarm it
+  delay++;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = delay / 1000;
+  its.it_value.tv_nsec = (delay % 1000) * 1000000L;
+  timerfd_settime(bridge->pace_fd, 0, &its, NULL);
+}
+
+void n_xbee_sched_run(struct xbee_serial_bridge* bridge) {
+  int i, n, limit, inflight, window, outq = 0;
+  uint32_t now;
+  struct xbee_serial_bridge* member;
+  struct xbee_remote_node* node;
+  n_xbee_pkt* pkt;
+
+  n = bridge->bond ? bridge->bond->nmembers : 1;
+  limit = N_XBEE_SCHED_OUTQ_LIMIT * n;
+  // asked once per run, then counted up by what we send, so a busy run
+  // costs no extra syscalls per frame
+  outq = bridge->sched.backlog ? n_xbee_sched_outq(bridge) : 0;
+  while (bridge->sched.backlog) {
+    inflight = window = 0;
+    for (i = 0; i < n; i++) {
+      member = bridge->bond ? bridge->bond->members[i] : bridge;
+      inflight += member->tx.inflight;
+      window += member->tx.window;
     }
-    pthread_yield();
-    if (!err)
-      usleep(10);
+    // a transmit status will wake us up
+    if (inflight >= window)
+      return;
+    // the count only ever overestimates, check before giving up
+    if (outq >= limit && (outq = n_xbee_sched_outq(bridge)) >= limit)
+      break;
+    now = xbee_millisecond_timer();
+    if (!(pkt = n_xbee_sched_dequeue(&bridge->sched, now)))
+      return;
+
+    // small frames to nodes that can unpack them share radio frames
+    node = NULL;
+    if (!bridge->bond && pkt->len < N_XBEE_DATA_MTU && !(pkt->data[0] & 1))
+      node = n_xbee_node_find_eth(&bridge->nodes, pkt->data, ETH_ALEN);
+    if (node && (node->caps & N_XBEE_CAP_AGG)) {
+      // alone in the queue, give it a moment to find company
+      if (!bridge->sched.backlog && now - pkt->enqueued < n_xbee_opts.agg_hold &&
+          n_xbee_sched_classify(pkt->data, pkt->len) != N_XBEE_SCHED_CONTROL) {
+        n_xbee_sched_requeue(&bridge->sched, pkt);
+        n_xbee_pace(bridge, n_xbee_opts.agg_hold - (now - pkt->enqueued));
+        return;
+      }
+      if (n_xbee_xmit_aggregate(bridge, node, pkt)) {
+        n_xbee_hist_add(&bridge->stats.tap_to_serial, n_xbee_stats_us() - pkt->read_us);
+        outq += pkt->len;
+        n_xbee_sched_free(&bridge->sched, pkt);
+        continue;
+      }
+    }
+    n_xbee_xmit_ether_now(bridge, pkt->data, pkt->len);
+    n_xbee_hist_add(&bridge->stats.tap_to_serial, n_xbee_stats_us() - pkt->read_us);
+    outq += pkt->len;
+    n_xbee_sched_free(&bridge->sched, pkt);
   }
+  if (!bridge->sched.backlog)
+    return;
 
-  return NULL;
+  // come back when about half of what is queued has gone out
+  member = bridge->bond ? bridge->bond->members[0] : bridge;
+  n_xbee_pace(bridge, member->xbee_dev->serial.baudrate ? (outq / n) * 5000 / member->xbee_dev->serial.baudrate : 0);
+}
+
+void n_xbee_xmit_ether_packet(struct xbee_serial_bridge* bridge, const void* buffer, int len) {
+  n_xbee_pkt* pkt;
+  bridge = n_xbee_sched_owner(bridge);
+  if (len > N_XBEE_POOL_BUF) {
+    bridge->stats.drops[N_XBEE_DROP_OVERSIZE]++;
+    return;
+  }
+  if (!(pkt = n_xbee_pool_get(&bridge->pool))) {
+    bridge->stats.drops[N_XBEE_DROP_POOL]++;
+    return;
+  }
+  memcpy(pkt->data, buffer, len);
+  pkt->len = len;
+  pkt->read_us = n_xbee_stats_us();
+  if (n_xbee_sched_enqueue(&bridge->sched, pkt, xbee_millisecond_timer()) != 0)
+    return;
+  n_xbee_sched_run(bridge);
 }
 
-void n_xbee_main_loop(void) {
-  int nread;
-  // set this to proper mtu later...
-  const int mtu = 1500;
-  char recv_buffer[mtu + 5];
-#ifdef N_XBEE_USE_SELECT
-  fd_set readset, activeset;
+// Reads everything bridge's tap queue has for us, up to
+// N_XBEE_NETDEV_BATCH frames so the radio side doesn't starve, into the
+// scheduler of the tap's owner.
+int n_xbee_drain_netdev(struct xbee_serial_bridge* bridge) {
+  int i, nread;
+  uint32_t now;
+  n_xbee_pkt* pkt;
+  struct xbee_serial_bridge* owner = n_xbee_sched_owner(bridge);
+  // room for the ethernet header a tun packet is given
+  int off = n_xbee_opts.tun ? N_XBEE_ETHHDR_LEN : 0;
+  // only used once the pool has run dry, the frame is dropped
+  unsigned char discard[N_XBEE_POOL_BUF];
+
+  for (i = 0; i < N_XBEE_NETDEV_BATCH; i++) {
+    // read straight into the buffer the frame gets queued and sent from
+    pkt = n_xbee_pool_get(&owner->pool);
+    nread = read(bridge->netdev, pkt ? pkt->data + off : discard, N_XBEE_POOL_BUF - off);
+    if (nread < 0) {
+      n_xbee_pool_put(&owner->pool, pkt);
+      if (errno == EAGAIN || errno == EINTR)
+        return 0;
+      printk(KERN_ALERT "%s: error reading from netdev, %d (%s)...\n", __FUNCTION__, errno, strerror(errno));
+      return -errno;
+    }
+#ifdef N_XBEE_VERBOSE
+    printk(KERN_INFO "%s: read %d bytes from netdev.\n", __FUNCTION__, nread);
 #endif
+    bridge->stats.tap_rx_frames++;
+    bridge->stats.tap_rx_bytes += nread;
+    n_xbee_cap(&bridge->cap, N_XBEE_CAP_TAP, 1, pkt ? pkt->data + off : discard, nread < N_XBEE_POOL_BUF - off ? nread : N_XBEE_POOL_BUF - off);
+    if (!pkt) {
+      owner->stats.drops[N_XBEE_DROP_POOL]++;
+      continue;
+    }
+    // cut short, the MTU check still sees the real length in the header
+    if (nread > N_XBEE_POOL_BUF - off)
+      nread = N_XBEE_POOL_BUF - off;
+    pkt->len = nread + off;
+    pkt->read_us = n_xbee_stats_us();
+    now = xbee_millisecond_timer();
+    if (off && n_xbee_route_frame(bridge, pkt->data, pkt->len, now) != 0) {
+      n_xbee_pool_put(&owner->pool, pkt);
+      continue;
+    }
+    // ARP and neighbour discovery we can answer never go on the air
+    if (n_xbee_arp_proxy(bridge, pkt->data, pkt->len, now) ||
+        n_xbee_nd_proxy(bridge, pkt->data, pkt->len) ||
+        n_xbee_mtu_check(owner, pkt->data, pkt->len)) {
+      n_xbee_pool_put(&owner->pool, pkt);
+      continue;
+    }
+    owner->mss_clamped += n_xbee_mtu_clamp(pkt->data, pkt->len);
+    n_xbee_sched_enqueue(&owner->sched, pkt, now);
+  }
+  return 0;
+}
 
-  struct xbee_serial_bridge* bridge = n_xbee_serial_bridge;
-  if (!bridge)
-    return;
+// Periodic housekeeping, every N_XBEE_TICK_INTERVAL.
+void n_xbee_housekeeping(struct xbee_serial_bridge* bridge) {
+  uint32_t mstime = xbee_millisecond_timer();
+
+  // lets the xbee code time out AT commands and discovery
+  n_xbee_handle_runtime_frames(bridge);
+  n_xbee_frag_expire(&bridge->frag, mstime);
+  n_xbee_tx_expire(bridge, mstime);
+  if (mstime - bridge->last_expire > 1000) {
+    n_xbee_node_expire(&bridge->nodes, mstime, N_XBEE_NODE_MAX_AGE);
+    n_xbee_disc_check(bridge, mstime);
+    bridge->last_expire = mstime;
+  }
+  // statuses come from the radio itself, losing them means the serial
+  // link is garbling frames
+  if (bridge->baud_base && bridge->tx.lost_streak >= N_XBEE_BAUD_LOST_LIMIT &&
+      (int32_t)(mstime - bridge->baud_retry) >= 0) {
+    pthread_mutex_lock(&n_xbee_lib_lock);
+    n_xbee_baud_fallback(bridge);
+    pthread_mutex_unlock(&n_xbee_lib_lock);
+  }
+  // give a down radio another chance, one more failure takes it back down
+  if (!bridge->link_up && mstime - bridge->link_down_since > N_XBEE_LINK_RETRY) {
+    bridge->link_up = 1;
+    bridge->tx_fail_streak = N_XBEE_LINK_FAIL_LIMIT - 1;
+  }
+  if (bridge->bond && bridge == bridge->bond->members[0]) {
+    pthread_mutex_lock(&n_xbee_lib_lock);
+    n_xbee_bond_expire(bridge->bond, mstime);
+    pthread_mutex_unlock(&n_xbee_lib_lock);
+  }
+}
+
+static int n_xbee_timerfd(uint32_t interval_ms) {
+  int fd;
+  struct itimerspec its;
+
+  if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+    return -errno;
+  its.it_interval.tv_sec = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+  its.it_value = its.it_interval;
+  if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+    close(fd);
+    return -errno;
+  }
+  return fd;
+}
+
+static int n_xbee_epoll_add(int epfd, n_xbee_event_source* src, int type, int fd, struct xbee_serial_bridge* bridge) {
+  struct epoll_event ev;
+
+  src->type = type;
+  src->fd = fd;
+  src->epfd = epfd;
+  src->bridge = bridge;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = src;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    printk(KERN_ALERT "%s: unable to watch fd %d, %d (%s)\n", __FUNCTION__, fd, errno, strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
 
-  pthread_t xbee_read_thread;
-  if (pthread_create(&xbee_read_thread, NULL, n_xbee_read_loop, NULL)) {
-    printk("%s: Error creating read thread, exiting.\n", __FUNCTION__);
+// Stops watching an fd that hung up or errored. epoll reports that for as
+// long as it lasts, so leaving it in would spin the worker.
+static void n_xbee_epoll_lost(n_xbee_event_source* src, uint32_t events) {
+  if (src->epfd < 0)
     return;
+  if (src->type == N_XBEE_EV_SERIAL)
+    printk(KERN_ALERT "%s: lost the radio on %s (%s), no longer reading it.\n", __FUNCTION__, src->bridge->tty_name, (events & EPOLLHUP) ? "hung up" : "error");
+  else
+    printk(KERN_ALERT "%s: fd %d (event type %d) %s, no longer watching it.\n", __FUNCTION__, src->fd, src->type, (events & EPOLLHUP) ? "hung up" : "errored");
+  epoll_ctl(src->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+  src->epfd = -1;
+}
+
+// Watches the serial port, the tap and our timers.
+int n_xbee_bridge_watch(int epfd, struct xbee_serial_bridge* bridge) {
+  int err;
+
+  if ((bridge->tick_fd = n_xbee_timerfd(N_XBEE_TICK_INTERVAL)) < 0 ||
+      (bridge->discover_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    printk(KERN_ALERT "%s: unable to create timers, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+    return -errno;
   }
+  // n_xbee_check_tty ran the first round
+  if ((err = n_xbee_disc_arm(bridge, N_XBEE_DISC_MIN_INTERVAL)))
+    return err;
+  bridge->last_expire = xbee_millisecond_timer();
+  // the event loop flushes from here on
+  n_xbee_serial_batch(&bridge->xbee_dev->serial, 1);
 
-#ifdef N_XBEE_USE_SELECT
-  FD_ZERO(&activeset);
-  FD_SET(bridge->netdev, &activeset);
-#endif
-  while(1) {
-#ifdef N_XBEE_USE_SELECT
-    // check for packets from tap
-    readset = activeset;
-    // first argument is maximum fd we are listening to + 1
-    if (select(bridge->netdev + 1, &readset, NULL, NULL, NULL) < 0) {
-      if (errno != -EINTR) {
-        printk(KERN_ALERT "%s: select() errored.\n", __FUNCTION__);
-        return;
-      }
+  if ((err = n_xbee_epoll_add(epfd, &bridge->ev_serial, N_XBEE_EV_SERIAL, bridge->xbee_dev->serial.fd, bridge)) ||
+      (err = n_xbee_epoll_add(epfd, &bridge->ev_tick, N_XBEE_EV_TICK, bridge->tick_fd, bridge)) ||
+      (err = n_xbee_epoll_add(epfd, &bridge->ev_discover, N_XBEE_EV_DISCOVER, bridge->discover_fd, bridge)))
+    return err;
+  // a shared tap is only watched once, by the first member of the bond
+  if (bridge->bond && bridge != bridge->bond->members[0])
+    return 0;
+
+  if ((bridge->pace_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    printk(KERN_ALERT "%s: unable to create pacing timer, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+    return -errno;
+  }
+  if ((err = n_xbee_epoll_add(epfd, &bridge->ev_pace, N_XBEE_EV_PACE, bridge->pace_fd, bridge)))
+    return err;
+  if (bridge->bond &&
+      (err = n_xbee_epoll_add(epfd, &bridge->bond->ev_reorder, N_XBEE_EV_REORDER, bridge->bond->reorder_fd, bridge)))
+    return err;
+  if (bridge->addrs.fd >= 0 &&
+      (err = n_xbee_epoll_add(epfd, &bridge->ev_addr, N_XBEE_EV_ADDR, bridge->addrs.fd, bridge)))
+    return err;
+  return n_xbee_epoll_add(epfd, &bridge->ev_netdev, N_XBEE_EV_NETDEV, bridge->netdev, bridge);
+}
+
+// Logs what every bridge and the nodes it knows have been up to.
+void n_xbee_dump_stats(void) {
+  int i, j;
+  struct xbee_serial_bridge* bridge;
+  xbee_remote_node* nod;
+
+  for (i = 0; i < n_xbee_bridge_count; i++) {
+    bridge = n_xbee_bridges[i];
+    printk(KERN_INFO "%s: %s: tx %u ok %u fail %u retries %u lost %u, sched %d queued %u dropped, %u packets in %u aggregates, %u mss clamped, %u too big\n", __FUNCTION__, bridge->tty_name,
+        bridge->tx.tx_frames, bridge->tx.tx_ok, bridge->tx.tx_fail, bridge->tx.tx_retries, bridge->tx.tx_lost,
+        bridge->sched.backlog, bridge->sched.overlimit_drops + bridge->sched.codel_drops, bridge->agg_packets, bridge->agg_frames,
+        bridge->mss_clamped, bridge->mtu_too_big);
+    if (!bridge->bond || bridge == bridge->bond->members[0]) {
+      printk(KERN_INFO "%s: %s: proxy arp answered %u, passed %u\n", __FUNCTION__, bridge->tty_name, bridge->arp.hits, bridge->arp.misses);
+      printk(KERN_INFO "%s: %s: pool %d/%d free, low %d, %u gets %u puts %u empty\n", __FUNCTION__, bridge->tty_name,
+          bridge->pool.avail, bridge->pool.size, bridge->pool.min_avail, bridge->pool.gets, bridge->pool.puts, bridge->pool.empty);
+      if (n_xbee_opts.tun)
+        printk(KERN_INFO "%s: %s: routed %u, flooded %u, broadcast %u\n", __FUNCTION__, bridge->tty_name,
+            bridge->routes.hits, bridge->routes.floods, bridge->routes.bcasts);
+    }
+    for (j = 0; j < N_XBEE_NODE_MAX; j++) {
+      nod = &bridge->nodes.nodes[j];
+      if (!nod->in_use)
+        continue;
+      printk(KERN_INFO "%s: %s:   %02x%02x%02x%02x%02x%02x%02x%02x caps 0x%04x, tx ok %u fail %u retries %u, compressed %u to %u bytes (%u%%)\n", __FUNCTION__, bridge->tty_name,
+          nod->node_addr[0], nod->node_addr[1], nod->node_addr[2], nod->node_addr[3],
+          nod->node_addr[4], nod->node_addr[5], nod->node_addr[6], nod->node_addr[7],
+          nod->caps, nod->tx_ok, nod->tx_fail, nod->tx_retries, nod->tx_lz_in, nod->tx_lz_out,
+          nod->tx_lz_in ? (unsigned)((uint64_t)nod->tx_lz_out * 100 / nod->tx_lz_in) : 100);
     }
+  }
+}
 
-    if (FD_ISSET(bridge->netdev, &readset)) {
-#endif
-      nread = read(bridge->netdev, recv_buffer, mtu + 5);
-      if (nread < 0) {
-        printk(KERN_ALERT "%s: error reading from recv_buf, %d (%s)...\n", __FUNCTION__, nread, strerror(nread));
-        return;
+// Blocks SIGUSR1 and SIGUSR2 so they only ever arrive through the
+// returned signalfd. Must run before any other thread is started.
+static int n_xbee_signalfd(void) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+int n_xbee_handle_event(n_xbee_event_source* src) {
+  int err;
+  uint64_t expirations;
+  struct signalfd_siginfo info;
+  struct xbee_serial_bridge* bridge = src->bridge;
+
+  switch (src->type) {
+    case N_XBEE_EV_SERIAL:
+      bridge->stats.rx_start = n_xbee_stats_us();
+      // dispatch every complete frame that is waiting
+      while (n_xbee_handle_runtime_frames(bridge) > 0)
+        ;
+      if (n_xbee_serial_error(&bridge->xbee_dev->serial) < 0)
+        n_xbee_epoll_lost(src, EPOLLERR);
+      // transmit statuses might have opened the window
+      bridge = bridge->bond ? bridge->bond->members[0] : bridge;
+      if (bridge->sched.backlog)
+        n_xbee_sched_run(bridge);
+      return 0;
+    case N_XBEE_EV_NETDEV:
+      err = n_xbee_drain_netdev(bridge);
+      n_xbee_sched_run(n_xbee_sched_owner(bridge));
+      return err;
+    case N_XBEE_EV_PACE:
+      read(src->fd, &expirations, sizeof(expirations));
+      n_xbee_sched_run(bridge);
+      return 0;
+    case N_XBEE_EV_TICK:
+      read(src->fd, &expirations, sizeof(expirations));
+      n_xbee_housekeeping(bridge);
+      // frames whose status went missing free up the window too
+      bridge = bridge->bond ? bridge->bond->members[0] : bridge;
+      if (bridge->sched.backlog)
+        n_xbee_sched_run(bridge);
+      return 0;
+    case N_XBEE_EV_DISCOVER:
+      read(src->fd, &expirations, sizeof(expirations));
+      n_xbee_disc_round(bridge);
+      return 0;
+    case N_XBEE_EV_REORDER:
+      read(src->fd, &expirations, sizeof(expirations));
+      // the members' workers hold frames under the same lock
+      pthread_mutex_lock(&n_xbee_lib_lock);
+      n_xbee_bond_reorder_timer(bridge->bond);
+      pthread_mutex_unlock(&n_xbee_lib_lock);
+      return 0;
+    case N_XBEE_EV_ADDR:
+      return n_xbee_addr_handle(&bridge->addrs);
+    case N_XBEE_EV_SIGNAL:
+      while (read(src->fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR2)
+          n_xbee_cap_toggle();
+        else
+          n_xbee_dump_stats();
       }
-      // not sure what the 46 byte packets are
-#ifdef N_XBEE_VERBOSE
-      printk(KERN_INFO "%s: read %d bytes from netdev.\n", __FUNCTION__, nread);
-#endif
+      return 0;
+    case N_XBEE_EV_STATS:
+      n_xbee_stats_accept(src->epfd, src->fd);
+      return 0;
+    case N_XBEE_EV_STATS_CLIENT:
+      n_xbee_stats_send(src);
+      return 0;
+  }
+  return 0;
+}
+
+// Writes out what bridge queued for its radio. Whatever the tty didn't
+// take goes when it says it has room, rather than on the next wakeup
+// for something else. Caller holds n_xbee_lib_lock.
+static void n_xbee_serial_flush_one(struct xbee_serial_bridge* bridge) {
+  struct epoll_event ev;
+  int out = n_xbee_serial_flush(&bridge->xbee_dev->serial) > 0;
+
+  if (out == bridge->serial_out || bridge->ev_serial.epfd < 0)
+    return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+  ev.data.ptr = &bridge->ev_serial;
+  if (epoll_ctl(bridge->ev_serial.epfd, EPOLL_CTL_MOD, bridge->ev_serial.fd, &ev) == 0)
+    bridge->serial_out = out;
+}
 
-      n_xbee_xmit_ether_packet(bridge, recv_buffer, nread);
-#ifdef N_XBEE_USE_SELECT
+// Writes out what the bridge, or its whole bond, queued for the radio.
+static void n_xbee_serial_flush_bridge(struct xbee_serial_bridge* bridge) {
+  int i;
+  pthread_mutex_lock(&n_xbee_lib_lock);
+  if (!bridge->bond)
+    n_xbee_serial_flush_one(bridge);
+  for (i = 0; bridge->bond && i < bridge->bond->nmembers; i++)
+    n_xbee_serial_flush_one(bridge->bond->members[i]);
+  pthread_mutex_unlock(&n_xbee_lib_lock);
+}
+
+void* n_xbee_worker_loop(void* ctx) {
+  int i, n;
+  struct epoll_event events[N_XBEE_MAX_EVENTS];
+  n_xbee_event_source* src;
+  n_xbee_worker* worker = (n_xbee_worker*)ctx;
+
+  while (1) {
+    n = epoll_wait(worker->epfd, events, N_XBEE_MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      printk(KERN_ALERT "%s: worker %d epoll_wait() errored, %d (%s)\n", __FUNCTION__, worker->id, errno, strerror(errno));
+      break;
+    }
+    for (i = 0; i < n; i++) {
+      src = (n_xbee_event_source*)events[i].data.ptr;
+      // whatever was still readable is handled first
+      if (n_xbee_handle_event(src) < 0)
+        return NULL;
+      if (events[i].events & (EPOLLHUP | EPOLLERR))
+        n_xbee_epoll_lost(src, events[i].events);
+    }
+    // whatever the batch sent goes out in one write per port
+    for (i = 0; i < n; i++) {
+      src = (n_xbee_event_source*)events[i].data.ptr;
+      if (src->bridge)
+        n_xbee_serial_flush_bridge(src->bridge);
     }
-#endif
-    pthread_yield();
   }
+  return NULL;
 }
 
-static int n_xbee_init(void) {
+// Spreads the bridges over nworkers threads, each with its own epoll set,
+// and waits for them. A bridge is only ever driven by one worker, and a
+// bond is driven by one worker as a whole.
+void n_xbee_main_loop(int nworkers) {
+  int i;
+  n_xbee_worker workers[N_XBEE_MAX_BRIDGES];
+  static n_xbee_event_source ev_signal;
+  static n_xbee_event_source ev_stats;
+
+  if (nworkers > n_xbee_bridge_count)
+    nworkers = n_xbee_bridge_count;
+  if (n_xbee_bridges[0] && n_xbee_bridges[0]->bond)
+    nworkers = 1;
+  if (nworkers < 1)
+    return;
+
+  for (i = 0; i < nworkers; i++) {
+    workers[i].id = i;
+    if ((workers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      printk(KERN_ALERT "%s: epoll_create1 failed, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+      return;
+    }
+  }
+  for (i = 0; i < n_xbee_bridge_count; i++) {
+    if (n_xbee_bridge_watch(workers[i % nworkers].epfd, n_xbee_bridges[i]) != 0)
+      return;
+  }
+  // kill -USR1 dumps stats, kill -USR2 starts and stops capturing
+  if ((ev_signal.fd = n_xbee_signalfd()) < 0 ||
+      n_xbee_epoll_add(workers[0].epfd, &ev_signal, N_XBEE_EV_SIGNAL, ev_signal.fd, NULL) != 0)
+    printk(KERN_ALERT "%s: unable to watch for SIGUSR1, no stats or capture.\n", __FUNCTION__);
+  if (n_xbee_opts.stats_path &&
+      ((ev_stats.fd = n_xbee_stats_open(n_xbee_opts.stats_path)) < 0 ||
+       n_xbee_epoll_add(workers[0].epfd, &ev_stats, N_XBEE_EV_STATS, ev_stats.fd, NULL) != 0))
+    printk(KERN_ALERT "%s: unable to serve stats on %s.\n", __FUNCTION__, n_xbee_opts.stats_path);
+
+  printk(KERN_INFO "%s: running %d bridge(s) on %d worker(s).\n", __FUNCTION__, n_xbee_bridge_count, nworkers);
+  for (i = 1; i < nworkers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, n_xbee_worker_loop, &workers[i])) {
+      printk(KERN_ALERT "%s: Error creating worker thread, exiting.\n", __FUNCTION__);
+      return;
+    }
+  }
+  n_xbee_worker_loop(&workers[0]);
+  for (i = 1; i < nworkers; i++)
+    pthread_join(workers[i].thread, NULL);
+  for (i = 0; i < nworkers; i++)
+    close(workers[i].epfd);
+  if (ev_stats.fd > 0) {
+    close(ev_stats.fd);
+    unlink(n_xbee_opts.stats_path);
+  }
+}
+
+int n_xbee_init(void) {
+  pthread_mutexattr_t attr;
   printk(KERN_INFO "%s: xbee-net initializing...\n", __FUNCTION__);
-  n_xbee_node_table = NULL;
+  // rx callbacks send (caps, arp) from inside xbee_dev_tick
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&n_xbee_lib_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  n_xbee_bridge_count = 0;
   return 0;
 }
 
 static void n_xbee_cleanup(void) {
+  n_xbee_bond* bond = n_xbee_bridge_count ? n_xbee_bridges[0]->bond : NULL;
   printk(KERN_INFO "%s: xbee-net shutting down...\n", __FUNCTION__);
-  // n_xbee_free_all_bridges();
-  if (n_xbee_serial_bridge)
-    n_xbee_free_bridge(n_xbee_serial_bridge);
-  n_xbee_free_remote_nodetable();
+  // members share the first one's tap, let it go last
+  while (n_xbee_bridge_count > 0) {
+    n_xbee_free_bridge(n_xbee_bridges[--n_xbee_bridge_count]);
+    n_xbee_bridges[n_xbee_bridge_count] = NULL;
+  }
+  n_xbee_bond_free(bond);
 }
 
 /*
    Parse the command-line arguments, looking for "/dev/" to determine the
-   serial port to use, and a bare number (assumed to be the baud rate).
+   serial ports to use, and bare numbers (assumed to be baud rates). A
+   baud rate applies to the port before it, or to every port if it comes
+   first. "--workers=N" sets the number of event loop threads, "--bond"
+   or "--bond=packet" bonds every port into a single tap, and
+   "--tx-window=N" sets how many frames each radio may have in flight.
+   "--agg-hold=MS" sets how long a small frame may wait to be aggregated.
+   "--lz-dict=PATH" compresses with a dictionary trained from PATH rather
+   than the built in one. "--arp-max-age=S" sets how long a learned ARP
+   binding is answered from locally, 0 always broadcasts. "--ipv6" derives
+   the link-local address from the radio and resolves neighbours locally.
+   "--baud-max" or "--baud-max=RATE" raises the radio and the port to the
+   fastest rate (up to RATE) that works. "--stats=PATH" serves counters
+   as JSON on a Unix socket at PATH. "--capture=PATH" lets SIGUSR2 record
+   into a ring and write it to PATH, "--replay=PATH" feeds such a capture
+   in before starting, without sending anything; meant for xbee_sim's
+   ports, the radios are set up as usual first.
 
    @param[in]	argc		argument count
    @param[in]	argv		array of \a argc arguments
-   @param[out]	serial	serial port settings
+   @param[out]	opts		options, including serial port settings
    */
-int parse_serial_arguments(int argc, const char *argv[], xbee_serial_t *serial) {
+int parse_serial_arguments(int argc, const char *argv[], n_xbee_options *opts) {
   int i;
+  long ncpu;
   uint32_t baud;
-
-  memset( serial, 0, sizeof *serial);
-
   // default baud rate
-  serial->baudrate = 115200;
+  uint32_t default_baud = 115200;
+  xbee_serial_t* serial = NULL;
+
+  memset(opts, 0, sizeof *opts);
+  opts->agg_hold = -1;
+  opts->arp_max_age = -1;
 
   for (i = 1; i < argc; ++i)
   {
     if (strncmp( argv[i], "/dev", 4) == 0)
     {
+      if (opts->nserial >= N_XBEE_MAX_BRIDGES) {
+        printk(KERN_ALERT "%s: too many devices, max is %d.\n", __FUNCTION__, N_XBEE_MAX_BRIDGES);
+        return -1;
+      }
+      serial = &opts->serial[opts->nserial++];
       strncpy( serial->device, argv[i], (sizeof serial->device) - 1);
       serial->device[(sizeof serial->device) - 1] = '\0';
     }
-    if ( (baud = (uint32_t) strtoul( argv[i], NULL, 0)) > 0)
+    else if (strncmp( argv[i], "--workers=", 10) == 0)
+    {
+      opts->workers = atoi(argv[i] + 10);
+    }
+    else if (strncmp( argv[i], "--agg-hold=", 11) == 0)
+    {
+      opts->agg_hold = atoi(argv[i] + 11);
+    }
+    else if (strcmp( argv[i], "--baud-max") == 0)
+    {
+      opts->baud_max = 921600;
+    }
+    else if (strncmp( argv[i], "--baud-max=", 11) == 0)
+    {
+      opts->baud_max = strtoul(argv[i] + 11, NULL, 0);
+    }
+    else if (strcmp( argv[i], "--ipv6") == 0)
+    {
+      opts->ipv6 = 1;
+    }
+    else if (strncmp( argv[i], "--mtu=", 6) == 0)
+    {
+      opts->mtu = atoi(argv[i] + 6);
+    }
+    else if (strcmp( argv[i], "--tun") == 0)
+    {
+      opts->tun = 1;
+    }
+    else if (strncmp( argv[i], "--route=", 8) == 0)
+    {
+      if (opts->nroutes >= N_XBEE_ROUTE_STATIC_MAX) {
+        printk(KERN_ALERT "%s: too many routes, max is %d.\n", __FUNCTION__, N_XBEE_ROUTE_STATIC_MAX);
+        return -1;
+      }
+      if (n_xbee_route_parse(argv[i] + 8, &opts->routes[opts->nroutes]) != 0) {
+        printk(KERN_ALERT "%s: bad route %s, expected PREFIX[/LEN]=ADDR64.\n", __FUNCTION__, argv[i] + 8);
+        return -1;
+      }
+      opts->nroutes++;
+    }
+    else if (strncmp( argv[i], "--arp-max-age=", 14) == 0)
+    {
+      opts->arp_max_age = atoi(argv[i] + 14) * 1000;
+    }
+    else if (strncmp( argv[i], "--lz-dict=", 10) == 0)
+    {
+      opts->lz_dict = argv[i] + 10;
+    }
+    else if (strncmp( argv[i], "--stats=", 8) == 0)
     {
-      serial->baudrate = baud;
+      opts->stats_path = argv[i] + 8;
+    }
+    else if (strncmp( argv[i], "--capture=", 10) == 0)
+    {
+      opts->capture = argv[i] + 10;
+    }
+    else if (strncmp( argv[i], "--replay=", 9) == 0)
+    {
+      opts->replay = argv[i] + 9;
+    }
+    else if (strncmp( argv[i], "--tx-window=", 12) == 0)
+    {
+      opts->tx_window = atoi(argv[i] + 12);
+    }
+    else if (strcmp( argv[i], "--bond") == 0 || strcmp( argv[i], "--bond=flow") == 0)
+    {
+      opts->bond_mode = N_XBEE_BOND_FLOW;
+    }
+    else if (strcmp( argv[i], "--bond=packet") == 0)
+    {
+      opts->bond_mode = N_XBEE_BOND_PACKET;
+    }
+    else if ( (baud = (uint32_t) strtoul( argv[i], NULL, 0)) > 0)
+    {
+      if (serial)
+        serial->baudrate = baud;
+      else
+        default_baud = baud;
     }
   }
 
-  if (*serial->device == '\0') {
+  if (opts->nserial == 0) {
     printk(KERN_ALERT "%s: invalid command line args.\n", __FUNCTION__);
-    printk(KERN_ALERT "usage: /dev/ttyUSB0 115200\n");
+    printk(KERN_ALERT "usage: [--workers=N] [--bond[=flow|packet]] [--tx-window=N] [--agg-hold=MS] [--lz-dict=PATH] [--arp-max-age=S] [--ipv6] [--baud-max[=RATE]] [--mtu=N] [--tun [--route=PREFIX=ADDR64 ...]] [--stats=PATH] [--capture=PATH] [--replay=PATH] /dev/ttyUSB0 [115200] [/dev/ttyUSB1 [115200] ...]\n");
     return -1;
   }
 
-  printk(KERN_INFO "%s: using device %s baud %d\n", __FUNCTION__, serial->device, serial->baudrate);
+  if (opts->agg_hold < 0)
+    opts->agg_hold = N_XBEE_AGG_HOLD;
+  if (opts->arp_max_age < 0)
+    opts->arp_max_age = N_XBEE_ARP_MAX_AGE;
+  if (!opts->mtu)
+    opts->mtu = N_XBEE_NETDEV_MTU;
+  if (opts->mtu < N_XBEE_MTU_MIN || opts->mtu > N_XBEE_NETDEV_MTU) {
+    printk(KERN_ALERT "%s: mtu must be between %d and %d.\n", __FUNCTION__, N_XBEE_MTU_MIN, N_XBEE_NETDEV_MTU);
+    return -1;
+  }
+  if (opts->ipv6 && opts->mtu < 1280)
+    printk(KERN_ALERT "%s: an mtu under 1280 turns IPv6 off on the device.\n", __FUNCTION__);
+
+  if (opts->workers <= 0) {
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->workers = ncpu > 0 ? ncpu : 1;
+  }
+
+  for (i = 0; i < opts->nserial; i++) {
+    if (!opts->serial[i].baudrate)
+      opts->serial[i].baudrate = default_baud;
+    printk(KERN_INFO "%s: using device %s baud %d\n", __FUNCTION__, opts->serial[i].device, opts->serial[i].baudrate);
+  }
   return 0;
 }
 
 int main(int argc, const char** argv) {
-  int res;
+  int i, res;
 
   if ((res = n_xbee_init()) != 0) {
     printk(KERN_ALERT "%s: init failed, exiting...\n", __FUNCTION__);
     return res;
   }
 
-  xbee_serial_t serial;
-  if ((res = parse_serial_arguments(argc, argv, &serial)) != 0)
+  if ((res = parse_serial_arguments(argc, argv, &n_xbee_opts)) != 0)
+    return res;
+
+  // peers check the ID in the caps, so this has to be settled first
+  if (!n_xbee_opts.lz_dict)
+    n_xbee_lz_dict_default(&n_xbee_lz_local_dict);
+  else if ((res = n_xbee_lz_dict_load(&n_xbee_lz_local_dict, n_xbee_opts.lz_dict)) != 0)
+    return res;
+
+  for (i = 0; i < n_xbee_opts.nserial; i++) {
+    if ((res = n_xbee_serial_open(&n_xbee_opts.serial[i])) != 0)
+      printk(KERN_ALERT "%s: giving up on %s.\n", __FUNCTION__, n_xbee_opts.serial[i].device);
+  }
+  if (n_xbee_bridge_count == 0)
     return res;
 
-  if ((res = n_xbee_serial_open(&serial)) != 0)
+  if (n_xbee_opts.bond_mode && !n_xbee_bond_create(n_xbee_bridges, n_xbee_bridge_count, n_xbee_opts.bond_mode)) {
+    printk(KERN_ALERT "%s: unable to bond, exiting...\n", __FUNCTION__);
+    n_xbee_cleanup();
+    return -ENOMEM;
+  }
+  for (i = 0; i < n_xbee_bridge_count; i++) {
+    struct xbee_serial_bridge* bridge = n_xbee_bridges[i];
+    // everyone in the bond reads and writes the same tap
+    if (bridge->bond && i > 0)
+      res = n_xbee_init_netdev_queue(bridge, n_xbee_bridges[0]);
+    else
+      res = n_xbee_init_netdev(bridge);
+    if (res != 0) {
+      printk(KERN_ALERT "%s: %s n_xbee_init_netdev indicated failure, aborting.\n", __FUNCTION__, bridge->tty_name);
+      n_xbee_cleanup();
+      return -ENODEV;
+    }
+  }
+
+  for (i = 0; n_xbee_opts.capture && i < n_xbee_bridge_count; i++) {
+    if (n_xbee_cap_init(&n_xbee_bridges[i]->cap, N_XBEE_CAP_RING_SIZE) != 0) {
+      printk(KERN_ALERT "%s: no memory for a capture ring, exiting...\n", __FUNCTION__);
+      n_xbee_cleanup();
+      return -ENOMEM;
+    }
+  }
+  if (n_xbee_opts.replay && (res = n_xbee_cap_replay(n_xbee_opts.replay)) != 0) {
+    n_xbee_cleanup();
     return res;
+  }
 
-  n_xbee_main_loop();
+  n_xbee_main_loop(n_xbee_opts.workers);
+  // whatever was being recorded when we stopped
+  if (n_xbee_cap_on)
+    n_xbee_cap_toggle();
   n_xbee_cleanup();
-  return res;
+  return 0;
 }
@@ -9,20 +9,47 @@
 #include <pthread.h>
 
 #include <sys/socket.h>
+#include <net/ethernet.h>
 
 #include <xbee/platform.h>
 #include <xbee/device.h>
 #include <xbee/discovery.h>
 
+#include "n_xbee_frag.h"
+#include "n_xbee_node.h"
+#include "n_xbee_sched.h"
+#include "n_xbee_tx.h"
+#include "n_xbee_addr.h"
+#include "n_xbee_arp.h"
+#include "n_xbee_route.h"
+#include "n_xbee_mtu.h"
+#include "n_xbee_stats.h"
+#include "n_xbee_cap.h"
+#include "n_xbee_disc.h"
+
+// compat with old printk defs
+#define KERN_INFO
+#define KERN_ALERT
+#define printk printf
+#define msleep(TIME) usleep(TIME * 1000)
+
 // Actual MTU of the hardware
 #define N_XBEE_DATA_MTU 72
 #define N_XBEE_MAXFRAME (N_XBEE_DATA_MTU*2 + 16)
+// MTU of the tap, frames bigger than N_XBEE_DATA_MTU get fragmented
+#define N_XBEE_NETDEV_MTU 1500
+// biggest frame we read from or write to the tap
+#define N_XBEE_FRAME_MAX (N_XBEE_NETDEV_MTU + N_XBEE_ETHHDR_LEN)
 #define TUN_PATH "/dev/net/tun"
 
 #define N_XBEE_PREAMBLE_LEN 0
 #define N_XBEE_ETHHDR_LEN sizeof(struct ether_header)
+// ethernet header and an IPv4 over ethernet ARP packet
+#define N_XBEE_ARP_FRAME_LEN (N_XBEE_ETHHDR_LEN + 28)
 
+#ifndef ETHERTYPE_IPV6
 #define ETHERTYPE_IPV6 0x86DD
+#endif
 
 // endpoint for xbee-netdev
 // #define N_XBEE_ENDPOINT 0xE7
@@ -31,21 +58,75 @@
 #define N_XBEE_CLUSTER_ID 0x11
 
 // Tick every 100ms
-// #define N_XBEE_TICK_INTERVAL 100
-// Discover every 2 minutes
-#define N_XBEE_DISCOVER_INTERVAL 120000
+#define N_XBEE_TICK_INTERVAL 100
 
 #define XBEE_NETDEV_PREFIX "xbee"
 
+// radios one process can drive
+#define N_XBEE_MAX_BRIDGES 16
+
+// frames read from the tap per wakeup
+#define N_XBEE_NETDEV_BATCH 32
+// events handled per epoll_wait
+#define N_XBEE_MAX_EVENTS 16
+
+// what an epoll event belongs to
+#define N_XBEE_EV_SERIAL 0
+#define N_XBEE_EV_NETDEV 1
+#define N_XBEE_EV_TICK 2
+#define N_XBEE_EV_DISCOVER 3
+#define N_XBEE_EV_PACE 4
+// SIGUSR1 and SIGUSR2, not tied to a bridge
+#define N_XBEE_EV_SIGNAL 5
+#define N_XBEE_EV_ADDR 6
+// a connection to the --stats socket, not tied to a bridge either
+#define N_XBEE_EV_STATS 7
+// a bond's reorder timer, on its first member
+#define N_XBEE_EV_REORDER 8
+// a --stats client still being written to
+#define N_XBEE_EV_STATS_CLIENT 9
+
+// bytes we let pile up in the serial driver before holding frames back
+// in the scheduler, a little over one full radio frame
+#define N_XBEE_SCHED_OUTQ_LIMIT (N_XBEE_MAXFRAME + 16)
+// ms a lone small frame may wait for company to share a radio frame with
+// unless --agg-hold says otherwise
+#define N_XBEE_AGG_HOLD 5
+
+typedef struct n_xbee_event_source {
+  int type;
+  int fd;
+  // the epoll set it is in, -1 once it hung up and was taken out
+  int epfd;
+  struct xbee_serial_bridge* bridge;
+} n_xbee_event_source;
+
 struct xbee_serial_bridge;
+struct n_xbee_bond;
 
-// Discovered remote node
-struct xbee_remote_node;
-typedef struct xbee_remote_node {
-  unsigned char node_addr[8];
-  struct xbee_remote_node* next;
-} xbee_remote_node;
-xbee_remote_node* n_xbee_node_table;
+// packet buffers per tap, everything the scheduler can hold and a batch
+// being read
+#define N_XBEE_POOL_SIZE (N_XBEE_SCHED_LIMIT + N_XBEE_NETDEV_BATCH)
+
+// ms to wait for the radio to answer AP / AO in API mode
+#define N_XBEE_PROBE_TIMEOUT 250
+// ms for an AT mode command, and for getting in or out of AT mode (the
+// guard time twice over)
+#define N_XBEE_ATMODE_TIMEOUT 1000
+#define N_XBEE_ATMODE_SWITCH_TIMEOUT 5000
+// transmit statuses missing in a row before a raised serial rate is
+// given up on
+#define N_XBEE_BAUD_LOST_LIMIT 3
+// ms between attempts to find a radio that fell off the raised rate
+#define N_XBEE_BAUD_RETRY 5000
+// ms before the first retry of a radio that didn't come up, doubled each
+// time after
+#define N_XBEE_RETRY_DELAY 250
+
+// failed transmissions in a row before a radio counts as down
+#define N_XBEE_LINK_FAIL_LIMIT 4
+// how long a down radio sits out before we try it again, ms
+#define N_XBEE_LINK_RETRY 5000
 
 /*
  * One bridge is created per registered xbee.
@@ -65,8 +146,153 @@ typedef struct xbee_serial_bridge {
   const char* tty_name;
   xbee_dev_t* xbee_dev;
   pthread_mutex_t write_lock;
+  // timerfds, discover_fd is one shot and rearmed by every round
+  int tick_fd;
+  int discover_fd;
+  // when discover_fd goes off next and why, owned by the bridge's worker
+  n_xbee_disc_state disc;
+  // one shot, wakes the scheduler once the serial port has drained
+  int pace_fd;
+  uint32_t last_expire;
+  n_xbee_event_source ev_serial;
+  // ev_serial also waits for EPOLLOUT, while the port has bytes queued
+  int serial_out;
+  n_xbee_event_source ev_netdev;
+  n_xbee_event_source ev_tick;
+  n_xbee_event_source ev_discover;
+  n_xbee_event_source ev_pace;
+  n_xbee_event_source ev_addr;
+  // the tap's addresses, owned by the tap's worker
+  n_xbee_addr_cache addrs;
+  // IPv4 bindings of remote nodes, owned by the tap's worker
+  n_xbee_arp_table arp;
+  // IP routes to remote nodes with --tun, owned by the tap's worker
+  n_xbee_route_table routes;
+  // ARP replies are built here, read thread only
+  unsigned char arp_reply[N_XBEE_ARP_FRAME_LEN];
+  // frames from the tap waiting for the radio, owned by the tap's worker
+  n_xbee_sched sched;
+  // buffers for them, only allocated for the tap's owner
+  n_xbee_pool pool;
+  // radio frames that carried more than one tap frame, and how many
+  uint32_t agg_frames;
+  uint32_t agg_packets;
+  // TCP SYNs whose MSS we lowered, packets over the MTU we turned back
+  uint32_t mss_clamped;
+  uint32_t mtu_too_big;
+  // everything else worth counting, see n_xbee_stats.h
+  n_xbee_stats stats;
+  // --capture, recorded by the bridge's worker
+  n_xbee_cap_ring cap;
+  n_xbee_frag_state frag;
+  n_xbee_node_table nodes;
+  // MAC the tap answers to, shared by every member of a bond
+  unsigned char mac[ETH_ALEN];
+  // NULL unless bonded, members other than the first share its tap
+  struct n_xbee_bond* bond;
+  // link health, from transmit status frames
+  int link_up;
+  int tx_fail_streak;
+  uint32_t link_down_since;
+  // frames in flight, under n_xbee_lib_lock
+  n_xbee_tx_state tx;
+  // rate we raised the serial link from, 0 if we didn't
+  uint32_t baud_base;
+  // when the fallback may try again, and where its scan of other rates is
+  uint32_t baud_retry;
+  uint32_t baud_scan;
+  // rebuilt frames on their way to the tap, read thread only
+  unsigned char rx_frame[N_XBEE_FRAME_MAX];
+  // decompressed datagrams, read thread only
+  unsigned char rx_lz[N_XBEE_FRAG_MAX_DGRAM];
 } xbee_serial_bridge;
-struct xbee_serial_bridge* n_xbee_serial_bridge;
+
+// Every bridge we drive, in the order they were opened.
+extern struct xbee_serial_bridge* n_xbee_bridges[N_XBEE_MAX_BRIDGES];
+extern int n_xbee_bridge_count;
+// Serializes calls into the xbee library, which is not thread safe.
+extern pthread_mutex_t n_xbee_lib_lock;
+
+// Sets up what every bridge shares, once before anything else.
+int n_xbee_init(void);
+// Allocates a bridge for serial and opens the port, without talking to
+// the radio yet. The bench harness builds its bridges with this.
+int n_xbee_bridge_new(xbee_serial_t* serial, struct xbee_serial_bridge** out);
+
+xbee_serial_bridge* n_xbee_find_bridge_byxbee(xbee_dev_t* xbee);
+xbee_serial_bridge* n_xbee_find_bridge_bywpan(const wpan_dev_t* dev);
+int n_xbee_envelope_send(const wpan_envelope_t* envelope);
+// Sends prefix followed by the envelope's payload without joining them.
+int n_xbee_envelope_send_prefixed(const wpan_envelope_t* envelope, const void* prefix, int prefixlen);
+int n_xbee_init_netdev(struct xbee_serial_bridge* bridge);
+// Has a bond member share owner's tap.
+int n_xbee_init_netdev_queue(struct xbee_serial_bridge* bridge, struct xbee_serial_bridge* owner);
+// Fills in the parts of the envelope that are the same for every frame.
+void n_xbee_init_envelope(struct xbee_serial_bridge* bridge, wpan_envelope_t* envelope);
+// Tells the node at addr (8 bytes) which encapsulations we understand.
+int n_xbee_send_caps(struct xbee_serial_bridge* bridge, const unsigned char* addr, unsigned char flags);
+// Queues a frame read from the tap for the radio.
+void n_xbee_xmit_ether_packet(struct xbee_serial_bridge* bridge, const void* buffer, int len);
+// Endpoint handler for everything the radio receives.
+int n_xbee_netdev_rx(const wpan_envelope_t* envelope, void* context);
+// Sends a tap frame to node (NULL to broadcast), optionally behind prefix.
+int n_xbee_xmit_frame(struct xbee_serial_bridge* bridge, struct xbee_remote_node* node, const unsigned char* buffer, int len, const unsigned char* prefix, int prefixlen);
+// Handles the contents of an N_XBEE_CLUSTER_ID_ENCAP frame. layers says
+// what buf was already unwrapped from, N_XBEE_RX_*, each only comes once.
+int n_xbee_netdev_rx_encap(struct xbee_serial_bridge* bridge, struct xbee_remote_node* remnode, const wpan_envelope_t* envelope, const unsigned char* buf, int len, int layers);
+
+// layers n_xbee_netdev_rx_encap has unwrapped, fragments can only be the
+// outermost one
+#define N_XBEE_RX_FRAG 0x01
+#define N_XBEE_RX_BOND 0x02
+#define N_XBEE_RX_LZ 0x04
+
+// One event loop thread.
+typedef struct n_xbee_worker {
+  int id;
+  int epfd;
+  pthread_t thread;
+} n_xbee_worker;
+
+typedef struct n_xbee_options {
+  xbee_serial_t serial[N_XBEE_MAX_BRIDGES];
+  int nserial;
+  int workers;
+  // 0, or N_XBEE_BOND_* to bond every radio into one tap
+  int bond_mode;
+  // frames in flight per radio
+  int tx_window;
+  // ms to hold small frames for aggregation, -1 until set
+  int agg_hold;
+  // compression dictionary to load instead of the built in one
+  const char* lz_dict;
+  // ms a learned ARP binding is answered from, 0 to never proxy, -1
+  // until set
+  int arp_max_age;
+  // link-local from the 64 bit address, neighbour discovery without
+  // broadcasts
+  int ipv6;
+  // highest rate to raise the serial link to, 0 to leave it alone
+  uint32_t baud_max;
+  // carry IP packets over a TUN device instead of ethernet over a tap
+  int tun;
+  // MTU of the device, 0 until set
+  int mtu;
+  // --route, static routes for tun mode
+  n_xbee_route routes[N_XBEE_ROUTE_STATIC_MAX];
+  int nroutes;
+  // --stats, the socket to serve stats on, NULL for none
+  const char* stats_path;
+  // --capture, where kill -USR2 writes captures, NULL for none
+  const char* capture;
+  // --replay, a capture to feed in before starting
+  const char* replay;
+} n_xbee_options;
+extern n_xbee_options n_xbee_opts;
+// Fills opts from the command line, defaults included.
+int parse_serial_arguments(int argc, const char *argv[], n_xbee_options *opts);
+// The endpoint the bridges receive on, for xbee_wpan_init.
+extern const wpan_endpoint_table_entry_t xbee_endpoints[];
 
 // kernel module functions not in header file
 #endif
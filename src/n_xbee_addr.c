@@ -0,0 +1,283 @@
+#include "n_xbee.h"
+#include "n_xbee_addr.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <arpa/inet.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+
+static void n_xbee_addr_add4(n_xbee_addr_cache* cache, const struct in_addr* addr, int plen) {
+  int i;
+  for (i = 0; i < cache->count4; i++) {
+    if (cache->v4[i].s_addr == addr->s_addr) {
+      cache->plen4[i] = plen;
+      return;
+    }
+  }
+  if (cache->count4 >= N_XBEE_ADDR_MAX) {
+    printk(KERN_ALERT "%s: more than %d addresses, ignoring the rest.\n", __FUNCTION__, N_XBEE_ADDR_MAX);
+    return;
+  }
+  cache->plen4[cache->count4] = plen;
+  cache->v4[cache->count4++] = *addr;
+}
+
+static void n_xbee_addr_del4(n_xbee_addr_cache* cache, const struct in_addr* addr) {
+  int i;
+  for (i = 0; i < cache->count4; i++) {
+    if (cache->v4[i].s_addr == addr->s_addr) {
+      cache->v4[i] = cache->v4[--cache->count4];
+      cache->plen4[i] = cache->plen4[cache->count4];
+      return;
+    }
+  }
+}
+
+// Applies one RTM_NEWADDR / RTM_DELADDR.
+static void n_xbee_addr_msg(n_xbee_addr_cache* cache, const struct nlmsghdr* nh) {
+  const struct ifaddrmsg* ifa = NLMSG_DATA(nh);
+  const struct rtattr* rta;
+  const struct in_addr* local = NULL;
+  const struct in_addr* address = NULL;
+  int len = IFA_PAYLOAD(nh);
+
+  if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)) || (int)ifa->ifa_index != cache->ifindex || ifa->ifa_family != AF_INET)
+    return;
+  for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    if (RTA_PAYLOAD(rta) < sizeof(struct in_addr))
+      continue;
+    if (rta->rta_type == IFA_LOCAL)
+      local = RTA_DATA(rta);
+    else if (rta->rta_type == IFA_ADDRESS)
+      address = RTA_DATA(rta);
+  }
+  // IFA_ADDRESS is the far end on point to point links
+  if (!local)
+    local = address;
+  if (!local)
+    return;
+  if (nh->nlmsg_type == RTM_NEWADDR)
+    n_xbee_addr_add4(cache, local, ifa->ifa_prefixlen);
+  else
+    n_xbee_addr_del4(cache, local);
+#ifdef N_XBEE_VERBOSE
+  printk(KERN_INFO "%s: %s %s, %d address(es).\n", __FUNCTION__, nh->nlmsg_type == RTM_NEWADDR ? "added" : "removed", inet_ntoa(*local), cache->count4);
+#endif
+}
+
+// Asks for every IPv4 address, the answer is read by n_xbee_addr_read.
+static int n_xbee_addr_dump(n_xbee_addr_cache* cache) {
+  struct {
+    struct nlmsghdr nh;
+    struct ifaddrmsg ifa;
+  } req;
+
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+  req.nh.nlmsg_type = RTM_GETADDR;
+  req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.nh.nlmsg_seq = ++cache->seq;
+  req.ifa.ifa_family = AF_INET;
+  if (send(cache->fd, &req, req.nh.nlmsg_len, 0) < 0) {
+    printk(KERN_ALERT "%s: unable to request addresses, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+// Reads what is waiting, returns 1 once a dump is done, 0 if there is
+// nothing left or <0.
+static int n_xbee_addr_read(n_xbee_addr_cache* cache) {
+  char buf[8192] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+  struct nlmsghdr* nh;
+  int len;
+
+  while ((len = recv(cache->fd, buf, sizeof(buf), 0)) > 0) {
+    for (nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+      // the first answer to a resync replaces everything we had
+      if (cache->resync && nh->nlmsg_seq == cache->seq) {
+        cache->count4 = 0;
+        cache->resync = 0;
+      }
+      switch (nh->nlmsg_type) {
+        case NLMSG_DONE:
+          return 1;
+        case NLMSG_ERROR:
+          // an ack
+          if (!((struct nlmsgerr*)NLMSG_DATA(nh))->error)
+            break;
+          printk(KERN_ALERT "%s: rtnetlink error %d.\n", __FUNCTION__, ((struct nlmsgerr*)NLMSG_DATA(nh))->error);
+          return -EIO;
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+          n_xbee_addr_msg(cache, nh);
+          break;
+      }
+    }
+  }
+  if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    printk(KERN_ALERT "%s: recv failed, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+    return -errno;
+  }
+  return 0;
+}
+
+int n_xbee_addr_open(n_xbee_addr_cache* cache, int ifindex) {
+  struct sockaddr_nl sa;
+  int res;
+
+  memset(cache, 0, sizeof(n_xbee_addr_cache));
+  cache->ifindex = ifindex;
+  if ((cache->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+    printk(KERN_ALERT "%s: unable to open rtnetlink, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+    return -errno;
+  }
+
+  // join before the dump so nothing falls in between
+  memset(&sa, 0, sizeof(sa));
+  sa.nl_family = AF_NETLINK;
+  sa.nl_groups = RTMGRP_IPV4_IFADDR;
+  if (bind(cache->fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    printk(KERN_ALERT "%s: unable to bind rtnetlink, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+    res = -errno;
+    n_xbee_addr_close(cache);
+    return res;
+  }
+
+  if ((res = n_xbee_addr_dump(cache)) < 0) {
+    n_xbee_addr_close(cache);
+    return res;
+  }
+  // the dump is read here, blocking, changes later from the event loop
+  while ((res = n_xbee_addr_read(cache)) == 0)
+    ;
+  if (res < 0) {
+    n_xbee_addr_close(cache);
+    return res;
+  }
+  fcntl(cache->fd, F_SETFL, fcntl(cache->fd, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+void n_xbee_addr_close(n_xbee_addr_cache* cache) {
+  if (cache->fd >= 0)
+    close(cache->fd);
+  cache->fd = -1;
+  cache->count4 = 0;
+}
+
+/* = Configuration = */
+// Appends an attribute to nh, returns it or NULL if it doesn't fit.
+static struct rtattr* n_xbee_addr_attr(struct nlmsghdr* nh, int maxlen, int type, const void* data, int len) {
+  struct rtattr* rta = (struct rtattr*)((char*)nh + NLMSG_ALIGN(nh->nlmsg_len));
+  if (NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(RTA_LENGTH(len)) > maxlen)
+    return NULL;
+  rta->rta_type = type;
+  rta->rta_len = RTA_LENGTH(len);
+  if (len)
+    memcpy(RTA_DATA(rta), data, len);
+  nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+  return rta;
+}
+
+// Closes an attribute opened with no data around what was added since.
+static void n_xbee_addr_nest_end(struct nlmsghdr* nh, struct rtattr* nest) {
+  nest->rta_len = (char*)nh + nh->nlmsg_len - (char*)nest;
+}
+
+// Sends one request on a socket of its own and waits for the ack.
+static int n_xbee_addr_request(struct nlmsghdr* nh) {
+  char buf[1024] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+  struct nlmsghdr* rh;
+  int fd, len, res = -EIO;
+
+  if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+    return -errno;
+  nh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+  nh->nlmsg_seq = 1;
+  if (send(fd, nh, nh->nlmsg_len, 0) < 0) {
+    res = -errno;
+    close(fd);
+    return res;
+  }
+  while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    for (rh = (struct nlmsghdr*)buf; NLMSG_OK(rh, len); rh = NLMSG_NEXT(rh, len)) {
+      if (rh->nlmsg_type == NLMSG_ERROR) {
+        res = ((struct nlmsgerr*)NLMSG_DATA(rh))->error;
+        close(fd);
+        return res;
+      }
+    }
+  }
+  close(fd);
+  return res;
+}
+
+int n_xbee_addr_set_ll6(int ifindex, const unsigned char* iid) {
+  struct {
+    struct nlmsghdr nh;
+    union {
+      struct ifinfomsg ifi;
+      struct ifaddrmsg ifa;
+    };
+    char attrs[64];
+  } req;
+  struct rtattr* spec;
+  struct rtattr* inet6;
+  unsigned char mode = IN6_ADDR_GEN_MODE_NONE;
+  unsigned char ll[16] = { 0xfe, 0x80 };
+  int res;
+
+  // keep the kernel from adding its own link-local
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+  req.nh.nlmsg_type = RTM_SETLINK;
+  req.ifi.ifi_family = AF_UNSPEC;
+  req.ifi.ifi_index = ifindex;
+  spec = n_xbee_addr_attr(&req.nh, sizeof(req), IFLA_AF_SPEC, NULL, 0);
+  inet6 = n_xbee_addr_attr(&req.nh, sizeof(req), AF_INET6, NULL, 0);
+  n_xbee_addr_attr(&req.nh, sizeof(req), IFLA_INET6_ADDR_GEN_MODE, &mode, 1);
+  n_xbee_addr_nest_end(&req.nh, inet6);
+  n_xbee_addr_nest_end(&req.nh, spec);
+  if ((res = n_xbee_addr_request(&req.nh)) < 0)
+    printk(KERN_ALERT "%s: unable to turn off address generation, %d (%s)\n", __FUNCTION__, -res, strerror(-res));
+
+  // radio addresses are unique, no point in DAD
+  memcpy(ll + 8, iid, 8);
+  memset(&req, 0, sizeof(req));
+  req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+  req.nh.nlmsg_type = RTM_NEWADDR;
+  req.nh.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+  req.ifa.ifa_family = AF_INET6;
+  req.ifa.ifa_prefixlen = 64;
+  req.ifa.ifa_flags = IFA_F_NODAD | IFA_F_PERMANENT;
+  req.ifa.ifa_scope = RT_SCOPE_LINK;
+  req.ifa.ifa_index = ifindex;
+  n_xbee_addr_attr(&req.nh, sizeof(req), IFA_LOCAL, ll, sizeof(ll));
+  n_xbee_addr_attr(&req.nh, sizeof(req), IFA_ADDRESS, ll, sizeof(ll));
+  if ((res = n_xbee_addr_request(&req.nh)) < 0) {
+    printk(KERN_ALERT "%s: unable to add link-local address, %d (%s)\n", __FUNCTION__, -res, strerror(-res));
+    return res;
+  }
+  return 0;
+}
+
+int n_xbee_addr_handle(n_xbee_addr_cache* cache) {
+  int res;
+  while ((res = n_xbee_addr_read(cache)) > 0)
+    ;
+  // notifications were dropped, something else on the host is busy
+  // changing addresses, and ours may be among them
+  if (res == -ENOBUFS) {
+    printk(KERN_INFO "%s: missed address changes, reloading.\n", __FUNCTION__);
+    if (n_xbee_addr_dump(cache) == 0)
+      cache->resync = 1;
+  }
+  // nothing here is worth taking the bridge down for
+  return 0;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#ifndef _N_XBEE_ADDR_H
+#define _N_XBEE_ADDR_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+/*
+ * The tap's addresses, kept up to date from rtnetlink.
+ *
+ * The cache is filled with a dump when the tap comes up and then follows
+ * RTM_NEWADDR / RTM_DELADDR for the tap's index, so the responders can
+ * check a target address without asking the kernel each time. It is only
+ * touched by the worker that drives the tap. If notifications are lost
+ * to a full socket buffer, the cache is dumped again and replaced.
+ */
+// addresses per family, secondaries included
+#define N_XBEE_ADDR_MAX 16
+
+typedef struct n_xbee_addr_cache {
+  int ifindex;
+  // rtnetlink socket, -1 if closed
+  int fd;
+  uint32_t seq;
+  // a dump to replace the cache with is on its way
+  int resync;
+  int count4;
+  struct in_addr v4[N_XBEE_ADDR_MAX];
+  // prefix length of each
+  uint8_t plen4[N_XBEE_ADDR_MAX];
+} n_xbee_addr_cache;
+
+// Subscribes to address changes for ifindex and loads what is there now.
+int n_xbee_addr_open(n_xbee_addr_cache* cache, int ifindex);
+void n_xbee_addr_close(n_xbee_addr_cache* cache);
+// Applies every pending notification, call when fd is readable. Never
+// fails, the cache is resynced instead.
+int n_xbee_addr_handle(n_xbee_addr_cache* cache);
+
+// Gives the interface fe80::iid/64 as its only link-local address,
+// instead of one the kernel derives from the MAC.
+int n_xbee_addr_set_ll6(int ifindex, const unsigned char* iid);
+
+// Whether addr (network order, 4 bytes) is one of ours.
+static inline int n_xbee_addr_has4(const n_xbee_addr_cache* cache, const void* addr) {
+  int i;
+  uint32_t a;
+  memcpy(&a, addr, sizeof(a));
+  for (i = 0; i < cache->count4; i++) {
+    if (cache->v4[i].s_addr == a)
+      return 1;
+  }
+  return 0;
+}
+
+// Whether addr (network order, 4 bytes) is the broadcast address of one
+// of our subnets.
+static inline int n_xbee_addr_is_bcast4(const n_xbee_addr_cache* cache, const void* addr) {
+  int i;
+  uint32_t a, mask;
+  memcpy(&a, addr, sizeof(a));
+  for (i = 0; i < cache->count4; i++) {
+    // /31 and /32 have none
+    if (cache->plen4[i] > 30)
+      continue;
+    mask = htonl(~0u << (32 - cache->plen4[i]));
+    if ((a & mask) == (cache->v4[i].s_addr & mask) && (a | mask) == ~0u)
+      return 1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,133 @@
+#include "n_xbee.h"
+#include "n_xbee_arp.h"
+#include "n_xbee_bond.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/if_ether.h>
+
+#define N_XBEE_ARP_MASK (N_XBEE_ARP_SIZE - 1)
+
+void n_xbee_arp_init(n_xbee_arp_table* table) {
+  memset(table, 0, sizeof(n_xbee_arp_table));
+}
+
+static inline uint32_t n_xbee_arp_hash(uint32_t ip) {
+  return (ip * 2654435761u) >> 16;
+}
+
+// The tap owner keeps the table, a bond shares one.
+static inline n_xbee_arp_table* n_xbee_arp_table_of(struct xbee_serial_bridge* bridge) {
+  return &(bridge->bond ? bridge->bond->members[0] : bridge)->arp;
+}
+
+static n_xbee_arp_entry* n_xbee_arp_find(n_xbee_arp_table* table, uint32_t ip) {
+  uint32_t i, h = n_xbee_arp_hash(ip);
+  n_xbee_arp_entry* ent;
+  for (i = 0; i < N_XBEE_ARP_PROBE; i++) {
+    ent = &table->entries[(h + i) & N_XBEE_ARP_MASK];
+    if (ent->ip == ip)
+      return ent;
+  }
+  return NULL;
+}
+
+static void n_xbee_arp_insert(n_xbee_arp_table* table, uint32_t ip, const unsigned char* mac, uint32_t now) {
+  uint32_t i, h = n_xbee_arp_hash(ip);
+  n_xbee_arp_entry* ent;
+  n_xbee_arp_entry* victim = NULL;
+
+  for (i = 0; i < N_XBEE_ARP_PROBE; i++) {
+    ent = &table->entries[(h + i) & N_XBEE_ARP_MASK];
+    if (ent->ip == ip || !ent->ip) {
+      victim = ent;
+      break;
+    }
+    // nothing free, take the stalest
+    if (!victim || now - ent->learned > now - victim->learned)
+      victim = ent;
+  }
+  victim->ip = ip;
+  victim->learned = now;
+  memcpy(victim->mac, mac, ETH_ALEN);
+}
+
+void n_xbee_arp_learn(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len, uint32_t now) {
+  const struct ether_header* eh = (const struct ether_header*)frame;
+  const struct ether_arp* ea;
+  const struct iphdr* iph;
+  uint32_t ip;
+
+  if (!n_xbee_opts.arp_max_age || len < N_XBEE_ETHHDR_LEN || (eh->ether_shost[0] & 0x01))
+    return;
+  switch (ntohs(eh->ether_type)) {
+    case ETHERTYPE_ARP:
+      if (len < N_XBEE_ARP_FRAME_LEN)
+        return;
+      ea = (const struct ether_arp*)(frame + N_XBEE_ETHHDR_LEN);
+      if (ntohs(ea->arp_hrd) != ARPHRD_ETHER || ntohs(ea->arp_pro) != ETHERTYPE_IP || ea->arp_hln != ETH_ALEN || ea->arp_pln != 4)
+        return;
+      // requests tell us about the sender as much as replies do
+      memcpy(&ip, ea->arp_spa, 4);
+      if (ip)
+        n_xbee_arp_insert(n_xbee_arp_table_of(bridge), ip, ea->arp_sha, now);
+      return;
+    case ETHERTYPE_IP:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct iphdr))
+        return;
+      iph = (const struct iphdr*)(frame + N_XBEE_ETHHDR_LEN);
+      if (iph->saddr)
+        n_xbee_arp_insert(n_xbee_arp_table_of(bridge), iph->saddr, eh->ether_shost, now);
+      return;
+  }
+}
+
+int n_xbee_arp_proxy(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len, uint32_t now) {
+  const struct ether_header* eh = (const struct ether_header*)frame;
+  const struct ether_arp* ea;
+  struct ether_header* txeh;
+  struct ether_arp* txea;
+  unsigned char txbuf[N_XBEE_ARP_FRAME_LEN];
+  n_xbee_arp_table* table = n_xbee_arp_table_of(bridge);
+  n_xbee_arp_entry* ent;
+  uint32_t spa, tpa;
+
+  if (!n_xbee_opts.arp_max_age || len < N_XBEE_ARP_FRAME_LEN || ntohs(eh->ether_type) != ETHERTYPE_ARP)
+    return 0;
+  ea = (const struct ether_arp*)(frame + N_XBEE_ETHHDR_LEN);
+  if (ntohs(ea->arp_op) != ARPOP_REQUEST || ntohs(ea->arp_hrd) != ARPHRD_ETHER || ntohs(ea->arp_pro) != ETHERTYPE_IP || ea->arp_hln != ETH_ALEN || ea->arp_pln != 4)
+    return 0;
+  memcpy(&spa, ea->arp_spa, 4);
+  memcpy(&tpa, ea->arp_tpa, 4);
+  // address probes and announcements are for everyone to see
+  if (!spa || spa == tpa)
+    return 0;
+
+  ent = n_xbee_arp_find(table, tpa);
+  if (!ent || now - ent->learned > (uint32_t)n_xbee_opts.arp_max_age || !n_xbee_node_find_eth(&bridge->nodes, ent->mac, ETH_ALEN)) {
+    table->misses++;
+    return 0;
+  }
+  table->hits++;
+
+  txeh = (struct ether_header*)txbuf;
+  memcpy(txeh->ether_dhost, ea->arp_sha, ETH_ALEN);
+  memcpy(txeh->ether_shost, ent->mac, ETH_ALEN);
+  txeh->ether_type = htons(ETHERTYPE_ARP);
+  txea = (struct ether_arp*)(txbuf + N_XBEE_ETHHDR_LEN);
+  memcpy(&txea->ea_hdr, &ea->ea_hdr, sizeof(struct arphdr));
+  txea->arp_op = htons(ARPOP_REPLY);
+  memcpy(txea->arp_sha, ent->mac, ETH_ALEN);
+  memcpy(txea->arp_spa, ea->arp_tpa, 4);
+  memcpy(txea->arp_tha, ea->arp_sha, ETH_ALEN);
+  memcpy(txea->arp_tpa, ea->arp_spa, 4);
+  if (write(bridge->netdev, txbuf, sizeof(txbuf)) < 0)
+    printk(KERN_ALERT "%s: unable to write arp reply to tap, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+#ifdef N_XBEE_VERBOSE
+  printk(KERN_INFO "%s: answered arp for %u.%u.%u.%u locally.\n", __FUNCTION__, ea->arp_tpa[0], ea->arp_tpa[1], ea->arp_tpa[2], ea->arp_tpa[3]);
+#endif
+  return 1;
+}
@@ -0,0 +1,51 @@
+#pragma once
+#ifndef _N_XBEE_ARP_H
+#define _N_XBEE_ARP_H
+
+#include <stdint.h>
+
+#include <net/ethernet.h>
+
+/*
+ * Proxy ARP.
+ *
+ * IPv4 to MAC bindings are learned from the ARP and IPv4 frames we get
+ * over the air, and ARP requests from the tap for a known address are
+ * answered straight back into the tap instead of being broadcast. An
+ * entry is only used while it is younger than the max age and its node
+ * is still in the node table, otherwise the request goes out as usual
+ * and the answer refreshes the entry.
+ */
+// entries, power of 2
+#define N_XBEE_ARP_SIZE 256
+// slots looked at per lookup
+#define N_XBEE_ARP_PROBE 8
+// ms, unless --arp-max-age says otherwise
+#define N_XBEE_ARP_MAX_AGE (5 * 60 * 1000)
+
+struct xbee_serial_bridge;
+
+typedef struct n_xbee_arp_entry {
+  // network order, 0 if free
+  uint32_t ip;
+  // xbee_millisecond_timer() when last heard from
+  uint32_t learned;
+  unsigned char mac[ETH_ALEN];
+} n_xbee_arp_entry;
+
+typedef struct n_xbee_arp_table {
+  // requests answered locally, and let through
+  uint32_t hits;
+  uint32_t misses;
+  n_xbee_arp_entry entries[N_XBEE_ARP_SIZE];
+} n_xbee_arp_table;
+
+void n_xbee_arp_init(n_xbee_arp_table* table);
+
+// Learns from a frame that came in over the air.
+void n_xbee_arp_learn(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len, uint32_t now);
+// Answers an ARP request read from the tap if it can, returns 1 if it did
+// and the frame should not be sent.
+int n_xbee_arp_proxy(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len, uint32_t now);
+
+#endif
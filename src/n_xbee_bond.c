@@ -0,0 +1,322 @@
+#include "n_xbee.h"
+#include "n_xbee_proto.h"
+#include "n_xbee_bond.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <sys/timerfd.h>
+
+n_xbee_bond* n_xbee_bond_create(struct xbee_serial_bridge** members, int nmembers, int mode) {
+  int i;
+  n_xbee_bond* bond;
+
+  if (nmembers < 1 || nmembers > N_XBEE_MAX_BRIDGES)
+    return NULL;
+  bond = calloc(1, sizeof(n_xbee_bond));
+  if (!bond)
+    return NULL;
+  bond->mode = mode;
+  bond->nmembers = nmembers;
+  if ((bond->reorder_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    printk(KERN_ALERT "%s: unable to create reorder timer, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+    free(bond);
+    return NULL;
+  }
+  for (i = 0; i < nmembers; i++) {
+    bond->members[i] = members[i];
+    members[i]->bond = bond;
+    // the tap and every member answer to the first radio's MAC
+    memcpy(members[i]->mac, members[0]->mac, ETH_ALEN);
+  }
+  strcpy(members[0]->netdevName, XBEE_BOND_NETDEV_NAME);
+  printk(KERN_INFO "%s: bonding %d radio(s) as %s, %s mode.\n", __FUNCTION__, nmembers, XBEE_BOND_NETDEV_NAME, mode == N_XBEE_BOND_PACKET ? "packet" : "flow");
+  return bond;
+}
+
+// The members are left alone, they may well be freed already.
+void n_xbee_bond_free(n_xbee_bond* bond) {
+  if (!bond)
+    return;
+  close(bond->reorder_fd);
+  free(bond);
+}
+
+/* = Peers = */
+static n_xbee_bond_peer* n_xbee_bond_peer_get(n_xbee_bond* bond, const unsigned char* mac) {
+  int i;
+  uint32_t now = xbee_millisecond_timer();
+  n_xbee_bond_peer* peer;
+  n_xbee_bond_peer* oldest = NULL;
+
+  for (i = 0; i < N_XBEE_BOND_PEERS; i++) {
+    peer = &bond->peers[i];
+    if (peer->in_use && memcmp(peer->mac, mac, ETH_ALEN) == 0) {
+      peer->last_used = now;
+      return peer;
+    }
+    if (!oldest || !peer->in_use || (oldest->in_use && now - peer->last_used > now - oldest->last_used))
+      oldest = peer;
+  }
+
+  peer = oldest;
+  memset(peer, 0, sizeof(n_xbee_bond_peer));
+  memcpy(peer->mac, mac, ETH_ALEN);
+  peer->in_use = 1;
+  peer->last_used = now;
+  return peer;
+}
+
+/* = Transmit = */
+// Hashes the parts of a frame that identify its flow.
+static uint32_t n_xbee_bond_flow_hash(const unsigned char* buffer, int len) {
+  const struct ether_header* eh = (const struct ether_header*)buffer;
+  const struct iphdr* iph;
+  const struct ip6_hdr* ip6h;
+  const unsigned char* l4 = NULL;
+  uint32_t h = 2166136261u;
+  int i, n = 0;
+  const unsigned char* key[3];
+  int keylen[3];
+
+  if (ntohs(eh->ether_type) == ETHERTYPE_IP && len >= N_XBEE_ETHHDR_LEN + sizeof(struct iphdr)) {
+    iph = (const struct iphdr*)(buffer + N_XBEE_ETHHDR_LEN);
+    key[n] = (const unsigned char*)&iph->saddr;
+    keylen[n++] = 8;
+    key[n] = &iph->protocol;
+    keylen[n++] = 1;
+    if ((iph->protocol == IPPROTO_TCP || iph->protocol == IPPROTO_UDP) && !(ntohs(iph->frag_off) & (IP_MF | IP_OFFMASK)))
+      l4 = buffer + N_XBEE_ETHHDR_LEN + iph->ihl * 4;
+  } else if (ntohs(eh->ether_type) == ETHERTYPE_IPV6 && len >= N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr)) {
+    ip6h = (const struct ip6_hdr*)(buffer + N_XBEE_ETHHDR_LEN);
+    key[n] = (const unsigned char*)&ip6h->ip6_src;
+    keylen[n++] = 32;
+    key[n] = &ip6h->ip6_nxt;
+    keylen[n++] = 1;
+    if (ip6h->ip6_nxt == IPPROTO_TCP || ip6h->ip6_nxt == IPPROTO_UDP)
+      l4 = buffer + N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr);
+  } else {
+    key[n] = buffer;
+    keylen[n++] = N_XBEE_ETHHDR_LEN;
+  }
+  // both ports
+  if (l4 && l4 + 4 <= buffer + len) {
+    key[n] = l4;
+    keylen[n++] = 4;
+  }
+
+  while (n-- > 0) {
+    for (i = 0; i < keylen[n]; i++) {
+      h ^= key[n][i];
+      h *= 16777619u;
+    }
+  }
+  return h;
+}
+
+void n_xbee_bond_xmit(n_xbee_bond* bond, const unsigned char* buffer, int len) {
+  const struct ether_header* eh = (const struct ether_header*)buffer;
+  int i, ncand = 0, nup = 0, bcast, pick;
+  unsigned char prefix[N_XBEE_BOND_HDR_LEN];
+  int prefixlen = 0;
+  struct xbee_serial_bridge* cand[N_XBEE_MAX_BRIDGES];
+  struct xbee_remote_node* candnode[N_XBEE_MAX_BRIDGES];
+  struct xbee_remote_node* node = NULL;
+  n_xbee_bond_peer* peer;
+
+  if (len < N_XBEE_ETHHDR_LEN)
+    return;
+  bcast = eh->ether_dhost[0] & 1;
+
+  // members that can reach the destination, the ones that are up first
+  for (i = 0; i < bond->nmembers; i++) {
+    if (!bcast && !(node = n_xbee_node_find_eth(&bond->members[i]->nodes, eh->ether_dhost, ETH_ALEN)))
+      continue;
+    if (bond->members[i]->link_up) {
+      memmove(cand + 1 + nup, cand + nup, (ncand - nup) * sizeof(cand[0]));
+      memmove(candnode + 1 + nup, candnode + nup, (ncand - nup) * sizeof(candnode[0]));
+      cand[nup] = bond->members[i];
+      candnode[nup] = node;
+      nup++;
+    } else {
+      cand[ncand] = bond->members[i];
+      candnode[ncand] = node;
+    }
+    ncand++;
+  }
+  if (!ncand) {
+    bond->members[0]->stats.drops[N_XBEE_DROP_NO_NODE]++;
+    n_xbee_disc_miss(bond->members[0], eh->ether_dhost);
+#ifdef N_XBEE_VERBOSE
+    printk(KERN_INFO "%s: unable to transmit, no member can reach the destination.\n", __FUNCTION__);
+#endif
+    return;
+  }
+  // if everything is down, keep trying rather than drop
+  if (!nup)
+    nup = ncand;
+
+  if (bcast) {
+    // every peer radio would pass a copy up, so send it once
+    n_xbee_xmit_frame(cand[0], NULL, buffer, len, NULL, 0);
+    return;
+  }
+
+  if (bond->mode == N_XBEE_BOND_PACKET)
+    pick = bond->rr++ % nup;
+  else
+    pick = n_xbee_bond_flow_hash(buffer, len) % nup;
+
+  if (bond->mode == N_XBEE_BOND_PACKET && (candnode[pick]->caps & N_XBEE_CAP_BOND)) {
+    peer = n_xbee_bond_peer_get(bond, eh->ether_dhost);
+    prefix[0] = N_XBEE_DISPATCH_BOND;
+    prefix[1] = peer->tx_seq >> 8;
+    prefix[2] = peer->tx_seq & 0xFF;
+    peer->tx_seq++;
+    prefixlen = N_XBEE_BOND_HDR_LEN;
+  }
+  n_xbee_xmit_frame(cand[pick], candnode[pick], buffer, len, prefixlen ? prefix : NULL, prefixlen);
+}
+
+/* = Receive = */
+static void n_xbee_bond_deliver(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope, const unsigned char* buf, int len, int layers) {
+  struct xbee_remote_node* remnode = n_xbee_node_find(&bridge->nodes, &envelope->ieee_address);
+  // layers has N_XBEE_RX_BOND, so another bond header inside is dropped
+  // rather than coming back in here
+  n_xbee_netdev_rx_encap(bridge, remnode, envelope, buf, len, layers);
+}
+
+// Delivers held frames for as long as there is no gap. The peer is
+// brought up to date before each delivery, so it is consistent whatever
+// the delivery does.
+static void n_xbee_bond_flush_ready(n_xbee_bond_peer* peer, uint32_t now) {
+  n_xbee_bond_slot* slot;
+  int len;
+  while (peer->held) {
+    slot = &peer->slots[peer->rx_next % N_XBEE_BOND_WINDOW];
+    if (!slot->len)
+      break;
+    len = slot->len;
+    slot->len = 0;
+    peer->held--;
+    peer->rx_next++;
+    n_xbee_bond_deliver(slot->bridge, &slot->envelope, slot->data, len, slot->layers);
+  }
+  if (peer->held)
+    peer->held_since = now;
+}
+
+// Gives up on the current gap, moves on to the next held frame.
+static void n_xbee_bond_skip_gap(n_xbee_bond* bond, n_xbee_bond_peer* peer, uint32_t now) {
+  int i;
+  for (i = 1; i < N_XBEE_BOND_WINDOW; i++) {
+    if (peer->slots[(uint16_t)(peer->rx_next + i) % N_XBEE_BOND_WINDOW].len) {
+      peer->rx_next += i;
+      bond->rx_gaps++;
+      break;
+    }
+  }
+  // held says there is something but no slot has it, callers loop on
+  // held so don't leave it like that
+  if (i == N_XBEE_BOND_WINDOW) {
+    peer->held = 0;
+    return;
+  }
+  n_xbee_bond_flush_ready(peer, now);
+}
+
+// Sets reorder_fd for the earliest deadline of any held frame, unless it
+// is already set to go off before that.
+static void n_xbee_bond_reorder_arm(n_xbee_bond* bond, uint32_t now) {
+  int i, first = 1;
+  uint32_t due = 0, delay;
+  struct itimerspec its;
+
+  for (i = 0; i < N_XBEE_BOND_PEERS; i++) {
+    if (!bond->peers[i].in_use || !bond->peers[i].held)
+      continue;
+    if (first || (int32_t)(bond->peers[i].held_since - due) < 0)
+      due = bond->peers[i].held_since;
+    first = 0;
+  }
+  if (first)
+    return;
+  // n_xbee_bond_expire wants it strictly past the timeout
+  due += N_XBEE_BOND_REORDER_TIMEOUT + 1;
+  if (bond->reorder_due && (int32_t)(bond->reorder_due - due) <= 0)
+    return;
+  delay = (int32_t)(due - now) > 0 ? due - now : 1;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = delay / 1000;
+  its.it_value.tv_nsec = (delay % 1000) * 1000000L;
+  if (timerfd_settime(bond->reorder_fd, 0, &its, NULL) == 0)
+    bond->reorder_due = due;
+}
+
+int n_xbee_bond_rx(n_xbee_bond* bond, struct xbee_serial_bridge* bridge, const unsigned char* peer_mac, const wpan_envelope_t* envelope, uint16_t seq, const unsigned char* buf, int len, int layers) {
+  int16_t d;
+  uint32_t now = xbee_millisecond_timer();
+  n_xbee_bond_peer* peer = n_xbee_bond_peer_get(bond, peer_mac);
+  n_xbee_bond_slot* slot;
+
+  if (!peer->rx_init) {
+    peer->rx_init = 1;
+    peer->rx_next = seq;
+  }
+
+  d = (int16_t)(seq - peer->rx_next);
+  if (d < 0) {
+    // we already gave up waiting for this one, late beats never
+    n_xbee_bond_deliver(bridge, envelope, buf, len, layers);
+    return 0;
+  }
+  if (d >= N_XBEE_BOND_WINDOW) {
+    // too far ahead, everything held is as good as it gets
+    while (peer->held)
+      n_xbee_bond_skip_gap(bond, peer, now);
+    peer->rx_next = seq;
+    d = 0;
+  }
+  if (d == 0) {
+    peer->rx_next++;
+    n_xbee_bond_deliver(bridge, envelope, buf, len, layers);
+    n_xbee_bond_flush_ready(peer, now);
+    return 0;
+  }
+
+  slot = &peer->slots[seq % N_XBEE_BOND_WINDOW];
+  if (slot->len || len > sizeof(slot->data))
+    return 0;
+  slot->len = len;
+  slot->bridge = bridge;
+  slot->envelope = *envelope;
+  slot->layers = layers;
+  memcpy(slot->data, buf, len);
+  if (!peer->held)
+    peer->held_since = now;
+  peer->held++;
+  bond->rx_reordered++;
+  n_xbee_bond_reorder_arm(bond, now);
+  return 0;
+}
+
+void n_xbee_bond_expire(n_xbee_bond* bond, uint32_t now) {
+  int i;
+  n_xbee_bond_peer* peer;
+  for (i = 0; i < N_XBEE_BOND_PEERS; i++) {
+    peer = &bond->peers[i];
+    while (peer->in_use && peer->held && now - peer->held_since > N_XBEE_BOND_REORDER_TIMEOUT)
+      n_xbee_bond_skip_gap(bond, peer, now);
+  }
+}
+
+void n_xbee_bond_reorder_timer(n_xbee_bond* bond) {
+  uint32_t now = xbee_millisecond_timer();
+  bond->reorder_due = 0;
+  n_xbee_bond_expire(bond, now);
+  // frames still held, their gaps opened later
+  n_xbee_bond_reorder_arm(bond, now);
+}
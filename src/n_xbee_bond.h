@@ -0,0 +1,99 @@
+#pragma once
+#ifndef _N_XBEE_BOND_H
+#define _N_XBEE_BOND_H
+
+#include <stdint.h>
+#include <net/ethernet.h>
+
+#include <xbee/platform.h>
+#include <wpan/aps.h>
+
+#include "n_xbee.h"
+#include "n_xbee_frag.h"
+
+/*
+ * Link bonding: one tap striped over several radios.
+ *
+ * In flow mode every flow sticks to one radio, picked by hashing its
+ * addresses and ports. In packet mode frames go round robin over the
+ * radios and carry a sequence number so the other end can put them back
+ * in order:
+ *
+ * [N_XBEE_DISPATCH_BOND] [seq hi] [seq lo] inner datagram...
+ *
+ * A radio whose transmissions keep failing is taken out of rotation for
+ * N_XBEE_LINK_RETRY ms.
+ *
+ * Frames held back for a gap go out once it fills, or when reorder_fd
+ * goes off at the oldest one's deadline, whichever comes first.
+ */
+#define N_XBEE_BOND_FLOW 1
+#define N_XBEE_BOND_PACKET 2
+
+#define N_XBEE_BOND_HDR_LEN 3
+// remote bonds we keep sequence state for
+#define N_XBEE_BOND_PEERS 8
+// frames held back waiting for a gap to fill, per peer
+#define N_XBEE_BOND_WINDOW 8
+// give up on a gap after this many ms
+#define N_XBEE_BOND_REORDER_TIMEOUT 50
+
+#define XBEE_BOND_NETDEV_NAME "xbeebond0"
+
+struct xbee_serial_bridge;
+
+typedef struct n_xbee_bond_slot {
+  // 0 if empty
+  int len;
+  struct xbee_serial_bridge* bridge;
+  wpan_envelope_t envelope;
+  // N_XBEE_RX_* it came in under
+  int layers;
+  unsigned char data[N_XBEE_FRAG_MAX_DGRAM];
+} n_xbee_bond_slot;
+
+typedef struct n_xbee_bond_peer {
+  unsigned char mac[ETH_ALEN];
+  uint8_t in_use;
+  uint8_t rx_init;
+  uint16_t tx_seq;
+  uint16_t rx_next;
+  int held;
+  // when the oldest held frame arrived
+  uint32_t held_since;
+  uint32_t last_used;
+  n_xbee_bond_slot slots[N_XBEE_BOND_WINDOW];
+} n_xbee_bond_peer;
+
+typedef struct n_xbee_bond {
+  int mode;
+  int nmembers;
+  struct xbee_serial_bridge* members[N_XBEE_MAX_BRIDGES];
+  unsigned int rr;
+  uint32_t rx_reordered;
+  uint32_t rx_gaps;
+  // one shot timerfd for the earliest held frame, watched by the first
+  // member's worker, and when it is set to go off, 0 if it isn't
+  int reorder_fd;
+  uint32_t reorder_due;
+  n_xbee_event_source ev_reorder;
+  n_xbee_bond_peer peers[N_XBEE_BOND_PEERS];
+} n_xbee_bond;
+
+// Ties the bridges together, members[0] owns the tap.
+n_xbee_bond* n_xbee_bond_create(struct xbee_serial_bridge** members, int nmembers, int mode);
+void n_xbee_bond_free(n_xbee_bond* bond);
+
+// Sends a frame from the tap over one of the member radios.
+void n_xbee_bond_xmit(n_xbee_bond* bond, const unsigned char* buffer, int len);
+
+// Handles a datagram that came in with a bond header, layers are the
+// N_XBEE_RX_* it was under, the bond header included.
+int n_xbee_bond_rx(n_xbee_bond* bond, struct xbee_serial_bridge* bridge, const unsigned char* peer_mac, const wpan_envelope_t* envelope, uint16_t seq, const unsigned char* buf, int len, int layers);
+
+// Delivers held frames whose gap has been open too long.
+void n_xbee_bond_expire(n_xbee_bond* bond, uint32_t now);
+// Handles reorder_fd going off.
+void n_xbee_bond_reorder_timer(n_xbee_bond* bond);
+
+#endif
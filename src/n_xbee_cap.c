@@ -0,0 +1,398 @@
+#include "n_xbee.h"
+#include "n_xbee_cap.h"
+#include "n_xbee_serial.h"
+
+#include <string.h>
+#include <stdio.h>
+
+#include <sys/time.h>
+
+#define N_XBEE_PCAPNG_SHB 0x0A0D0D0A
+#define N_XBEE_PCAPNG_IDB 0x00000001
+#define N_XBEE_PCAPNG_EPB 0x00000006
+#define N_XBEE_PCAPNG_MAGIC 0x1A2B3C4D
+
+#define N_XBEE_PCAPNG_OPT_END 0
+#define N_XBEE_PCAPNG_OPT_IF_NAME 2
+#define N_XBEE_PCAPNG_OPT_EPB_FLAGS 2
+
+#define N_XBEE_PCAPNG_INBOUND 1
+#define N_XBEE_PCAPNG_OUTBOUND 2
+
+#define N_XBEE_API_START 0x7E
+
+// pieces of an API frame n_xbee_cap_api_frame takes
+#define N_XBEE_CAP_IOV_MAX 4
+// biggest block replay reads, anything bigger isn't ours
+#define N_XBEE_CAP_BLOCK_MAX (N_XBEE_POOL_BUF + 64)
+
+volatile int n_xbee_cap_on;
+volatile int n_xbee_cap_replaying;
+
+typedef struct n_xbee_cap_hdr {
+  uint32_t len;
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+  uint8_t point;
+  uint8_t inbound;
+  uint16_t pad;
+} n_xbee_cap_hdr;
+
+int n_xbee_cap_init(n_xbee_cap_ring* ring, uint32_t size) {
+  memset(ring, 0, sizeof(n_xbee_cap_ring));
+  if (!(ring->buf = malloc(size)))
+    return -ENOMEM;
+  ring->size = size;
+  pthread_mutex_init(&ring->lock, NULL);
+  return 0;
+}
+
+void n_xbee_cap_destroy(n_xbee_cap_ring* ring) {
+  if (!ring->buf)
+    return;
+  free(ring->buf);
+  ring->buf = NULL;
+  pthread_mutex_destroy(&ring->lock);
+}
+
+/* = Ring = */
+static void n_xbee_cap_ring_write(n_xbee_cap_ring* ring, uint32_t off, const void* src, uint32_t len) {
+  uint32_t first = ring->size - off < len ? ring->size - off : len;
+  memcpy(ring->buf + off, src, first);
+  memcpy(ring->buf, (const unsigned char*)src + first, len - first);
+}
+
+static void n_xbee_cap_ring_read(const n_xbee_cap_ring* ring, uint32_t off, void* dst, uint32_t len) {
+  uint32_t first = ring->size - off < len ? ring->size - off : len;
+  memcpy(dst, ring->buf + off, first);
+  memcpy((unsigned char*)dst + first, ring->buf, len - first);
+}
+
+static void n_xbee_cap_ring_drop(n_xbee_cap_ring* ring) {
+  n_xbee_cap_hdr hdr;
+  n_xbee_cap_ring_read(ring, ring->tail, &hdr, sizeof(hdr));
+  ring->tail = (ring->tail + sizeof(hdr) + hdr.len) % ring->size;
+  ring->used -= sizeof(hdr) + hdr.len;
+  ring->records--;
+}
+
+void n_xbee_cap_recordv(n_xbee_cap_ring* ring, int point, int inbound, const struct iovec* iov, int iovcnt) {
+  n_xbee_cap_hdr hdr;
+  struct timeval tv;
+  uint32_t off;
+  int i;
+
+  if (!ring->buf)
+    return;
+  memset(&hdr, 0, sizeof(hdr));
+  for (i = 0; i < iovcnt; i++)
+    hdr.len += iov[i].iov_len;
+  if (sizeof(hdr) + hdr.len > ring->size)
+    return;
+  gettimeofday(&tv, NULL);
+  hdr.ts_sec = tv.tv_sec;
+  hdr.ts_usec = tv.tv_usec;
+  hdr.point = point;
+  hdr.inbound = inbound;
+
+  pthread_mutex_lock(&ring->lock);
+  while (ring->size - ring->used < sizeof(hdr) + hdr.len) {
+    n_xbee_cap_ring_drop(ring);
+    ring->overwritten++;
+  }
+  n_xbee_cap_ring_write(ring, ring->head, &hdr, sizeof(hdr));
+  off = (ring->head + sizeof(hdr)) % ring->size;
+  for (i = 0; i < iovcnt; i++) {
+    n_xbee_cap_ring_write(ring, off, iov[i].iov_base, iov[i].iov_len);
+    off = (off + iov[i].iov_len) % ring->size;
+  }
+  ring->head = off;
+  ring->used += sizeof(hdr) + hdr.len;
+  ring->records++;
+  pthread_mutex_unlock(&ring->lock);
+}
+
+void n_xbee_cap_api_frame(n_xbee_cap_ring* ring, int inbound, const struct iovec* iov, int iovcnt) {
+  struct iovec all[N_XBEE_CAP_IOV_MAX + 2];
+  unsigned char head[3];
+  unsigned char sum = 0;
+  int i, j, len = 0;
+
+  if (iovcnt > N_XBEE_CAP_IOV_MAX)
+    return;
+  for (i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+    for (j = 0; j < iov[i].iov_len; j++)
+      sum += ((const unsigned char*)iov[i].iov_base)[j];
+    all[i + 1] = iov[i];
+  }
+  head[0] = N_XBEE_API_START;
+  head[1] = len >> 8;
+  head[2] = len & 0xFF;
+  sum = 0xFF - sum;
+  all[0].iov_base = head;
+  all[0].iov_len = sizeof(head);
+  all[iovcnt + 1].iov_base = &sum;
+  all[iovcnt + 1].iov_len = 1;
+  n_xbee_cap_recordv(ring, N_XBEE_CAP_SERIAL, inbound, all, iovcnt + 2);
+}
+
+void n_xbee_cap_envelope(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope, const void* prefix, int prefixlen, int inbound) {
+  unsigned char hdr[N_XBEE_CAP_ENCAP_HDR_LEN];
+  struct iovec iov[3];
+
+  memcpy(hdr, envelope->ieee_address.b, 8);
+  hdr[8] = envelope->cluster_id >> 8;
+  hdr[9] = envelope->cluster_id & 0xFF;
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void*)prefix;
+  iov[1].iov_len = prefixlen;
+  iov[2].iov_base = (void*)envelope->payload;
+  iov[2].iov_len = envelope->length;
+  n_xbee_cap_recordv(&bridge->cap, N_XBEE_CAP_ENCAP, inbound, iov, 3);
+}
+
+int n_xbee_cap_frame_handler(xbee_dev_t* xbee, const void FAR* frame, uint16_t length, void FAR* context) {
+  struct xbee_serial_bridge* bridge;
+  struct iovec iov;
+
+  if (!n_xbee_cap_on || !(bridge = n_xbee_find_bridge_byxbee(xbee)))
+    return 0;
+  iov.iov_base = (void*)frame;
+  iov.iov_len = length;
+  n_xbee_cap_api_frame(&bridge->cap, 1, &iov, 1);
+  return 0;
+}
+
+/* = pcapng = */
+static void n_xbee_pcapng_u32(FILE* f, uint32_t v) {
+  fwrite(&v, 4, 1, f);
+}
+
+static void n_xbee_pcapng_u16(FILE* f, uint16_t v) {
+  fwrite(&v, 2, 1, f);
+}
+
+static void n_xbee_pcapng_pad(FILE* f, uint32_t len) {
+  static const unsigned char zero[4];
+  fwrite(zero, 1, (4 - (len & 3)) & 3, f);
+}
+
+static inline uint32_t n_xbee_pcapng_align(uint32_t len) {
+  return (len + 3) & ~3u;
+}
+
+static void n_xbee_pcapng_shb(FILE* f) {
+  n_xbee_pcapng_u32(f, N_XBEE_PCAPNG_SHB);
+  n_xbee_pcapng_u32(f, 28);
+  n_xbee_pcapng_u32(f, N_XBEE_PCAPNG_MAGIC);
+  n_xbee_pcapng_u16(f, 1);
+  n_xbee_pcapng_u16(f, 0);
+  // section length unknown
+  n_xbee_pcapng_u32(f, 0xFFFFFFFF);
+  n_xbee_pcapng_u32(f, 0xFFFFFFFF);
+  n_xbee_pcapng_u32(f, 28);
+}
+
+static void n_xbee_pcapng_idb(FILE* f, uint16_t linktype, const char* name) {
+  uint32_t nlen = strlen(name);
+  uint32_t total = 20 + 4 + n_xbee_pcapng_align(nlen) + 4;
+
+  n_xbee_pcapng_u32(f, N_XBEE_PCAPNG_IDB);
+  n_xbee_pcapng_u32(f, total);
+  n_xbee_pcapng_u16(f, linktype);
+  n_xbee_pcapng_u16(f, 0);
+  // no snap length
+  n_xbee_pcapng_u32(f, 0);
+  n_xbee_pcapng_u16(f, N_XBEE_PCAPNG_OPT_IF_NAME);
+  n_xbee_pcapng_u16(f, nlen);
+  fwrite(name, 1, nlen, f);
+  n_xbee_pcapng_pad(f, nlen);
+  n_xbee_pcapng_u32(f, N_XBEE_PCAPNG_OPT_END);
+  n_xbee_pcapng_u32(f, total);
+}
+
+// Writes the record at off in ring as an enhanced packet block.
+static void n_xbee_pcapng_epb(FILE* f, const n_xbee_cap_ring* ring, uint32_t off, const n_xbee_cap_hdr* hdr, uint32_t ifid) {
+  unsigned char data[N_XBEE_POOL_BUF + N_XBEE_CAP_ENCAP_HDR_LEN];
+  uint64_t ts = (uint64_t)hdr->ts_sec * 1000000 + hdr->ts_usec;
+  uint32_t len = hdr->len < sizeof(data) ? hdr->len : sizeof(data);
+  uint32_t total = 28 + n_xbee_pcapng_align(len) + 8 + 4 + 4;
+
+  n_xbee_cap_ring_read(ring, off, data, len);
+  n_xbee_pcapng_u32(f, N_XBEE_PCAPNG_EPB);
+  n_xbee_pcapng_u32(f, total);
+  n_xbee_pcapng_u32(f, ifid);
+  n_xbee_pcapng_u32(f, ts >> 32);
+  n_xbee_pcapng_u32(f, ts & 0xFFFFFFFF);
+  n_xbee_pcapng_u32(f, len);
+  n_xbee_pcapng_u32(f, hdr->len);
+  fwrite(data, 1, len, f);
+  n_xbee_pcapng_pad(f, len);
+  n_xbee_pcapng_u16(f, N_XBEE_PCAPNG_OPT_EPB_FLAGS);
+  n_xbee_pcapng_u16(f, 4);
+  n_xbee_pcapng_u32(f, hdr->inbound ? N_XBEE_PCAPNG_INBOUND : N_XBEE_PCAPNG_OUTBOUND);
+  n_xbee_pcapng_u32(f, N_XBEE_PCAPNG_OPT_END);
+  n_xbee_pcapng_u32(f, total);
+}
+
+int n_xbee_cap_flush(const char* path) {
+  int i, p, res = 0;
+  uint32_t off, n = 0, lost = 0;
+  char name[64];
+  n_xbee_cap_hdr hdr;
+  n_xbee_cap_ring* ring;
+  FILE* f = fopen(path, "wb");
+
+  if (!f) {
+    res = -errno;
+    printk(KERN_ALERT "%s: unable to open %s, %d (%s)\n", __FUNCTION__, path, -res, strerror(-res));
+    return res;
+  }
+  n_xbee_pcapng_shb(f);
+  // interface bridge * N_XBEE_CAP_POINTS + point
+  for (i = 0; i < n_xbee_bridge_count; i++) {
+    for (p = 0; p < N_XBEE_CAP_POINTS; p++) {
+      snprintf(name, sizeof(name), "%s:%s", n_xbee_bridges[i]->tty_name, p == N_XBEE_CAP_TAP ? "tap" : p == N_XBEE_CAP_ENCAP ? "encap" : "serial");
+      n_xbee_pcapng_idb(f, p == N_XBEE_CAP_SERIAL ? N_XBEE_CAP_LINKTYPE_XBEE_API : p == N_XBEE_CAP_ENCAP ? N_XBEE_CAP_LINKTYPE_XBEE_ENCAP :
+          n_xbee_opts.tun ? N_XBEE_CAP_LINKTYPE_RAW : N_XBEE_CAP_LINKTYPE_ETHERNET, name);
+    }
+  }
+  for (i = 0; i < n_xbee_bridge_count; i++) {
+    ring = &n_xbee_bridges[i]->cap;
+    if (!ring->buf)
+      continue;
+    pthread_mutex_lock(&ring->lock);
+    for (off = ring->tail; ring->records; ring->records--) {
+      n_xbee_cap_ring_read(ring, off, &hdr, sizeof(hdr));
+      off = (off + sizeof(hdr)) % ring->size;
+      n_xbee_pcapng_epb(f, ring, off, &hdr, i * N_XBEE_CAP_POINTS + hdr.point);
+      off = (off + hdr.len) % ring->size;
+      n++;
+    }
+    lost += ring->overwritten;
+    ring->head = ring->tail = ring->used = ring->overwritten = 0;
+    pthread_mutex_unlock(&ring->lock);
+  }
+  if (fclose(f) != 0) {
+    res = -errno;
+    printk(KERN_ALERT "%s: unable to write %s, %d (%s)\n", __FUNCTION__, path, -res, strerror(-res));
+    return res;
+  }
+  printk(KERN_INFO "%s: wrote %u records to %s, %u older ones were overwritten.\n", __FUNCTION__, n, path, lost);
+  return 0;
+}
+
+void n_xbee_cap_toggle(void) {
+  if (!n_xbee_opts.capture) {
+    printk(KERN_ALERT "%s: not capturing, start with --capture=PATH.\n", __FUNCTION__);
+    return;
+  }
+  if (!n_xbee_cap_on) {
+    n_xbee_cap_on = 1;
+    printk(KERN_INFO "%s: capturing.\n", __FUNCTION__);
+    return;
+  }
+  n_xbee_cap_on = 0;
+  n_xbee_cap_flush(n_xbee_opts.capture);
+}
+
+/* = Replay = */
+// Hands an API frame to every handler that would have taken it from the
+// radio, but the one that records it.
+static void n_xbee_cap_dispatch(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len) {
+  const xbee_dispatch_table_entry_t* entry;
+
+  for (entry = xbee_frame_handlers; entry->frame_type != 0xFF; entry++) {
+    if (!entry->handler || entry->handler == n_xbee_cap_frame_handler)
+      continue;
+    if (entry->frame_type && entry->frame_type != frame[0])
+      continue;
+    if (entry->frame_id && (len < 2 || entry->frame_id != frame[1]))
+      continue;
+    entry->handler(bridge->xbee_dev, frame, len, entry->context);
+  }
+}
+
+int n_xbee_cap_replay(const char* path) {
+  uint32_t blk[2], body[5], flags, off, optend, nif = 0, n = 0, ifid;
+  uint16_t code, linktypes[N_XBEE_MAX_BRIDGES * N_XBEE_CAP_POINTS];
+  unsigned char buf[N_XBEE_CAP_BLOCK_MAX];
+  unsigned char* frame = buf + sizeof(body);
+  int i, res = 0;
+  FILE* f = fopen(path, "rb");
+
+  if (!f) {
+    res = -errno;
+    printk(KERN_ALERT "%s: unable to open %s, %d (%s)\n", __FUNCTION__, path, -res, strerror(-res));
+    return res;
+  }
+  // these frames were answered the first time round
+  n_xbee_cap_replaying = 1;
+  for (i = 0; i < n_xbee_bridge_count; i++)
+    n_xbee_serial_sink(&n_xbee_bridges[i]->xbee_dev->serial, 1);
+  while (!res && fread(blk, 4, 2, f) == 2) {
+    if (blk[1] < 12 || (blk[1] & 3)) {
+      res = -EINVAL;
+      break;
+    }
+    if (blk[1] - 8 > sizeof(buf)) {
+      fseek(f, blk[1] - 8, SEEK_CUR);
+      continue;
+    }
+    if (fread(buf, 1, blk[1] - 8, f) != blk[1] - 8) {
+      res = -EINVAL;
+      break;
+    }
+    // block body, without the trailing length
+    optend = blk[1] - 12;
+    switch (blk[0]) {
+      case N_XBEE_PCAPNG_SHB:
+        memcpy(body, buf, 4);
+        // we only ever read what we wrote, on the same machine
+        if (body[0] != N_XBEE_PCAPNG_MAGIC)
+          res = -EPROTO;
+        nif = 0;
+        break;
+      case N_XBEE_PCAPNG_IDB:
+        if (nif < N_XBEE_MAX_BRIDGES * N_XBEE_CAP_POINTS)
+          memcpy(&linktypes[nif], buf, 2);
+        nif++;
+        break;
+      case N_XBEE_PCAPNG_EPB:
+        if (optend < sizeof(body))
+          break;
+        memcpy(body, buf, sizeof(body));
+        ifid = body[0];
+        off = sizeof(body) + n_xbee_pcapng_align(body[3]);
+        if (ifid >= nif || ifid >= N_XBEE_MAX_BRIDGES * N_XBEE_CAP_POINTS || linktypes[ifid] != N_XBEE_CAP_LINKTYPE_XBEE_API ||
+            ifid / N_XBEE_CAP_POINTS >= n_xbee_bridge_count || off > optend)
+          break;
+        flags = 0;
+        if (off + 8 <= optend) {
+          memcpy(&code, buf + off, 2);
+          if (code == N_XBEE_PCAPNG_OPT_EPB_FLAGS)
+            memcpy(&flags, buf + off + 4, 4);
+        }
+        // only what the radio told us, what we told it we'll say again
+        if (!(flags & N_XBEE_PCAPNG_INBOUND) || body[3] < 5 || frame[0] != N_XBEE_API_START)
+          break;
+        pthread_mutex_lock(&n_xbee_lib_lock);
+        n_xbee_cap_dispatch(n_xbee_bridges[ifid / N_XBEE_CAP_POINTS], frame + 3, body[3] - 4);
+        pthread_mutex_unlock(&n_xbee_lib_lock);
+        n++;
+        break;
+    }
+  }
+  fclose(f);
+  for (i = 0; i < n_xbee_bridge_count; i++)
+    n_xbee_serial_sink(&n_xbee_bridges[i]->xbee_dev->serial, 0);
+  n_xbee_cap_replaying = 0;
+  if (res) {
+    printk(KERN_ALERT "%s: %s is not a capture we can read, %d (%s)\n", __FUNCTION__, path, -res, strerror(-res));
+    return res;
+  }
+  printk(KERN_INFO "%s: replayed %u frames from %s.\n", __FUNCTION__, n, path);
+  return 0;
+}
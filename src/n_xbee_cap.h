@@ -0,0 +1,119 @@
+#pragma once
+#ifndef _N_XBEE_CAP_H
+#define _N_XBEE_CAP_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <sys/uio.h>
+
+#include <xbee/device.h>
+
+/*
+ * Packet capture.
+ *
+ * With --capture=PATH every bridge gets a ring of N_XBEE_CAP_RING_SIZE
+ * bytes, and kill -USR2 starts recording into it. Three points are
+ * recorded, each as its own pcapng interface:
+ *
+ *  - tap, frames read from and written to the device, ethernet or with
+ *    --tun raw IP
+ *  - encap, radio payloads as sent and received, behind the peer's 64
+ *    bit address and the cluster ID, both big endian
+ *    (N_XBEE_CAP_LINKTYPE_XBEE_ENCAP)
+ *  - serial, API frames as they cross the serial port, start delimiter,
+ *    length and checksum included, never escaped
+ *    (N_XBEE_CAP_LINKTYPE_XBEE_API)
+ *
+ * Inbound is what the bridge took in, from the device or the radio. Once
+ * the ring is full the oldest records make room. The next kill -USR2
+ * stops recording and writes the ring to PATH as pcapng, as does exiting
+ * while recording.
+ *
+ * While stopped, a capture point costs one load and a branch.
+ *
+ * --replay=PATH feeds the inbound serial records of a capture back
+ * through the frame handlers, of the bridge at the same position on the
+ * command line, before the bridges start, so the radio side of a session
+ * can be reproduced without the radios having to say it again.
+ *
+ * Replay is for the simulator. The ports still have to be set up as
+ * radios first, so point it at xbee_sim's ptys, and what it receives is
+ * written to their taps as it was live. Nothing goes out while
+ * replaying: our own sends fail with -ENETDOWN, so nodes are still asked
+ * for their caps once the bridges start, and whatever the library
+ * answers on its own is dropped at the port.
+ */
+#define N_XBEE_CAP_TAP 0
+#define N_XBEE_CAP_ENCAP 1
+#define N_XBEE_CAP_SERIAL 2
+#define N_XBEE_CAP_POINTS 3
+
+// per bridge
+#define N_XBEE_CAP_RING_SIZE (1 << 20)
+// peer address and cluster ID in front of an encap record
+#define N_XBEE_CAP_ENCAP_HDR_LEN 10
+
+#define N_XBEE_CAP_LINKTYPE_ETHERNET 1
+#define N_XBEE_CAP_LINKTYPE_RAW 101
+// LINKTYPE_USER0 and USER1, nothing is registered for either
+#define N_XBEE_CAP_LINKTYPE_XBEE_API 147
+#define N_XBEE_CAP_LINKTYPE_XBEE_ENCAP 148
+
+typedef struct n_xbee_cap_ring {
+  // held by whoever records or flushes, only while recording
+  pthread_mutex_t lock;
+  // NULL unless --capture
+  unsigned char* buf;
+  uint32_t size;
+  // where the next record goes and where the oldest starts
+  uint32_t head;
+  uint32_t tail;
+  uint32_t used;
+  uint32_t records;
+  // records that made room for newer ones
+  uint32_t overwritten;
+} n_xbee_cap_ring;
+
+// Set while recording.
+extern volatile int n_xbee_cap_on;
+// Set while replaying, nothing is sent.
+extern volatile int n_xbee_cap_replaying;
+
+int n_xbee_cap_init(n_xbee_cap_ring* ring, uint32_t size);
+void n_xbee_cap_destroy(n_xbee_cap_ring* ring);
+
+// Records the concatenation of iov.
+void n_xbee_cap_recordv(n_xbee_cap_ring* ring, int point, int inbound, const struct iovec* iov, int iovcnt);
+
+static inline void n_xbee_cap(n_xbee_cap_ring* ring, int point, int inbound, const void* data, int len) {
+  struct iovec iov;
+  if (!n_xbee_cap_on)
+    return;
+  iov.iov_base = (void*)data;
+  iov.iov_len = len;
+  n_xbee_cap_recordv(ring, point, inbound, &iov, 1);
+}
+
+struct xbee_serial_bridge;
+
+// Records a radio payload, prefix followed by the envelope's.
+void n_xbee_cap_envelope(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope, const void* prefix, int prefixlen, int inbound);
+
+// Records an API frame made of iov, adding the delimiter, length and
+// checksum.
+void n_xbee_cap_api_frame(n_xbee_cap_ring* ring, int inbound, const struct iovec* iov, int iovcnt);
+
+// Frame handler that records every API frame the radio sends us, first
+// in xbee_frame_handlers.
+int n_xbee_cap_frame_handler(xbee_dev_t* xbee, const void FAR* frame, uint16_t length, void FAR* context);
+
+// Starts recording, or stops and writes the rings to --capture.
+void n_xbee_cap_toggle(void);
+// Writes every bridge's ring to path as pcapng and empties them.
+int n_xbee_cap_flush(const char* path);
+
+// Dispatches the inbound serial records in the capture at path.
+int n_xbee_cap_replay(const char* path);
+
+#endif
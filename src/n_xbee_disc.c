@@ -0,0 +1,88 @@
+#include "n_xbee.h"
+#include "n_xbee_proto.h"
+#include "n_xbee_disc.h"
+
+#include <string.h>
+
+#include <sys/timerfd.h>
+
+// Digi's OUI as it shows in a radio's MAC, the last 6 bytes of 00 13 A2 00 xx xx xx xx
+static const unsigned char n_xbee_disc_digi_mac[2] = { 0xA2, 0x00 };
+static const unsigned char n_xbee_disc_digi_prefix[2] = { 0x00, 0x13 };
+
+void n_xbee_disc_init(n_xbee_disc_state* disc) {
+  memset(disc, 0, sizeof(n_xbee_disc_state));
+  disc->interval = N_XBEE_DISC_MIN_INTERVAL;
+  disc->last_probe = xbee_millisecond_timer() - N_XBEE_DISC_MAX_INTERVAL;
+}
+
+int n_xbee_disc_arm(struct xbee_serial_bridge* bridge, uint32_t delay_ms) {
+  struct itimerspec its;
+
+  // one shot, every round decides when the next one is
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = delay_ms / 1000;
+  its.it_value.tv_nsec = (delay_ms % 1000) * 1000000L;
+  if (timerfd_settime(bridge->discover_fd, 0, &its, NULL) < 0) {
+    printk(KERN_ALERT "%s: unable to arm the discovery timer of %s, %d (%s)\n", __FUNCTION__, bridge->name, errno, strerror(errno));
+    return -errno;
+  }
+  bridge->disc.next_round = xbee_millisecond_timer() + delay_ms;
+  return 0;
+}
+
+void n_xbee_disc_round(struct xbee_serial_bridge* bridge) {
+  n_xbee_disc_state* disc = &bridge->disc;
+  uint32_t changes = __atomic_load_n(&bridge->nodes.changes, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&n_xbee_lib_lock);
+  xbee_disc_discover_nodes(bridge->xbee_dev, NULL);
+  pthread_mutex_unlock(&n_xbee_lib_lock);
+  disc->rounds++;
+
+  // answers to the last round count towards it
+  if (changes != disc->changes_seen)
+    disc->interval = N_XBEE_DISC_MIN_INTERVAL;
+  else if ((disc->interval *= 2) > N_XBEE_DISC_MAX_INTERVAL)
+    disc->interval = N_XBEE_DISC_MAX_INTERVAL;
+  disc->changes_seen = changes;
+#ifdef N_XBEE_VERBOSE
+  printk(KERN_INFO "%s: %s discovering, %d node(s) known, next round in %u ms.\n", __FUNCTION__, bridge->name, bridge->nodes.count, disc->interval);
+#endif
+  n_xbee_disc_arm(bridge, disc->interval);
+}
+
+void n_xbee_disc_check(struct xbee_serial_bridge* bridge, uint32_t now) {
+  n_xbee_disc_state* disc = &bridge->disc;
+
+  if (__atomic_load_n(&bridge->nodes.changes, __ATOMIC_RELAXED) == disc->changes_seen)
+    return;
+  if ((int32_t)(disc->next_round - now) > N_XBEE_DISC_MIN_INTERVAL)
+    n_xbee_disc_arm(bridge, N_XBEE_DISC_MIN_INTERVAL);
+}
+
+void n_xbee_disc_miss(struct xbee_serial_bridge* bridge, const unsigned char* mac) {
+  n_xbee_disc_state* disc = &bridge->disc;
+  uint32_t now = xbee_millisecond_timer();
+  unsigned char addr[8];
+  int again = memcmp(mac, disc->probed, ETH_ALEN) == 0;
+
+  if (now - disc->last_probe < (again ? disc->interval : N_XBEE_DISC_PROBE_HOLDOFF))
+    return;
+  disc->last_probe = now;
+  memcpy(disc->probed, mac, ETH_ALEN);
+  disc->probes++;
+
+  if (memcmp(mac, n_xbee_disc_digi_mac, sizeof(n_xbee_disc_digi_mac)) == 0) {
+    memcpy(addr, n_xbee_disc_digi_prefix, sizeof(n_xbee_disc_digi_prefix));
+    memcpy(addr + 2, mac, ETH_ALEN);
+    n_xbee_send_caps(bridge, addr, N_XBEE_CTRL_FLAG_REPLY);
+  }
+  // a bond MAC, or a radio that isn't running a bridge, only answers
+  // discovery
+  if (!again && (int32_t)(disc->next_round - now) > N_XBEE_DISC_MIN_INTERVAL)
+    n_xbee_disc_arm(bridge, N_XBEE_DISC_MIN_INTERVAL);
+#ifdef N_XBEE_VERBOSE
+  printk(KERN_INFO "%s: %s probing for %.2x:%.2x:%.2x:%.2x:%.2x:%.2x.\n", __FUNCTION__, bridge->name, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+#endif
+}
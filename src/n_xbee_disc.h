@@ -0,0 +1,64 @@
+#pragma once
+#ifndef _N_XBEE_DISC_H
+#define _N_XBEE_DISC_H
+
+#include <stdint.h>
+
+#include <net/ethernet.h>
+
+/*
+ * Scheduling node discovery.
+ *
+ * A discovery round is a broadcast every radio in the network answers,
+ * so it costs airtime in proportion to the network. Rounds start
+ * N_XBEE_DISC_MIN_INTERVAL apart, and the gap doubles after every round
+ * that found nothing new, up to N_XBEE_DISC_MAX_INTERVAL. A node joining
+ * or going away, however we noticed, brings the next round back in to
+ * the minimum.
+ *
+ * Nodes are also learned from anything they send us and from successful
+ * transmit statuses, and aged out after N_XBEE_NODE_MAX_AGE. That is
+ * well over the longest gap, so a quiet node that still answers
+ * discovery is kept.
+ *
+ * A frame to a MAC no node has doesn't wait for the next round. The
+ * caps request goes to the address a Digi radio with that MAC would
+ * have, and a bridge there answers it, which is enough to learn it. A
+ * MAC that misses again is probed again only once a full interval has
+ * passed, so a dead destination doesn't keep the air busy.
+ */
+// ms between rounds at startup and after a change, longer than a
+// radio's discovery timeout (NT) so rounds don't overlap
+#define N_XBEE_DISC_MIN_INTERVAL 10000
+// ms between rounds once nothing changes, well under N_XBEE_NODE_MAX_AGE
+#define N_XBEE_DISC_MAX_INTERVAL (10 * 60 * 1000)
+// ms between probes of unknown MACs
+#define N_XBEE_DISC_PROBE_HOLDOFF 1000
+
+struct xbee_serial_bridge;
+
+typedef struct n_xbee_disc_state {
+  // ms between rounds right now
+  uint32_t interval;
+  // xbee_millisecond_timer() the next round is due
+  uint32_t next_round;
+  // the node table's changes counter when the last round started
+  uint32_t changes_seen;
+  // the last MAC we probed for, and when
+  unsigned char probed[ETH_ALEN];
+  uint32_t last_probe;
+  uint32_t rounds;
+  uint32_t probes;
+} n_xbee_disc_state;
+
+void n_xbee_disc_init(n_xbee_disc_state* disc);
+// Sets the bridge's discover timer to go off in delay_ms.
+int n_xbee_disc_arm(struct xbee_serial_bridge* bridge, uint32_t delay_ms);
+// Starts a round and schedules the next one, when the timer goes off.
+void n_xbee_disc_round(struct xbee_serial_bridge* bridge);
+// Brings the next round in if nodes came or went, from housekeeping.
+void n_xbee_disc_check(struct xbee_serial_bridge* bridge, uint32_t now);
+// A unicast frame for mac found no node.
+void n_xbee_disc_miss(struct xbee_serial_bridge* bridge, const unsigned char* mac);
+
+#endif
@@ -0,0 +1,201 @@
+#include "n_xbee.h"
+#include "n_xbee_proto.h"
+#include "n_xbee_frag.h"
+
+#include <string.h>
+
+// largest fragment payloads that keep every offset a multiple of 8
+#define N_XBEE_FRAG1_DATA ((N_XBEE_DATA_MTU - N_XBEE_FRAG1_HDR_LEN) & ~7)
+#define N_XBEE_FRAGN_DATA ((N_XBEE_DATA_MTU - N_XBEE_FRAGN_HDR_LEN) & ~7)
+
+void n_xbee_frag_init(n_xbee_frag_state* st) {
+  memset(st, 0, sizeof(n_xbee_frag_state));
+  st->tx_tag = (uint16_t)xbee_millisecond_timer();
+}
+
+// copy len bytes starting at off out of hdr + buf
+static void n_xbee_frag_copy(unsigned char* dst, const unsigned char* hdr, int hdrlen, const unsigned char* buf, int off, int len) {
+  int n;
+  if (off < hdrlen) {
+    n = hdrlen - off;
+    if (n > len)
+      n = len;
+    memcpy(dst, hdr + off, n);
+    dst += n;
+    len -= n;
+    off = hdrlen;
+  }
+  if (len > 0)
+    memcpy(dst, buf + (off - hdrlen), len);
+}
+
+int n_xbee_frag_send(struct xbee_serial_bridge* bridge, wpan_envelope_t* envelope, const void* hdr, int hdrlen, const void* buf, int len) {
+  unsigned char fbuf[N_XBEE_DATA_MTU];
+  int err, hlen, chunk, off = 0;
+  int size = hdrlen + len;
+  uint16_t tag;
+
+  if (size > N_XBEE_FRAG_MAX_DGRAM) {
+#ifdef N_XBEE_VERBOSE
+    printk(KERN_ALERT "%s: datagram of len %d is too big to fragment, dropping.\n", __FUNCTION__, size);
+#endif
+    return -EMSGSIZE;
+  }
+
+  tag = bridge->frag.tx_tag++;
+  bridge->frag.tx_datagrams++;
+  envelope->cluster_id = N_XBEE_CLUSTER_ID_ENCAP;
+
+  while (off < size) {
+    if (off == 0) {
+      fbuf[0] = N_XBEE_DISPATCH_FRAG1 | ((size >> 8) & 0x07);
+      hlen = N_XBEE_FRAG1_HDR_LEN;
+      chunk = N_XBEE_FRAG1_DATA;
+    } else {
+      fbuf[0] = N_XBEE_DISPATCH_FRAGN | ((size >> 8) & 0x07);
+      fbuf[4] = off >> 3;
+      hlen = N_XBEE_FRAGN_HDR_LEN;
+      chunk = N_XBEE_FRAGN_DATA;
+    }
+    fbuf[1] = size & 0xFF;
+    fbuf[2] = tag >> 8;
+    fbuf[3] = tag & 0xFF;
+    if (chunk > size - off)
+      chunk = size - off;
+
+    if (off >= hdrlen) {
+      // all payload, which goes out from where it is
+      envelope->payload = (const unsigned char*)buf + (off - hdrlen);
+      envelope->length = chunk;
+      err = n_xbee_envelope_send_prefixed(envelope, fbuf, hlen);
+    } else {
+      n_xbee_frag_copy(fbuf + hlen, hdr, hdrlen, buf, off, chunk);
+      envelope->payload = fbuf;
+      envelope->length = hlen + chunk;
+      err = n_xbee_envelope_send(envelope);
+    }
+    if (err != 0)
+      return err;
+    bridge->frag.tx_fragments++;
+    off += chunk;
+  }
+  return 0;
+}
+
+void n_xbee_frag_expire(n_xbee_frag_state* st, uint32_t now) {
+  int i;
+  n_xbee_reasm_slot* slot;
+  for (i = 0; i < N_XBEE_REASM_SLOTS; i++) {
+    slot = &st->slots[i];
+    if (slot->size && now - slot->started > N_XBEE_REASM_TIMEOUT) {
+      slot->size = 0;
+      st->rx_timeouts++;
+    }
+  }
+}
+
+// Finds the slot for this datagram, or takes a new one. Each peer gets at
+// most N_XBEE_REASM_PEER_SLOTS, after that its own oldest slot is reused.
+static n_xbee_reasm_slot* n_xbee_frag_slot(n_xbee_frag_state* st, const addr64* src, uint16_t tag, uint16_t size, uint32_t now) {
+  int i, peer_slots = 0;
+  n_xbee_reasm_slot* slot;
+  n_xbee_reasm_slot* free_slot = NULL;
+  n_xbee_reasm_slot* peer_oldest = NULL;
+  n_xbee_reasm_slot* oldest = NULL;
+
+  for (i = 0; i < N_XBEE_REASM_SLOTS; i++) {
+    slot = &st->slots[i];
+    if (!slot->size) {
+      if (!free_slot)
+        free_slot = slot;
+      continue;
+    }
+    if (memcmp(&slot->src, src, sizeof(addr64)) == 0) {
+      if (slot->tag == tag) {
+        if (slot->size == size)
+          return slot;
+        // tag reused with a different size, the old one is dead
+        slot->size = 0;
+        st->rx_evicted++;
+        free_slot = slot;
+        continue;
+      }
+      peer_slots++;
+      if (!peer_oldest || now - slot->started > now - peer_oldest->started)
+        peer_oldest = slot;
+    }
+    if (!oldest || now - slot->started > now - oldest->started)
+      oldest = slot;
+  }
+
+  if (peer_slots >= N_XBEE_REASM_PEER_SLOTS)
+    slot = peer_oldest;
+  else if (free_slot)
+    slot = free_slot;
+  else
+    slot = oldest;
+  if (slot->size)
+    st->rx_evicted++;
+
+  memcpy(&slot->src, src, sizeof(addr64));
+  slot->tag = tag;
+  slot->size = size;
+  slot->received = 0;
+  slot->started = now;
+  memset(slot->blocks, 0, sizeof(slot->blocks));
+  return slot;
+}
+
+int n_xbee_frag_rx(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope, const unsigned char** out, int* outlen) {
+  n_xbee_frag_state* st = &bridge->frag;
+  n_xbee_reasm_slot* slot;
+  const unsigned char* p = envelope->payload;
+  int i, hlen, plen, off, size, first, last, seen;
+  uint16_t tag;
+  uint32_t now = xbee_millisecond_timer();
+
+  st->rx_fragments++;
+  hlen = (p[0] & N_XBEE_DISPATCH_FRAG_MASK) == N_XBEE_DISPATCH_FRAG1 ? N_XBEE_FRAG1_HDR_LEN : N_XBEE_FRAGN_HDR_LEN;
+  // the header has to be all there before any of it is read
+  if ((plen = envelope->length - hlen) <= 0) {
+    st->rx_invalid++;
+    return -EINVAL;
+  }
+  off = hlen == N_XBEE_FRAGN_HDR_LEN ? p[4] << 3 : 0;
+  size = ((p[0] & 0x07) << 8) | p[1];
+  if (size == 0 || off + plen > size || ((off + plen) < size && (plen & 7))) {
+    st->rx_invalid++;
+    return -EINVAL;
+  }
+  tag = (p[2] << 8) | p[3];
+
+  n_xbee_frag_expire(st, now);
+  slot = n_xbee_frag_slot(st, &envelope->ieee_address, tag, size, now);
+
+  first = off >> 3;
+  last = (off + plen - 1) >> 3;
+  for (i = first, seen = 0; i <= last; i++)
+    seen += (slot->blocks[i >> 3] >> (i & 7)) & 1;
+  // duplicate, the radio retried after a lost ack
+  if (seen == last - first + 1)
+    return 0;
+  // overlaps what we have without matching it, counting it would
+  // complete the datagram with holes in it
+  if (seen) {
+    st->rx_invalid++;
+    return -EINVAL;
+  }
+  for (i = first; i <= last; i++)
+    slot->blocks[i >> 3] |= 1 << (i & 7);
+  memcpy(slot->data + off, p + hlen, plen);
+  slot->received += plen;
+
+  if (slot->received < slot->size)
+    return 0;
+
+  slot->size = 0;
+  st->rx_datagrams++;
+  *out = slot->data;
+  *outlen = size;
+  return 1;
+}
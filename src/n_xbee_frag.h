@@ -0,0 +1,72 @@
+#pragma once
+#ifndef _N_XBEE_FRAG_H
+#define _N_XBEE_FRAG_H
+
+#include <stdint.h>
+
+#include <xbee/platform.h>
+#include <wpan/aps.h>
+
+/*
+ * Fragmentation and reassembly of datagrams bigger than N_XBEE_DATA_MTU.
+ *
+ * FRAG1: [0xC0 | size >> 8] [size & 0xFF] [tag hi] [tag lo] data...
+ * FRAGN: [0xE0 | size >> 8] [size & 0xFF] [tag hi] [tag lo] [offset / 8] data...
+ *
+ * Every fragment but the last carries a multiple of 8 bytes.
+ */
+#define N_XBEE_FRAG1_HDR_LEN 4
+#define N_XBEE_FRAGN_HDR_LEN 5
+// 11 bits of size
+#define N_XBEE_FRAG_MAX_DGRAM 2047
+
+// datagrams being reassembled at once, across all peers
+#define N_XBEE_REASM_SLOTS 8
+// ... and per peer
+#define N_XBEE_REASM_PEER_SLOTS 2
+// drop incomplete datagrams after this many ms
+#define N_XBEE_REASM_TIMEOUT 2000
+
+struct xbee_serial_bridge;
+
+typedef struct n_xbee_reasm_slot {
+  addr64 src;
+  uint16_t tag;
+  // datagram size, 0 if the slot is free
+  uint16_t size;
+  uint16_t received;
+  uint32_t started;
+  // one bit per 8 byte block
+  uint8_t blocks[(N_XBEE_FRAG_MAX_DGRAM / 8) / 8 + 1];
+  unsigned char data[N_XBEE_FRAG_MAX_DGRAM];
+} n_xbee_reasm_slot;
+
+typedef struct n_xbee_frag_state {
+  // only touched under the bridge write_lock
+  uint16_t tx_tag;
+  uint32_t tx_datagrams;
+  uint32_t tx_fragments;
+  // only touched from the read thread
+  uint32_t rx_fragments;
+  uint32_t rx_datagrams;
+  uint32_t rx_timeouts;
+  uint32_t rx_evicted;
+  uint32_t rx_invalid;
+  n_xbee_reasm_slot slots[N_XBEE_REASM_SLOTS];
+} n_xbee_frag_state;
+
+void n_xbee_frag_init(n_xbee_frag_state* st);
+
+// Sends hdr + buf as one datagram, split over as many envelopes as needed.
+// The envelope should be filled in apart from the cluster and payload.
+int n_xbee_frag_send(struct xbee_serial_bridge* bridge, wpan_envelope_t* envelope, const void* hdr, int hdrlen, const void* buf, int len);
+
+// Feeds a received fragment in. Returns 1 and sets out/outlen when a
+// datagram completed, 0 if more fragments are needed, <0 on error.
+// The returned buffer stays valid until the next call.
+int n_xbee_frag_rx(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope, const unsigned char** out, int* outlen);
+
+// Frees slots that have been waiting for longer than N_XBEE_REASM_TIMEOUT.
+void n_xbee_frag_expire(n_xbee_frag_state* st, uint32_t now);
+
+#endif
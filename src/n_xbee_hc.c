@@ -0,0 +1,233 @@
+#include "n_xbee.h"
+#include "n_xbee_proto.h"
+#include "n_xbee_hc.h"
+
+#include <string.h>
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+static const unsigned char n_xbee_hc_bcast_mac[ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+uint16_t n_xbee_inet_csum(const void* buf, int len) {
+  const unsigned char* p = buf;
+  uint32_t sum = 0;
+  while (len > 1) {
+    sum += (p[0] << 8) | p[1];
+    p += 2;
+    len -= 2;
+  }
+  if (len)
+    sum += p[0] << 8;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return htons(~sum & 0xFFFF);
+}
+
+// Compresses an IPv4 header (and UDP if present) into hdr, returns the
+// number of bytes written or 0 if the header has to be sent as-is.
+static int n_xbee_hc_compress_ipv4(const unsigned char* ip, int len, unsigned char* hdr, int* consumed) {
+  const struct iphdr* iph = (const struct iphdr*)ip;
+  const struct udphdr* udph;
+  unsigned char* enc = hdr;
+  unsigned char* p = hdr + 1;
+  uint16_t frag;
+
+  if (len < sizeof(struct iphdr) || iph->version != 4 || iph->ihl != 5)
+    return 0;
+  if (ntohs(iph->tot_len) != len)
+    return 0;
+  frag = ntohs(iph->frag_off);
+  if (frag & ~IP_DF)
+    return 0;
+  if (n_xbee_inet_csum(ip, sizeof(struct iphdr)) != 0)
+    return 0;
+
+  *enc = 0;
+  if (iph->tos) {
+    *enc |= N_XBEE_HC_IP_TOS;
+    *p++ = iph->tos;
+  }
+  if (iph->id) {
+    *enc |= N_XBEE_HC_IP_ID;
+    memcpy(p, &iph->id, 2);
+    p += 2;
+  }
+  if (frag & IP_DF)
+    *enc |= N_XBEE_HC_IP_DF;
+  if (iph->ttl != N_XBEE_HC_DEFAULT_TTL) {
+    *enc |= N_XBEE_HC_IP_TTL;
+    *p++ = iph->ttl;
+  }
+  switch (iph->protocol) {
+    case IPPROTO_UDP:
+      *enc |= N_XBEE_HC_IP_PROTO_UDP;
+      break;
+    case IPPROTO_TCP:
+      *enc |= N_XBEE_HC_IP_PROTO_TCP;
+      break;
+    case IPPROTO_ICMP:
+      *enc |= N_XBEE_HC_IP_PROTO_ICMP;
+      break;
+    default:
+      *p++ = iph->protocol;
+      break;
+  }
+  memcpy(p, &iph->saddr, 4);
+  memcpy(p + 4, &iph->daddr, 4);
+  p += 8;
+  *consumed = sizeof(struct iphdr);
+
+  udph = (const struct udphdr*)(ip + sizeof(struct iphdr));
+  if (iph->protocol == IPPROTO_UDP && len >= sizeof(struct iphdr) + sizeof(struct udphdr) &&
+      ntohs(udph->len) == len - sizeof(struct iphdr)) {
+    *enc |= N_XBEE_HC_IP_UDP;
+    memcpy(p, &udph->source, 2);
+    memcpy(p + 2, &udph->dest, 2);
+    memcpy(p + 4, &udph->check, 2);
+    p += 6;
+    *consumed += sizeof(struct udphdr);
+  }
+  return p - hdr;
+}
+
+int n_xbee_hc_compress(const unsigned char* src_mac, int bcast, const unsigned char* frame, int len, unsigned char* hdr, int* consumed) {
+  const struct ether_header* eh = (const struct ether_header*)frame;
+  uint16_t ether_type;
+  int type, iplen, ipconsumed;
+
+  if (len < N_XBEE_ETHHDR_LEN)
+    return -EINVAL;
+  if (memcmp(eh->ether_shost, src_mac, ETH_ALEN) != 0)
+    return -EINVAL;
+  if (bcast && memcmp(eh->ether_dhost, n_xbee_hc_bcast_mac, ETH_ALEN) != 0)
+    return -EINVAL;
+
+  ether_type = ntohs(eh->ether_type);
+  *consumed = N_XBEE_ETHHDR_LEN;
+  iplen = 0;
+  switch (ether_type) {
+    case ETHERTYPE_IP:
+      iplen = n_xbee_hc_compress_ipv4(frame + N_XBEE_ETHHDR_LEN, len - N_XBEE_ETHHDR_LEN, hdr + 1, &ipconsumed);
+      if (iplen) {
+        type = N_XBEE_HC_TYPE_IPV4;
+        *consumed += ipconsumed;
+      } else
+        type = N_XBEE_HC_TYPE_ETHERTYPE;
+      break;
+    case ETHERTYPE_ARP:
+      type = N_XBEE_HC_TYPE_ARP;
+      break;
+    case ETHERTYPE_IPV6:
+      type = N_XBEE_HC_TYPE_IPV6;
+      break;
+    default:
+      type = N_XBEE_HC_TYPE_ETHERTYPE;
+      break;
+  }
+
+  hdr[0] = N_XBEE_DISPATCH_HC | (type << N_XBEE_HC_TYPE_SHIFT) | (bcast ? N_XBEE_HC_BCAST : 0);
+  if (type == N_XBEE_HC_TYPE_ETHERTYPE) {
+    memcpy(hdr + 1, &eh->ether_type, 2);
+    return 3;
+  }
+  return 1 + iplen;
+}
+
+int n_xbee_hc_decompress(const unsigned char* src_mac, const unsigned char* dst_mac, const unsigned char* buf, int len, unsigned char* out, int outsize) {
+  struct ether_header* eh = (struct ether_header*)out;
+  struct iphdr* iph;
+  struct udphdr* udph;
+  const unsigned char* p = buf + 1;
+  const unsigned char* end = buf + len;
+  unsigned char* o = out + N_XBEE_ETHHDR_LEN;
+  unsigned char enc;
+  int type, udp;
+
+  if (len < 1 || outsize < N_XBEE_ETHHDR_LEN)
+    return -EINVAL;
+  type = (buf[0] & N_XBEE_HC_TYPE_MASK) >> N_XBEE_HC_TYPE_SHIFT;
+
+  memcpy(eh->ether_dhost, (buf[0] & N_XBEE_HC_BCAST) ? n_xbee_hc_bcast_mac : dst_mac, ETH_ALEN);
+  memcpy(eh->ether_shost, src_mac, ETH_ALEN);
+
+  switch (type) {
+    case N_XBEE_HC_TYPE_ETHERTYPE:
+      if (end - p < 2)
+        return -EINVAL;
+      memcpy(&eh->ether_type, p, 2);
+      p += 2;
+      break;
+    case N_XBEE_HC_TYPE_ARP:
+      eh->ether_type = htons(ETHERTYPE_ARP);
+      break;
+    case N_XBEE_HC_TYPE_IPV6:
+      eh->ether_type = htons(ETHERTYPE_IPV6);
+      break;
+    case N_XBEE_HC_TYPE_IPV4:
+      eh->ether_type = htons(ETHERTYPE_IP);
+      if (outsize < N_XBEE_ETHHDR_LEN + sizeof(struct iphdr) + sizeof(struct udphdr))
+        return -ENOSPC;
+      if (end - p < 1)
+        return -EINVAL;
+      enc = *p++;
+      udp = (enc & N_XBEE_HC_IP_UDP) != 0;
+      if (end - p < ((enc & N_XBEE_HC_IP_TOS) ? 1 : 0) + ((enc & N_XBEE_HC_IP_ID) ? 2 : 0) +
+          ((enc & N_XBEE_HC_IP_TTL) ? 1 : 0) + ((enc & N_XBEE_HC_IP_PROTO_MASK) ? 0 : 1) + 8 + (udp ? 6 : 0))
+        return -EINVAL;
+
+      iph = (struct iphdr*)o;
+      memset(iph, 0, sizeof(struct iphdr));
+      iph->version = 4;
+      iph->ihl = 5;
+      if (enc & N_XBEE_HC_IP_TOS)
+        iph->tos = *p++;
+      if (enc & N_XBEE_HC_IP_ID) {
+        memcpy(&iph->id, p, 2);
+        p += 2;
+      }
+      if (enc & N_XBEE_HC_IP_DF)
+        iph->frag_off = htons(IP_DF);
+      iph->ttl = N_XBEE_HC_DEFAULT_TTL;
+      if (enc & N_XBEE_HC_IP_TTL)
+        iph->ttl = *p++;
+      switch (enc & N_XBEE_HC_IP_PROTO_MASK) {
+        case N_XBEE_HC_IP_PROTO_UDP:
+          iph->protocol = IPPROTO_UDP;
+          break;
+        case N_XBEE_HC_IP_PROTO_TCP:
+          iph->protocol = IPPROTO_TCP;
+          break;
+        case N_XBEE_HC_IP_PROTO_ICMP:
+          iph->protocol = IPPROTO_ICMP;
+          break;
+        default:
+          iph->protocol = *p++;
+          break;
+      }
+      memcpy(&iph->saddr, p, 4);
+      memcpy(&iph->daddr, p + 4, 4);
+      p += 8;
+      o += sizeof(struct iphdr);
+
+      if (udp) {
+        udph = (struct udphdr*)o;
+        memcpy(&udph->source, p, 2);
+        memcpy(&udph->dest, p + 2, 2);
+        memcpy(&udph->check, p + 4, 2);
+        udph->len = htons(sizeof(struct udphdr) + (end - p - 6));
+        p += 6;
+        o += sizeof(struct udphdr);
+      }
+      iph->tot_len = htons((o - out) - N_XBEE_ETHHDR_LEN + (end - p));
+      iph->check = n_xbee_inet_csum(iph, sizeof(struct iphdr));
+      break;
+  }
+
+  if ((o - out) + (end - p) > outsize)
+    return -ENOSPC;
+  memcpy(o, p, end - p);
+  return (o - out) + (end - p);
+}
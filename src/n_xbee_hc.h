@@ -0,0 +1,66 @@
+#pragma once
+#ifndef _N_XBEE_HC_H
+#define _N_XBEE_HC_H
+
+#include <stdint.h>
+
+/*
+ * Stateless header compression, in the spirit of 6LoWPAN IPHC.
+ *
+ * Both MACs are dropped: the source is the last 6 bytes of the sender's
+ * 64 bit address and the destination is either the receiver's own MAC
+ * or broadcast. IPv4 headers without options lose the version, length
+ * and checksum, and UDP headers lose the length.
+ *
+ * [0x60 | type << 3 | bcast] ...
+ *
+ *   type 0: [ethertype 2] payload
+ *   type 1: [enc] [tos] [id 2] [ttl] [proto] [src 4] [dst 4] [udp] payload
+ *   type 2: arp payload
+ *   type 3: ipv6 payload
+ *
+ * Fields in [] are only there if enc says so, udp is
+ * [sport 2] [dport 2] [checksum 2] when N_XBEE_HC_IP_UDP is set.
+ */
+#define N_XBEE_HC_TYPE_SHIFT 3
+#define N_XBEE_HC_TYPE_MASK 0x18
+#define N_XBEE_HC_TYPE_ETHERTYPE 0
+#define N_XBEE_HC_TYPE_IPV4 1
+#define N_XBEE_HC_TYPE_ARP 2
+#define N_XBEE_HC_TYPE_IPV6 3
+// destination MAC is ff:ff:ff:ff:ff:ff
+#define N_XBEE_HC_BCAST 0x04
+
+// enc bits for type 1
+#define N_XBEE_HC_IP_TOS 0x80
+#define N_XBEE_HC_IP_ID 0x40
+#define N_XBEE_HC_IP_DF 0x20
+#define N_XBEE_HC_IP_TTL 0x10
+#define N_XBEE_HC_IP_PROTO_MASK 0x0C
+#define N_XBEE_HC_IP_PROTO_INLINE 0x00
+#define N_XBEE_HC_IP_PROTO_UDP 0x04
+#define N_XBEE_HC_IP_PROTO_TCP 0x08
+#define N_XBEE_HC_IP_PROTO_ICMP 0x0C
+#define N_XBEE_HC_IP_UDP 0x02
+
+// TTL assumed when N_XBEE_HC_IP_TTL is clear
+#define N_XBEE_HC_DEFAULT_TTL 64
+
+// dispatch + enc + tos + id + ttl + proto + addrs + udp
+#define N_XBEE_HC_MAX_HDR 25
+
+// Internet checksum of buf, in network byte order.
+uint16_t n_xbee_inet_csum(const void* buf, int len);
+
+// Compresses the headers of an ethernet frame. src_mac must match the
+// frame or nothing is done, the frame's destination must be the peer's
+// MAC unless bcast is set. Writes the compressed header to hdr and the
+// number of frame bytes it replaces to consumed.
+// Returns the header length, or <0 if the frame can't be compressed.
+int n_xbee_hc_compress(const unsigned char* src_mac, int bcast, const unsigned char* frame, int len, unsigned char* hdr, int* consumed);
+
+// Rebuilds the full ethernet frame from a compressed one.
+// Returns the frame length, or <0 if buf is malformed or out too small.
+int n_xbee_hc_decompress(const unsigned char* src_mac, const unsigned char* dst_mac, const unsigned char* buf, int len, unsigned char* out, int outsize);
+
+#endif
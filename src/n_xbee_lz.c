@@ -0,0 +1,190 @@
+#include "n_xbee.h"
+#include "n_xbee_lz.h"
+
+#include <string.h>
+#include <stdio.h>
+
+n_xbee_lz_dict n_xbee_lz_local_dict;
+
+// Common strings in what we carry, the most common last since those get
+// the shortest offsets.
+static const char n_xbee_lz_builtin[] =
+  "Content-Type: text/plain; charset=utf-8\r\n"
+  "Content-Length: \r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: \r\n"
+  "Accept: */*\r\n"
+  "HTTP/1.1 200 OK\r\n"
+  "GET / HTTP/1.1\r\nHost: "
+  "POST /api/v1/"
+  "Content-Type: application/json\r\n"
+  "{\"error\":\"\",\"message\":\"\",\"code\":"
+  "\"latitude\":\"longitude\":\"altitude\":"
+  "\"voltage\":\"current\":\"power\":\"energy\":"
+  "\"battery\":\"rssi\":\"uptime\":"
+  "\"pressure\":\"humidity\":"
+  "\"unit\":\"celsius\","
+  "\"type\":\"sensor\",\"name\":\"node\","
+  "\"status\":\"ok\",\"online\":true,\"enabled\":false,\"data\":null,"
+  "\"time\":\"2020-01-01T00:00:00.000Z\","
+  "\"timestamp\":1600000000,\"id\":\"device\","
+  "{\"temperature\":\"value\":";
+
+static inline uint32_t n_xbee_lz_hash(const unsigned char* p) {
+  uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - N_XBEE_LZ_HASH_BITS);
+}
+
+void n_xbee_lz_dict_init(n_xbee_lz_dict* dict, const unsigned char* data, int len) {
+  int i;
+  uint16_t a = 1, b = 0;
+
+  if (len > N_XBEE_LZ_DICT_MAX) {
+    data += len - N_XBEE_LZ_DICT_MAX;
+    len = N_XBEE_LZ_DICT_MAX;
+  }
+  memset(dict, 0, sizeof(n_xbee_lz_dict));
+  memset(dict->table, 0xFF, sizeof(dict->table));
+  if (len <= 0)
+    return;
+  dict->len = len;
+  memcpy(dict->data, data, len);
+  for (i = 0; i + N_XBEE_LZ_MIN_MATCH <= len; i++)
+    dict->table[n_xbee_lz_hash(dict->data + i)] = i;
+  // fletcher-16, never 0 since that means no dictionary
+  for (i = 0; i < len; i++) {
+    a = (a + dict->data[i]) % 255;
+    b = (b + a) % 255;
+  }
+  dict->id = ((b << 8) | a) ? ((b << 8) | a) : 1;
+}
+
+void n_xbee_lz_dict_default(n_xbee_lz_dict* dict) {
+  n_xbee_lz_dict_init(dict, (const unsigned char*)n_xbee_lz_builtin, sizeof(n_xbee_lz_builtin) - 1);
+}
+
+int n_xbee_lz_dict_load(n_xbee_lz_dict* dict, const char* path) {
+  FILE* f;
+  long size;
+  int len;
+  unsigned char buf[N_XBEE_LZ_DICT_MAX];
+
+  if (!(f = fopen(path, "rb"))) {
+    printk(KERN_ALERT "%s: unable to open %s, %d (%s)\n", __FUNCTION__, path, errno, strerror(errno));
+    return -errno;
+  }
+  // keep the tail
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  fseek(f, size > N_XBEE_LZ_DICT_MAX ? size - N_XBEE_LZ_DICT_MAX : 0, SEEK_SET);
+  len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+
+  n_xbee_lz_dict_init(dict, buf, len);
+  printk(KERN_INFO "%s: using %d byte dictionary %s, id 0x%04x.\n", __FUNCTION__, dict->len, path, dict->id);
+  return 0;
+}
+
+// Emits literals, returns the new output position or -1 if out of room.
+static int n_xbee_lz_literals(const unsigned char* src, int n, unsigned char* out, int op, int outsize) {
+  int k;
+  while (n > 0) {
+    k = n > N_XBEE_LZ_MAX_LITERALS ? N_XBEE_LZ_MAX_LITERALS : n;
+    if (op + 1 + k > outsize)
+      return -1;
+    out[op++] = k - 1;
+    memcpy(out + op, src, k);
+    op += k;
+    src += k;
+    n -= k;
+  }
+  return op;
+}
+
+int n_xbee_lz_compress(const n_xbee_lz_dict* dict, const unsigned char* in, int len, unsigned char* out, int outsize) {
+  unsigned char win[N_XBEE_LZ_DICT_MAX + N_XBEE_LZ_MAX_INPUT];
+  uint16_t table[N_XBEE_LZ_HASH_SIZE];
+  int base, end, pos, lit, op = 0, mlen, off, i;
+  uint32_t h, cand;
+
+  if (len > N_XBEE_LZ_MAX_INPUT)
+    return -1;
+  // never bigger than what we started with
+  if (outsize > len - 1)
+    outsize = len - 1;
+
+  base = dict ? dict->len : 0;
+  if (base) {
+    memcpy(win, dict->data, base);
+    memcpy(table, dict->table, sizeof(table));
+  } else
+    memset(table, 0xFF, sizeof(table));
+  memcpy(win + base, in, len);
+  end = base + len;
+  pos = lit = base;
+
+  while (pos + N_XBEE_LZ_MIN_MATCH <= end) {
+    h = n_xbee_lz_hash(win + pos);
+    cand = table[h];
+    table[h] = pos;
+    if (cand == 0xFFFF || pos - cand > N_XBEE_LZ_MAX_OFFSET || memcmp(win + cand, win + pos, N_XBEE_LZ_MIN_MATCH) != 0) {
+      pos++;
+      continue;
+    }
+    mlen = N_XBEE_LZ_MIN_MATCH;
+    while (pos + mlen < end && mlen < N_XBEE_LZ_MAX_MATCH && win[cand + mlen] == win[pos + mlen])
+      mlen++;
+    off = pos - cand;
+
+    if ((op = n_xbee_lz_literals(win + lit, pos - lit, out, op, outsize)) < 0 || op + 2 > outsize)
+      return -1;
+    out[op++] = 0x80 | ((mlen - N_XBEE_LZ_MIN_MATCH) << 3) | ((off - 1) >> 8);
+    out[op++] = (off - 1) & 0xFF;
+
+    // the positions we skip over are still good match sources
+    for (i = 1; i < mlen && pos + i + N_XBEE_LZ_MIN_MATCH <= end; i++)
+      table[n_xbee_lz_hash(win + pos + i)] = pos + i;
+    pos += mlen;
+    lit = pos;
+  }
+  return n_xbee_lz_literals(win + lit, end - lit, out, op, outsize);
+}
+
+int n_xbee_lz_decompress(const n_xbee_lz_dict* dict, const unsigned char* in, int len, unsigned char* out, int outlen) {
+  unsigned char win[N_XBEE_LZ_DICT_MAX + N_XBEE_LZ_MAX_INPUT];
+  int base, limit, op, ip = 0, n, off, i;
+  unsigned char c;
+
+  if (outlen > N_XBEE_LZ_MAX_INPUT)
+    return -EMSGSIZE;
+  base = dict ? dict->len : 0;
+  memcpy(win, dict ? dict->data : win, base);
+  op = base;
+  limit = base + outlen;
+
+  while (ip < len) {
+    c = in[ip++];
+    if (c & 0x80) {
+      if (ip >= len)
+        return -EINVAL;
+      off = (((c & 0x07) << 8) | in[ip++]) + 1;
+      n = ((c >> 3) & 0x0F) + N_XBEE_LZ_MIN_MATCH;
+      if (off > op || op + n > limit)
+        return -EINVAL;
+      // may overlap, byte at a time
+      for (i = 0; i < n; i++)
+        win[op + i] = win[op - off + i];
+    } else {
+      n = c + 1;
+      if (ip + n > len || op + n > limit)
+        return -EINVAL;
+      memcpy(win + op, in + ip, n);
+      ip += n;
+    }
+    op += n;
+  }
+  if (op != limit)
+    return -EINVAL;
+  memcpy(out, win + base, outlen);
+  return outlen;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#ifndef _N_XBEE_LZ_H
+#define _N_XBEE_LZ_H
+
+#include <stdint.h>
+
+#include "n_xbee_frag.h"
+
+/*
+ * Payload compression, a small LZ77 with an optional preset dictionary.
+ *
+ * [N_XBEE_DISPATCH_LZ] [flags] [len hi] [len lo] tokens...
+ *
+ * len is the size of the datagram the tokens expand to, which is handled
+ * as if it had been received as is. Tokens are either
+ *
+ *   0LLLLLLL                 L + 1 literal bytes follow
+ *   1MMMMOOO OOOOOOOO        copy M + 3 bytes from O + 1 bytes back
+ *
+ * With N_XBEE_LZ_FLAG_DICT set, the dictionary is treated as if it came
+ * right before the datagram so matches can reach into it. Both ends
+ * must have the same dictionary, which the capability exchange checks
+ * by its ID.
+ *
+ * Memory is fixed: the compressor needs a 2 KB hash table and a window
+ * the size of the dictionary plus one datagram, both on the stack.
+ */
+#define N_XBEE_LZ_HDR_LEN 4
+#define N_XBEE_LZ_FLAG_DICT 0x01
+
+#define N_XBEE_LZ_MIN_MATCH 3
+#define N_XBEE_LZ_MAX_MATCH (N_XBEE_LZ_MIN_MATCH + 15)
+#define N_XBEE_LZ_MAX_OFFSET 2048
+#define N_XBEE_LZ_MAX_LITERALS 128
+#define N_XBEE_LZ_HASH_BITS 10
+#define N_XBEE_LZ_HASH_SIZE (1 << N_XBEE_LZ_HASH_BITS)
+
+// biggest dictionary, only the last this many bytes of a file are used
+#define N_XBEE_LZ_DICT_MAX 1024
+#define N_XBEE_LZ_MAX_INPUT N_XBEE_FRAG_MAX_DGRAM
+// not worth trying below this
+#define N_XBEE_LZ_MIN_INPUT 24
+
+typedef struct n_xbee_lz_dict {
+  int len;
+  // 0 if there is no dictionary
+  uint16_t id;
+  unsigned char data[N_XBEE_LZ_DICT_MAX];
+  // hash table primed with the dictionary
+  uint16_t table[N_XBEE_LZ_HASH_SIZE];
+} n_xbee_lz_dict;
+
+// The dictionary we compress with and advertise.
+extern n_xbee_lz_dict n_xbee_lz_local_dict;
+
+// Sets up dict from data, len may be 0 for no dictionary.
+void n_xbee_lz_dict_init(n_xbee_lz_dict* dict, const unsigned char* data, int len);
+// Loads the dictionary from a file, any content the traffic is likely to
+// repeat will do (sample payloads, the more typical the closer to the end).
+int n_xbee_lz_dict_load(n_xbee_lz_dict* dict, const char* path);
+// The built in dictionary, tuned for JSON, HTTP and similar text.
+void n_xbee_lz_dict_default(n_xbee_lz_dict* dict);
+
+// Compresses len bytes into out, returns the compressed length or -1 if
+// it came out no smaller than the input or doesn't fit in outsize.
+// dict may be NULL.
+int n_xbee_lz_compress(const n_xbee_lz_dict* dict, const unsigned char* in, int len, unsigned char* out, int outsize);
+// Expands exactly outlen bytes into out, returns outlen or <0.
+int n_xbee_lz_decompress(const n_xbee_lz_dict* dict, const unsigned char* in, int len, unsigned char* out, int outlen);
+
+#endif
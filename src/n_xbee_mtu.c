@@ -0,0 +1,246 @@
+#include "n_xbee.h"
+#include "n_xbee_mtu.h"
+#include "n_xbee_hc.h"
+
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+
+#define N_XBEE_TCPOPT_EOL 0
+#define N_XBEE_TCPOPT_NOP 1
+#define N_XBEE_TCPOPT_MSS 2
+
+#define N_XBEE_ICMP6_PACKET_TOO_BIG 2
+
+/* = MSS clamping = */
+// Finds the MSS option of a TCP SYN in frame. Returns its offset, and
+// the offset of the TCP checksum and the MSS the link fits through check
+// and mss, or -1 if there is none.
+static int n_xbee_mtu_find_mss(const unsigned char* frame, int len, int* check, int* mss) {
+  const struct ether_header* eh = (const struct ether_header*)frame;
+  const struct iphdr* iph;
+  const struct ip6_hdr* ip6h;
+  const struct tcphdr* th;
+  int off = N_XBEE_ETHHDR_LEN, end, i;
+
+  if (len < N_XBEE_ETHHDR_LEN)
+    return -1;
+  switch (ntohs(eh->ether_type)) {
+    case ETHERTYPE_IP:
+      if (len < off + sizeof(struct iphdr))
+        return -1;
+      iph = (const struct iphdr*)(frame + off);
+      // only the first fragment has the TCP header
+      if (iph->protocol != IPPROTO_TCP || iph->ihl < 5 || (ntohs(iph->frag_off) & IP_OFFMASK))
+        return -1;
+      off += iph->ihl * 4;
+      *mss = n_xbee_opts.mtu - sizeof(struct iphdr) - sizeof(struct tcphdr);
+      break;
+    case ETHERTYPE_IPV6:
+      if (len < off + sizeof(struct ip6_hdr))
+        return -1;
+      ip6h = (const struct ip6_hdr*)(frame + off);
+      // SYNs don't come with extension headers in practice
+      if (ip6h->ip6_nxt != IPPROTO_TCP)
+        return -1;
+      off += sizeof(struct ip6_hdr);
+      *mss = n_xbee_opts.mtu - sizeof(struct ip6_hdr) - sizeof(struct tcphdr);
+      break;
+    default:
+      return -1;
+  }
+  if (len < off + sizeof(struct tcphdr))
+    return -1;
+  th = (const struct tcphdr*)(frame + off);
+  end = off + th->doff * 4;
+  if (!th->syn || th->doff < 5 || end > len)
+    return -1;
+  *check = off + offsetof(struct tcphdr, check);
+
+  for (i = off + sizeof(struct tcphdr); i < end;) {
+    if (frame[i] == N_XBEE_TCPOPT_EOL)
+      break;
+    if (frame[i] == N_XBEE_TCPOPT_NOP) {
+      i++;
+      continue;
+    }
+    if (i + 1 >= end || frame[i + 1] < 2 || i + frame[i + 1] > end)
+      break;
+    if (frame[i] == N_XBEE_TCPOPT_MSS && frame[i + 1] == 4)
+      return i + 2;
+    i += frame[i + 1];
+  }
+  return -1;
+}
+
+int n_xbee_mtu_clamp_needed(const unsigned char* frame, int len) {
+  int check, mss, at = n_xbee_mtu_find_mss(frame, len, &check, &mss);
+  return at >= 0 && ((frame[at] << 8) | frame[at + 1]) > mss;
+}
+
+int n_xbee_mtu_clamp(unsigned char* frame, int len) {
+  int check, mss, old;
+  uint32_t sum;
+  int at = n_xbee_mtu_find_mss(frame, len, &check, &mss);
+
+  if (at < 0 || (old = (frame[at] << 8) | frame[at + 1]) <= mss)
+    return 0;
+  frame[at] = mss >> 8;
+  frame[at + 1] = mss & 0xFF;
+  // RFC 1624, HC' = ~(~HC + ~m + m')
+  sum = (~((frame[check] << 8) | frame[check + 1]) & 0xFFFF) + (~old & 0xFFFF) + mss;
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = ~sum & 0xFFFF;
+  frame[check] = sum >> 8;
+  frame[check + 1] = sum & 0xFF;
+  return 1;
+}
+
+/* = Too big = */
+// Writes an ICMP error built in txbuf back into the device.
+static void n_xbee_mtu_reply(struct xbee_serial_bridge* bridge, const unsigned char* frame, unsigned char* txbuf, int len, int type) {
+  struct ether_header* txeh = (struct ether_header*)txbuf;
+  // a tun takes the packet without the ethernet header
+  int off = n_xbee_opts.tun ? N_XBEE_ETHHDR_LEN : 0;
+
+  memcpy(txeh->ether_dhost, ((const struct ether_header*)frame)->ether_shost, ETH_ALEN);
+  memcpy(txeh->ether_shost, ((const struct ether_header*)frame)->ether_dhost, ETH_ALEN);
+  txeh->ether_type = htons(type);
+  if (write(bridge->netdev, txbuf + off, len - off) < 0)
+    printk(KERN_ALERT "%s: unable to write icmp error to %s, %d (%s)\n", __FUNCTION__, bridge->netdevName, errno, strerror(errno));
+}
+
+// ICMP fragmentation needed for the IPv4 packet in frame.
+static void n_xbee_mtu_frag_needed(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len) {
+  unsigned char txbuf[N_XBEE_ETHHDR_LEN + sizeof(struct iphdr) + 8 + 60 + 8];
+  const struct iphdr* iph = (const struct iphdr*)(frame + N_XBEE_ETHHDR_LEN);
+  const struct icmphdr* oic;
+  struct iphdr* txiph = (struct iphdr*)(txbuf + N_XBEE_ETHHDR_LEN);
+  struct icmphdr* ic = (struct icmphdr*)(txbuf + N_XBEE_ETHHDR_LEN + sizeof(struct iphdr));
+  int quote = iph->ihl * 4 + 8;
+
+  if (N_XBEE_ETHHDR_LEN + quote > len || !iph->saddr)
+    return;
+  // never an error about an error
+  if (iph->protocol == IPPROTO_ICMP) {
+    oic = (const struct icmphdr*)(frame + N_XBEE_ETHHDR_LEN + iph->ihl * 4);
+    if (oic->type != ICMP_ECHO && oic->type != ICMP_ECHOREPLY)
+      return;
+  }
+
+  memset(txiph, 0, sizeof(struct iphdr) + 8);
+  txiph->version = 4;
+  txiph->ihl = 5;
+  txiph->tos = IPTOS_PREC_INTERNETCONTROL;
+  txiph->tot_len = htons(sizeof(struct iphdr) + 8 + quote);
+  txiph->ttl = 64;
+  txiph->protocol = IPPROTO_ICMP;
+  // from where it was going, the kernel drops packets coming in on the
+  // tap from one of its own addresses
+  txiph->saddr = iph->daddr;
+  txiph->daddr = iph->saddr;
+  txiph->check = n_xbee_inet_csum(txiph, sizeof(struct iphdr));
+
+  ic->type = ICMP_DEST_UNREACH;
+  ic->code = ICMP_FRAG_NEEDED;
+  ic->un.frag.mtu = htons(n_xbee_opts.mtu);
+  memcpy((unsigned char*)ic + 8, iph, quote);
+  ic->checksum = n_xbee_inet_csum(ic, 8 + quote);
+
+  n_xbee_mtu_reply(bridge, frame, txbuf, N_XBEE_ETHHDR_LEN + sizeof(struct iphdr) + 8 + quote, ETHERTYPE_IP);
+}
+
+// ICMPv6 packet too big for the IPv6 packet in frame.
+static void n_xbee_mtu_too_big6(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len) {
+  unsigned char txbuf[N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr) + 8 + N_XBEE_MTU_QUOTE6];
+  // pseudo header and the message, for the checksum
+  unsigned char pseudo[40 + 8 + N_XBEE_MTU_QUOTE6];
+  const struct ip6_hdr* ip6h = (const struct ip6_hdr*)(frame + N_XBEE_ETHHDR_LEN);
+  struct ip6_hdr* txip6h = (struct ip6_hdr*)(txbuf + N_XBEE_ETHHDR_LEN);
+  unsigned char* ic = txbuf + N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr);
+  int quote = len - N_XBEE_ETHHDR_LEN;
+  uint16_t csum;
+
+  if (quote > N_XBEE_MTU_QUOTE6)
+    quote = N_XBEE_MTU_QUOTE6;
+  // nobody to send it to, or nothing to send it from
+  if (IN6_IS_ADDR_UNSPECIFIED(&ip6h->ip6_src) || IN6_IS_ADDR_MULTICAST(&ip6h->ip6_dst))
+    return;
+
+  memset(txip6h, 0, sizeof(struct ip6_hdr));
+  txip6h->ip6_flow = htonl(0x60000000);
+  txip6h->ip6_plen = htons(8 + quote);
+  txip6h->ip6_nxt = IPPROTO_ICMPV6;
+  txip6h->ip6_hlim = 64;
+  memcpy(&txip6h->ip6_src, &ip6h->ip6_dst, 16);
+  memcpy(&txip6h->ip6_dst, &ip6h->ip6_src, 16);
+
+  memset(ic, 0, 8);
+  ic[0] = N_XBEE_ICMP6_PACKET_TOO_BIG;
+  ic[4] = (n_xbee_opts.mtu >> 24) & 0xFF;
+  ic[5] = (n_xbee_opts.mtu >> 16) & 0xFF;
+  ic[6] = (n_xbee_opts.mtu >> 8) & 0xFF;
+  ic[7] = n_xbee_opts.mtu & 0xFF;
+  memcpy(ic + 8, ip6h, quote);
+
+  memset(pseudo, 0, 40);
+  memcpy(pseudo, &txip6h->ip6_src, 16);
+  memcpy(pseudo + 16, &txip6h->ip6_dst, 16);
+  pseudo[34] = (8 + quote) >> 8;
+  pseudo[35] = (8 + quote) & 0xFF;
+  pseudo[39] = IPPROTO_ICMPV6;
+  memcpy(pseudo + 40, ic, 8 + quote);
+  csum = n_xbee_inet_csum(pseudo, 40 + 8 + quote);
+  memcpy(ic + 2, &csum, 2);
+
+  n_xbee_mtu_reply(bridge, frame, txbuf, N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr) + 8 + quote, ETHERTYPE_IPV6);
+}
+
+int n_xbee_mtu_check(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len) {
+  const struct ether_header* eh = (const struct ether_header*)frame;
+  const struct iphdr* iph;
+  const struct ip6_hdr* ip6h;
+  int iplen;
+
+  if (len < N_XBEE_ETHHDR_LEN)
+    return 0;
+  switch (ntohs(eh->ether_type)) {
+    case ETHERTYPE_IP:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct iphdr))
+        return 0;
+      iph = (const struct iphdr*)(frame + N_XBEE_ETHHDR_LEN);
+      // from the header, a read that was cut short doesn't fool it
+      if ((iplen = ntohs(iph->tot_len)) <= n_xbee_opts.mtu)
+        return 0;
+      if (!(ntohs(iph->frag_off) & IP_DF))
+        break;
+      bridge->mtu_too_big++;
+      n_xbee_mtu_frag_needed(bridge, frame, len);
+      return 1;
+    case ETHERTYPE_IPV6:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr))
+        return 0;
+      ip6h = (const struct ip6_hdr*)(frame + N_XBEE_ETHHDR_LEN);
+      if ((iplen = sizeof(struct ip6_hdr) + ntohs(ip6h->ip6_plen)) <= n_xbee_opts.mtu)
+        return 0;
+      bridge->mtu_too_big++;
+      n_xbee_mtu_too_big6(bridge, frame, len);
+      return 1;
+    default:
+      iplen = len - N_XBEE_ETHHDR_LEN;
+      break;
+  }
+  // anything bigger than a receiver can rebuild is lost anyway
+  if (iplen > N_XBEE_NETDEV_MTU) {
+    bridge->mtu_too_big++;
+    return 1;
+  }
+  return 0;
+}
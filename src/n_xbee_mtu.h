@@ -0,0 +1,37 @@
+#pragma once
+#ifndef _N_XBEE_MTU_H
+#define _N_XBEE_MTU_H
+
+#include <stdint.h>
+
+/*
+ * Keeping IP within the link MTU.
+ *
+ * The device is created with --mtu (N_XBEE_NETDEV_MTU, the most a
+ * receiver can rebuild, by default), and TCP SYNs going either way have
+ * their MSS option lowered to fit it, so connections between hosts with
+ * bigger MTUs routed over the radios never depend on path MTU discovery.
+ *
+ * An IPv4 packet over the MTU with DF set, or any IPv6 packet over it, is
+ * answered with ICMP "fragmentation needed" / "packet too big" straight
+ * back into the device rather than being sent. IPv4 without DF still
+ * goes as long as a receiver can take it.
+ */
+// smallest --mtu, IPv6 wants 1280
+#define N_XBEE_MTU_MIN 576
+// bytes of the offending packet quoted in an ICMPv6 error
+#define N_XBEE_MTU_QUOTE6 256
+
+struct xbee_serial_bridge;
+
+// Whether frame is a TCP SYN whose MSS is more than the link fits.
+int n_xbee_mtu_clamp_needed(const unsigned char* frame, int len);
+// Lowers the MSS of a TCP SYN to fit the link and fixes up the checksum,
+// returns 1 if it did.
+int n_xbee_mtu_clamp(unsigned char* frame, int len);
+
+// Checks a frame read from the device against the MTU, returns 1 if it
+// is too big to send, in which case it has been answered if it should be.
+int n_xbee_mtu_check(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len);
+
+#endif
@@ -0,0 +1,164 @@
+#include "n_xbee.h"
+#include "n_xbee_nd.h"
+#include "n_xbee_bond.h"
+#include "n_xbee_hc.h"
+
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+
+#define N_XBEE_ND_MLD_QUERY 130
+#define N_XBEE_ND_MLD_REPORT 131
+#define N_XBEE_ND_MLD_DONE 132
+#define N_XBEE_ND_MLD2_REPORT 143
+
+// NS / NA: type, code, checksum, reserved or flags, target
+#define N_XBEE_ND_MSG_LEN 24
+// NA with a target link-layer address option
+#define N_XBEE_ND_NA_LEN (N_XBEE_ND_MSG_LEN + 8)
+#define N_XBEE_ND_NA_FRAME_LEN (N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr) + N_XBEE_ND_NA_LEN)
+// solicited, override
+#define N_XBEE_ND_NA_FLAGS 0x60
+
+static inline struct xbee_serial_bridge* n_xbee_nd_owner(struct xbee_serial_bridge* bridge) {
+  return bridge->bond ? bridge->bond->members[0] : bridge;
+}
+
+int n_xbee_nd_setup(struct xbee_serial_bridge* bridge) {
+  unsigned char iid[8];
+  if (!n_xbee_opts.ipv6)
+    return 0;
+  n_xbee_nd_iid(bridge->xbee_dev->wpan_dev.address.ieee.b, iid);
+  printk(KERN_INFO "%s: %s link-local is fe80::%02x%02x:%02x%02x:%02x%02x:%02x%02x\n", __FUNCTION__, bridge->netdevName,
+      iid[0], iid[1], iid[2], iid[3], iid[4], iid[5], iid[6], iid[7]);
+  return n_xbee_addr_set_ll6(bridge->netdev_idx, iid);
+}
+
+// Whether the identifier is the EUI-64 form of mac.
+static int n_xbee_nd_iid_is_mac(const unsigned char* iid, const unsigned char* mac) {
+  return iid[3] == 0xff && iid[4] == 0xfe && (iid[0] ^ 0x02) == mac[0] &&
+    iid[1] == mac[1] && iid[2] == mac[2] && memcmp(iid + 5, mac + 3, 3) == 0;
+}
+
+// Finds the node an address belongs to by its interface identifier.
+static xbee_remote_node* n_xbee_nd_lookup(struct xbee_serial_bridge* bridge, const unsigned char* target) {
+  unsigned char addr[8];
+  unsigned char mac[ETH_ALEN];
+  xbee_remote_node* nod;
+
+  n_xbee_nd_iid(target + 8, addr);
+  if ((nod = n_xbee_node_find(&bridge->nodes, (const addr64*)addr)))
+    return nod;
+  if (target[11] != 0xff || target[12] != 0xfe)
+    return NULL;
+  mac[0] = target[8] ^ 0x02;
+  mac[1] = target[9];
+  mac[2] = target[10];
+  memcpy(mac + 3, target + 13, 3);
+  return n_xbee_node_find_eth(&bridge->nodes, mac, ETH_ALEN);
+}
+
+static int n_xbee_nd_is_own(struct xbee_serial_bridge* bridge, const unsigned char* target) {
+  unsigned char iid[8];
+  n_xbee_nd_iid(bridge->xbee_dev->wpan_dev.address.ieee.b, iid);
+  return memcmp(target + 8, iid, 8) == 0 || n_xbee_nd_iid_is_mac(target + 8, bridge->mac);
+}
+
+// Writes a neighbour advertisement for the solicitation in frame to the
+// tap, on behalf of nod.
+static void n_xbee_nd_answer(struct xbee_serial_bridge* bridge, xbee_remote_node* nod, const unsigned char* frame, const unsigned char* ns) {
+  unsigned char txbuf[N_XBEE_ND_NA_FRAME_LEN];
+  // pseudo header and the message, for the checksum
+  unsigned char pseudo[32 + 8 + N_XBEE_ND_NA_LEN];
+  const struct ip6_hdr* ip6h = (const struct ip6_hdr*)(frame + N_XBEE_ETHHDR_LEN);
+  struct ether_header* txeh = (struct ether_header*)txbuf;
+  struct ip6_hdr* txip6h = (struct ip6_hdr*)(txbuf + N_XBEE_ETHHDR_LEN);
+  unsigned char* na = txbuf + N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr);
+  uint16_t csum;
+
+  memcpy(txeh->ether_dhost, ((const struct ether_header*)frame)->ether_shost, ETH_ALEN);
+  memcpy(txeh->ether_shost, nod->eth, ETH_ALEN);
+  txeh->ether_type = htons(ETHERTYPE_IPV6);
+
+  memset(txip6h, 0, sizeof(struct ip6_hdr));
+  txip6h->ip6_flow = htonl(0x60000000);
+  txip6h->ip6_plen = htons(N_XBEE_ND_NA_LEN);
+  txip6h->ip6_nxt = IPPROTO_ICMPV6;
+  txip6h->ip6_hlim = 255;
+  memcpy(&txip6h->ip6_src, ns + 8, 16);
+  memcpy(&txip6h->ip6_dst, &ip6h->ip6_src, 16);
+
+  memset(na, 0, N_XBEE_ND_NA_LEN);
+  na[0] = N_XBEE_ND_NA;
+  na[4] = N_XBEE_ND_NA_FLAGS;
+  memcpy(na + 8, ns + 8, 16);
+  // target link-layer address
+  na[N_XBEE_ND_MSG_LEN] = 2;
+  na[N_XBEE_ND_MSG_LEN + 1] = 1;
+  memcpy(na + N_XBEE_ND_MSG_LEN + 2, nod->eth, ETH_ALEN);
+
+  memset(pseudo, 0, sizeof(pseudo));
+  memcpy(pseudo, &txip6h->ip6_src, 16);
+  memcpy(pseudo + 16, &txip6h->ip6_dst, 16);
+  pseudo[35] = N_XBEE_ND_NA_LEN;
+  pseudo[39] = IPPROTO_ICMPV6;
+  memcpy(pseudo + 40, na, N_XBEE_ND_NA_LEN);
+  csum = n_xbee_inet_csum(pseudo, sizeof(pseudo));
+  memcpy(na + 2, &csum, 2);
+
+  if (write(bridge->netdev, txbuf, sizeof(txbuf)) < 0)
+    printk(KERN_ALERT "%s: unable to write neighbour advertisement to tap, %d (%s)\n", __FUNCTION__, errno, strerror(errno));
+}
+
+int n_xbee_nd_proxy(struct xbee_serial_bridge* bridge, unsigned char* frame, int len) {
+  struct ether_header* eh = (struct ether_header*)frame;
+  const struct ip6_hdr* ip6h;
+  const unsigned char* ns;
+  const unsigned char* target;
+  xbee_remote_node* nod;
+  int off, nxt, type, dad;
+
+  if (!n_xbee_opts.ipv6 || len < N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr) + 4 || ntohs(eh->ether_type) != ETHERTYPE_IPV6)
+    return 0;
+  ip6h = (const struct ip6_hdr*)(frame + N_XBEE_ETHHDR_LEN);
+  // only multicast costs a broadcast
+  if (ip6h->ip6_dst.s6_addr[0] != 0xff)
+    return 0;
+  off = N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr);
+  nxt = ip6h->ip6_nxt;
+  // MLD comes behind a hop-by-hop header with the router alert
+  if (nxt == IPPROTO_HOPOPTS) {
+    if (len < off + 8)
+      return 0;
+    nxt = frame[off];
+    off += (frame[off + 1] + 1) * 8;
+  }
+  if (nxt != IPPROTO_ICMPV6 || len < off + 4)
+    return 0;
+
+  type = frame[off];
+  if (type == N_XBEE_ND_MLD_REPORT || type == N_XBEE_ND_MLD_DONE || type == N_XBEE_ND_MLD2_REPORT)
+    return 1;
+  if (type != N_XBEE_ND_NS || len < off + N_XBEE_ND_MSG_LEN)
+    return 0;
+  ns = frame + off;
+  target = ns + 8;
+  dad = IN6_IS_ADDR_UNSPECIFIED(&ip6h->ip6_src);
+
+  bridge = n_xbee_nd_owner(bridge);
+  if (n_xbee_nd_is_own(bridge, target))
+    return dad;
+  if (!(nod = n_xbee_nd_lookup(bridge, target)))
+    return 0;
+  if (dad) {
+    // whoever has it should get to defend it
+    memcpy(eh->ether_dhost, nod->eth, ETH_ALEN);
+    return 0;
+  }
+#ifdef N_XBEE_VERBOSE
+  printk(KERN_INFO "%s: answering neighbour solicitation locally.\n", __FUNCTION__);
+#endif
+  n_xbee_nd_answer(bridge, nod, frame, ns);
+  return 1;
+}
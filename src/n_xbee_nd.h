@@ -0,0 +1,43 @@
+#pragma once
+#ifndef _N_XBEE_ND_H
+#define _N_XBEE_ND_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * IPv6 neighbour discovery without multicast, turned on with --ipv6.
+ *
+ * The tap gets fe80::/64 with the radio's 64 bit address as a modified
+ * EUI-64 for its link-local address, in place of the one the kernel
+ * would derive from the 48 bit MAC, so any node's link-local address
+ * follows from the node table.
+ *
+ * Neighbour solicitations from the tap to a solicited-node group are
+ * answered straight back into the tap when the target's interface
+ * identifier is a known node's 64 bit address, or the EUI-64 form of its
+ * MAC (what SLAAC uses). DAD for an address a node already has goes to
+ * that node unicast, DAD for our own derived address is dropped since
+ * radio addresses are unique, and MLD reports are dropped since nothing
+ * on the air listens for them. Anything else still goes out broadcast.
+ */
+#define N_XBEE_ND_NS 135
+#define N_XBEE_ND_NA 136
+
+struct xbee_serial_bridge;
+
+// The interface identifier for a 64 bit radio address.
+static inline void n_xbee_nd_iid(const unsigned char* addr64, unsigned char* iid) {
+  memcpy(iid, addr64, 8);
+  iid[0] ^= 0x02;
+}
+
+// Sets up the tap's link-local address, call once the tap exists.
+int n_xbee_nd_setup(struct xbee_serial_bridge* bridge);
+
+// Handles neighbour discovery read from the tap. Returns 1 if the frame
+// was answered or dropped, 0 if it should be sent, possibly with its
+// destination rewritten to a node's MAC.
+int n_xbee_nd_proxy(struct xbee_serial_bridge* bridge, unsigned char* frame, int len);
+
+#endif
@@ -0,0 +1,287 @@
+#include "n_xbee.h"
+#include "n_xbee_node.h"
+
+#include <string.h>
+
+#define N_XBEE_NODE_HASH_MASK (N_XBEE_NODE_HASH_SIZE - 1)
+
+/* = Seqlock = */
+static inline uint32_t n_xbee_node_read_begin(n_xbee_node_table* table) {
+  uint32_t seq;
+  // odd while a writer is in the middle of a change
+  while ((seq = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE)) & 1)
+    ;
+  return seq;
+}
+
+static inline int n_xbee_node_read_retry(n_xbee_node_table* table, uint32_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&table->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void n_xbee_node_write_begin(n_xbee_node_table* table) {
+  pthread_mutex_lock(&table->lock);
+  __atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void n_xbee_node_write_end(n_xbee_node_table* table) {
+  __atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&table->lock);
+}
+
+/* = Hashing = */
+static inline uint32_t n_xbee_node_mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (uint32_t)x;
+}
+
+static inline uint32_t n_xbee_node_hash_addr(const unsigned char* addr) {
+  uint64_t x;
+  memcpy(&x, addr, 8);
+  return n_xbee_node_mix(x);
+}
+
+static inline uint32_t n_xbee_node_hash_eth(const unsigned char* mac) {
+  uint64_t x = 0;
+  memcpy(&x, mac, 6);
+  return n_xbee_node_mix(x);
+}
+
+/* = Index probing = */
+// Walks the index from the hash until the node or an empty slot is hit.
+// Bounded so a reader racing a writer can never spin forever.
+static xbee_remote_node* n_xbee_node_probe_addr(n_xbee_node_table* table, const unsigned char* addr) {
+  uint32_t i, h = n_xbee_node_hash_addr(addr);
+  uint16_t idx;
+  xbee_remote_node* nod;
+  for (i = 0; i < N_XBEE_NODE_HASH_SIZE; i++) {
+    idx = __atomic_load_n(&table->by_addr[(h + i) & N_XBEE_NODE_HASH_MASK], __ATOMIC_RELAXED);
+    if (idx == N_XBEE_NODE_SLOT_EMPTY)
+      return NULL;
+    if (idx == N_XBEE_NODE_SLOT_DELETED || idx >= N_XBEE_NODE_MAX)
+      continue;
+    nod = &table->nodes[idx];
+    if (memcmp(nod->node_addr, addr, 8) == 0)
+      return nod;
+  }
+  return NULL;
+}
+
+static xbee_remote_node* n_xbee_node_probe_eth(n_xbee_node_table* table, const unsigned char* mac) {
+  uint32_t i, h = n_xbee_node_hash_eth(mac);
+  uint16_t idx;
+  xbee_remote_node* nod;
+  for (i = 0; i < N_XBEE_NODE_HASH_SIZE; i++) {
+    idx = __atomic_load_n(&table->by_eth[(h + i) & N_XBEE_NODE_HASH_MASK], __ATOMIC_RELAXED);
+    if (idx == N_XBEE_NODE_SLOT_EMPTY)
+      return NULL;
+    if (idx == N_XBEE_NODE_SLOT_DELETED || idx >= N_XBEE_NODE_MAX)
+      continue;
+    nod = &table->nodes[idx];
+    if (memcmp(nod->eth, mac, 6) == 0)
+      return nod;
+  }
+  return NULL;
+}
+
+// Writer side, table->lock held.
+static void n_xbee_node_index_put(uint16_t* index, uint32_t h, uint16_t idx) {
+  uint32_t i;
+  uint16_t cur;
+  for (i = 0; i < N_XBEE_NODE_HASH_SIZE; i++) {
+    cur = index[(h + i) & N_XBEE_NODE_HASH_MASK];
+    if (cur == N_XBEE_NODE_SLOT_EMPTY || cur == N_XBEE_NODE_SLOT_DELETED) {
+      __atomic_store_n(&index[(h + i) & N_XBEE_NODE_HASH_MASK], idx, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+static int n_xbee_node_index_del(uint16_t* index, uint32_t h, uint16_t idx) {
+  uint32_t i;
+  uint16_t cur;
+  for (i = 0; i < N_XBEE_NODE_HASH_SIZE; i++) {
+    cur = index[(h + i) & N_XBEE_NODE_HASH_MASK];
+    if (cur == N_XBEE_NODE_SLOT_EMPTY)
+      return 0;
+    if (cur == idx) {
+      __atomic_store_n(&index[(h + i) & N_XBEE_NODE_HASH_MASK], N_XBEE_NODE_SLOT_DELETED, __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Drops deleted markers once they start making probes long.
+static void n_xbee_node_rehash(n_xbee_node_table* table) {
+  int i;
+  xbee_remote_node* nod;
+  memset(table->by_addr, 0xFF, sizeof(table->by_addr));
+  memset(table->by_eth, 0xFF, sizeof(table->by_eth));
+  for (i = 0; i < N_XBEE_NODE_MAX; i++) {
+    nod = &table->nodes[i];
+    if (!nod->in_use)
+      continue;
+    n_xbee_node_index_put(table->by_addr, n_xbee_node_hash_addr(nod->node_addr), i);
+    n_xbee_node_index_put(table->by_eth, n_xbee_node_hash_eth(nod->eth), i);
+  }
+  table->deleted = 0;
+}
+
+static void n_xbee_node_remove(n_xbee_node_table* table, xbee_remote_node* nod) {
+  uint16_t idx = nod - table->nodes;
+  n_xbee_node_index_del(table->by_addr, n_xbee_node_hash_addr(nod->node_addr), idx);
+  n_xbee_node_index_del(table->by_eth, n_xbee_node_hash_eth(nod->eth), idx);
+  nod->in_use = 0;
+  table->count--;
+  table->deleted += 2;
+  table->changes++;
+}
+
+/* = Public = */
+void n_xbee_node_table_init(n_xbee_node_table* table) {
+  memset(table, 0, sizeof(n_xbee_node_table));
+  pthread_mutex_init(&table->lock, NULL);
+  n_xbee_node_rehash(table);
+}
+
+void n_xbee_node_table_clear(n_xbee_node_table* table) {
+  n_xbee_node_write_begin(table);
+  memset(table->nodes, 0, sizeof(table->nodes));
+  table->count = 0;
+  table->changes++;
+  n_xbee_node_rehash(table);
+  n_xbee_node_write_end(table);
+}
+
+xbee_remote_node* n_xbee_node_find(n_xbee_node_table* table, const addr64* id) {
+  uint32_t seq;
+  xbee_remote_node* nod;
+  do {
+    seq = n_xbee_node_read_begin(table);
+    nod = n_xbee_node_probe_addr(table, id->b);
+  } while (n_xbee_node_read_retry(table, seq));
+  return nod;
+}
+
+xbee_remote_node* n_xbee_node_find_eth(n_xbee_node_table* table, const void* addr, int len) {
+  uint32_t seq;
+  xbee_remote_node* nod;
+  // only the ethernet suffix is indexed
+  if (len != 6)
+    return NULL;
+  do {
+    seq = n_xbee_node_read_begin(table);
+    nod = n_xbee_node_probe_eth(table, addr);
+  } while (n_xbee_node_read_retry(table, seq));
+  return nod;
+}
+
+int n_xbee_node_copy(n_xbee_node_table* table, int i, xbee_remote_node* out) {
+  uint32_t seq;
+  do {
+    seq = n_xbee_node_read_begin(table);
+    memcpy(out, &table->nodes[i], sizeof(xbee_remote_node));
+  } while (n_xbee_node_read_retry(table, seq));
+  return out->in_use;
+}
+
+xbee_remote_node* n_xbee_node_find_or_insert(n_xbee_node_table* table, const addr64* id) {
+  char addr64_buf[ADDR64_STRING_LENGTH];
+  int i;
+  uint32_t now = xbee_millisecond_timer();
+  addr64 evicted;
+  xbee_remote_node* nod;
+  xbee_remote_node* oldest = NULL;
+
+  if ((nod = n_xbee_node_find(table, id))) {
+    __atomic_store_n(&nod->last_seen, now, __ATOMIC_RELAXED);
+    return nod;
+  }
+
+  n_xbee_node_write_begin(table);
+  // someone else might have beaten us to it
+  if ((nod = n_xbee_node_probe_addr(table, id->b))) {
+    nod->last_seen = now;
+    n_xbee_node_write_end(table);
+    return nod;
+  }
+
+  if (table->count >= N_XBEE_NODE_MAX) {
+    for (i = 0; i < N_XBEE_NODE_MAX; i++) {
+      if (!oldest || now - table->nodes[i].last_seen > now - oldest->last_seen)
+        oldest = &table->nodes[i];
+    }
+    memcpy(&evicted, oldest->node_addr, sizeof(addr64));
+    n_xbee_node_remove(table, oldest);
+  }
+  if (table->deleted > N_XBEE_NODE_HASH_SIZE / 4)
+    n_xbee_node_rehash(table);
+
+  for (i = 0; i < N_XBEE_NODE_MAX; i++) {
+    if (!table->nodes[i].in_use)
+      break;
+  }
+  nod = &table->nodes[i];
+  memset(nod, 0, sizeof(xbee_remote_node));
+  memcpy(nod->node_addr, id, sizeof(addr64));
+  memcpy(nod->eth, nod->node_addr + 2, 6);
+  nod->last_seen = now;
+  nod->in_use = 1;
+  n_xbee_node_index_put(table->by_addr, n_xbee_node_hash_addr(nod->node_addr), i);
+  n_xbee_node_index_put(table->by_eth, n_xbee_node_hash_eth(nod->eth), i);
+  table->count++;
+  table->changes++;
+  n_xbee_node_write_end(table);
+
+  if (oldest)
+    printk(KERN_INFO "%s: node table full, evicted %s\n", __FUNCTION__, addr64_format(addr64_buf, &evicted));
+  printk(KERN_INFO "%s: registering new remote node %s\n", __FUNCTION__, addr64_format(addr64_buf, id));
+  return nod;
+}
+
+void n_xbee_node_set_eth(n_xbee_node_table* table, xbee_remote_node* nod, const unsigned char* mac) {
+  uint16_t idx = nod - table->nodes;
+  if (memcmp(nod->eth, mac, 6) == 0)
+    return;
+  n_xbee_node_write_begin(table);
+  if (nod->in_use && n_xbee_node_index_del(table->by_eth, n_xbee_node_hash_eth(nod->eth), idx)) {
+    table->deleted++;
+    memcpy(nod->eth, mac, 6);
+    n_xbee_node_index_put(table->by_eth, n_xbee_node_hash_eth(nod->eth), idx);
+  }
+  n_xbee_node_write_end(table);
+}
+
+static inline int n_xbee_node_is_stale(const xbee_remote_node* nod, uint32_t now, uint32_t max_age) {
+  return nod->in_use && now - __atomic_load_n(&nod->last_seen, __ATOMIC_RELAXED) > max_age;
+}
+
+int n_xbee_node_expire(n_xbee_node_table* table, uint32_t now, uint32_t max_age) {
+  int i, expired = 0;
+
+  // don't make readers retry unless something is actually going away
+  for (i = 0; i < N_XBEE_NODE_MAX; i++) {
+    if (n_xbee_node_is_stale(&table->nodes[i], now, max_age))
+      break;
+  }
+  if (i == N_XBEE_NODE_MAX)
+    return 0;
+
+  n_xbee_node_write_begin(table);
+  for (; i < N_XBEE_NODE_MAX; i++) {
+    if (!n_xbee_node_is_stale(&table->nodes[i], now, max_age))
+      continue;
+    n_xbee_node_remove(table, &table->nodes[i]);
+    expired++;
+  }
+  if (table->deleted > N_XBEE_NODE_HASH_SIZE / 4)
+    n_xbee_node_rehash(table);
+  n_xbee_node_write_end(table);
+
+  printk(KERN_INFO "%s: forgot %d silent node(s), %d left\n", __FUNCTION__, expired, table->count);
+  return expired;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#ifndef _N_XBEE_NODE_H
+#define _N_XBEE_NODE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <xbee/platform.h>
+
+/*
+ * Remote node table.
+ *
+ * Nodes live in a fixed array and are found through two open addressing
+ * indexes, one keyed by the full 64 bit address and one by the 48 bit
+ * ethernet address, which is the address suffix unless the node told us
+ * it answers to a bond MAC. Writers serialize on lock and bump seq around every
+ * change, readers never block and retry if seq moved under them.
+ *
+ * Node pointers stay valid memory for the life of the table, but a slot
+ * is reused once its node is evicted, which only happens after it has
+ * been silent for the max age or the table is full.
+ */
+#define N_XBEE_NODE_MAX 512
+// power of 2, at least twice N_XBEE_NODE_MAX
+#define N_XBEE_NODE_HASH_SIZE 1024
+// forget nodes that have not been heard from in 30 minutes
+#define N_XBEE_NODE_MAX_AGE (30 * 60 * 1000)
+
+#define N_XBEE_NODE_SLOT_EMPTY 0xFFFF
+#define N_XBEE_NODE_SLOT_DELETED 0xFFFE
+
+// Discovered remote node
+struct xbee_remote_node;
+typedef struct xbee_remote_node {
+  unsigned char node_addr[8];
+  // MAC the node's frames carry, indexed by by_eth
+  unsigned char eth[6];
+  // N_XBEE_CAP_* the node told us about
+  uint16_t caps;
+  // we asked the node for its caps already
+  uint8_t caps_requested;
+  uint8_t in_use;
+  // xbee_millisecond_timer() when we last heard from it
+  uint32_t last_seen;
+  // transmit status results for frames sent to it
+  uint32_t tx_ok;
+  uint32_t tx_fail;
+  uint32_t tx_retries;
+  // tap frames to and radio frames from it
+  uint32_t tx_frames;
+  uint64_t tx_bytes;
+  uint32_t rx_frames;
+  uint64_t rx_bytes;
+  // dictionary ID it compresses with, 0 for none
+  uint16_t lz_dict;
+  // bytes we had to send it, and bytes that went on the air for them
+  uint32_t tx_lz_in;
+  uint32_t tx_lz_out;
+} xbee_remote_node;
+
+typedef struct n_xbee_node_table {
+  pthread_mutex_t lock;
+  uint32_t seq;
+  int count;
+  int deleted;
+  // bumped whenever a node is added or goes away, never reset
+  uint32_t changes;
+  uint16_t by_addr[N_XBEE_NODE_HASH_SIZE];
+  uint16_t by_eth[N_XBEE_NODE_HASH_SIZE];
+  xbee_remote_node nodes[N_XBEE_NODE_MAX];
+} n_xbee_node_table;
+
+void n_xbee_node_table_init(n_xbee_node_table* table);
+// Forgets every node.
+void n_xbee_node_table_clear(n_xbee_node_table* table);
+
+// Lookup by full 64 bit address, never blocks.
+xbee_remote_node* n_xbee_node_find(n_xbee_node_table* table, const addr64* id);
+// Lookup by the last len (should be ETH_ALEN) bytes, never blocks.
+xbee_remote_node* n_xbee_node_find_eth(n_xbee_node_table* table, const void* addr, int len);
+// Lookup and mark as seen, inserting the node if it's new.
+xbee_remote_node* n_xbee_node_find_or_insert(n_xbee_node_table* table, const addr64* id);
+// Re-indexes the node under a different ethernet address.
+void n_xbee_node_set_eth(n_xbee_node_table* table, xbee_remote_node* nod, const unsigned char* mac);
+// Copies slot i out whole, for readers on another thread. Returns
+// whether it holds a node, retrying while a writer is in the middle.
+int n_xbee_node_copy(n_xbee_node_table* table, int i, xbee_remote_node* out);
+// Evicts nodes not heard from in max_age ms, returns how many.
+int n_xbee_node_expire(n_xbee_node_table* table, uint32_t now, uint32_t max_age);
+
+#endif
@@ -0,0 +1,26 @@
+#include "n_xbee.h"
+#include "n_xbee_pool.h"
+
+#include <string.h>
+
+_Static_assert(N_XBEE_FRAME_MAX <= N_XBEE_POOL_BUF, "pool buffers must hold a full tap frame");
+
+int n_xbee_pool_init(n_xbee_pool* pool, int size) {
+  int i;
+  memset(pool, 0, sizeof(n_xbee_pool));
+  if (!(pool->pkts = calloc(size, sizeof(n_xbee_pkt)))) {
+    printk(KERN_ALERT "%s: unable to allocate %d packet buffers.\n", __FUNCTION__, size);
+    return -ENOMEM;
+  }
+  for (i = size - 1; i >= 0; i--) {
+    pool->pkts[i].next = pool->free;
+    pool->free = &pool->pkts[i];
+  }
+  pool->size = pool->avail = pool->min_avail = size;
+  return 0;
+}
+
+void n_xbee_pool_destroy(n_xbee_pool* pool) {
+  free(pool->pkts);
+  memset(pool, 0, sizeof(n_xbee_pool));
+}
@@ -0,0 +1,70 @@
+#pragma once
+#ifndef _N_XBEE_POOL_H
+#define _N_XBEE_POOL_H
+
+#include <stdint.h>
+
+/*
+ * Fixed size packet buffers.
+ *
+ * Each tap gets one pool, allocated when the tap comes up. Frames are
+ * read from the tap straight into a pool buffer, which the scheduler
+ * queues and the transmit path sends from, then hands back. Nothing on
+ * the way touches the heap. A pool is only used by the worker that
+ * drives its tap, so it takes no lock.
+ */
+// a full tap frame, N_XBEE_FRAME_MAX, with room to spare
+#define N_XBEE_POOL_BUF 1536
+
+typedef struct n_xbee_pkt {
+  struct n_xbee_pkt* next;
+  // xbee_millisecond_timer() when it was queued
+  uint32_t enqueued;
+  // n_xbee_stats_us() when it was read from the tap
+  uint32_t read_us;
+  int len;
+  unsigned char data[N_XBEE_POOL_BUF];
+} n_xbee_pkt;
+
+typedef struct n_xbee_pool {
+  n_xbee_pkt* pkts;
+  n_xbee_pkt* free;
+  int size;
+  int avail;
+  // fewest buffers ever free at once
+  int min_avail;
+  uint32_t gets;
+  uint32_t puts;
+  // gets that found the pool empty
+  uint32_t empty;
+} n_xbee_pool;
+
+// Allocates size buffers up front, returns 0 or <0.
+int n_xbee_pool_init(n_xbee_pool* pool, int size);
+void n_xbee_pool_destroy(n_xbee_pool* pool);
+
+// Returns a free buffer or NULL.
+static inline n_xbee_pkt* n_xbee_pool_get(n_xbee_pool* pool) {
+  n_xbee_pkt* pkt = pool->free;
+  if (!pkt) {
+    pool->empty++;
+    return NULL;
+  }
+  pool->free = pkt->next;
+  pkt->next = NULL;
+  pool->gets++;
+  if (--pool->avail < pool->min_avail)
+    pool->min_avail = pool->avail;
+  return pkt;
+}
+
+static inline void n_xbee_pool_put(n_xbee_pool* pool, n_xbee_pkt* pkt) {
+  if (!pkt)
+    return;
+  pkt->next = pool->free;
+  pool->free = pkt;
+  pool->avail++;
+  pool->puts++;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+#ifndef _N_XBEE_PROTO_H
+#define _N_XBEE_PROTO_H
+
+/*
+ * Over-the-air encapsulation.
+ *
+ * Frames on N_XBEE_CLUSTER_ID are plain ethernet frames, exactly as read
+ * from the tap. This is what older builds speak, and what we still send
+ * whenever a frame fits in a single radio payload.
+ *
+ * Frames on N_XBEE_CLUSTER_ID_ENCAP start with a one byte dispatch value
+ * (loosely modelled on 6LoWPAN) that says how to interpret the rest.
+ */
+
+// encapsulated frames, see dispatch values below
+#define N_XBEE_CLUSTER_ID_ENCAP 0x12
+
+// control message, second byte is one of N_XBEE_CTRL_*
+#define N_XBEE_DISPATCH_CTRL 0x01
+
+// bonded frame, see n_xbee_bond.h
+#define N_XBEE_DISPATCH_BOND 0x02
+
+// several small datagrams for the same node in one radio frame:
+// [N_XBEE_DISPATCH_AGG] [len] datagram [len] datagram ...
+// each datagram starts with its own N_XBEE_DISPATCH_HC or _ETH
+#define N_XBEE_DISPATCH_AGG 0x03
+
+// compressed datagram, see n_xbee_lz.h
+#define N_XBEE_DISPATCH_LZ 0x04
+
+// uncompressed ethernet frame follows
+#define N_XBEE_DISPATCH_ETH 0x40
+
+// compressed headers, see n_xbee_hc.h
+#define N_XBEE_DISPATCH_HC 0x60
+#define N_XBEE_DISPATCH_HC_MASK 0xE0
+
+// fragment headers, the low 3 bits carry bits 8-10 of the datagram size
+#define N_XBEE_DISPATCH_FRAG1 0xC0
+#define N_XBEE_DISPATCH_FRAGN 0xE0
+#define N_XBEE_DISPATCH_FRAG_MASK 0xF8
+
+/*
+ * Capability exchange. Sent to every node we see for the first time,
+ * nodes that do not answer only ever get plain ethernet frames.
+ *
+ * [N_XBEE_DISPATCH_CTRL] [N_XBEE_CTRL_CAPS] [caps hi] [caps lo] [flags] [bond mac] [dict hi] [dict lo]
+ *
+ * The 6 byte bond MAC is only there when N_XBEE_CAP_BOND is set, it is the
+ * address the node's frames carry no matter which of its radios sent them.
+ * The dictionary ID follows it when N_XBEE_CAP_LZ is set, 0 for none.
+ */
+#define N_XBEE_CTRL_CAPS 0x01
+#define N_XBEE_CTRL_CAPS_LEN 5
+#define N_XBEE_CTRL_CAPS_BOND_LEN 11
+#define N_XBEE_CTRL_CAPS_LZ_LEN 13
+// sender wants our caps back
+#define N_XBEE_CTRL_FLAG_REPLY 0x01
+
+#define N_XBEE_CAP_FRAG 0x0001
+#define N_XBEE_CAP_HC 0x0002
+#define N_XBEE_CAP_BOND 0x0004
+#define N_XBEE_CAP_AGG 0x0008
+#define N_XBEE_CAP_LZ 0x0010
+
+#endif
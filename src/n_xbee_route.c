@@ -0,0 +1,244 @@
+#include "n_xbee.h"
+#include "n_xbee_route.h"
+#include "n_xbee_bond.h"
+#include "n_xbee_nd.h"
+
+#include <string.h>
+#include <ctype.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+#define N_XBEE_ROUTE_MASK (N_XBEE_ROUTE_SIZE - 1)
+
+void n_xbee_route_init(n_xbee_route_table* table) {
+  memset(table, 0, sizeof(n_xbee_route_table));
+}
+
+// The tap owner keeps the table, a bond shares one.
+static inline struct xbee_serial_bridge* n_xbee_route_owner(struct xbee_serial_bridge* bridge) {
+  return bridge->bond ? bridge->bond->members[0] : bridge;
+}
+
+static inline int n_xbee_route_alen(int family) {
+  return family == 4 ? 4 : 16;
+}
+
+static uint32_t n_xbee_route_hash(int family, const unsigned char* addr) {
+  uint32_t h = 2166136261u;
+  int i;
+  for (i = 0; i < n_xbee_route_alen(family); i++) {
+    h ^= addr[i];
+    h *= 16777619u;
+  }
+  return h ^ (h >> 16);
+}
+
+/* = Configuration = */
+int n_xbee_route_parse(const char* arg, n_xbee_route* route) {
+  char prefix[INET6_ADDRSTRLEN + 4];
+  const char* eq = strchr(arg, '=');
+  char* slash;
+  int i, n = 0, max;
+
+  memset(route, 0, sizeof(n_xbee_route));
+  if (!eq || eq - arg >= (int)sizeof(prefix))
+    return -EINVAL;
+  memcpy(prefix, arg, eq - arg);
+  prefix[eq - arg] = '\0';
+  if ((slash = strchr(prefix, '/')))
+    *slash = '\0';
+
+  if (inet_pton(AF_INET, prefix, route->addr) == 1)
+    route->family = 4;
+  else if (inet_pton(AF_INET6, prefix, route->addr) == 1)
+    route->family = 6;
+  else
+    return -EINVAL;
+  max = n_xbee_route_alen(route->family) * 8;
+  route->plen = slash ? atoi(slash + 1) : max;
+  if (route->plen > max)
+    return -EINVAL;
+
+  // 0013A200-40A1B2C3, 00:13:a2:..., or just the digits
+  for (i = 1; eq[i] && n < 16; i++) {
+    if (!isxdigit((unsigned char)eq[i]))
+      continue;
+    route->node_addr[n / 2] |= (isdigit((unsigned char)eq[i]) ? eq[i] - '0' : (tolower((unsigned char)eq[i]) - 'a' + 10)) << (n & 1 ? 0 : 4);
+    n++;
+  }
+  return n == 16 && !eq[i] ? 0 : -EINVAL;
+}
+
+/* = Host routes = */
+static n_xbee_route* n_xbee_route_find(n_xbee_route_table* table, int family, const unsigned char* addr) {
+  uint32_t i, h = n_xbee_route_hash(family, addr);
+  n_xbee_route* ent;
+  for (i = 0; i < N_XBEE_ROUTE_PROBE; i++) {
+    ent = &table->hosts[(h + i) & N_XBEE_ROUTE_MASK];
+    if (ent->family == family && memcmp(ent->addr, addr, n_xbee_route_alen(family)) == 0)
+      return ent;
+  }
+  return NULL;
+}
+
+static void n_xbee_route_insert(n_xbee_route_table* table, int family, const unsigned char* addr, const unsigned char* node_addr, uint32_t now) {
+  uint32_t i, h = n_xbee_route_hash(family, addr);
+  n_xbee_route* ent;
+  n_xbee_route* victim = NULL;
+
+  for (i = 0; i < N_XBEE_ROUTE_PROBE; i++) {
+    ent = &table->hosts[(h + i) & N_XBEE_ROUTE_MASK];
+    if (!ent->family || (ent->family == family && memcmp(ent->addr, addr, n_xbee_route_alen(family)) == 0)) {
+      victim = ent;
+      break;
+    }
+    // nothing free, take the stalest
+    if (!victim || now - ent->learned > now - victim->learned)
+      victim = ent;
+  }
+  memset(victim, 0, sizeof(n_xbee_route));
+  victim->family = family;
+  victim->plen = n_xbee_route_alen(family) * 8;
+  memcpy(victim->addr, addr, n_xbee_route_alen(family));
+  memcpy(victim->node_addr, node_addr, 8);
+  victim->learned = now;
+}
+
+void n_xbee_route_learn(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len, const unsigned char* from, uint32_t now) {
+  const struct ether_header* eh = (const struct ether_header*)frame;
+  const unsigned char* src;
+  uint32_t a;
+
+  if (len < N_XBEE_ETHHDR_LEN)
+    return;
+  switch (ntohs(eh->ether_type)) {
+    case ETHERTYPE_IP:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct iphdr))
+        return;
+      src = (const unsigned char*)&((const struct iphdr*)(frame + N_XBEE_ETHHDR_LEN))->saddr;
+      memcpy(&a, src, 4);
+      // DHCP clients and the like don't have an address yet
+      if (!a || a == INADDR_BROADCAST || (src[0] & 0xF0) == 0xE0)
+        return;
+      n_xbee_route_insert(&n_xbee_route_owner(bridge)->routes, 4, src, from, now);
+      return;
+    case ETHERTYPE_IPV6:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr))
+        return;
+      src = ((const struct ip6_hdr*)(frame + N_XBEE_ETHHDR_LEN))->ip6_src.s6_addr;
+      if (IN6_IS_ADDR_UNSPECIFIED((const struct in6_addr*)src) || src[0] == 0xff)
+        return;
+      n_xbee_route_insert(&n_xbee_route_owner(bridge)->routes, 6, src, from, now);
+      return;
+  }
+}
+
+void n_xbee_route_discovered(struct xbee_serial_bridge* bridge, const char* ni, const unsigned char* node_addr, uint32_t now) {
+  unsigned char addr[4];
+  if (!n_xbee_opts.tun || inet_pton(AF_INET, ni, addr) != 1)
+    return;
+  n_xbee_route_insert(&n_xbee_route_owner(bridge)->routes, 4, addr, node_addr, now);
+}
+
+/* = Lookup = */
+static int n_xbee_route_match(const unsigned char* addr, const unsigned char* prefix, int plen) {
+  int bytes = plen / 8, bits = plen % 8;
+  if (memcmp(addr, prefix, bytes) != 0)
+    return 0;
+  return !bits || ((addr[bytes] ^ prefix[bytes]) & (0xFF << (8 - bits))) == 0;
+}
+
+static int n_xbee_route_is_bcast(struct xbee_serial_bridge* bridge, int family, const unsigned char* dst) {
+  uint32_t a;
+  if (family == 6)
+    return dst[0] == 0xff;
+  memcpy(&a, dst, 4);
+  return a == INADDR_BROADCAST || (dst[0] & 0xF0) == 0xE0 || n_xbee_addr_is_bcast4(&bridge->addrs, dst);
+}
+
+// The node at node_addr, added to the node tables if we haven't heard
+// from it yet, which a static route allows.
+static xbee_remote_node* n_xbee_route_node(struct xbee_serial_bridge* bridge, const unsigned char* node_addr) {
+  int i;
+  xbee_remote_node* nod;
+
+  if ((nod = n_xbee_node_find(&bridge->nodes, (const addr64*)node_addr)))
+    return nod;
+  if (bridge->bond) {
+    for (i = 1; i < bridge->bond->nmembers; i++)
+      n_xbee_node_find_or_insert(&bridge->bond->members[i]->nodes, (const addr64*)node_addr);
+  }
+  return n_xbee_node_find_or_insert(&bridge->nodes, (const addr64*)node_addr);
+}
+
+static xbee_remote_node* n_xbee_route_lookup(struct xbee_serial_bridge* bridge, int family, const unsigned char* dst, uint32_t now) {
+  int i;
+  unsigned char node_addr[8];
+  n_xbee_route* ent;
+  n_xbee_route* best = NULL;
+  xbee_remote_node* nod;
+
+  if ((ent = n_xbee_route_find(&bridge->routes, family, dst)) && now - ent->learned <= N_XBEE_ROUTE_MAX_AGE)
+    return n_xbee_route_node(bridge, ent->node_addr);
+  // a link-local address names its node
+  if (family == 6 && dst[0] == 0xfe && (dst[1] & 0xC0) == 0x80) {
+    n_xbee_nd_iid(dst + 8, node_addr);
+    if ((nod = n_xbee_node_find(&bridge->nodes, (const addr64*)node_addr)))
+      return nod;
+  }
+  for (i = 0; i < n_xbee_opts.nroutes; i++) {
+    ent = &n_xbee_opts.routes[i];
+    if (ent->family == family && (!best || ent->plen > best->plen) && n_xbee_route_match(dst, ent->addr, ent->plen))
+      best = ent;
+  }
+  return best ? n_xbee_route_node(bridge, best->node_addr) : NULL;
+}
+
+int n_xbee_route_frame(struct xbee_serial_bridge* bridge, unsigned char* frame, int len, uint32_t now) {
+  struct ether_header* eh = (struct ether_header*)frame;
+  const unsigned char* ip = frame + N_XBEE_ETHHDR_LEN;
+  const unsigned char* dst;
+  xbee_remote_node* nod;
+  int family;
+
+  if (len <= N_XBEE_ETHHDR_LEN)
+    return -EINVAL;
+  bridge = n_xbee_route_owner(bridge);
+  switch (ip[0] >> 4) {
+    case 4:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct iphdr))
+        return -EINVAL;
+      family = 4;
+      dst = (const unsigned char*)&((const struct iphdr*)ip)->daddr;
+      eh->ether_type = htons(ETHERTYPE_IP);
+      break;
+    case 6:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr))
+        return -EINVAL;
+      family = 6;
+      dst = ((const struct ip6_hdr*)ip)->ip6_dst.s6_addr;
+      eh->ether_type = htons(ETHERTYPE_IPV6);
+      break;
+    default:
+      return -EPROTONOSUPPORT;
+  }
+  memcpy(eh->ether_shost, bridge->mac, ETH_ALEN);
+
+  if (n_xbee_route_is_bcast(bridge, family, dst)) {
+    bridge->routes.bcasts++;
+    memset(eh->ether_dhost, 0xFF, ETH_ALEN);
+    return 0;
+  }
+  if ((nod = n_xbee_route_lookup(bridge, family, dst, now))) {
+    bridge->routes.hits++;
+    memcpy(eh->ether_dhost, nod->eth, ETH_ALEN);
+    return 0;
+  }
+  // whoever has it answers, and the answer teaches us the route
+  bridge->routes.floods++;
+  memset(eh->ether_dhost, 0xFF, ETH_ALEN);
+  return 0;
+}
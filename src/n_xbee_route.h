@@ -0,0 +1,79 @@
+#pragma once
+#ifndef _N_XBEE_ROUTE_H
+#define _N_XBEE_ROUTE_H
+
+#include <stdint.h>
+
+#include <net/ethernet.h>
+
+/*
+ * IP to radio routes, for --tun.
+ *
+ * A TUN device hands us bare IP packets, with no MAC to look a node up
+ * by and no ARP to find one, so the 64 bit address a packet goes to
+ * comes from here instead:
+ *
+ *  - host routes learned from the source address of every packet a node
+ *    sends us, aged out after N_XBEE_ROUTE_MAX_AGE
+ *  - host routes from discovery, for nodes whose NI is an IPv4 address
+ *  - fe80:: addresses, whose interface identifier is the node's 64 bit
+ *    address (see n_xbee_nd.h)
+ *  - static routes from --route=PREFIX=ADDR64, longest prefix first
+ *
+ * Multicast, limited broadcast and the directed broadcast of any of the
+ * device's subnets go out as radio broadcasts, and so does unicast we
+ * have no route for, as a learning switch would flood it; the reply
+ * teaches us the route.
+ *
+ * Packets are given an ethernet header from the routed node's MAC on
+ * the way in, so they are queued, compressed and sent exactly like tap
+ * frames, and a TAP peer can't tell the difference. Header compression
+ * leaves the MACs off the air anyway.
+ */
+// learned host routes, power of 2
+#define N_XBEE_ROUTE_SIZE 256
+// slots looked at per lookup
+#define N_XBEE_ROUTE_PROBE 8
+#define N_XBEE_ROUTE_STATIC_MAX 32
+// ms a learned route is used for after the node was last heard from
+#define N_XBEE_ROUTE_MAX_AGE (30 * 60 * 1000)
+
+struct xbee_serial_bridge;
+
+typedef struct n_xbee_route {
+  // 4 or 6, 0 if free
+  uint8_t family;
+  // prefix length, static routes only
+  uint8_t plen;
+  // network order, IPv4 in the first 4 bytes
+  unsigned char addr[16];
+  unsigned char node_addr[8];
+  // xbee_millisecond_timer() when last heard from, learned routes only
+  uint32_t learned;
+} n_xbee_route;
+
+typedef struct n_xbee_route_table {
+  // packets routed to a node, flooded for lack of a route, and broadcast
+  uint32_t hits;
+  uint32_t floods;
+  uint32_t bcasts;
+  n_xbee_route hosts[N_XBEE_ROUTE_SIZE];
+} n_xbee_route_table;
+
+void n_xbee_route_init(n_xbee_route_table* table);
+
+// Parses PREFIX=ADDR64, PREFIX being an IPv4 or IPv6 address with an
+// optional /len and ADDR64 16 hex digits, optionally separated.
+int n_xbee_route_parse(const char* arg, n_xbee_route* route);
+
+// Learns a route to from from an ethernet frame that came in over the air.
+void n_xbee_route_learn(struct xbee_serial_bridge* bridge, const unsigned char* frame, int len, const unsigned char* from, uint32_t now);
+// Learns a host route from a node's NI, if it is an IPv4 address.
+void n_xbee_route_discovered(struct xbee_serial_bridge* bridge, const char* ni, const unsigned char* node_addr, uint32_t now);
+
+// Fills in the ethernet header in front of the IP packet at frame +
+// N_XBEE_ETHHDR_LEN, len being the whole frame. Returns 0 or <0 if the
+// packet should be dropped.
+int n_xbee_route_frame(struct xbee_serial_bridge* bridge, unsigned char* frame, int len, uint32_t now);
+
+#endif
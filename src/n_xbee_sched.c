@@ -0,0 +1,293 @@
+#include "n_xbee.h"
+#include "n_xbee_sched.h"
+
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+#define N_XBEE_SCHED_BUCKET_MASK (N_XBEE_SCHED_BUCKETS - 1)
+
+// wrap safe a >= b for ms timestamps
+#define N_XBEE_TIME_AFTER_EQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+void n_xbee_sched_init(n_xbee_sched* sched, n_xbee_pool* pool) {
+  int i;
+  memset(sched, 0, sizeof(n_xbee_sched));
+  sched->pool = pool;
+  for (i = 0; i < N_XBEE_SCHED_CLASSES; i++)
+    sched->head[i] = sched->tail[i] = -1;
+  for (i = 0; i < N_XBEE_SCHED_FLOWS; i++)
+    sched->flows[i].next = -1;
+}
+
+void n_xbee_sched_clear(n_xbee_sched* sched) {
+  int i;
+  n_xbee_pkt* pkt;
+  for (i = 0; i < N_XBEE_SCHED_FLOWS; i++) {
+    while ((pkt = sched->flows[i].head)) {
+      sched->flows[i].head = pkt->next;
+      n_xbee_sched_free(sched, pkt);
+    }
+  }
+  n_xbee_sched_init(sched, sched->pool);
+}
+
+/* = Classification = */
+static int n_xbee_sched_dscp_class(uint8_t dscp) {
+  if (dscp >= 48)
+    return N_XBEE_SCHED_CONTROL;
+  if (dscp >= 32)
+    return N_XBEE_SCHED_INTERACTIVE;
+  return N_XBEE_SCHED_BULK;
+}
+
+int n_xbee_sched_classify(const unsigned char* frame, int len) {
+  const struct ether_header* eh = (const struct ether_header*)frame;
+  const struct iphdr* iph;
+  const struct ip6_hdr* ip6h;
+
+  if (len < N_XBEE_ETHHDR_LEN)
+    return N_XBEE_SCHED_BULK;
+  switch (ntohs(eh->ether_type)) {
+    case ETHERTYPE_ARP:
+      return N_XBEE_SCHED_CONTROL;
+    case ETHERTYPE_IP:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct iphdr))
+        return N_XBEE_SCHED_BULK;
+      iph = (const struct iphdr*)(frame + N_XBEE_ETHHDR_LEN);
+      if (iph->protocol == IPPROTO_ICMP)
+        return N_XBEE_SCHED_CONTROL;
+      return n_xbee_sched_dscp_class(iph->tos >> 2);
+    case ETHERTYPE_IPV6:
+      if (len < N_XBEE_ETHHDR_LEN + sizeof(struct ip6_hdr))
+        return N_XBEE_SCHED_BULK;
+      ip6h = (const struct ip6_hdr*)(frame + N_XBEE_ETHHDR_LEN);
+      // neighbour discovery lives here
+      if (ip6h->ip6_nxt == IPPROTO_ICMPV6)
+        return N_XBEE_SCHED_CONTROL;
+      return n_xbee_sched_dscp_class((ntohl(ip6h->ip6_flow) >> 22) & 0x3F);
+  }
+  return N_XBEE_SCHED_BULK;
+}
+
+static int n_xbee_sched_flow_index(int cls, const unsigned char* mac) {
+  uint32_t h = 2166136261u;
+  int i;
+  for (i = 0; i < ETH_ALEN; i++) {
+    h ^= mac[i];
+    h *= 16777619u;
+  }
+  return cls * N_XBEE_SCHED_BUCKETS + ((h ^ (h >> 16)) & N_XBEE_SCHED_BUCKET_MASK);
+}
+
+/* = Queues = */
+static n_xbee_pkt* n_xbee_sched_pop(n_xbee_sched* sched, n_xbee_sched_flow* flow) {
+  n_xbee_pkt* pkt = flow->head;
+  if (!pkt)
+    return NULL;
+  flow->head = pkt->next;
+  if (!flow->head)
+    flow->tail = NULL;
+  flow->qlen--;
+  flow->bytes -= pkt->len;
+  sched->backlog--;
+  return pkt;
+}
+
+// Puts the flow at the end of its class's active list.
+static void n_xbee_sched_activate(n_xbee_sched* sched, int cls, int idx) {
+  n_xbee_sched_flow* flow = &sched->flows[idx];
+  flow->active = 1;
+  flow->deficit = N_XBEE_SCHED_QUANTUM;
+  flow->next = -1;
+  if (sched->tail[cls] >= 0)
+    sched->flows[sched->tail[cls]].next = idx;
+  else
+    sched->head[cls] = idx;
+  sched->tail[cls] = idx;
+}
+
+// Head drop from the queue holding the most bytes.
+static void n_xbee_sched_drop_fattest(n_xbee_sched* sched) {
+  int i;
+  n_xbee_sched_flow* fattest = NULL;
+  for (i = 0; i < N_XBEE_SCHED_FLOWS; i++) {
+    if (!fattest || sched->flows[i].bytes > fattest->bytes)
+      fattest = &sched->flows[i];
+  }
+  n_xbee_sched_free(sched, n_xbee_sched_pop(sched, fattest));
+  sched->overlimit_drops++;
+}
+
+int n_xbee_sched_enqueue(n_xbee_sched* sched, n_xbee_pkt* pkt, uint32_t now) {
+  int cls, idx;
+  n_xbee_sched_flow* flow;
+
+  if (pkt->len < N_XBEE_ETHHDR_LEN) {
+    n_xbee_sched_free(sched, pkt);
+    return -EINVAL;
+  }
+  cls = n_xbee_sched_classify(pkt->data, pkt->len);
+  idx = n_xbee_sched_flow_index(cls, ((const struct ether_header*)pkt->data)->ether_dhost);
+  flow = &sched->flows[idx];
+
+  // old frames are worth less than new ones, drop from the head
+  if (flow->qlen >= N_XBEE_SCHED_FLOW_LIMIT) {
+    n_xbee_sched_free(sched, n_xbee_sched_pop(sched, flow));
+    sched->overlimit_drops++;
+  } else if (sched->backlog >= N_XBEE_SCHED_LIMIT)
+    n_xbee_sched_drop_fattest(sched);
+
+  pkt->next = NULL;
+  pkt->enqueued = now;
+
+  if (flow->tail)
+    flow->tail->next = pkt;
+  else
+    flow->head = pkt;
+  flow->tail = pkt;
+  flow->qlen++;
+  flow->bytes += pkt->len;
+  sched->backlog++;
+  sched->enqueued++;
+
+  if (!flow->active)
+    n_xbee_sched_activate(sched, cls, idx);
+  return 0;
+}
+
+/* = CoDel = */
+static uint32_t n_xbee_sched_isqrt(uint32_t x) {
+  uint32_t r = 0, bit = 1u << 30;
+  while (bit > x)
+    bit >>= 2;
+  while (bit) {
+    if (x >= r + bit) {
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    } else
+      r >>= 1;
+    bit >>= 2;
+  }
+  return r;
+}
+
+// interval / sqrt(count), in 1/16ths to keep some precision
+static uint32_t n_xbee_sched_control_law(uint32_t t, uint32_t count) {
+  uint32_t root = n_xbee_sched_isqrt((count > 1000000 ? 1000000 : count) * 256);
+  return t + (N_XBEE_SCHED_INTERVAL * 16) / (root ? root : 1);
+}
+
+// Pops the next frame CoDel lets through.
+static n_xbee_pkt* n_xbee_sched_codel_pop(n_xbee_sched* sched, n_xbee_sched_flow* flow, uint32_t now) {
+  n_xbee_pkt* pkt;
+  int ok;
+
+  while ((pkt = n_xbee_sched_pop(sched, flow))) {
+    // below target, or too little queued to be worth dropping from
+    ok = (now - pkt->enqueued) < N_XBEE_SCHED_TARGET || flow->bytes < N_XBEE_DATA_MTU;
+    if (ok) {
+      flow->above = 0;
+      flow->dropping = 0;
+      return pkt;
+    }
+    if (!flow->above) {
+      flow->above = 1;
+      flow->first_above = now + N_XBEE_SCHED_INTERVAL;
+      return pkt;
+    }
+    if (!flow->dropping) {
+      if (!N_XBEE_TIME_AFTER_EQ(now, flow->first_above))
+        return pkt;
+      flow->dropping = 1;
+      // pick up where we left off if we were dropping recently
+      if (flow->count > 2 && now - flow->drop_next < 8 * N_XBEE_SCHED_INTERVAL)
+        flow->count -= 2;
+      else
+        flow->count = 1;
+      flow->drop_next = n_xbee_sched_control_law(now, flow->count);
+    } else if (N_XBEE_TIME_AFTER_EQ(now, flow->drop_next)) {
+      flow->count++;
+      flow->drop_next = n_xbee_sched_control_law(flow->drop_next, flow->count);
+    } else
+      return pkt;
+    n_xbee_sched_free(sched, pkt);
+    sched->codel_drops++;
+  }
+  return NULL;
+}
+
+void n_xbee_sched_requeue(n_xbee_sched* sched, n_xbee_pkt* pkt) {
+  int cls = n_xbee_sched_classify(pkt->data, pkt->len);
+  int idx = n_xbee_sched_flow_index(cls, ((const struct ether_header*)pkt->data)->ether_dhost);
+  n_xbee_sched_flow* flow = &sched->flows[idx];
+
+  pkt->next = flow->head;
+  flow->head = pkt;
+  if (!flow->tail)
+    flow->tail = pkt;
+  flow->qlen++;
+  flow->bytes += pkt->len;
+  sched->backlog++;
+  if (!flow->active)
+    n_xbee_sched_activate(sched, cls, idx);
+  else
+    flow->deficit += pkt->len;
+}
+
+n_xbee_pkt* n_xbee_sched_peek_dest(n_xbee_sched* sched, const unsigned char* mac, int* flow) {
+  int cls, idx;
+  n_xbee_pkt* pkt;
+  for (cls = 0; cls < N_XBEE_SCHED_CLASSES; cls++) {
+    idx = n_xbee_sched_flow_index(cls, mac);
+    pkt = sched->flows[idx].head;
+    // only ever the front, or frames to the same node get reordered
+    if (pkt && memcmp(((const struct ether_header*)pkt->data)->ether_dhost, mac, ETH_ALEN) == 0) {
+      *flow = idx;
+      return pkt;
+    }
+  }
+  return NULL;
+}
+
+n_xbee_pkt* n_xbee_sched_take(n_xbee_sched* sched, int flow) {
+  n_xbee_pkt* pkt = n_xbee_sched_pop(sched, &sched->flows[flow]);
+  // it rode along for free, but still counts against the flow's share
+  if (pkt)
+    sched->flows[flow].deficit -= pkt->len;
+  return pkt;
+}
+
+n_xbee_pkt* n_xbee_sched_dequeue(n_xbee_sched* sched, uint32_t now) {
+  int cls, idx;
+  n_xbee_sched_flow* flow;
+  n_xbee_pkt* pkt;
+
+  for (cls = 0; cls < N_XBEE_SCHED_CLASSES; cls++) {
+    while ((idx = sched->head[cls]) >= 0) {
+      flow = &sched->flows[idx];
+      if (flow->deficit > 0 && (pkt = n_xbee_sched_codel_pop(sched, flow, now))) {
+        flow->deficit -= pkt->len;
+        return pkt;
+      }
+      // out of credit or empty, off the front of the list
+      sched->head[cls] = flow->next;
+      if (sched->head[cls] < 0)
+        sched->tail[cls] = -1;
+      flow->next = -1;
+      if (!flow->head) {
+        flow->active = 0;
+        continue;
+      }
+      flow->deficit += N_XBEE_SCHED_QUANTUM;
+      if (sched->tail[cls] >= 0)
+        sched->flows[sched->tail[cls]].next = idx;
+      else
+        sched->head[cls] = idx;
+      sched->tail[cls] = idx;
+    }
+  }
+  return NULL;
+}
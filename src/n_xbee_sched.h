@@ -0,0 +1,94 @@
+#pragma once
+#ifndef _N_XBEE_SCHED_H
+#define _N_XBEE_SCHED_H
+
+#include <stdint.h>
+
+#include "n_xbee_pool.h"
+
+/*
+ * Transmit scheduler, sits between the tap and the radio.
+ *
+ * Frames are sorted into strict priority classes by ethertype and DSCP,
+ * and within a class into per destination queues (hashed by MAC) that are
+ * served deficit round robin, so one bulk transfer can't hold up every
+ * other node. Each queue runs CoDel on the time frames spend in it, and
+ * when the scheduler is full the head of the longest queue is dropped.
+ */
+// ARP, ICMP, ICMPv6, DSCP CS6 and up
+#define N_XBEE_SCHED_CONTROL 0
+// DSCP CS4 and up (AF4x, CS5, EF)
+#define N_XBEE_SCHED_INTERACTIVE 1
+// everything else
+#define N_XBEE_SCHED_BULK 2
+#define N_XBEE_SCHED_CLASSES 3
+
+// destination queues per class, power of 2
+#define N_XBEE_SCHED_BUCKETS 16
+#define N_XBEE_SCHED_FLOWS (N_XBEE_SCHED_CLASSES * N_XBEE_SCHED_BUCKETS)
+// bytes a queue may send per round
+#define N_XBEE_SCHED_QUANTUM 300
+// frames held across all queues, and in one queue
+#define N_XBEE_SCHED_LIMIT 256
+#define N_XBEE_SCHED_FLOW_LIMIT 64
+// CoDel, in ms. The radio moves a few KB/s, so these are a lot looser
+// than on ethernet.
+#define N_XBEE_SCHED_TARGET 50
+#define N_XBEE_SCHED_INTERVAL 500
+
+typedef struct n_xbee_sched_flow {
+  n_xbee_pkt* head;
+  n_xbee_pkt* tail;
+  int qlen;
+  int bytes;
+  int deficit;
+  // index of the next active flow in the class, -1 at the end
+  int next;
+  uint8_t active;
+  // CoDel state
+  uint8_t above;
+  uint8_t dropping;
+  uint32_t first_above;
+  uint32_t drop_next;
+  uint32_t count;
+} n_xbee_sched_flow;
+
+typedef struct n_xbee_sched {
+  // where queued frames come from and go back to
+  n_xbee_pool* pool;
+  int backlog;
+  // active flow lists, -1 if empty
+  int head[N_XBEE_SCHED_CLASSES];
+  int tail[N_XBEE_SCHED_CLASSES];
+  uint32_t enqueued;
+  uint32_t overlimit_drops;
+  uint32_t codel_drops;
+  n_xbee_sched_flow flows[N_XBEE_SCHED_FLOWS];
+} n_xbee_sched;
+
+void n_xbee_sched_init(n_xbee_sched* sched, n_xbee_pool* pool);
+// Drops everything still queued.
+void n_xbee_sched_clear(n_xbee_sched* sched);
+
+// Returns the N_XBEE_SCHED_* class for an ethernet frame.
+int n_xbee_sched_classify(const unsigned char* frame, int len);
+
+// Queues a frame from sched's pool, which the scheduler owns from then
+// on. Returns 0 or <0 if it was dropped.
+int n_xbee_sched_enqueue(n_xbee_sched* sched, n_xbee_pkt* pkt, uint32_t now);
+// Returns the next frame to send or NULL, free it with n_xbee_sched_free.
+n_xbee_pkt* n_xbee_sched_dequeue(n_xbee_sched* sched, uint32_t now);
+// Gives the frame back to the pool.
+static inline void n_xbee_sched_free(n_xbee_sched* sched, n_xbee_pkt* pkt) {
+  n_xbee_pool_put(sched->pool, pkt);
+}
+// Puts a dequeued frame back at the front of its queue.
+void n_xbee_sched_requeue(n_xbee_sched* sched, n_xbee_pkt* pkt);
+
+// Returns the oldest frame for mac in the highest class that has one at
+// the front of its queue, and its flow for n_xbee_sched_take, or NULL.
+n_xbee_pkt* n_xbee_sched_peek_dest(n_xbee_sched* sched, const unsigned char* mac, int* flow);
+// Pops the frame n_xbee_sched_peek_dest returned.
+n_xbee_pkt* n_xbee_sched_take(n_xbee_sched* sched, int flow);
+
+#endif
@@ -0,0 +1,346 @@
+#include "n_xbee.h"
+#include "n_xbee_serial.h"
+
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include <sys/ioctl.h>
+
+#include <xbee/serial.h>
+
+typedef struct n_xbee_serial_port {
+  // -1 while the slot is free
+  int fd;
+  int batch;
+  int sink;
+  // rx[rx_head..rx_tail) hasn't been handed to the library yet
+  int rx_head;
+  int rx_tail;
+  int tx_len;
+  // what the last failed read() said, 0 while the tty is fine
+  int error;
+  uint64_t reads;
+  uint64_t writes;
+  unsigned char rx[N_XBEE_SERIAL_RX_SIZE];
+  unsigned char tx[N_XBEE_SERIAL_TX_SIZE];
+} n_xbee_serial_port;
+
+static n_xbee_serial_port* n_xbee_serial_ports[N_XBEE_SERIAL_MAX_PORTS];
+
+static const struct {
+  uint32_t rate;
+  speed_t speed;
+} n_xbee_serial_speeds[] = {
+  { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+  { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+  { 230400, B230400 }, { 460800, B460800 }, { 921600, B921600 },
+};
+
+static n_xbee_serial_port* n_xbee_serial_port_of(xbee_serial_t* serial) {
+  int i;
+  for (i = 0; i < N_XBEE_SERIAL_MAX_PORTS; i++) {
+    if (n_xbee_serial_ports[i] && n_xbee_serial_ports[i]->fd == serial->fd)
+      return n_xbee_serial_ports[i];
+  }
+  return NULL;
+}
+
+static int n_xbee_serial_flush_port(n_xbee_serial_port* port) {
+  int n;
+  if (!port->tx_len)
+    return 0;
+  port->writes++;
+  if ((n = write(port->fd, port->tx, port->tx_len)) < 0)
+    return errno == EAGAIN ? port->tx_len : -errno;
+  // the rest goes next time round
+  memmove(port->tx, port->tx + n, port->tx_len - n);
+  port->tx_len -= n;
+  return port->tx_len;
+}
+
+// Takes whatever the tty has, if the buffer is empty. Returns the bytes
+// buffered, or <0 if the tty is gone.
+static int n_xbee_serial_fill(n_xbee_serial_port* port) {
+  int n;
+  if (port->rx_head < port->rx_tail)
+    return port->rx_tail - port->rx_head;
+  port->rx_head = port->rx_tail = 0;
+  // whoever reads is waiting on an answer to what we queued
+  if (port->tx_len)
+    n_xbee_serial_flush_port(port);
+  port->reads++;
+  if ((n = read(port->fd, port->rx, sizeof(port->rx))) < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    return port->error = -errno;
+  }
+  // the port is non blocking, nothing to read is EAGAIN and 0 is a hang up
+  if (n == 0)
+    return port->error = -ENODEV;
+  port->rx_tail = n;
+  return n;
+}
+
+void n_xbee_serial_batch(xbee_serial_t* serial, int on) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  if (!port)
+    return;
+  if (!on)
+    n_xbee_serial_flush_port(port);
+  port->batch = on;
+}
+
+void n_xbee_serial_sink(xbee_serial_t* serial, int on) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  if (port)
+    port->sink = on;
+}
+
+int n_xbee_serial_flush(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  return port ? n_xbee_serial_flush_port(port) : -EINVAL;
+}
+
+int n_xbee_serial_rx_buffered(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  return port ? port->rx_tail - port->rx_head : 0;
+}
+
+int n_xbee_serial_error(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  return port ? port->error : -EINVAL;
+}
+
+void n_xbee_serial_syscalls(xbee_serial_t* serial, uint64_t* reads, uint64_t* writes) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  *reads = port ? port->reads : 0;
+  *writes = port ? port->writes : 0;
+}
+
+/* = xbee/serial.h = */
+int xbee_ser_invalid(xbee_serial_t* serial) {
+  return serial == NULL || serial->fd < 0 || !n_xbee_serial_port_of(serial);
+}
+
+const char* xbee_ser_portname(xbee_serial_t* serial) {
+  return serial->device;
+}
+
+int xbee_ser_write(xbee_serial_t* serial, const void FAR* buffer, int length) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  int n;
+
+  if (!port)
+    return -EINVAL;
+  if (port->sink)
+    return length;
+  if (!port->batch) {
+    port->writes++;
+    if ((n = write(port->fd, buffer, length)) < 0)
+      return errno == EAGAIN ? 0 : -EIO;
+    return n;
+  }
+  if (port->tx_len + length > N_XBEE_SERIAL_TX_SIZE && n_xbee_serial_flush_port(port) < 0)
+    return -EIO;
+  // still no room, the tty is backed up
+  if (port->tx_len + length > N_XBEE_SERIAL_TX_SIZE)
+    return 0;
+  memcpy(port->tx + port->tx_len, buffer, length);
+  port->tx_len += length;
+  return length;
+}
+
+int xbee_ser_read(xbee_serial_t* serial, void FAR* buffer, int bufsize) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  int n;
+
+  if (!port)
+    return -EINVAL;
+  if ((n = n_xbee_serial_fill(port)) < 0)
+    return n;
+  if (n > bufsize)
+    n = bufsize;
+  memcpy(buffer, port->rx + port->rx_head, n);
+  port->rx_head += n;
+  return n;
+}
+
+int xbee_ser_putchar(xbee_serial_t* serial, uint8_t ch) {
+  int n = xbee_ser_write(serial, &ch, 1);
+  if (n < 0)
+    return n;
+  return n == 1 ? 0 : -ENOSPC;
+}
+
+int xbee_ser_getchar(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  int n;
+  if (!port)
+    return -EINVAL;
+  if ((n = n_xbee_serial_fill(port)) <= 0)
+    return n < 0 ? n : -ENODATA;
+  return port->rx[port->rx_head++];
+}
+
+int xbee_ser_tx_free(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  // the kernel takes what doesn't fit here
+  if (!port || !port->batch)
+    return INT_MAX;
+  // the library writes a frame in pieces and must see whether all of
+  // them fit before the first, or the radio gets a header without its
+  // payload
+  if (N_XBEE_SERIAL_TX_SIZE - port->tx_len < N_XBEE_SERIAL_FRAME_ROOM)
+    n_xbee_serial_flush_port(port);
+  return N_XBEE_SERIAL_TX_SIZE - port->tx_len;
+}
+
+int xbee_ser_tx_used(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  int outq = 0;
+  if (!port)
+    return 0;
+  n_xbee_serial_flush_port(port);
+  ioctl(port->fd, TIOCOUTQ, &outq);
+  return outq + port->tx_len;
+}
+
+int xbee_ser_tx_flush(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  if (!port)
+    return -EINVAL;
+  port->tx_len = 0;
+  tcflush(port->fd, TCOFLUSH);
+  return 0;
+}
+
+int xbee_ser_rx_free(xbee_serial_t* serial) {
+  return INT_MAX;
+}
+
+int xbee_ser_rx_used(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  int avail = 0;
+  if (!port)
+    return 0;
+  if (port->tx_len)
+    n_xbee_serial_flush_port(port);
+  ioctl(port->fd, FIONREAD, &avail);
+  return avail + port->rx_tail - port->rx_head;
+}
+
+int xbee_ser_rx_flush(xbee_serial_t* serial) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  if (!port)
+    return -EINVAL;
+  port->rx_head = port->rx_tail = 0;
+  tcflush(port->fd, TCIFLUSH);
+  return 0;
+}
+
+int xbee_ser_baudrate(xbee_serial_t* serial, uint32_t baudrate) {
+  n_xbee_serial_port* port = n_xbee_serial_port_of(serial);
+  struct termios tio;
+  int i;
+
+  if (!port)
+    return -EINVAL;
+  for (i = 0; i < (int)(sizeof(n_xbee_serial_speeds) / sizeof(n_xbee_serial_speeds[0])); i++) {
+    if (n_xbee_serial_speeds[i].rate == baudrate)
+      break;
+  }
+  if (i == sizeof(n_xbee_serial_speeds) / sizeof(n_xbee_serial_speeds[0]))
+    return -EINVAL;
+  // anything queued was meant for the old rate
+  n_xbee_serial_flush_port(port);
+  if (tcgetattr(port->fd, &tio) != 0)
+    return -errno;
+  cfsetispeed(&tio, n_xbee_serial_speeds[i].speed);
+  cfsetospeed(&tio, n_xbee_serial_speeds[i].speed);
+  if (tcsetattr(port->fd, TCSANOW, &tio) != 0)
+    return -errno;
+  serial->baudrate = baudrate;
+  return 0;
+}
+
+int xbee_ser_open(xbee_serial_t* serial, uint32_t baudrate) {
+  n_xbee_serial_port* port;
+  struct termios tio;
+  int i, err;
+
+  for (i = 0; i < N_XBEE_SERIAL_MAX_PORTS && n_xbee_serial_ports[i]; i++)
+    ;
+  if (i == N_XBEE_SERIAL_MAX_PORTS)
+    return -ENOSPC;
+  if (!(port = calloc(1, sizeof(n_xbee_serial_port))))
+    return -ENOMEM;
+  if ((port->fd = open(serial->device, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0) {
+    err = -errno;
+    printk(KERN_ALERT "%s: unable to open %s, %d (%s)\n", __FUNCTION__, serial->device, -err, strerror(-err));
+    free(port);
+    return err;
+  }
+  // raw 8N1, no flow control until asked for
+  tcgetattr(port->fd, &tio);
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~CRTSCTS;
+  // with O_NONBLOCK this makes an empty tty EAGAIN, so read() only
+  // returns 0 once it has hung up
+  tio.c_cc[VMIN] = 1;
+  tio.c_cc[VTIME] = 0;
+  tcsetattr(port->fd, TCSANOW, &tio);
+
+  serial->fd = port->fd;
+  n_xbee_serial_ports[i] = port;
+  if ((err = xbee_ser_baudrate(serial, baudrate)) != 0) {
+    xbee_ser_close(serial);
+    return err;
+  }
+  tcflush(port->fd, TCIOFLUSH);
+  return 0;
+}
+
+int xbee_ser_close(xbee_serial_t* serial) {
+  int i;
+  for (i = 0; i < N_XBEE_SERIAL_MAX_PORTS; i++) {
+    if (n_xbee_serial_ports[i] && n_xbee_serial_ports[i]->fd == serial->fd) {
+      close(serial->fd);
+      free(n_xbee_serial_ports[i]);
+      n_xbee_serial_ports[i] = NULL;
+      serial->fd = -1;
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+int xbee_ser_break(xbee_serial_t* serial, bool_t enabled) {
+  return ioctl(serial->fd, enabled ? TIOCSBRK : TIOCCBRK) < 0 ? -errno : 0;
+}
+
+int xbee_ser_flowcontrol(xbee_serial_t* serial, bool_t enabled) {
+  struct termios tio;
+  if (tcgetattr(serial->fd, &tio) != 0)
+    return -errno;
+  if (enabled)
+    tio.c_cflag |= CRTSCTS;
+  else
+    tio.c_cflag &= ~CRTSCTS;
+  return tcsetattr(serial->fd, TCSANOW, &tio) != 0 ? -errno : 0;
+}
+
+int xbee_ser_set_rts(xbee_serial_t* serial, bool_t asserted) {
+  int bits = TIOCM_RTS;
+  return ioctl(serial->fd, asserted ? TIOCMBIS : TIOCMBIC, &bits) < 0 ? -errno : 0;
+}
+
+int xbee_ser_get_cts(xbee_serial_t* serial) {
+  int bits;
+  if (ioctl(serial->fd, TIOCMGET, &bits) < 0)
+    return -errno;
+  return (bits & TIOCM_CTS) != 0;
+}
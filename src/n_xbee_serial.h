@@ -0,0 +1,68 @@
+#pragma once
+#ifndef _N_XBEE_SERIAL_H
+#define _N_XBEE_SERIAL_H
+
+#include <stdint.h>
+
+#include <xbee/platform.h>
+
+/*
+ * Serial ports, in place of the library's xbee_serial_posix.
+ *
+ * The library reads an API frame a few bytes at a time and writes one in
+ * three or four pieces, which through plain read() and write() is a
+ * syscall for every piece. Here every port has a receive buffer that is
+ * filled N_XBEE_SERIAL_RX_SIZE bytes at a time, so one read() feeds the
+ * parser every frame that has arrived, and the library's small reads are
+ * copies out of it.
+ *
+ * Once a bridge is running its port is switched to batching, and writes
+ * pile up in a transmit buffer instead of going out. The event loop
+ * flushes it with a single write() after each event, so everything a
+ * scheduler run or a receive burst sent leaves together. Reading, and
+ * asking how much is waiting to go out, flush first, so anything waiting
+ * on an answer has had its request sent. While setting the radio up,
+ * writes go straight out as before, which keeps AT mode's guard times
+ * right.
+ *
+ * A frame that doesn't fit in what is left of the transmit buffer is
+ * refused as a whole through xbee_ser_tx_free, never cut short. What the
+ * tty didn't take stays queued, and the event loop watches the port for
+ * EPOLLOUT until it is gone.
+ *
+ * A read() that fails, or reads nothing because the tty hung up, is
+ * returned from xbee_ser_read and kept for n_xbee_serial_error.
+ *
+ * A port can be made a sink, which drops every write as if the tty had
+ * taken it. Replaying a capture does this, so the radio isn't answered
+ * twice.
+ *
+ * The buffers are only ever used under n_xbee_lib_lock or by the port's
+ * worker, like the rest of the library's state.
+ */
+// ports open at once, as many as there can be bridges
+#define N_XBEE_SERIAL_MAX_PORTS 16
+// bytes taken from the tty per read()
+#define N_XBEE_SERIAL_RX_SIZE 4096
+// bytes queued before a write() is forced, room for a fragmented
+// datagram and then some
+#define N_XBEE_SERIAL_TX_SIZE 4096
+// room below which asking for it flushes first, an API frame with
+// every byte escaped
+#define N_XBEE_SERIAL_FRAME_ROOM 512
+
+// Queue writes until n_xbee_serial_flush, or not.
+void n_xbee_serial_batch(xbee_serial_t* serial, int on);
+// Drop writes as if they went out, or not.
+void n_xbee_serial_sink(xbee_serial_t* serial, int on);
+// Writes out what is queued, as much as the tty takes. Returns the bytes
+// still queued, or <0 on error.
+int n_xbee_serial_flush(xbee_serial_t* serial);
+// 0, or the error that made the tty unusable, like -ENODEV once it hung up.
+int n_xbee_serial_error(xbee_serial_t* serial);
+// Bytes read from the tty that the library hasn't taken yet.
+int n_xbee_serial_rx_buffered(xbee_serial_t* serial);
+// read() and write() calls made on the port.
+void n_xbee_serial_syscalls(xbee_serial_t* serial, uint64_t* reads, uint64_t* writes);
+
+#endif
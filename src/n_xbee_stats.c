@@ -0,0 +1,229 @@
+#include "n_xbee.h"
+#include "n_xbee_stats.h"
+#include "n_xbee_bond.h"
+#include "n_xbee_serial.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// a connection still owed part of its snapshot, free while ev.fd is -1
+typedef struct n_xbee_stats_client {
+  n_xbee_event_source ev;
+  char* buf;
+  size_t len;
+  size_t off;
+} n_xbee_stats_client;
+
+static n_xbee_stats_client n_xbee_stats_clients[N_XBEE_STATS_CLIENTS] = {
+  [0 ... N_XBEE_STATS_CLIENTS - 1] = { .ev = { .fd = -1, .epfd = -1 } },
+};
+
+static const char* n_xbee_drop_names[N_XBEE_DROP_REASONS] = {
+  "pool_empty", "no_node", "tx_error", "decode", "tap_write", "oversize",
+};
+
+static void n_xbee_stats_hist_json(FILE* f, const char* name, const n_xbee_hist* hist) {
+  int i;
+  fprintf(f, "\"%s\":[", name);
+  for (i = 0; i < N_XBEE_STATS_HIST_BUCKETS; i++)
+    fprintf(f, "%s%u", i ? "," : "", hist->buckets[i]);
+  fprintf(f, "]");
+}
+
+static void n_xbee_stats_node_json(FILE* f, const xbee_remote_node* nod, uint32_t now) {
+  const unsigned char* a = nod->node_addr;
+  fprintf(f, "{\"addr\":\"%02x%02x%02x%02x%02x%02x%02x%02x\",\"mac\":\"%02x:%02x:%02x:%02x:%02x:%02x\",\"caps\":%u,\"idle_ms\":%u,",
+      a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7],
+      nod->eth[0], nod->eth[1], nod->eth[2], nod->eth[3], nod->eth[4], nod->eth[5],
+      nod->caps, now - nod->last_seen);
+  fprintf(f, "\"rx_frames\":%u,\"rx_bytes\":%llu,\"tx_frames\":%u,\"tx_bytes\":%llu,\"tx_ok\":%u,\"tx_fail\":%u,\"tx_retries\":%u,\"lz_in\":%u,\"lz_out\":%u}",
+      nod->rx_frames, (unsigned long long)nod->rx_bytes, nod->tx_frames, (unsigned long long)nod->tx_bytes,
+      nod->tx_ok, nod->tx_fail, nod->tx_retries, nod->tx_lz_in, nod->tx_lz_out);
+}
+
+static void n_xbee_stats_bridge_json(FILE* f, struct xbee_serial_bridge* bridge, uint32_t now) {
+  const n_xbee_stats* st = &bridge->stats;
+  // queues and the pool live with the tap's owner
+  struct xbee_serial_bridge* owner = bridge->bond ? bridge->bond->members[0] : bridge;
+  int i, outq = 0, first = 1;
+  uint64_t reads, writes;
+  xbee_remote_node nod;
+
+  ioctl(bridge->xbee_dev->serial.fd, TIOCOUTQ, &outq);
+  n_xbee_serial_syscalls(&bridge->xbee_dev->serial, &reads, &writes);
+  fprintf(f, "{\"tty\":\"%s\",\"netdev\":\"%s\",\"owner\":%s,\"link_up\":%s,\"baud\":%u,",
+      bridge->tty_name, bridge->netdevName, owner == bridge ? "true" : "false", bridge->link_up ? "true" : "false",
+      (unsigned)bridge->xbee_dev->serial.baudrate);
+  fprintf(f, "\"tap\":{\"rx_frames\":%llu,\"rx_bytes\":%llu,\"tx_frames\":%llu,\"tx_bytes\":%llu},",
+      (unsigned long long)st->tap_rx_frames, (unsigned long long)st->tap_rx_bytes,
+      (unsigned long long)st->tap_tx_frames, (unsigned long long)st->tap_tx_bytes);
+  fprintf(f, "\"air\":{\"tx_frames\":%llu,\"tx_bytes\":%llu,\"rx_frames\":%llu,\"rx_bytes\":%llu,\"airtime_us\":%llu},",
+      (unsigned long long)st->air_tx_frames, (unsigned long long)st->air_tx_bytes,
+      (unsigned long long)st->air_rx_frames, (unsigned long long)st->air_rx_bytes, (unsigned long long)st->airtime_us);
+  fprintf(f, "\"tx\":{\"ok\":%u,\"fail\":%u,\"retries\":%u,\"lost\":%u,\"inflight\":%d,\"window\":%d},",
+      bridge->tx.tx_ok, bridge->tx.tx_fail, bridge->tx.tx_retries, bridge->tx.tx_lost, bridge->tx.inflight, bridge->tx.window);
+  fprintf(f, "\"queue\":{\"backlog\":%d,\"serial_outq\":%d,\"pool_free\":%d,\"pool_size\":%d,\"pool_low\":%d},",
+      owner->sched.backlog, outq, owner->pool.avail, owner->pool.size, owner->pool.min_avail);
+  fprintf(f, "\"serial\":{\"reads\":%llu,\"writes\":%llu},", (unsigned long long)reads, (unsigned long long)writes);
+  fprintf(f, "\"discovery\":{\"rounds\":%u,\"interval_ms\":%u,\"next_ms\":%d,\"probes\":%u,\"changes\":%u},",
+      bridge->disc.rounds, bridge->disc.interval, (int)(bridge->disc.next_round - now), bridge->disc.probes, bridge->nodes.changes);
+  fprintf(f, "\"frag\":{\"tx_datagrams\":%u,\"tx_fragments\":%u,\"rx_datagrams\":%u,\"rx_fragments\":%u,\"rx_timeouts\":%u,\"rx_evicted\":%u,\"rx_invalid\":%u},",
+      bridge->frag.tx_datagrams, bridge->frag.tx_fragments, bridge->frag.rx_datagrams, bridge->frag.rx_fragments,
+      bridge->frag.rx_timeouts, bridge->frag.rx_evicted, bridge->frag.rx_invalid);
+  fprintf(f, "\"drops\":{");
+  for (i = 0; i < N_XBEE_DROP_REASONS; i++)
+    fprintf(f, "\"%s\":%u,", n_xbee_drop_names[i], st->drops[i]);
+  fprintf(f, "\"too_big\":%u,\"sched_overlimit\":%u,\"sched_codel\":%u},", bridge->mtu_too_big,
+      owner == bridge ? bridge->sched.overlimit_drops : 0, owner == bridge ? bridge->sched.codel_drops : 0);
+  fprintf(f, "\"aggregates\":%u,\"aggregated\":%u,\"mss_clamped\":%u,",
+      bridge->agg_frames, bridge->agg_packets, bridge->mss_clamped);
+  fprintf(f, "\"latency_us\":{");
+  n_xbee_stats_hist_json(f, "tap_to_serial", &st->tap_to_serial);
+  fprintf(f, ",");
+  n_xbee_stats_hist_json(f, "serial_to_tap", &st->serial_to_tap);
+  fprintf(f, "},\"nodes\":[");
+  // the bridge's worker may be evicting and reusing slots as we go
+  for (i = 0; i < N_XBEE_NODE_MAX; i++) {
+    if (!n_xbee_node_copy(&bridge->nodes, i, &nod))
+      continue;
+    if (!first)
+      fprintf(f, ",");
+    first = 0;
+    n_xbee_stats_node_json(f, &nod, now);
+  }
+  fprintf(f, "]}");
+}
+
+void n_xbee_stats_json(FILE* f) {
+  int i;
+  uint32_t now = xbee_millisecond_timer();
+
+  fprintf(f, "{\"uptime_ms\":%u,\"hist_buckets\":%d,\"bridges\":[", now, N_XBEE_STATS_HIST_BUCKETS);
+  for (i = 0; i < n_xbee_bridge_count; i++) {
+    if (i)
+      fprintf(f, ",");
+    n_xbee_stats_bridge_json(f, n_xbee_bridges[i], now);
+  }
+  fprintf(f, "]}\n");
+}
+
+int n_xbee_stats_open(const char* path) {
+  struct sockaddr_un sa;
+  int fd, res;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(sa.sun_path)) {
+    printk(KERN_ALERT "%s: %s is too long for a socket path.\n", __FUNCTION__, path);
+    return -ENAMETOOLONG;
+  }
+  strcpy(sa.sun_path, path);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    return -errno;
+  // left behind by an earlier run
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(fd, 4) < 0) {
+    res = -errno;
+    printk(KERN_ALERT "%s: unable to listen on %s, %d (%s)\n", __FUNCTION__, path, -res, strerror(-res));
+    close(fd);
+    return res;
+  }
+  printk(KERN_INFO "%s: serving stats on %s.\n", __FUNCTION__, path);
+  return fd;
+}
+
+// Sends what the client can take, returns 1 once it has everything or
+// gave up, 0 while there is more to come.
+static int n_xbee_stats_push(int fd, const char* buf, size_t len, size_t* off) {
+  ssize_t n;
+  while (*off < len) {
+    if ((n = send(fd, buf + *off, len - *off, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : 1;
+    *off += n;
+  }
+  return 1;
+}
+
+static void n_xbee_stats_client_close(n_xbee_stats_client* client) {
+  if (client->ev.epfd >= 0)
+    epoll_ctl(client->ev.epfd, EPOLL_CTL_DEL, client->ev.fd, NULL);
+  close(client->ev.fd);
+  free(client->buf);
+  client->buf = NULL;
+  client->ev.fd = client->ev.epfd = -1;
+}
+
+// Keeps cfd around to finish sending buf[off..len) on EPOLLOUT.
+static void n_xbee_stats_client_add(int epfd, int cfd, const char* buf, size_t len, size_t off) {
+  n_xbee_stats_client* client = NULL;
+  struct epoll_event ev;
+  int i;
+
+  for (i = 0; i < N_XBEE_STATS_CLIENTS && !client; i++) {
+    if (n_xbee_stats_clients[i].ev.fd < 0)
+      client = &n_xbee_stats_clients[i];
+  }
+  if (!client || !(client->buf = malloc(len - off))) {
+    close(cfd);
+    return;
+  }
+  memcpy(client->buf, buf + off, len - off);
+  client->len = len - off;
+  client->off = 0;
+  client->ev.type = N_XBEE_EV_STATS_CLIENT;
+  client->ev.fd = cfd;
+  client->ev.epfd = epfd;
+  client->ev.bridge = NULL;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLOUT;
+  ev.data.ptr = &client->ev;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+    client->ev.epfd = -1;
+    n_xbee_stats_client_close(client);
+  }
+}
+
+int n_xbee_stats_accept(int epfd, int fd) {
+  int cfd, err;
+  char* buf = NULL;
+  size_t len = 0, off;
+  FILE* f;
+
+  while ((cfd = accept(fd, NULL, NULL)) >= 0) {
+    // one snapshot for everyone waiting
+    if (!buf) {
+      if (!(f = open_memstream(&buf, &len))) {
+        close(cfd);
+        continue;
+      }
+      n_xbee_stats_json(f);
+      fclose(f);
+    }
+    off = 0;
+    if (n_xbee_stats_push(cfd, buf, len, &off))
+      close(cfd);
+    else
+      n_xbee_stats_client_add(epfd, cfd, buf, len, off);
+  }
+  err = errno;
+  free(buf);
+  if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR)
+    return 0;
+  return -err;
+}
+
+int n_xbee_stats_send(struct n_xbee_event_source* src) {
+  // ev is the client's first member
+  n_xbee_stats_client* client = (n_xbee_stats_client*)src;
+  if (client->ev.fd < 0)
+    return 0;
+  if (n_xbee_stats_push(client->ev.fd, client->buf, client->len, &client->off))
+    n_xbee_stats_client_close(client);
+  return 0;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#ifndef _N_XBEE_STATS_H
+#define _N_XBEE_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Runtime counters, and a JSON snapshot of them for monitoring.
+ *
+ * Every counter is only ever written by the worker that drives its
+ * bridge, so counting is a plain increment. The snapshot is read from
+ * another thread without any locking and can be a little inconsistent,
+ * but never by more than what happened while it was being written.
+ * Nodes are copied out under their table's seqlock, so a node evicted
+ * while we write doesn't come out half one node and half another.
+ *
+ * With --stats=PATH a Unix stream socket is opened at PATH, and every
+ * connection to it gets one snapshot, after which it is closed. A
+ * snapshot the socket can't take at once is finished on EPOLLOUT, the
+ * worker never waits on a reader:
+ *
+ *   socat - UNIX-CONNECT:/run/xbee-netdev.sock
+ *
+ * Latencies are in log2 histograms of microseconds, bucket i counting
+ * those under 2^i us, the last one everything longer.
+ */
+#define N_XBEE_STATS_HIST_BUCKETS 24
+
+// connections being written to at once, more are turned away
+#define N_XBEE_STATS_CLIENTS 8
+
+// Air time estimate for 802.15.4 at 250 kbit/s: 32 us per byte, plus the
+// PHY, MAC and APS headers and the ACK turnaround per frame.
+#define N_XBEE_STATS_AIR_US_PER_BYTE 32
+#define N_XBEE_STATS_AIR_FRAME_OVERHEAD 40
+
+// reasons a frame was dropped, besides the scheduler's own and the MTU
+#define N_XBEE_DROP_POOL 0
+#define N_XBEE_DROP_NO_NODE 1
+#define N_XBEE_DROP_TX_ERROR 2
+#define N_XBEE_DROP_DECODE 3
+#define N_XBEE_DROP_TAP_WRITE 4
+// handed to n_xbee_xmit_ether_packet bigger than a pool buffer
+#define N_XBEE_DROP_OVERSIZE 5
+#define N_XBEE_DROP_REASONS 6
+
+struct xbee_serial_bridge;
+struct n_xbee_event_source;
+
+typedef struct n_xbee_hist {
+  uint32_t buckets[N_XBEE_STATS_HIST_BUCKETS];
+} n_xbee_hist;
+
+typedef struct n_xbee_stats {
+  // frames read from and written to the device
+  uint64_t tap_rx_frames;
+  uint64_t tap_rx_bytes;
+  uint64_t tap_tx_frames;
+  uint64_t tap_tx_bytes;
+  // radio frames written to and read from the serial port
+  uint64_t air_tx_frames;
+  uint64_t air_tx_bytes;
+  uint64_t air_rx_frames;
+  uint64_t air_rx_bytes;
+  // estimated, retries included
+  uint64_t airtime_us;
+  uint32_t drops[N_XBEE_DROP_REASONS];
+  // when the serial event being handled started, n_xbee_stats_us()
+  uint32_t rx_start;
+  // read from the device until handed to the serial port
+  n_xbee_hist tap_to_serial;
+  // serial port readable until written to the device
+  n_xbee_hist serial_to_tap;
+} n_xbee_stats;
+
+// Monotonic microseconds, wraps every 71 minutes which differences don't
+// mind.
+static inline uint32_t n_xbee_stats_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static inline void n_xbee_hist_add(n_xbee_hist* hist, uint32_t us) {
+  int i = us ? 32 - __builtin_clz(us) : 0;
+  hist->buckets[i < N_XBEE_STATS_HIST_BUCKETS ? i : N_XBEE_STATS_HIST_BUCKETS - 1]++;
+}
+
+// Air time of a radio frame with len payload bytes, sent retries more
+// times.
+static inline uint32_t n_xbee_stats_airtime(int len, int retries) {
+  return (uint32_t)(len + N_XBEE_STATS_AIR_FRAME_OVERHEAD) * N_XBEE_STATS_AIR_US_PER_BYTE * (retries + 1);
+}
+
+// Writes every bridge and the nodes it knows as JSON.
+void n_xbee_stats_json(FILE* f);
+
+// Opens the stats socket at path, returns the listening fd or <0.
+int n_xbee_stats_open(const char* path);
+// Serves whoever is waiting on the listening fd, watching those that
+// can't take their snapshot at once in epfd.
+int n_xbee_stats_accept(int epfd, int fd);
+// Sends more of a client's snapshot, closes it once it has all of it.
+int n_xbee_stats_send(struct n_xbee_event_source* src);
+
+#endif
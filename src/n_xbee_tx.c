@@ -0,0 +1,174 @@
+#include "n_xbee.h"
+#include "n_xbee_tx.h"
+
+#include <string.h>
+#include <endian.h>
+
+#include <xbee/wpan.h>
+
+void n_xbee_tx_init(n_xbee_tx_state* tx, int window) {
+  memset(tx, 0, sizeof(n_xbee_tx_state));
+  if (window < 1)
+    window = N_XBEE_TX_WINDOW;
+  if (window > N_XBEE_TX_MAX_WINDOW)
+    window = N_XBEE_TX_MAX_WINDOW;
+  tx->window = window;
+  tx->next_id = 1;
+}
+
+// Returns a free frame ID, or 0 if all 255 are waiting on a status.
+static uint8_t n_xbee_tx_next_id(n_xbee_tx_state* tx) {
+  uint8_t id;
+  int tries;
+  for (tries = 0; tries < 255; tries++) {
+    id = tx->next_id++;
+    if (!tx->next_id)
+      tx->next_id = 1;
+    if (!tx->slots[id].in_use)
+      return id;
+  }
+  return 0;
+}
+
+int n_xbee_tx_send(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope, const void* prefix, int prefixlen) {
+  int err;
+  uint8_t id;
+  // the API header and the prefix, back to back
+  unsigned char hbuf[sizeof(xbee_header_transmit_explicit_t) + N_XBEE_DATA_MTU];
+  xbee_header_transmit_explicit_t* header = (xbee_header_transmit_explicit_t*)hbuf;
+  n_xbee_tx_state* tx = &bridge->tx;
+  struct iovec iov[2];
+
+  if (prefixlen < 0 || prefixlen > N_XBEE_DATA_MTU)
+    return -EMSGSIZE;
+  pthread_mutex_lock(&n_xbee_lib_lock);
+  if (!(id = n_xbee_tx_next_id(tx))) {
+    bridge->stats.drops[N_XBEE_DROP_TX_ERROR]++;
+    pthread_mutex_unlock(&n_xbee_lib_lock);
+    return -EBUSY;
+  }
+  memset(header, 0, sizeof(*header));
+  header->frame_type = XBEE_FRAME_TRANSMIT_EXPLICIT;
+  header->frame_id = id;
+  header->ieee_address = envelope->ieee_address;
+  header->network_address_be = htobe16(envelope->network_address);
+  header->source_endpoint = envelope->source_endpoint;
+  header->dest_endpoint = envelope->dest_endpoint;
+  header->cluster_id_be = htobe16(envelope->cluster_id);
+  header->profile_id_be = htobe16(envelope->profile_id);
+  if (prefixlen)
+    memcpy(hbuf + sizeof(*header), prefix, prefixlen);
+
+  err = xbee_frame_write(bridge->xbee_dev, hbuf, sizeof(*header) + prefixlen, envelope->payload, envelope->length, 0);
+  if (n_xbee_cap_on && err >= 0) {
+    n_xbee_cap_envelope(bridge, envelope, prefix, prefixlen, 0);
+    iov[0].iov_base = hbuf;
+    iov[0].iov_len = sizeof(*header) + prefixlen;
+    iov[1].iov_base = (void*)envelope->payload;
+    iov[1].iov_len = envelope->length;
+    n_xbee_cap_api_frame(&bridge->cap, 0, iov, 2);
+  }
+  if (err >= 0) {
+    err = 0;
+    tx->slots[id].in_use = 1;
+    tx->slots[id].bcast = (envelope->options & WPAN_ENVELOPE_BROADCAST_ADDR) != 0;
+    tx->slots[id].known = tx->slots[id].bcast || n_xbee_node_find(&bridge->nodes, &envelope->ieee_address);
+    tx->slots[id].len = prefixlen + envelope->length;
+    tx->slots[id].sent = xbee_millisecond_timer();
+    tx->slots[id].dest = envelope->ieee_address;
+    tx->inflight++;
+    tx->tx_frames++;
+    bridge->stats.air_tx_frames++;
+    bridge->stats.air_tx_bytes += tx->slots[id].len;
+    bridge->stats.airtime_us += n_xbee_stats_airtime(tx->slots[id].len, 0);
+  } else
+    bridge->stats.drops[N_XBEE_DROP_TX_ERROR]++;
+  pthread_mutex_unlock(&n_xbee_lib_lock);
+  return err;
+}
+
+// Keeps score per radio, a radio that can't get anything through is
+// taken out of a bond until N_XBEE_LINK_RETRY has passed.
+static void n_xbee_tx_link_result(struct xbee_serial_bridge* bridge, int ok) {
+  if (ok) {
+    bridge->tx_fail_streak = 0;
+    if (!bridge->link_up)
+      printk(KERN_INFO "%s: %s is delivering again.\n", __FUNCTION__, bridge->name);
+    bridge->link_up = 1;
+    return;
+  }
+  if (++bridge->tx_fail_streak >= N_XBEE_LINK_FAIL_LIMIT && bridge->link_up) {
+    printk(KERN_ALERT "%s: %s failed %d transmissions in a row, marking it down.\n", __FUNCTION__, bridge->name, bridge->tx_fail_streak);
+    bridge->link_up = 0;
+    bridge->link_down_since = xbee_millisecond_timer();
+  }
+}
+
+int n_xbee_tx_status_handler(xbee_dev_t* xbee, const void FAR* frame, uint16_t length, void FAR* context) {
+  const xbee_frame_transmit_status_t* status = frame;
+  xbee_serial_bridge* bridge = n_xbee_find_bridge_byxbee(xbee);
+  n_xbee_tx_slot* slot;
+  xbee_remote_node* node = NULL;
+  int ok;
+
+  if (!bridge || length < sizeof(xbee_frame_transmit_status_t))
+    return 0;
+  slot = &bridge->tx.slots[status->frame_id];
+  // not one of ours, or it already timed out
+  if (!status->frame_id || !slot->in_use)
+    return 0;
+  slot->in_use = 0;
+  bridge->tx.inflight--;
+  bridge->tx.lost_streak = 0;
+
+  ok = status->delivery == XBEE_TX_DELIVERY_SUCCESS;
+  if (ok)
+    bridge->tx.tx_ok++;
+  else
+    bridge->tx.tx_fail++;
+  bridge->tx.tx_retries += status->retries;
+  if (status->retries)
+    bridge->stats.airtime_us += n_xbee_stats_airtime(slot->len, status->retries - 1);
+  if (!slot->bcast && (node = n_xbee_node_find(&bridge->nodes, &slot->dest))) {
+    // the radio on the other end acked it, as good as hearing from it
+    if (ok) {
+      node->tx_ok++;
+      node->last_seen = xbee_millisecond_timer();
+    } else
+      node->tx_fail++;
+    node->tx_retries += status->retries;
+  }
+#ifdef N_XBEE_VERBOSE
+  if (!ok) {
+    char addr64_buf[ADDR64_STRING_LENGTH];
+    printk(KERN_INFO "%s: %s failed to deliver to %s after %d retries, status 0x%02x.\n", __FUNCTION__, bridge->name, addr64_format(addr64_buf, &slot->dest), status->retries, status->delivery);
+  }
+#endif
+  // a probe to an address we guessed says nothing about our radio
+  if (!slot->known)
+    return 0;
+  n_xbee_tx_link_result(bridge, ok);
+  return 0;
+}
+
+void n_xbee_tx_expire(struct xbee_serial_bridge* bridge, uint32_t now) {
+  int i;
+  n_xbee_tx_state* tx = &bridge->tx;
+
+  if (!tx->inflight)
+    return;
+  pthread_mutex_lock(&n_xbee_lib_lock);
+  for (i = 1; i < 256; i++) {
+    if (tx->slots[i].in_use && now - tx->slots[i].sent > N_XBEE_TX_TIMEOUT) {
+      tx->slots[i].in_use = 0;
+      tx->inflight--;
+      tx->tx_lost++;
+      tx->lost_streak++;
+      // a radio that has gone quiet isn't delivering either, unless all
+      // it had was a probe
+      if (tx->slots[i].known)
+        n_xbee_tx_link_result(bridge, 0);
+    }
+  }
+  pthread_mutex_unlock(&n_xbee_lib_lock);
+}
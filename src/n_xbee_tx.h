@@ -0,0 +1,85 @@
+#pragma once
+#ifndef _N_XBEE_TX_H
+#define _N_XBEE_TX_H
+
+#include <stdint.h>
+
+#include <xbee/platform.h>
+#include <xbee/device.h>
+#include <wpan/aps.h>
+
+/*
+ * Transmit engine.
+ *
+ * Every frame we hand the radio gets its own API frame ID, and the radio
+ * answers each with a transmit status frame. Up to a window of frames
+ * are kept in flight per radio, the scheduler holds the rest back until
+ * a status comes in, so we never wait on the radio for each frame but
+ * never bury it either. The window is checked once per tap frame, the
+ * fragments of one frame always go out together.
+ */
+// frames in flight per radio unless --tx-window says otherwise
+#define N_XBEE_TX_WINDOW 4
+#define N_XBEE_TX_MAX_WINDOW 64
+// give up on hearing about a frame after this many ms, route discovery
+// and retries can take the radio a few seconds
+#define N_XBEE_TX_TIMEOUT 10000
+// frames over the window control messages may add, they don't go through
+// the scheduler but a discovery round answered by hundreds of nodes must
+// not use up every frame ID
+#define N_XBEE_TX_CTRL_HEADROOM 16
+
+struct xbee_serial_bridge;
+
+typedef struct n_xbee_tx_slot {
+  uint8_t in_use;
+  uint8_t bcast;
+  // to a node in the table, not a probe to an address we guessed
+  uint8_t known;
+  // bytes on the air, for the air time of retries
+  uint16_t len;
+  uint32_t sent;
+  addr64 dest;
+} n_xbee_tx_slot;
+
+typedef struct n_xbee_tx_state {
+  int window;
+  int inflight;
+  uint8_t next_id;
+  uint32_t tx_frames;
+  uint32_t tx_ok;
+  uint32_t tx_fail;
+  uint32_t tx_retries;
+  // status never came back
+  uint32_t tx_lost;
+  // ... and how many in a row
+  int lost_streak;
+  // indexed by frame ID, 0 is never used since it means "no status"
+  n_xbee_tx_slot slots[256];
+} n_xbee_tx_state;
+
+void n_xbee_tx_init(n_xbee_tx_state* tx, int window);
+
+// Room for another frame in the window.
+static inline int n_xbee_tx_ready(const n_xbee_tx_state* tx) {
+  return tx->inflight < tx->window;
+}
+
+// Room for a control message, which counts against the window too.
+static inline int n_xbee_tx_ctrl_ready(const n_xbee_tx_state* tx) {
+  return tx->inflight < tx->window + N_XBEE_TX_CTRL_HEADROOM;
+}
+
+// Writes prefix followed by the envelope's payload to the radio with a
+// frame ID of our own. The prefix rides along with the API header, so
+// the payload never has to be copied next to it. Returns -EBUSY if every
+// frame ID is waiting on a status.
+int n_xbee_tx_send(struct xbee_serial_bridge* bridge, const wpan_envelope_t* envelope, const void* prefix, int prefixlen);
+
+// XBEE_FRAME_TRANSMIT_STATUS handler.
+int n_xbee_tx_status_handler(xbee_dev_t* xbee, const void FAR* frame, uint16_t length, void FAR* context);
+
+// Forgets frames whose status has been missing for N_XBEE_TX_TIMEOUT.
+void n_xbee_tx_expire(struct xbee_serial_bridge* bridge, uint32_t now);
+
+#endif
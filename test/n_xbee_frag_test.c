@@ -0,0 +1,220 @@
+/*
+ * Fragmentation round trips and what reassembly does with bad input.
+ *
+ * n_xbee_frag_send's envelopes are caught by the stubs below instead of
+ * going to a radio, and fed back into n_xbee_frag_rx in whatever order
+ * the test wants.
+ */
+#include "../src/n_xbee.h"
+#include "../src/n_xbee_proto.h"
+#include "../src/n_xbee_frag.h"
+#include "n_xbee_test.h"
+
+#include <string.h>
+
+// fragments of the biggest datagram, and then some
+#define N_XBEE_TEST_FRAGS 64
+
+typedef struct n_xbee_test_frag {
+  unsigned char data[N_XBEE_DATA_MTU];
+  int len;
+} n_xbee_test_frag;
+
+static n_xbee_test_frag n_xbee_test_frags[N_XBEE_TEST_FRAGS];
+static int n_xbee_test_nfrags;
+static uint32_t n_xbee_test_now = 1000;
+static xbee_serial_bridge n_xbee_test_bridge;
+
+/* = Stubs = */
+uint32_t xbee_millisecond_timer(void) {
+  return n_xbee_test_now;
+}
+
+int n_xbee_envelope_send_prefixed(const wpan_envelope_t* envelope, const void* prefix, int prefixlen) {
+  n_xbee_test_frag* f;
+  if (n_xbee_test_nfrags == N_XBEE_TEST_FRAGS || prefixlen + envelope->length > N_XBEE_DATA_MTU)
+    return -EMSGSIZE;
+  f = &n_xbee_test_frags[n_xbee_test_nfrags++];
+  memcpy(f->data, prefix, prefixlen);
+  memcpy(f->data + prefixlen, envelope->payload, envelope->length);
+  f->len = prefixlen + envelope->length;
+  return 0;
+}
+
+int n_xbee_envelope_send(const wpan_envelope_t* envelope) {
+  return n_xbee_envelope_send_prefixed(envelope, NULL, 0);
+}
+
+/* = Helpers = */
+static void n_xbee_test_pattern(unsigned char* buf, int len, int seed) {
+  int i;
+  for (i = 0; i < len; i++)
+    buf[i] = (unsigned char)(i * 7 + seed);
+}
+
+// Feeds data[0..len) from peer in, returns what n_xbee_frag_rx did.
+static int n_xbee_test_rx(int peer, const unsigned char* data, int len, const unsigned char** out, int* outlen) {
+  wpan_envelope_t envelope;
+  memset(&envelope, 0, sizeof(envelope));
+  envelope.ieee_address.b[7] = peer;
+  envelope.payload = data;
+  envelope.length = len;
+  return n_xbee_frag_rx(&n_xbee_test_bridge, &envelope, out, outlen);
+}
+
+// Fragments a 3 byte header and len - 3 bytes of payload.
+static int n_xbee_test_send(unsigned char* dgram, int len) {
+  wpan_envelope_t envelope;
+  memset(&envelope, 0, sizeof(envelope));
+  n_xbee_test_nfrags = 0;
+  n_xbee_test_pattern(dgram, len, len);
+  return n_xbee_frag_send(&n_xbee_test_bridge, &envelope, dgram, 3, dgram + 3, len - 3);
+}
+
+/* = Tests = */
+static void n_xbee_test_round_trip(void) {
+  static const int sizes[] = { 3, 8, N_XBEE_DATA_MTU, N_XBEE_DATA_MTU + 1, 200, 1500, N_XBEE_FRAG_MAX_DGRAM };
+  unsigned char dgram[N_XBEE_FRAG_MAX_DGRAM];
+  const unsigned char* out;
+  int i, j, n, res, outlen, complete;
+
+  for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+    N_XBEE_CHECK(n_xbee_test_send(dgram, sizes[i]) == 0);
+    // in order, then backwards, which only completes on the first one
+    for (n = 0; n < 2; n++) {
+      complete = 0;
+      for (j = 0; j < n_xbee_test_nfrags; j++) {
+        n_xbee_test_frag* f = &n_xbee_test_frags[n ? n_xbee_test_nfrags - 1 - j : j];
+        N_XBEE_CHECK(f->len <= N_XBEE_DATA_MTU);
+        res = n_xbee_test_rx(1, f->data, f->len, &out, &outlen);
+        N_XBEE_CHECK(res >= 0);
+        if (res == 1) {
+          complete++;
+          N_XBEE_CHECK(j == n_xbee_test_nfrags - 1);
+          N_XBEE_CHECK(outlen == sizes[i]);
+          N_XBEE_CHECK(memcmp(out, dgram, sizes[i]) == 0);
+        }
+      }
+      N_XBEE_CHECK(complete == 1);
+    }
+  }
+}
+
+static void n_xbee_test_too_big(void) {
+  unsigned char dgram[N_XBEE_FRAG_MAX_DGRAM + 1];
+  N_XBEE_CHECK(n_xbee_test_send(dgram, sizeof(dgram)) == -EMSGSIZE);
+  N_XBEE_CHECK(n_xbee_test_nfrags == 0);
+}
+
+static void n_xbee_test_truncated(void) {
+  unsigned char dgram[200];
+  const unsigned char* out;
+  int len, outlen;
+  uint32_t invalid;
+
+  N_XBEE_CHECK(n_xbee_test_send(dgram, sizeof(dgram)) == 0);
+  N_XBEE_CHECK(n_xbee_test_nfrags >= 2);
+  invalid = n_xbee_test_bridge.frag.rx_invalid;
+  // a header and nothing after it, or not even the header
+  for (len = 1; len <= N_XBEE_FRAG1_HDR_LEN; len++)
+    N_XBEE_CHECK(n_xbee_test_rx(2, n_xbee_test_frags[0].data, len, &out, &outlen) == -EINVAL);
+  for (len = 1; len <= N_XBEE_FRAGN_HDR_LEN; len++)
+    N_XBEE_CHECK(n_xbee_test_rx(2, n_xbee_test_frags[1].data, len, &out, &outlen) == -EINVAL);
+  N_XBEE_CHECK(n_xbee_test_bridge.frag.rx_invalid == invalid + N_XBEE_FRAG1_HDR_LEN + N_XBEE_FRAGN_HDR_LEN);
+  // a middle fragment cut short isn't a multiple of 8 any more
+  N_XBEE_CHECK(n_xbee_test_rx(2, n_xbee_test_frags[0].data, n_xbee_test_frags[0].len - 1, &out, &outlen) == -EINVAL);
+}
+
+static void n_xbee_test_bad_header(void) {
+  unsigned char frag[N_XBEE_DATA_MTU];
+  const unsigned char* out;
+  int outlen;
+
+  // size 0
+  memset(frag, 0, sizeof(frag));
+  frag[0] = N_XBEE_DISPATCH_FRAG1;
+  N_XBEE_CHECK(n_xbee_test_rx(3, frag, 16, &out, &outlen) == -EINVAL);
+  // runs past the end of a 40 byte datagram
+  frag[0] = N_XBEE_DISPATCH_FRAGN;
+  frag[1] = 40;
+  frag[4] = 32 >> 3;
+  N_XBEE_CHECK(n_xbee_test_rx(3, frag, N_XBEE_FRAGN_HDR_LEN + 16, &out, &outlen) == -EINVAL);
+}
+
+static void n_xbee_test_duplicate(void) {
+  unsigned char dgram[300];
+  const unsigned char* out;
+  int i, res, outlen, complete = 0;
+
+  N_XBEE_CHECK(n_xbee_test_send(dgram, sizeof(dgram)) == 0);
+  // every fragment twice, the radio retried after a lost ack
+  for (i = 0; i < n_xbee_test_nfrags; i++) {
+    N_XBEE_CHECK(n_xbee_test_rx(4, n_xbee_test_frags[i].data, n_xbee_test_frags[i].len, &out, &outlen) >= 0);
+    if (i == n_xbee_test_nfrags - 1)
+      break;
+    N_XBEE_CHECK(n_xbee_test_rx(4, n_xbee_test_frags[i].data, n_xbee_test_frags[i].len, &out, &outlen) == 0);
+  }
+  N_XBEE_CHECK(n_xbee_test_bridge.frag.rx_datagrams > 0);
+  // and once more for the whole lot, which starts a new datagram
+  for (i = 0; i < n_xbee_test_nfrags; i++) {
+    res = n_xbee_test_rx(4, n_xbee_test_frags[i].data, n_xbee_test_frags[i].len, &out, &outlen);
+    if (res == 1 && outlen == (int)sizeof(dgram) && memcmp(out, dgram, sizeof(dgram)) == 0)
+      complete++;
+  }
+  N_XBEE_CHECK(complete == 1);
+}
+
+static void n_xbee_test_overlap(void) {
+  unsigned char dgram[200];
+  unsigned char frag[N_XBEE_DATA_MTU];
+  const unsigned char* out;
+  int i, res, outlen, complete = 0;
+  uint32_t invalid;
+
+  N_XBEE_CHECK(n_xbee_test_send(dgram, sizeof(dgram)) == 0);
+  N_XBEE_CHECK(n_xbee_test_rx(5, n_xbee_test_frags[0].data, n_xbee_test_frags[0].len, &out, &outlen) == 0);
+  // starts inside the first fragment and runs into the second, if it
+  // counted the datagram would complete with a hole in it
+  memcpy(frag, n_xbee_test_frags[1].data, N_XBEE_FRAGN_HDR_LEN);
+  frag[4] = (n_xbee_test_frags[0].len - N_XBEE_FRAG1_HDR_LEN - 8) >> 3;
+  memset(frag + N_XBEE_FRAGN_HDR_LEN, 0xEE, 24);
+  invalid = n_xbee_test_bridge.frag.rx_invalid;
+  N_XBEE_CHECK(n_xbee_test_rx(5, frag, N_XBEE_FRAGN_HDR_LEN + 24, &out, &outlen) == -EINVAL);
+  N_XBEE_CHECK(n_xbee_test_bridge.frag.rx_invalid == invalid + 1);
+  for (i = 1; i < n_xbee_test_nfrags; i++) {
+    res = n_xbee_test_rx(5, n_xbee_test_frags[i].data, n_xbee_test_frags[i].len, &out, &outlen);
+    if (res == 1) {
+      complete++;
+      N_XBEE_CHECK(outlen == (int)sizeof(dgram));
+      N_XBEE_CHECK(memcmp(out, dgram, sizeof(dgram)) == 0);
+    }
+  }
+  N_XBEE_CHECK(complete == 1);
+}
+
+static void n_xbee_test_timeout(void) {
+  unsigned char dgram[200];
+  const unsigned char* out;
+  int outlen;
+  uint32_t timeouts = n_xbee_test_bridge.frag.rx_timeouts;
+
+  N_XBEE_CHECK(n_xbee_test_send(dgram, sizeof(dgram)) == 0);
+  N_XBEE_CHECK(n_xbee_test_rx(6, n_xbee_test_frags[0].data, n_xbee_test_frags[0].len, &out, &outlen) == 0);
+  n_xbee_test_now += N_XBEE_REASM_TIMEOUT + 1;
+  n_xbee_frag_expire(&n_xbee_test_bridge.frag, n_xbee_test_now);
+  N_XBEE_CHECK(n_xbee_test_bridge.frag.rx_timeouts == timeouts + 1);
+  // the rest alone never makes a datagram
+  N_XBEE_CHECK(n_xbee_test_rx(6, n_xbee_test_frags[1].data, n_xbee_test_frags[1].len, &out, &outlen) == 0);
+}
+
+int main(void) {
+  n_xbee_frag_init(&n_xbee_test_bridge.frag);
+  n_xbee_test_round_trip();
+  n_xbee_test_too_big();
+  n_xbee_test_truncated();
+  n_xbee_test_bad_header();
+  n_xbee_test_duplicate();
+  n_xbee_test_overlap();
+  n_xbee_test_timeout();
+  return n_xbee_test_done("n_xbee_frag_test");
+}
@@ -0,0 +1,252 @@
+/*
+ * Header compression round trips and what decompression does with bad
+ * input.
+ *
+ * Frames are built here, compressed, and the header plus whatever
+ * n_xbee_hc_compress didn't consume is fed back into n_xbee_hc_decompress
+ * the way n_xbee_rx would.
+ */
+#include "../src/n_xbee.h"
+#include "../src/n_xbee_proto.h"
+#include "../src/n_xbee_hc.h"
+#include "n_xbee_test.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+static const unsigned char n_xbee_test_src[ETH_ALEN] = { 0x13, 0xA2, 0x00, 0x41, 0x52, 0x63 };
+static const unsigned char n_xbee_test_dst[ETH_ALEN] = { 0x13, 0xA2, 0x00, 0x41, 0x74, 0x85 };
+static const unsigned char n_xbee_test_bcast[ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+/* = Helpers = */
+// An ethernet header from our source to dst, returns where the payload goes.
+static unsigned char* n_xbee_test_eth(unsigned char* frame, const unsigned char* dst, uint16_t ether_type) {
+  struct ether_header* eh = (struct ether_header*)frame;
+  memcpy(eh->ether_dhost, dst, ETH_ALEN);
+  memcpy(eh->ether_shost, n_xbee_test_src, ETH_ALEN);
+  eh->ether_type = htons(ether_type);
+  return frame + N_XBEE_ETHHDR_LEN;
+}
+
+// An IPv4 frame with paylen bytes after the IP (and UDP) header, returns
+// the frame length.
+static int n_xbee_test_ipv4(unsigned char* frame, const unsigned char* dst, uint8_t protocol, uint8_t tos, uint16_t id, int df, uint8_t ttl, int paylen) {
+  struct iphdr* iph = (struct iphdr*)n_xbee_test_eth(frame, dst, ETHERTYPE_IP);
+  unsigned char* p = (unsigned char*)(iph + 1);
+  int i, iplen = sizeof(struct iphdr) + paylen;
+
+  if (protocol == IPPROTO_UDP) {
+    struct udphdr* udph = (struct udphdr*)p;
+    iplen += sizeof(struct udphdr);
+    udph->source = htons(5353);
+    udph->dest = htons(1234);
+    udph->len = htons(sizeof(struct udphdr) + paylen);
+    udph->check = htons(0xBEEF);
+    p += sizeof(struct udphdr);
+  }
+  memset(iph, 0, sizeof(struct iphdr));
+  iph->version = 4;
+  iph->ihl = 5;
+  iph->tos = tos;
+  iph->tot_len = htons(iplen);
+  iph->id = htons(id);
+  iph->frag_off = df ? htons(IP_DF) : 0;
+  iph->ttl = ttl;
+  iph->protocol = protocol;
+  iph->saddr = htonl(0x0A000001);
+  iph->daddr = htonl(0x0A000002);
+  iph->check = n_xbee_inet_csum(iph, sizeof(struct iphdr));
+  for (i = 0; i < paylen; i++)
+    p[i] = (unsigned char)(i * 13 + protocol);
+  return N_XBEE_ETHHDR_LEN + iplen;
+}
+
+// Compresses frame and lays it out as it would go on the air, returns
+// the compressed length or what n_xbee_hc_compress failed with.
+static int n_xbee_test_compress(const unsigned char* frame, int len, int bcast, unsigned char* buf, int* hdrlen) {
+  int consumed, res;
+  res = n_xbee_hc_compress(n_xbee_test_src, bcast, frame, len, buf, &consumed);
+  if (res < 0)
+    return res;
+  *hdrlen = res;
+  memcpy(buf + res, frame + consumed, len - consumed);
+  return res + len - consumed;
+}
+
+// Compresses, expands and compares, returns the header length.
+static int n_xbee_test_round_trip_one(const unsigned char* frame, int len, int bcast, int type) {
+  unsigned char buf[N_XBEE_FRAME_MAX + N_XBEE_HC_MAX_HDR];
+  unsigned char out[N_XBEE_FRAME_MAX];
+  int clen, hdrlen = 0;
+
+  clen = n_xbee_test_compress(frame, len, bcast, buf, &hdrlen);
+  N_XBEE_CHECK(clen > 0);
+  if (clen <= 0)
+    return 0;
+  N_XBEE_CHECK(hdrlen <= N_XBEE_HC_MAX_HDR);
+  N_XBEE_CHECK((buf[0] & N_XBEE_DISPATCH_HC_MASK) == N_XBEE_DISPATCH_HC);
+  N_XBEE_CHECK((buf[0] & N_XBEE_HC_TYPE_MASK) >> N_XBEE_HC_TYPE_SHIFT == type);
+  N_XBEE_CHECK(!(buf[0] & N_XBEE_HC_BCAST) == !bcast);
+  memset(out, 0xAA, sizeof(out));
+  N_XBEE_CHECK(n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, clen, out, sizeof(out)) == len);
+  N_XBEE_CHECK(memcmp(out, frame, len) == 0);
+  return hdrlen;
+}
+
+/* = Tests = */
+static void n_xbee_test_round_trip(void) {
+  unsigned char frame[N_XBEE_FRAME_MAX];
+  int len;
+
+  // plain UDP with everything at its default is the smallest there is,
+  // dispatch, enc, addresses and ports
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 20);
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_IPV4) == 1 + 1 + 8 + 6);
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0x10, 0x1234, 1, 3, 0);
+  n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_IPV4);
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_TCP, 0, 77, 1, N_XBEE_HC_DEFAULT_TTL, 40);
+  n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_IPV4);
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_ICMP, 0, 1, 0, 255, 64);
+  n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_IPV4);
+  // a protocol the enc byte has no code for goes inline
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, 47, 0xFF, 0xFFFF, 1, 1, 10);
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_IPV4) == 1 + 1 + 1 + 2 + 1 + 1 + 8);
+  len = n_xbee_test_ipv4(frame, n_xbee_test_bcast, IPPROTO_UDP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, N_XBEE_NETDEV_MTU - sizeof(struct iphdr) - sizeof(struct udphdr));
+  N_XBEE_CHECK(len == N_XBEE_FRAME_MAX);
+  n_xbee_test_round_trip_one(frame, len, 1, N_XBEE_HC_TYPE_IPV4);
+
+  memset(n_xbee_test_eth(frame, n_xbee_test_bcast, ETHERTYPE_ARP), 0x42, 28);
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(frame, N_XBEE_ARP_FRAME_LEN, 1, N_XBEE_HC_TYPE_ARP) == 1);
+  memset(n_xbee_test_eth(frame, n_xbee_test_dst, ETHERTYPE_IPV6), 0x60, 48);
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(frame, N_XBEE_ETHHDR_LEN + 48, 0, N_XBEE_HC_TYPE_IPV6) == 1);
+  memset(n_xbee_test_eth(frame, n_xbee_test_dst, 0x88B5), 0x11, 30);
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(frame, N_XBEE_ETHHDR_LEN + 30, 0, N_XBEE_HC_TYPE_ETHERTYPE) == 3);
+  // a bare ethernet header
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(frame, N_XBEE_ETHHDR_LEN, 0, N_XBEE_HC_TYPE_ETHERTYPE) == 3);
+}
+
+static void n_xbee_test_ipv4_as_is(void) {
+  unsigned char frame[N_XBEE_FRAME_MAX];
+  struct iphdr* iph = (struct iphdr*)(frame + N_XBEE_ETHHDR_LEN);
+  int len;
+
+  // anything the decompressor couldn't rebuild exactly goes as ethertype
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 20);
+  iph->check ^= 1;
+  n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_ETHERTYPE);
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 20);
+  iph->frag_off = htons(IP_MF);
+  iph->check = 0;
+  iph->check = n_xbee_inet_csum(iph, sizeof(struct iphdr));
+  n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_ETHERTYPE);
+  // ethernet padding after a short datagram
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 2);
+  memset(frame + len, 0, 60 - len);
+  n_xbee_test_round_trip_one(frame, 60, 0, N_XBEE_HC_TYPE_ETHERTYPE);
+  // a UDP length that disagrees keeps the UDP header in the payload
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 20);
+  ((struct udphdr*)(iph + 1))->len = htons(9);
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_IPV4) == 1 + 1 + 8);
+  // options
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_TCP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 20);
+  iph->ihl = 6;
+  iph->check = 0;
+  iph->check = n_xbee_inet_csum(iph, sizeof(struct iphdr) + 4);
+  n_xbee_test_round_trip_one(frame, len, 0, N_XBEE_HC_TYPE_ETHERTYPE);
+}
+
+static void n_xbee_test_bad_frame(void) {
+  unsigned char frame[N_XBEE_FRAME_MAX];
+  unsigned char buf[N_XBEE_FRAME_MAX + N_XBEE_HC_MAX_HDR];
+  int hdrlen, len;
+
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 20);
+  // not from us, or claiming broadcast when it isn't
+  frame[ETH_ALEN] ^= 1;
+  N_XBEE_CHECK(n_xbee_test_compress(frame, len, 0, buf, &hdrlen) == -EINVAL);
+  frame[ETH_ALEN] ^= 1;
+  N_XBEE_CHECK(n_xbee_test_compress(frame, len, 1, buf, &hdrlen) == -EINVAL);
+  N_XBEE_CHECK(n_xbee_test_compress(frame, N_XBEE_ETHHDR_LEN - 1, 0, buf, &hdrlen) == -EINVAL);
+}
+
+static void n_xbee_test_truncated(void) {
+  unsigned char frame[N_XBEE_FRAME_MAX];
+  unsigned char buf[N_XBEE_FRAME_MAX + N_XBEE_HC_MAX_HDR];
+  unsigned char out[N_XBEE_FRAME_MAX];
+  int n, i, len, clen, hdrlen = 0;
+
+  for (n = 0; n < 3; n++) {
+    if (n == 0)
+      len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0x10, 0x1234, 1, 3, 20);
+    else if (n == 1)
+      len = n_xbee_test_ipv4(frame, n_xbee_test_dst, 47, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 20);
+    else {
+      memset(n_xbee_test_eth(frame, n_xbee_test_dst, 0x88B5), 0x11, 20);
+      len = N_XBEE_ETHHDR_LEN + 20;
+    }
+    clen = n_xbee_test_compress(frame, len, 0, buf, &hdrlen);
+    N_XBEE_CHECK(clen > hdrlen);
+    // cut anywhere in the header
+    for (i = 0; i < hdrlen; i++)
+      N_XBEE_CHECK(n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, i, out, sizeof(out)) == -EINVAL);
+    // cut in the payload, which is what the lengths get rebuilt from
+    for (i = hdrlen; i < clen; i++)
+      N_XBEE_CHECK(n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, i, out, sizeof(out)) == len - (clen - i));
+  }
+}
+
+static void n_xbee_test_no_room(void) {
+  unsigned char frame[N_XBEE_FRAME_MAX];
+  unsigned char buf[N_XBEE_FRAME_MAX + N_XBEE_HC_MAX_HDR];
+  unsigned char out[N_XBEE_FRAME_MAX];
+  int len, clen, hdrlen;
+
+  len = n_xbee_test_ipv4(frame, n_xbee_test_dst, IPPROTO_UDP, 0, 0, 0, N_XBEE_HC_DEFAULT_TTL, 100);
+  clen = n_xbee_test_compress(frame, len, 0, buf, &hdrlen);
+  N_XBEE_CHECK(n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, clen, out, len - 1) == -ENOSPC);
+  N_XBEE_CHECK(n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, clen, out, N_XBEE_ETHHDR_LEN + 4) == -ENOSPC);
+  N_XBEE_CHECK(n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, clen, out, N_XBEE_ETHHDR_LEN - 1) == -EINVAL);
+  N_XBEE_CHECK(n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, clen, out, len) == len);
+  memset(n_xbee_test_eth(frame, n_xbee_test_dst, ETHERTYPE_IPV6), 0x60, 48);
+  clen = n_xbee_test_compress(frame, N_XBEE_ETHHDR_LEN + 48, 0, buf, &hdrlen);
+  N_XBEE_CHECK(n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, clen, out, N_XBEE_ETHHDR_LEN + 47) == -ENOSPC);
+}
+
+static void n_xbee_test_garbage(void) {
+  unsigned char buf[64];
+  // room to spot a write past outsize
+  unsigned char out[N_XBEE_ETHHDR_LEN + 64 + 16];
+  int i, j, len, outsize, res;
+
+  srand(1);
+  for (i = 0; i < 100000; i++) {
+    len = rand() % sizeof(buf);
+    for (j = 0; j < len; j++)
+      buf[j] = rand();
+    if (len)
+      buf[0] = N_XBEE_DISPATCH_HC | (buf[0] & ~N_XBEE_DISPATCH_HC_MASK);
+    outsize = N_XBEE_ETHHDR_LEN + rand() % 64;
+    memset(out, 0xAA, sizeof(out));
+    res = n_xbee_hc_decompress(n_xbee_test_src, n_xbee_test_dst, buf, len, out, outsize);
+    N_XBEE_CHECK(res == -EINVAL || res == -ENOSPC || (res >= N_XBEE_ETHHDR_LEN && res <= outsize));
+    for (j = outsize; j < (int)sizeof(out); j++)
+      if (out[j] != 0xAA)
+        break;
+    N_XBEE_CHECK(j == sizeof(out));
+  }
+}
+
+int main(void) {
+  n_xbee_test_round_trip();
+  n_xbee_test_ipv4_as_is();
+  n_xbee_test_bad_frame();
+  n_xbee_test_truncated();
+  n_xbee_test_no_room();
+  n_xbee_test_garbage();
+  return n_xbee_test_done("n_xbee_hc_test");
+}
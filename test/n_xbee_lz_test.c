@@ -0,0 +1,211 @@
+/*
+ * LZ round trips, with and without a dictionary, and what decompression
+ * does with bad input.
+ *
+ * Only the tokens are covered here, the 4 byte header in front of them
+ * is n_xbee_rx's.
+ */
+#include "../src/n_xbee.h"
+#include "../src/n_xbee_lz.h"
+#include "n_xbee_test.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static n_xbee_lz_dict n_xbee_test_none;
+static n_xbee_lz_dict n_xbee_test_default;
+
+/* = Helpers = */
+// Fills buf with the kind of JSON a sensor sends.
+static int n_xbee_test_json(unsigned char* buf, int size, unsigned int seed) {
+  char line[128];
+  int len = 0, n;
+  while (len < size) {
+    n = snprintf(line, sizeof(line),
+                 "{\"temperature\":%u.%u,\"humidity\":%u,\"battery\":%u,\"status\":\"ok\",\"id\":\"device%u\"}\n",
+                 seed % 40, seed % 10, seed % 100, 3000 + seed % 700, seed % 16);
+    if (n > size - len)
+      n = size - len;
+    memcpy(buf + len, line, n);
+    len += n;
+    seed = seed * 1103515245u + 12345;
+  }
+  return size;
+}
+
+static void n_xbee_test_random(unsigned char* buf, int len) {
+  int i;
+  for (i = 0; i < len; i++)
+    buf[i] = rand();
+}
+
+// Compresses and expands in with dict, returns the compressed length or
+// -1 if it didn't compress.
+static int n_xbee_test_round_trip_one(const n_xbee_lz_dict* dict, const unsigned char* in, int len) {
+  unsigned char lz[N_XBEE_LZ_MAX_INPUT];
+  // guard bytes past outlen
+  unsigned char out[N_XBEE_LZ_MAX_INPUT + 16];
+  int clen, i;
+
+  clen = n_xbee_lz_compress(dict, in, len, lz, sizeof(lz));
+  if (clen < 0)
+    return -1;
+  N_XBEE_CHECK(clen < len);
+  memset(out, 0xAA, sizeof(out));
+  N_XBEE_CHECK(n_xbee_lz_decompress(dict, lz, clen, out, len) == len);
+  N_XBEE_CHECK(memcmp(out, in, len) == 0);
+  for (i = len; i < (int)sizeof(out) && out[i] == 0xAA; i++)
+    ;
+  N_XBEE_CHECK(i == sizeof(out));
+  return clen;
+}
+
+/* = Tests = */
+static void n_xbee_test_round_trip(void) {
+  static const int sizes[] = { N_XBEE_LZ_MIN_INPUT, 64, 100, 500, 1280, N_XBEE_LZ_MAX_INPUT };
+  unsigned char in[N_XBEE_LZ_MAX_INPUT + 1];
+  const n_xbee_lz_dict* dicts[] = { NULL, &n_xbee_test_none, &n_xbee_test_default };
+  int i, j, clen;
+
+  for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+    n_xbee_test_json(in, sizes[i], i);
+    for (j = 0; j < (int)(sizeof(dicts) / sizeof(dicts[0])); j++) {
+      clen = n_xbee_test_round_trip_one(dicts[j], in, sizes[i]);
+      // everything but the shortest without a dictionary has repeats
+      if (sizes[i] > 64 || dicts[j] == &n_xbee_test_default)
+        N_XBEE_CHECK(clen > 0);
+    }
+    // runs, where a match overlaps what it copies
+    memset(in, 'a' + i, sizes[i]);
+    N_XBEE_CHECK(n_xbee_test_round_trip_one(NULL, in, sizes[i]) > 0);
+  }
+  // more than the longest literal run between matches
+  n_xbee_test_random(in, 300);
+  memcpy(in + 300, in, 300);
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(NULL, in, 600) > 0);
+  // the dictionary is what makes a single short message worth it
+  n_xbee_test_json(in, 48, 7);
+  clen = n_xbee_test_round_trip_one(&n_xbee_test_default, in, 48);
+  N_XBEE_CHECK(clen > 0);
+  j = n_xbee_test_round_trip_one(NULL, in, 48);
+  N_XBEE_CHECK(j < 0 || clen < j);
+}
+
+static void n_xbee_test_incompressible(void) {
+  unsigned char in[N_XBEE_LZ_MAX_INPUT + 1];
+  unsigned char lz[N_XBEE_LZ_MAX_INPUT + 1];
+  int clen;
+
+  n_xbee_test_random(in, sizeof(in));
+  N_XBEE_CHECK(n_xbee_lz_compress(NULL, in, 200, lz, sizeof(lz)) == -1);
+  N_XBEE_CHECK(n_xbee_lz_compress(&n_xbee_test_default, in, 200, lz, sizeof(lz)) == -1);
+  N_XBEE_CHECK(n_xbee_lz_compress(NULL, in, sizeof(in), lz, sizeof(lz)) == -1);
+  // fits, but not in the room given
+  n_xbee_test_json(in, 500, 3);
+  clen = n_xbee_lz_compress(NULL, in, 500, lz, sizeof(lz));
+  N_XBEE_CHECK(clen > 0);
+  N_XBEE_CHECK(n_xbee_lz_compress(NULL, in, 500, lz, clen) == clen);
+  N_XBEE_CHECK(n_xbee_lz_compress(NULL, in, 500, lz, clen - 1) == -1);
+}
+
+static void n_xbee_test_truncated(void) {
+  unsigned char in[500];
+  unsigned char lz[sizeof(in)];
+  unsigned char out[sizeof(in)];
+  int i, clen;
+
+  n_xbee_test_json(in, sizeof(in), 5);
+  clen = n_xbee_lz_compress(&n_xbee_test_default, in, sizeof(in), lz, sizeof(lz));
+  N_XBEE_CHECK(clen > 0);
+  // every prefix comes up short, or stops in the middle of a token
+  for (i = 0; i < clen; i++)
+    N_XBEE_CHECK(n_xbee_lz_decompress(&n_xbee_test_default, lz, i, out, sizeof(out)) == -EINVAL);
+  // and so does expecting the wrong length
+  N_XBEE_CHECK(n_xbee_lz_decompress(&n_xbee_test_default, lz, clen, out, sizeof(out) - 1) == -EINVAL);
+  N_XBEE_CHECK(n_xbee_lz_decompress(&n_xbee_test_default, lz, clen, out, sizeof(out) - 100) == -EINVAL);
+  N_XBEE_CHECK(n_xbee_lz_decompress(&n_xbee_test_default, lz, clen, out, N_XBEE_LZ_MAX_INPUT) == -EINVAL);
+  N_XBEE_CHECK(n_xbee_lz_decompress(&n_xbee_test_default, lz, clen, out, N_XBEE_LZ_MAX_INPUT + 1) == -EMSGSIZE);
+}
+
+static void n_xbee_test_wrong_dict(void) {
+  unsigned char in[200];
+  unsigned char lz[sizeof(in)];
+  unsigned char out[sizeof(in)];
+  int clen;
+
+  n_xbee_test_json(in, sizeof(in), 9);
+  clen = n_xbee_lz_compress(&n_xbee_test_default, in, sizeof(in), lz, sizeof(lz));
+  N_XBEE_CHECK(clen > 0);
+  // the first token reaches into the dictionary, so without it there's
+  // nothing there to copy
+  N_XBEE_CHECK(n_xbee_lz_decompress(NULL, lz, clen, out, sizeof(out)) == -EINVAL);
+  N_XBEE_CHECK(n_xbee_lz_decompress(&n_xbee_test_none, lz, clen, out, sizeof(out)) == -EINVAL);
+}
+
+static void n_xbee_test_corrupt(void) {
+  unsigned char in[400];
+  unsigned char lz[sizeof(in)];
+  unsigned char bad[sizeof(in)];
+  // guard bytes past outlen
+  unsigned char out[sizeof(in) + 16];
+  int i, j, clen, res;
+
+  n_xbee_test_json(in, sizeof(in), 11);
+  clen = n_xbee_lz_compress(&n_xbee_test_default, in, sizeof(in), lz, sizeof(lz));
+  N_XBEE_CHECK(clen > 0);
+  srand(1);
+  for (i = 0; i < 100000; i++) {
+    memcpy(bad, lz, clen);
+    // a few flipped bits, or all of it random
+    if (i & 1)
+      for (j = rand() % 4; j >= 0; j--)
+        bad[rand() % clen] ^= 1 << (rand() % 8);
+    else
+      n_xbee_test_random(bad, clen);
+    memset(out, 0xAA, sizeof(out));
+    res = n_xbee_lz_decompress((i & 2) ? &n_xbee_test_default : NULL, bad, clen, out, sizeof(in));
+    N_XBEE_CHECK(res == -EINVAL || res == (int)sizeof(in));
+    for (j = sizeof(in); j < (int)sizeof(out) && out[j] == 0xAA; j++)
+      ;
+    N_XBEE_CHECK(j == sizeof(out));
+  }
+}
+
+static void n_xbee_test_dict(void) {
+  unsigned char data[N_XBEE_LZ_DICT_MAX + 500];
+  char path[] = "/tmp/n_xbee_lz_test.XXXXXX";
+  n_xbee_lz_dict loaded, tail;
+  FILE* f;
+  int fd;
+
+  N_XBEE_CHECK(n_xbee_test_none.id == 0 && n_xbee_test_none.len == 0);
+  N_XBEE_CHECK(n_xbee_test_default.id != 0 && n_xbee_test_default.len > 0);
+  // a file longer than a dictionary keeps its tail
+  n_xbee_test_json(data, sizeof(data), 13);
+  N_XBEE_CHECK((fd = mkstemp(path)) >= 0);
+  N_XBEE_CHECK((f = fdopen(fd, "wb")) != NULL);
+  N_XBEE_CHECK(fwrite(data, 1, sizeof(data), f) == sizeof(data));
+  fclose(f);
+  N_XBEE_CHECK(n_xbee_lz_dict_load(&loaded, path) == 0);
+  unlink(path);
+  n_xbee_lz_dict_init(&tail, data + sizeof(data) - N_XBEE_LZ_DICT_MAX, N_XBEE_LZ_DICT_MAX);
+  N_XBEE_CHECK(loaded.len == N_XBEE_LZ_DICT_MAX);
+  N_XBEE_CHECK(loaded.id == tail.id);
+  N_XBEE_CHECK(memcmp(&loaded, &tail, sizeof(n_xbee_lz_dict)) == 0);
+  N_XBEE_CHECK(n_xbee_test_round_trip_one(&loaded, data, 300) > 0);
+  N_XBEE_CHECK(n_xbee_lz_dict_load(&loaded, "/nonexistent/n_xbee_lz_test") < 0);
+}
+
+int main(void) {
+  n_xbee_lz_dict_init(&n_xbee_test_none, NULL, 0);
+  n_xbee_lz_dict_default(&n_xbee_test_default);
+  n_xbee_test_round_trip();
+  n_xbee_test_incompressible();
+  n_xbee_test_truncated();
+  n_xbee_test_wrong_dict();
+  n_xbee_test_corrupt();
+  n_xbee_test_dict();
+  return n_xbee_test_done("n_xbee_lz_test");
+}
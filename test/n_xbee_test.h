@@ -0,0 +1,31 @@
+#pragma once
+#ifndef _N_XBEE_TEST_H
+#define _N_XBEE_TEST_H
+
+#include <stdio.h>
+
+/*
+ * What the standalone tests share.
+ *
+ * Each test is one file that links only the module it covers and stubs
+ * whatever else that module calls. A failed N_XBEE_CHECK is printed and
+ * counted, the test keeps going and exits non zero at the end.
+ */
+static int n_xbee_test_failed;
+static int n_xbee_test_checks;
+
+#define N_XBEE_CHECK(cond) do { \
+  n_xbee_test_checks++; \
+  if (!(cond)) { \
+    printf("%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __FUNCTION__, #cond); \
+    n_xbee_test_failed++; \
+  } \
+} while (0)
+
+// Prints the tally, returns the exit code.
+static inline int n_xbee_test_done(const char* name) {
+  printf("%s: %d check(s), %d failed\n", name, n_xbee_test_checks, n_xbee_test_failed);
+  return n_xbee_test_failed ? 1 : 0;
+}
+
+#endif